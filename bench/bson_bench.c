@@ -0,0 +1,183 @@
+// Copyright (c) 2022  Buzz Moschetti <buzz.moschetti@gmail.com>
+// See LICENSE; same terms as pgbson.c.
+
+// bson_bench:  times what pgbench cannot reach, the binary protocol
+// functions bson_send and bson_recv (and jsonb_send/jsonb_recv as the
+// baseline), with COPY ... (FORMAT binary) on the tables bench/setup.sql
+// makes.  Prints one JSON object per line:
+//
+//   {"bench":"send","table":"bench_narrow","column":"data","bytes":...,"best_s":...,"mb_per_s":...}
+//
+//   bson_bench "dbname=pgbson_bench" [reps]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libpq-fe.h>
+
+typedef struct
+{
+    char* data;
+    size_t len;
+    size_t max;
+} Buf;
+
+static void _die(PGconn* conn, const char* what)
+{
+    fprintf(stderr, "bson_bench: %s: %s", what, PQerrorMessage(conn));
+    PQfinish(conn);
+    exit(1);
+}
+
+static double _now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void _exec(PGconn* conn, const char* sql)
+{
+    PGresult* res = PQexec(conn, sql);
+    if(PQresultStatus(res) != PGRES_COMMAND_OK) {
+	_die(conn, sql);
+    }
+    PQclear(res);
+}
+
+static void _append(Buf* b, const char* p, size_t n)
+{
+    if(b->len + n > b->max) {
+	b->max = (b->max == 0) ? 1 << 20 : b->max * 2;
+	while(b->len + n > b->max) b->max *= 2;
+	b->data = realloc(b->data, b->max);
+	if(b->data == NULL) {
+	    fprintf(stderr, "bson_bench: out of memory\n");
+	    exit(1);
+	}
+    }
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+}
+
+static void _copy_done(PGconn* conn, const char* what)
+{
+    PGresult* res = PQgetResult(conn);
+    if(PQresultStatus(res) != PGRES_COMMAND_OK) {
+	_die(conn, what);
+    }
+    PQclear(res);
+}
+
+// COPY (SELECT col FROM table) TO STDOUT:  every bson_send call.  The
+// stream is kept in out (if not NULL) to feed the recv run.
+static double _send(PGconn* conn, const char* table, const char* col, Buf* out)
+{
+    char sql[256];
+    snprintf(sql, sizeof(sql), "COPY (SELECT %s FROM %s) TO STDOUT (FORMAT binary)", col, table);
+
+    double t0 = _now();
+    PGresult* res = PQexec(conn, sql);
+    if(PQresultStatus(res) != PGRES_COPY_OUT) {
+	_die(conn, sql);
+    }
+    PQclear(res);
+
+    char* row;
+    int n;
+    while((n = PQgetCopyData(conn, &row, 0)) > 0) {
+	if(out != NULL) _append(out, row, n);
+	PQfreemem(row);
+    }
+    if(n == -2) {
+	_die(conn, "PQgetCopyData");
+    }
+    _copy_done(conn, sql);
+
+    return _now() - t0;
+}
+
+// COPY sink FROM STDIN with what _send captured:  every bson_recv call.
+static double _recv(PGconn* conn, const char* sink, const Buf* in)
+{
+    char sql[256];
+    snprintf(sql, sizeof(sql), "TRUNCATE %s", sink);
+    _exec(conn, sql);
+
+    snprintf(sql, sizeof(sql), "COPY %s FROM STDIN (FORMAT binary)", sink);
+
+    double t0 = _now();
+    PGresult* res = PQexec(conn, sql);
+    if(PQresultStatus(res) != PGRES_COPY_IN) {
+	_die(conn, sql);
+    }
+    PQclear(res);
+
+    const size_t chunk = 1 << 16;
+    for(size_t off = 0; off < in->len; off += chunk) {
+	size_t n = (in->len - off < chunk) ? in->len - off : chunk;
+	if(PQputCopyData(conn, in->data + off, (int) n) != 1) {
+	    _die(conn, "PQputCopyData");
+	}
+    }
+    if(PQputCopyEnd(conn, NULL) != 1) {
+	_die(conn, "PQputCopyEnd");
+    }
+    _copy_done(conn, sql);
+
+    return _now() - t0;
+}
+
+static void _report(const char* bench, const char* table, const char* col, size_t bytes, double best)
+{
+    printf("{\"bench\":\"%s\",\"table\":\"%s\",\"column\":\"%s\",\"bytes\":%zu,\"best_s\":%.6f,\"mb_per_s\":%.2f}\n",
+	   bench, table, col, bytes, best, bytes / best / (1024.0 * 1024.0));
+    fflush(stdout);
+}
+
+int main(int argc, char** argv)
+{
+    static const char* const tables[] = { "bench_narrow", "bench_wide", "bench_deep", "bench_big" };
+    static const char* const cols[][2] = { { "data", "bson" }, { "jdata", "jsonb" } };
+
+    if(argc < 2) {
+	fprintf(stderr, "usage: bson_bench conninfo [reps]\n");
+	return 2;
+    }
+    int reps = (argc > 2) ? atoi(argv[2]) : 5;
+    if(reps < 1) reps = 1;
+
+    PGconn* conn = PQconnectdb(argv[1]);
+    if(PQstatus(conn) != CONNECTION_OK) {
+	_die(conn, "connect");
+    }
+
+    _exec(conn, "CREATE TEMP TABLE bench_sink_bson (data bson)");
+    _exec(conn, "CREATE TEMP TABLE bench_sink_jsonb (data jsonb)");
+
+    for(size_t t = 0; t < sizeof(tables) / sizeof(tables[0]); t++) {
+	for(size_t c = 0; c < sizeof(cols) / sizeof(cols[0]); c++) {
+	    Buf stream = { NULL, 0, 0 };
+	    char sink[64];
+	    snprintf(sink, sizeof(sink), "bench_sink_%s", cols[c][1]);
+
+	    double best_send = _send(conn, tables[t], cols[c][0], &stream);
+	    double best_recv = _recv(conn, sink, &stream);
+	    for(int r = 1; r < reps; r++) {
+		double s = _send(conn, tables[t], cols[c][0], NULL);
+		double v = _recv(conn, sink, &stream);
+		if(s < best_send) best_send = s;
+		if(v < best_recv) best_recv = v;
+	    }
+
+	    _report("send", tables[t], cols[c][0], stream.len, best_send);
+	    _report("recv", tables[t], cols[c][0], stream.len, best_recv);
+	    free(stream.data);
+	}
+    }
+
+    PQfinish(conn);
+    return 0;
+}
@@ -0,0 +1,42 @@
+#!/bin/sh
+#  Runs the pgbson benchmarks against a scratch database and prints one
+#  JSON object per line on stdout; progress goes to stderr.  Usually
+#  started with  make bench  (see "Benchmarks" in README.md):
+#
+#    BENCH_DB     database to (create and) use     default pgbson_bench
+#    BENCH_TIME   seconds per pgbench script        default 10
+#    BENCH_ONLY   only scripts whose name matches this grep pattern
+#
+#  The extension must already be installed (make install).
+
+set -e
+
+DIR=$(dirname "$0")
+DB=${BENCH_DB:-pgbson_bench}
+T=${BENCH_TIME:-10}
+ONLY=${BENCH_ONLY:-.}
+
+createdb "$DB" 2>/dev/null || true
+echo "loading data into $DB ..." >&2
+psql -q -X -v ON_ERROR_STOP=1 -d "$DB" -f "$DIR/setup.sql" >&2
+
+VERSION=$(psql -q -X -A -t -d "$DB" -c "SELECT pgbson_version()")
+
+for f in "$DIR"/sql/*.sql; do
+    name=$(basename "$f" .sql)
+    echo "$name" | grep -q -e "$ONLY" || continue
+    echo "$name ..." >&2
+    pgbench -n -c 1 -T "$T" -f "$f" "$DB" 2>&1 | awk -v name="$name" -v version="$VERSION" '
+        /^latency average/ { lat = $4 }
+        /^tps/             { tps = $3 }
+        /^number of transactions actually processed/ { split($0, a, ": "); n = a[2] + 0 }
+        END {
+            if (tps == "") tps = "null";
+            if (lat == "") lat = "null";
+            printf "{\"bench\":\"%s\",\"version\":\"%s\",\"tps\":%s,\"latency_ms\":%s,\"transactions\":%d}\n",
+                   name, version, tps, lat, n
+        }'
+done
+
+echo "binary send/recv ..." >&2
+"$DIR/bson_bench" "dbname=$DB"
@@ -0,0 +1,64 @@
+-- Data sets for the benchmarks (make bench).  Each table has the same
+-- documents as bson (data) and as jsonb (jdata) for the jsonb baselines.
+-- Typed values use the EJSON wrappers so the bson side gets real int64,
+-- datetime, decimal128 and binary fields.
+
+CREATE EXTENSION IF NOT EXISTS pgbson;
+
+DROP TABLE IF EXISTS bench_narrow, bench_wide, bench_deep, bench_big;
+
+-- 100k small documents with one field of every common type.
+CREATE TABLE bench_narrow (id int, data bson, jdata jsonb);
+INSERT INTO bench_narrow
+SELECT i, j::bson, j
+FROM (
+    SELECT i, jsonb_build_object(
+        'id', i,
+        's', md5(i::text),
+        'd', i + 0.5,
+        'i64', jsonb_build_object('$numberLong', (i::bigint * 1000000007)::text),
+        'dt', jsonb_build_object('$date', to_char(timestamp '2020-01-01' + i * interval '1 minute',
+                                                  'YYYY-MM-DD"T"HH24:MI:SS.MS"Z"')),
+        'dec', jsonb_build_object('$numberDecimal', (i / 100.0)::text),
+        'b', i % 2 = 0,
+        'bin', jsonb_build_object('$binary', jsonb_build_object(
+                   'base64', encode(decode(md5(i::text), 'hex'), 'base64'), 'subType', '00')),
+        'arr', jsonb_build_array(i, i + 1, i + 2),
+        'sub', jsonb_build_object('a', i, 'b', jsonb_build_object('c', md5(i::text)))) AS j
+    FROM generate_series(1, 100000) i
+) t;
+
+-- 20k documents with 200 top-level keys, also as bsonx.
+CREATE TABLE bench_wide (id int, data bson, xdata bsonx, jdata jsonb);
+INSERT INTO bench_wide
+SELECT i, j::bson, j::bson::bsonx, j
+FROM (
+    SELECT i, (SELECT jsonb_object_agg('k' || k, i * 200 + k) FROM generate_series(0, 199) k) AS j
+    FROM generate_series(1, 20000) i
+) t;
+
+-- 50k documents nested 8 levels deep.
+CREATE TABLE bench_deep (id int, data bson, jdata jsonb);
+INSERT INTO bench_deep
+SELECT i, j::bson, j
+FROM (
+    SELECT i, jsonb_build_object('l1', jsonb_build_object('l2', jsonb_build_object('l3',
+              jsonb_build_object('l4', jsonb_build_object('l5', jsonb_build_object('l6',
+              jsonb_build_object('l7', jsonb_build_object('l8', jsonb_build_object('v', i)))))))),
+              'pad', md5(i::text)) AS j
+    FROM generate_series(1, 50000) i
+) t;
+
+-- 200 documents of about 100KB, TOASTed:  a big array and a field after it.
+CREATE TABLE bench_big (id int, data bson, jdata jsonb);
+INSERT INTO bench_big
+SELECT i, j::bson, j
+FROM (
+    SELECT i, jsonb_build_object(
+        'head', i,
+        'items', (SELECT jsonb_agg(jsonb_build_object('n', n, 's', md5((i * n)::text))) FROM generate_series(1, 1500) n),
+        'tail', i) AS j
+    FROM generate_series(1, 200) i
+) t;
+
+VACUUM ANALYZE bench_narrow, bench_wide, bench_deep, bench_big;
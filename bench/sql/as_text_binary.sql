@@ -0,0 +1 @@
+SELECT count(data->>'bin') FROM bench_narrow;
@@ -0,0 +1 @@
+SELECT count(data->>'d') FROM bench_narrow;
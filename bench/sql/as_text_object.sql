@@ -0,0 +1 @@
+SELECT count(data->>'sub') FROM bench_narrow;
@@ -0,0 +1 @@
+SELECT sum(bson_get_int32(data, 'head')) FROM bench_big;
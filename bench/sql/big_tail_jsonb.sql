@@ -0,0 +1 @@
+SELECT sum((jdata->>'tail')::int4) FROM bench_big;
@@ -0,0 +1 @@
+SELECT count(data::jsonb) FROM bench_narrow;
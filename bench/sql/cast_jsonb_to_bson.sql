@@ -0,0 +1 @@
+SELECT count(jdata::bson) FROM bench_narrow;
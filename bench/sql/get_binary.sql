@@ -0,0 +1 @@
+SELECT sum(length(bson_get_binary(data, 'bin'))) FROM bench_narrow;
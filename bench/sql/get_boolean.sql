@@ -0,0 +1 @@
+SELECT count(*) FROM bench_narrow WHERE bson_get_boolean(data, 'b');
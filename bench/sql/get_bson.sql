@@ -0,0 +1 @@
+SELECT count(bson_get_bson(data, 'sub')) FROM bench_narrow;
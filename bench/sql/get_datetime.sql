@@ -0,0 +1 @@
+SELECT max(bson_get_datetime(data, 'dt')) FROM bench_narrow;
@@ -0,0 +1 @@
+SELECT sum(bson_get_decimal128(data, 'dec')) FROM bench_narrow;
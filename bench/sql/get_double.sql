@@ -0,0 +1 @@
+SELECT sum(bson_get_double(data, 'd')) FROM bench_narrow;
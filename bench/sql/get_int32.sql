@@ -0,0 +1 @@
+SELECT sum(bson_get_int32(data, 'id')) FROM bench_narrow;
@@ -0,0 +1 @@
+SELECT sum((jdata->>'id')::int4) FROM bench_narrow;
@@ -0,0 +1 @@
+SELECT sum(bson_get_int64(data, 'i64')) FROM bench_narrow;
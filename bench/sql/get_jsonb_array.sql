@@ -0,0 +1 @@
+SELECT count(bson_get_jsonb_array(data, 'arr')) FROM bench_narrow;
@@ -0,0 +1 @@
+SELECT count(bson_get_string(data, 's')) FROM bench_narrow;
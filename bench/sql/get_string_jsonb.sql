@@ -0,0 +1 @@
+SELECT count(jdata->>'s') FROM bench_narrow;
@@ -0,0 +1 @@
+SELECT count(data::text::bson) FROM bench_narrow;
@@ -0,0 +1 @@
+SELECT count(jdata::text::jsonb) FROM bench_narrow;
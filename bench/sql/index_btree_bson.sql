@@ -0,0 +1,2 @@
+CREATE INDEX bench_ix ON bench_narrow (data);
+DROP INDEX bench_ix;
@@ -0,0 +1,2 @@
+CREATE INDEX bench_ix ON bench_wide (bson_get_int32(data, 'k100'));
+DROP INDEX bench_ix;
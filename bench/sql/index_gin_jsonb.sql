@@ -0,0 +1,2 @@
+CREATE INDEX bench_ix ON bench_narrow USING gin (jdata jsonb_path_ops);
+DROP INDEX bench_ix;
@@ -0,0 +1 @@
+SELECT sum(length(data::text)) FROM bench_narrow;
@@ -0,0 +1 @@
+SELECT sum(length(jdata::text)) FROM bench_narrow;
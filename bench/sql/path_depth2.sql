@@ -0,0 +1 @@
+SELECT count(bson_get_string(data, 'sub.b.c')) FROM bench_narrow;
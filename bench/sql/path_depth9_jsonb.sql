@@ -0,0 +1 @@
+SELECT sum((jdata#>>'{l1,l2,l3,l4,l5,l6,l7,l8,v}')::int4) FROM bench_deep;
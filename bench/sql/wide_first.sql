@@ -0,0 +1 @@
+SELECT sum(bson_get_int32(data, 'k0')) FROM bench_wide;
@@ -0,0 +1 @@
+SELECT sum(bson_get_int32(data, 'k199')) FROM bench_wide;
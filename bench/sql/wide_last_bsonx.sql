@@ -0,0 +1 @@
+SELECT sum(bson_get_int32(xdata, 'k199')) FROM bench_wide;
@@ -0,0 +1 @@
+SELECT sum((jdata->>'k199')::int4) FROM bench_wide;
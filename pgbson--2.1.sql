@@ -0,0 +1,1069 @@
+-- Copyright (c) 2022  Buzz Moschetti <buzz.moschetti@gmail.com>
+-- 
+-- Permission to use, copy, modify, and distribute this software and its documentation for any purpose, without fee, and without a written agreement is hereby granted,
+-- provided that the above copyright notice and this paragraph and the following two paragraphs appear in all copies.
+-- 
+-- IN NO EVENT SHALL THE AUTHOR BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST PROFITS, 
+-- ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION, EVEN IF THE AUTHOR HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+-- 
+-- THE AUTHOR SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+-- THE SOFTWARE PROVIDED HEREUNDER IS ON AN "AS IS" BASIS, AND THE AUTHOR HAS NO OBLIGATIONS TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR MODIFICATIONS.
+
+
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION pgbson" to load this file. \quit
+
+------------------------------------
+-- type definition and i/o functions
+------------------------------------
+
+-- Do this first to establish the type name "bson".  We will need to declare the
+-- "main 4" function in, out, recv, and send.
+CREATE TYPE bson;
+
+-- from-/to- string.  The string is EJSON.
+CREATE FUNCTION bson_in(cstring) RETURNS bson AS 'MODULE_PATHNAME' LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+-- STABLE:  the EJSON flavor follows pgbson.output_mode (see bson_to_ejson).
+CREATE FUNCTION bson_out(bson) RETURNS cstring AS 'MODULE_PATHNAME' LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+-- binary i/o
+-- note recv takes 'internal' type....
+CREATE FUNCTION bson_recv(internal) RETURNS bson AS 'MODULE_PATHNAME' LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION bson_send(bson) RETURNS bytea AS 'MODULE_PATHNAME' LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+-- ANALYZE gathers the standard stats and then per-path stats for the most
+-- common dotpaths (pgbson.analyze_paths, default 32); see bson_column_stats.
+CREATE FUNCTION bson_typanalyze(internal) RETURNS boolean AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+
+-- Now that we have the "main 4" functions defined, we can fill out our new
+-- type with the Main 4 functions:
+CREATE TYPE bson (
+    input = bson_in,
+    output = bson_out,
+    send = bson_send,
+    receive = bson_recv,
+    analyze = bson_typanalyze,
+    alignment = int4,
+    storage = extended  -- Big BSONs will need TOAST!
+);
+
+
+-- To prevent storing junk or accidentally malformed BSON into the DB,
+-- we call pgbson_validate during the cast.  Fortunately, testing has shown
+-- the performance hit to be negligible.  How much checking is done is set
+-- by pgbson.validate = none | header | structure (default) | utf8 | full;
+-- none is for trusted pipelines that validated upstream.  Only superusers
+-- may change it (as pgbson.recv_validate for binary input), which is what
+-- keeps the cast IMMUTABLE:  an expression index or a folded constant
+-- cannot see a result that depends on some session's setting.
+CREATE FUNCTION pgbson_validate(bytea) RETURNS bson AS 'MODULE_PATHNAME' LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+CREATE CAST (bytea AS bson) WITH FUNCTION pgbson_validate(bytea) AS IMPLICIT;
+
+-- Going the other way, however, is easy; the BSON just comes out as bytea:
+CREATE CAST (bson AS bytea) WITHOUT FUNCTION AS IMPLICIT;
+
+
+-- But here's a great trick:
+--   To turn bson into json, just use bson_out!
+--   To turn json(b) into bson, just use bson_in!
+-- It emits data in EJSON format (relaxed unless pgbson.output_mode says
+-- canonical or postgres)!  Which means...
+-- ALL functions and expressions in Postgres JSON are now available to you.
+CREATE CAST (bson AS json) WITH INOUT;
+
+-- The text forms above depend on pgbson.output_mode, so bson_out and the
+-- bson::text and bson::json casts are STABLE (as timestamptz output is with
+-- DateStyle) and cannot go in an index expression.  bson_to_ejson names
+-- the flavor instead and is IMMUTABLE, e.g.
+--   create index on btest (bson_to_ejson(data, 'relaxed'));
+CREATE FUNCTION bson_to_ejson(bson, mode text) RETURNS text
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 50;
+
+-- bson to jsonb is very common so it gets a real function that builds
+-- the jsonb directly from the BSON instead of printing EJSON and
+-- reparsing it.  The result is the same relaxed EJSON shape as bson_out.
+CREATE FUNCTION bson_to_jsonb(bson) RETURNS jsonb AS 'MODULE_PATHNAME' LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+CREATE CAST (bson AS jsonb) WITH FUNCTION bson_to_jsonb(bson);
+
+-- Same idea going the other way:  walk the jsonb directly into BSON.
+-- EJSON wrappers like {"$date": ...} are still recognized.
+CREATE FUNCTION jsonb_to_bson(jsonb) RETURNS bson AS 'MODULE_PATHNAME' LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+CREATE CAST (jsonb AS bson) WITH FUNCTION jsonb_to_bson(jsonb);
+
+CREATE CAST (json AS bson) WITH INOUT;
+
+
+------------
+-- operators
+------------
+
+-- logical comparison
+-- Must name it other than bson_compare() because that symbol already
+-- exists in libbson.1!
+-- The ordering is the BSON spec / MongoDB one:  element by element, by
+-- canonical type, then field name, then value.  Numbers compare by value
+-- regardless of BSON type so {"a":1} = {"a":1.0}.  Use == for "same bytes".
+CREATE FUNCTION pgbson_compare(bson, bson) RETURNS INT4
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+-- btree support function 2:  fast sorts and index builds with
+-- abbreviated keys
+CREATE FUNCTION bson_sortsupport(internal) RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+--  These are "conveniences" in SQL imp in terms of real C pgbson_compare():
+CREATE FUNCTION bson_equal(bson, bson) RETURNS BOOL AS $$
+    SELECT pgbson_compare($1, $2) = 0;
+$$ LANGUAGE SQL;
+
+CREATE FUNCTION bson_not_equal(bson, bson) RETURNS BOOL AS $$
+    SELECT pgbson_compare($1, $2) <> 0;
+$$ LANGUAGE SQL;
+
+CREATE FUNCTION bson_lt(bson, bson) RETURNS BOOL AS $$
+    SELECT pgbson_compare($1, $2) < 0;
+$$ LANGUAGE SQL;
+
+CREATE FUNCTION bson_lte(bson, bson) RETURNS BOOL AS $$
+    SELECT pgbson_compare($1, $2) <= 0;
+$$ LANGUAGE SQL;
+
+CREATE FUNCTION bson_gt(bson, bson) RETURNS BOOL AS $$
+    SELECT pgbson_compare($1, $2) > 0;
+$$ LANGUAGE SQL;
+
+CREATE FUNCTION bson_gte(bson, bson) RETURNS BOOL AS $$
+    SELECT pgbson_compare($1, $2) >= 0;
+$$ LANGUAGE SQL;
+
+CREATE OPERATOR = (
+    LEFTARG = bson,
+    RIGHTARG = bson,
+    PROCEDURE = bson_equal,
+    NEGATOR = <>
+);
+
+CREATE OPERATOR <> (
+    LEFTARG = bson,
+    RIGHTARG = bson,
+    PROCEDURE = bson_not_equal,
+    NEGATOR = =
+);
+
+CREATE OPERATOR < (
+    LEFTARG = bson,
+    RIGHTARG = bson,
+    PROCEDURE = bson_lt,
+    NEGATOR = >=
+);
+
+CREATE OPERATOR <= (
+    LEFTARG = bson,
+    RIGHTARG = bson,
+    PROCEDURE = bson_lte,
+    NEGATOR = >
+);
+
+CREATE OPERATOR > (
+    LEFTARG = bson,
+    RIGHTARG = bson,
+    PROCEDURE = bson_gt,
+    NEGATOR = <=
+);
+
+CREATE OPERATOR >= (
+    LEFTARG = bson,
+    RIGHTARG = bson,
+    PROCEDURE = bson_gte,
+    NEGATOR = <
+);
+
+
+
+-- binary equality
+CREATE FUNCTION bson_binary_equal(bson, bson) RETURNS BOOL
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION bson_binary_not_equal(bson, bson) RETURNS BOOL AS $$
+    SELECT NOT(bson_binary_equal($1, $2));
+$$ LANGUAGE SQL;
+
+
+CREATE OPERATOR == (
+    LEFTARG = bson,
+    RIGHTARG = bson,
+    PROCEDURE = bson_binary_equal,
+    NEGATOR = <<>>
+);
+
+CREATE OPERATOR <<>> (
+    LEFTARG = bson,
+    RIGHTARG = bson,
+    PROCEDURE = bson_binary_not_equal,
+    NEGATOR = ==
+);
+
+---------------------
+-- hash index support
+---------------------
+
+CREATE FUNCTION bson_hash(bson) RETURNS INT4
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+-- seeded 64 bit flavor; needed for hash partitioning
+CREATE FUNCTION bson_hash_extended(bson, int8) RETURNS INT8
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE OPERATOR CLASS bson_hash_ops
+    DEFAULT FOR TYPE bson USING hash AS
+        OPERATOR 1 == (bson, bson) ,
+        FUNCTION 1 bson_hash(bson),
+        FUNCTION 2 bson_hash_extended(bson, int8);
+
+--------------------
+-- GIN index support
+--------------------
+
+-- Containment and path existence, like the jsonb operators of the same
+-- names.  Paths for ?, ?| and ?& are dotpaths, so array items are
+-- reached by index:  bson_column ? 'data.payments.0.amt'
+-- @> compares BSON types exactly, except that int32, int64, and double
+-- are all just numbers, and an array contains any value that one of
+-- its items contains:
+--   '{"tags":["red","blue"]}'::bson @> '{"tags":"red"}'::bson   is true
+CREATE FUNCTION bson_contains(bson, bson) RETURNS BOOL
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION bson_contained(bson, bson) RETURNS BOOL
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION bson_exists(bson, text) RETURNS BOOL
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION bson_exists_any(bson, text[]) RETURNS BOOL
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION bson_exists_all(bson, text[]) RETURNS BOOL
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+-- MongoDB style query filters, evaluated on the BSON itself:
+--   select * from orders where data @@ '{"status":"A", "qty":{"$gte":10}}';
+-- $eq $ne $gt $gte $lt $lte $in $nin $all $exists $type $size $elemMatch
+-- $not, and $and $or $nor.  The GIN opclass uses the plain equalities.
+CREATE FUNCTION bson_match(bson, bson) RETURNS BOOL
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+-- Restriction estimators that use the per-path stats gathered by ANALYZE;
+-- without them they are matchingsel.
+CREATE FUNCTION bson_contains_sel(internal, oid, internal, integer) RETURNS float8
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+CREATE FUNCTION bson_exists_sel(internal, oid, internal, integer) RETURNS float8
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+CREATE FUNCTION bson_exists_any_sel(internal, oid, internal, integer) RETURNS float8
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+CREATE FUNCTION bson_exists_all_sel(internal, oid, internal, integer) RETURNS float8
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+-- The path stats documents ANALYZE kept for a bson column, e.g.
+--   select s::text from unnest(bson_column_stats('btest', 'data')) s;
+CREATE FUNCTION bson_column_stats(regclass, text) RETURNS bson[]
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+CREATE OPERATOR @> (
+    LEFTARG = bson,
+    RIGHTARG = bson,
+    PROCEDURE = bson_contains,
+    COMMUTATOR = <@,
+    RESTRICT = bson_contains_sel,
+    JOIN = matchingjoinsel
+);
+
+CREATE OPERATOR <@ (
+    LEFTARG = bson,
+    RIGHTARG = bson,
+    PROCEDURE = bson_contained,
+    COMMUTATOR = @>,
+    RESTRICT = matchingsel,
+    JOIN = matchingjoinsel
+);
+
+CREATE OPERATOR ? (
+    LEFTARG = bson,
+    RIGHTARG = text,
+    PROCEDURE = bson_exists,
+    RESTRICT = bson_exists_sel,
+    JOIN = matchingjoinsel
+);
+
+CREATE OPERATOR ?| (
+    LEFTARG = bson,
+    RIGHTARG = text[],
+    PROCEDURE = bson_exists_any,
+    RESTRICT = bson_exists_any_sel,
+    JOIN = matchingjoinsel
+);
+
+CREATE OPERATOR ?& (
+    LEFTARG = bson,
+    RIGHTARG = text[],
+    PROCEDURE = bson_exists_all,
+    RESTRICT = bson_exists_all_sel,
+    JOIN = matchingjoinsel
+);
+
+CREATE OPERATOR @@ (
+    LEFTARG = bson,
+    RIGHTARG = bson,
+    PROCEDURE = bson_match,
+    RESTRICT = matchingsel,
+    JOIN = matchingjoinsel
+);
+
+CREATE FUNCTION gin_extract_bson(bson, internal, internal) RETURNS internal
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION gin_extract_bson_query(bson, internal, int2, internal, internal, internal, internal) RETURNS internal
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION gin_consistent_bson(internal, int2, bson, int4, internal, internal, internal, internal) RETURNS bool
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+-- Keys are int4 hashes of (path) and (path, typed value), e.g.
+--   CREATE INDEX ON data_collection USING gin (data);
+--   select * from data_collection where data @> '{"d":{"recordId":"R1"}}';
+CREATE OPERATOR CLASS bson_gin_ops
+    DEFAULT FOR TYPE bson USING gin AS
+        OPERATOR 7 @> (bson, bson),
+        OPERATOR 9 ? (bson, text),
+        OPERATOR 10 ?| (bson, text[]),
+        OPERATOR 11 ?& (bson, text[]),
+        OPERATOR 16 @@ (bson, bson),
+        FUNCTION 1 btint4cmp(int4, int4),
+        FUNCTION 2 gin_extract_bson(bson, internal, internal),
+        FUNCTION 3 gin_extract_bson_query(bson, internal, int2, internal, internal, internal, internal),
+        FUNCTION 4 gin_consistent_bson(internal, int2, bson, int4, internal, internal, internal, internal),
+        STORAGE int4;
+
+-----------------------
+-- b-tree index support
+-----------------------
+
+CREATE OPERATOR CLASS bson_btree_ops
+    DEFAULT FOR TYPE bson USING btree AS
+        OPERATOR 1 < (bson, bson),
+        OPERATOR 2 <= (bson, bson),
+        OPERATOR 3 = (bson, bson),
+        OPERATOR 4 >= (bson, bson),
+        OPERATOR 5 > (bson, bson),
+        FUNCTION 1 pgbson_compare(bson, bson),
+        FUNCTION 2 bson_sortsupport(internal);
+
+
+-- libbson already has bson_version....
+CREATE FUNCTION pgbson_version() RETURNS text
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+-- Counters for the hot paths, gathered while pgbson.track_stats is on.
+-- With pgbson in shared_preload_libraries they add up every backend;
+-- otherwise they cover only the current session.  The "get" site counts
+-- the bson_get_* getters:  bytes is what had to be detoasted, misses are
+-- absent paths and mismatches are values of the wrong type (both NULL).
+CREATE FUNCTION pgbson_stats(
+    OUT site text,
+    OUT calls int8,
+    OUT bytes int8,
+    OUT time_ms float8,
+    OUT misses int8,
+    OUT mismatches int8
+) RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL RESTRICTED;
+
+CREATE VIEW pgbson_stats AS
+    SELECT site, calls, bytes, time_ms, misses, mismatches,
+           misses::float8 / nullif(calls, 0) AS miss_rate
+    FROM pgbson_stats();
+
+CREATE FUNCTION pgbson_stats_reset() RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL RESTRICTED;
+
+REVOKE ALL ON FUNCTION pgbson_stats_reset() FROM PUBLIC;
+
+------------------------------
+-- All the _get_ functions can take a dotpath, e.g.
+-- bson_get_string(bson_column, 'user.detail.address.city')
+--
+-- IMPORTANT NOTE:
+-- The default text representation of BSON is *relaxed* EJSON.  Canonical EJSON
+-- explicitly identifies all types EXCEPT string using the "dollar-typename"
+-- convention, e.g.
+--   {"fld1": {"$numberInt": "123"},
+--    "fld2": {"$date": 1646309594456},
+--    "fld3": {"$numberDecimal": "23498734.34"},
+--    "fld4": {"$numberDouble": "3.14159"}
+--   }
+-- Note how numeric values are represented as strings to prevent the JSON parser
+-- from trying to do numeric interpretation.  Also note the date format is a long
+-- integer, millis since epoch.  Although this preserves type and precision, it
+-- is irritating to work with directly.  Relaxed EJSON changes the format
+-- as follows:
+-- 1.  Int32, int64, and double values are emitted directly
+-- 2.  Date is emitted in ISO8601 format
+--   {"fld1": 123},
+--    "fld2": {"$date": "2022-03-03T12:13:14.789Z"},
+--    "fld3": {"$numberDecimal": "23498734.34"},
+--    "fld4": 3.14159}
+--   }
+--
+-- Although the dollar-typename format continues to appear in textual output
+-- (most notably in  "select bson_column from table"), it is *NOT* part of the
+-- actual path to data.  Example:
+--    Correct way: No dollar-typename, returns a postgres numeric type:
+--    select bson_get_decimal128(bson_column,'path.to.fld3') from table
+--
+--    INCORRECT way:
+--    select bson_get_decimal128(bson_column,'path.to.fld3.$numberDecimal') from table
+--
+------------------------------
+
+-- Planner support for all the (bson, dotpath) functions below.  When the
+-- first argument is itself bson_get_bson() (or the -> operator) with a
+-- constant path, the two calls are folded into one with a joined dotpath:
+--   bson_column->'a'->'b'->>'c'   is planned as   bson_as_text(bson_column, 'a.b.c')
+-- so arrow chains get the same single walk as dotpaths.
+-- It also prices each call from the COST below plus a bit per dotpath
+-- segment, and estimates  where bson_get_boolean(data, 'x')  from the stats
+-- of a matching expression index when there is one.
+--
+-- COST is relative:  fixed-width getters are cheapest, then getters that
+-- copy (string, decimal128, binary), then bson_get_bson (builds a subdoc),
+-- bson_as_text (may render a whole object as JSON) and finally
+-- bson_get_jsonb_array.  The planner runs cheap quals first.
+CREATE FUNCTION bson_path_support(internal) RETURNS internal
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION bson_get_string(bson, text) RETURNS text
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 10
+SUPPORT bson_path_support;
+
+CREATE FUNCTION bson_get_datetime(bson, text) RETURNS timestamp without time zone
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 5
+SUPPORT bson_path_support;
+
+-- BSON datetimes are UTC so this is the same instant as bson_get_datetime.
+CREATE FUNCTION bson_get_datetime_tz(bson, text) RETURNS timestamp with time zone
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 5
+SUPPORT bson_path_support;
+
+-- The raw millis since epoch, for cheap range predicates, e.g.
+--   where bson_get_datetime_millis(data, 'd.ts') >= 1654517594500
+CREATE FUNCTION bson_get_datetime_millis(bson, text) RETURNS int8
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 5
+SUPPORT bson_path_support;
+
+CREATE FUNCTION bson_get_decimal128(bson, text) RETURNS numeric
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 10
+SUPPORT bson_path_support;
+
+CREATE FUNCTION bson_get_int32(bson, text) RETURNS int4
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 5
+SUPPORT bson_path_support;
+
+CREATE FUNCTION bson_get_int64(bson, text) RETURNS int8
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 5
+SUPPORT bson_path_support;
+
+CREATE FUNCTION bson_get_double(bson, text) RETURNS float8
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 5
+SUPPORT bson_path_support;
+
+CREATE FUNCTION bson_get_binary(bson, text) RETURNS bytea
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 10
+SUPPORT bson_path_support;
+
+-- The binary as base64 text, and the binary with its BinData subtype.
+
+CREATE FUNCTION bson_get_binary_base64(bson, text) RETURNS text
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 10
+SUPPORT bson_path_support;
+
+CREATE FUNCTION bson_get_bindata(bson, text, OUT subtype int4, OUT data bytea) RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 10
+SUPPORT bson_path_support;
+
+CREATE FUNCTION bson_get_boolean(bson, text) RETURNS boolean
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 5
+SUPPORT bson_path_support;
+
+
+-- A great workhorse function especially for rapidly descending into a complex
+-- BSON structure to yield a subdoc, which can then be cast to JSON for
+-- all kinds of processing in Postgres.  For example, a doc with big subdocs
+-- a and b does not need to be fully parsed into JSON only to get at c.vector:
+--
+--   select json_array_length(bson_get_bson(data, 'a.b.c')::json->'vector') from btest;
+--
+-- It is also "the" function to call from client-side programs
+-- to fetch BSON in native form (returned to program drivers as bytea)
+-- 
+CREATE FUNCTION bson_get_bson(bson, text) RETURNS bson
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 25
+SUPPORT bson_path_support;
+
+
+-- See README.md for special value of this function.
+CREATE FUNCTION bson_get_jsonb_array(bson, text) RETURNS jsonb
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 100
+SUPPORT bson_path_support;
+
+
+
+
+-- Forces to-text; used in ->> operator
+CREATE FUNCTION bson_as_text(bson, text) RETURNS text
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 50
+SUPPORT bson_path_support;
+
+CREATE OPERATOR -> (
+    LEFTARG = bson,
+    RIGHTARG = text,
+    FUNCTION = bson_get_bson
+);
+
+CREATE OPERATOR ->> (
+    LEFTARG = bson,
+    RIGHTARG = text,
+    FUNCTION = bson_as_text
+);
+
+
+-- Hash / compare the value at a dotpath in place, type tag included, e.g.
+-- to join on an embedded id without making a text out of it first:
+--
+--   ... ON bson_path_equal(e.doc, 'hdr.id', r.doc, 'id')
+--
+-- bson_path_equal is a plain function, so on its own it only nested-loop
+-- joins.  Put the hash equality next to it to get a hash join; the int4 =
+-- does the hashing and bson_path_equal weeds out the collisions:
+--
+--   ... ON bson_path_hash(e.doc, 'hdr.id') = bson_path_hash(r.doc, 'id')
+--      AND bson_path_equal(e.doc, 'hdr.id', r.doc, 'id')
+--
+-- NULL if the path is missing.
+CREATE FUNCTION bson_path_hash(bson, text) RETURNS INT4
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 5;
+
+CREATE FUNCTION bson_path_equal(bson, text, bson, text) RETURNS BOOL
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 10;
+
+
+-- Fetch many dotpaths in one walk of the document.  Much cheaper than
+-- calling the bson_get_{type} functions N times on the same column because
+-- the BSON is detoasted and walked only once.  Supply the names and types
+-- of the results in a column definition list; the types follow the same
+-- rules as the getters (bson_get_int32 for int4, bson_as_text for text,
+-- etc., plus bson and jsonb for subdocs/arrays):
+--
+--   select x.* from btest,
+--     bson_extract(data, array['d.recordId','d.amt','d.ts']) as x(id text, amt numeric, ts timestamp);
+CREATE FUNCTION bson_extract(bson, text[]) RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+
+-- Rewrite a document so the given dotpaths come first at each level;
+-- everything else keeps its order.  Lookups scan in order so hot fields
+-- up front are cheaper to reach, e.g.
+--
+--   update btest set data = bson_reorder(data, array['d.recordId','d.ts']);
+--
+-- To do this to every document on the way in, set pgbson.hot_paths
+-- server wide, e.g.
+--   ALTER SYSTEM SET pgbson.hot_paths = 'd.recordId, d.ts';
+--   SELECT pg_reload_conf();
+CREATE FUNCTION bson_reorder(bson, text[]) RETURNS bson
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+
+-- bsonx is bson with a sorted table of top-level key offsets stored in
+-- front of it, so a getter on a wide document jumps straight to the
+-- field instead of walking every key before it.  It costs 8 bytes per
+-- top-level key; documents with fewer than 16 keys are stored plain.
+-- Only the top level is indexed.  Casting to bson or bytea, and binary
+-- send, give back the untouched BSON:
+--
+--   create table btestx (data bsonx);
+--   insert into btestx select data from btest;
+--   select data->>'d.recordId' from btestx;
+CREATE TYPE bsonx;
+
+CREATE FUNCTION bsonx_in(cstring) RETURNS bsonx AS 'MODULE_PATHNAME' LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+CREATE FUNCTION bsonx_out(bsonx) RETURNS cstring AS 'MODULE_PATHNAME' LANGUAGE C STRICT STABLE PARALLEL SAFE;
+CREATE FUNCTION bsonx_recv(internal) RETURNS bsonx AS 'MODULE_PATHNAME' LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+CREATE FUNCTION bsonx_send(bsonx) RETURNS bytea AS 'MODULE_PATHNAME' LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE TYPE bsonx (
+    input = bsonx_in,
+    output = bsonx_out,
+    send = bsonx_send,
+    receive = bsonx_recv,
+    alignment = int4,
+    storage = extended
+);
+
+CREATE FUNCTION bson_to_bsonx(bson) RETURNS bsonx AS 'MODULE_PATHNAME' LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+CREATE CAST (bson AS bsonx) WITH FUNCTION bson_to_bsonx(bson) AS ASSIGNMENT;
+
+CREATE FUNCTION bytea_to_bsonx(bytea) RETURNS bsonx AS 'MODULE_PATHNAME' LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+CREATE CAST (bytea AS bsonx) WITH FUNCTION bytea_to_bsonx(bytea) AS ASSIGNMENT;
+
+-- Implicit so everything declared on bson (comparison, hashing, @>,
+-- bson_extract, ...) also takes bsonx.
+CREATE FUNCTION bsonx_to_bson(bsonx) RETURNS bson AS 'MODULE_PATHNAME' LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+CREATE CAST (bsonx AS bson) WITH FUNCTION bsonx_to_bson(bsonx) AS IMPLICIT;
+
+CREATE FUNCTION bsonx_to_bytea(bsonx) RETURNS bytea AS 'MODULE_PATHNAME','bsonx_to_bson' LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+CREATE CAST (bsonx AS bytea) WITH FUNCTION bsonx_to_bytea(bsonx);
+
+CREATE CAST (bsonx AS json) WITH INOUT;
+
+-- The getters use the index directly, so they are declared on bsonx too.
+CREATE FUNCTION bson_get_string(bsonx, text) RETURNS text
+AS 'MODULE_PATHNAME','bson_get_string'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 10
+SUPPORT bson_path_support;
+
+CREATE FUNCTION bson_get_datetime(bsonx, text) RETURNS timestamp without time zone
+AS 'MODULE_PATHNAME','bson_get_datetime'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 5
+SUPPORT bson_path_support;
+
+CREATE FUNCTION bson_get_datetime_tz(bsonx, text) RETURNS timestamp with time zone
+AS 'MODULE_PATHNAME','bson_get_datetime_tz'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 5
+SUPPORT bson_path_support;
+
+CREATE FUNCTION bson_get_datetime_millis(bsonx, text) RETURNS int8
+AS 'MODULE_PATHNAME','bson_get_datetime_millis'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 5
+SUPPORT bson_path_support;
+
+CREATE FUNCTION bson_get_decimal128(bsonx, text) RETURNS numeric
+AS 'MODULE_PATHNAME','bson_get_decimal128'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 10
+SUPPORT bson_path_support;
+
+CREATE FUNCTION bson_get_int32(bsonx, text) RETURNS int4
+AS 'MODULE_PATHNAME','bson_get_int32'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 5
+SUPPORT bson_path_support;
+
+CREATE FUNCTION bson_get_int64(bsonx, text) RETURNS int8
+AS 'MODULE_PATHNAME','bson_get_int64'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 5
+SUPPORT bson_path_support;
+
+CREATE FUNCTION bson_get_double(bsonx, text) RETURNS float8
+AS 'MODULE_PATHNAME','bson_get_double'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 5
+SUPPORT bson_path_support;
+
+CREATE FUNCTION bson_get_binary(bsonx, text) RETURNS bytea
+AS 'MODULE_PATHNAME','bson_get_binary'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 10
+SUPPORT bson_path_support;
+
+CREATE FUNCTION bson_get_binary_base64(bsonx, text) RETURNS text
+AS 'MODULE_PATHNAME','bson_get_binary_base64'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 10
+SUPPORT bson_path_support;
+
+CREATE FUNCTION bson_get_bindata(bsonx, text, OUT subtype int4, OUT data bytea) RETURNS record
+AS 'MODULE_PATHNAME','bson_get_bindata'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 10
+SUPPORT bson_path_support;
+
+CREATE FUNCTION bson_get_boolean(bsonx, text) RETURNS boolean
+AS 'MODULE_PATHNAME','bson_get_boolean'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 5
+SUPPORT bson_path_support;
+
+CREATE FUNCTION bson_get_bson(bsonx, text) RETURNS bson
+AS 'MODULE_PATHNAME','bson_get_bson'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 25
+SUPPORT bson_path_support;
+
+CREATE FUNCTION bson_as_text(bsonx, text) RETURNS text
+AS 'MODULE_PATHNAME','bson_as_text'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 50
+SUPPORT bson_path_support;
+
+CREATE OPERATOR -> (
+    LEFTARG = bsonx,
+    RIGHTARG = text,
+    FUNCTION = bson_get_bson
+);
+
+CREATE OPERATOR ->> (
+    LEFTARG = bsonx,
+    RIGHTARG = text,
+    FUNCTION = bson_as_text
+);
+
+
+-- The array at a dotpath as a postgres array, in one walk:
+--
+--   select bson_get_float8_array(data, 'sensor.readings') from btest;
+--
+-- float8 takes doubles, int32s and int64s; int8 int32s and int64s; text
+-- strings; timestamp datetimes.  BSON null items are NULL elements.  Any
+-- other item is an error, or with strict => false is left out.
+CREATE FUNCTION bson_get_float8_array(bson, text, strict boolean DEFAULT true) RETURNS float8[]
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 25
+SUPPORT bson_path_support;
+
+CREATE FUNCTION bson_get_int8_array(bson, text, strict boolean DEFAULT true) RETURNS int8[]
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 25
+SUPPORT bson_path_support;
+
+CREATE FUNCTION bson_get_text_array(bson, text, strict boolean DEFAULT true) RETURNS text[]
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 25
+SUPPORT bson_path_support;
+
+CREATE FUNCTION bson_get_timestamp_array(bson, text, strict boolean DEFAULT true) RETURNS timestamp without time zone[]
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 25
+SUPPORT bson_path_support;
+
+
+-- Unnest the array at a dotpath, one item per row, straight from the BSON:
+--
+--   select li.* from btest, bson_array_elements(data, 'd.lineItems') as li;
+--   select sum(x) from btest, bson_array_elements_numeric(data, 'd.amts') as x;
+--
+-- NOTE:  bson is always a document, so bson_array_elements and bson_each
+-- return NULL, not the value, for scalar items (numbers, strings, dates,
+-- ...); only subdocuments and subarrays come back as bson.  Use the _text
+-- variant, which renders every item as ->> does, or _int8 / _numeric
+-- (other items are NULL there too) when the items are scalars.
+-- bson_each and bson_each_text do the same for the key/value pairs of a
+-- document.  An empty path means the document itself.  The row estimate
+-- is exact when both arguments are constants.  COST is per row, on the
+-- same scale as the getters.
+CREATE FUNCTION bson_array_elements_support(internal) RETURNS internal
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION bson_each_support(internal) RETURNS internal
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION bson_array_elements(bson, text) RETURNS SETOF bson
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 10 ROWS 100 SUPPORT bson_array_elements_support;
+
+CREATE FUNCTION bson_array_elements_text(bson, text) RETURNS SETOF text
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 10 ROWS 100 SUPPORT bson_array_elements_support;
+
+CREATE FUNCTION bson_array_elements_int8(bson, text) RETURNS SETOF int8
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 5 ROWS 100 SUPPORT bson_array_elements_support;
+
+CREATE FUNCTION bson_array_elements_numeric(bson, text) RETURNS SETOF numeric
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 5 ROWS 100 SUPPORT bson_array_elements_support;
+
+CREATE FUNCTION bson_each(bson, text, OUT key text, OUT value bson) RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 10 ROWS 100 SUPPORT bson_each_support;
+
+CREATE FUNCTION bson_each_text(bson, text, OUT key text, OUT value text) RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE
+COST 10 ROWS 100 SUPPORT bson_each_support;
+
+
+-- Change one thing in a document without a trip through EJSON or jsonb.
+-- The rest of the document is copied byte for byte.
+--
+--   update btest set data = bson_set(data, 'd.status', 'SHIPPED'::text);
+--
+-- bson_set adds missing keys (and documents on the way down) and
+-- replaces existing ones; a NULL value stores BSON null.  The value can
+-- be boolean, int2/4/8, float4/8, numeric (as decimal128), text,
+-- timestamp(tz) (as datetime), bytea (as binary), jsonb or bson.
+-- bson_array_append adds to the end of the array at path, making it if
+-- needed.  bson_unset removes a key (array items become null so the
+-- others keep their index).  bson_merge sets each top-level key of the
+-- second document on the first, like jsonb ||.
+CREATE FUNCTION bson_set(bson, text, anyelement) RETURNS bson
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION bson_array_append(bson, text, anyelement) RETURNS bson
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION bson_unset(bson, text) RETURNS bson
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION bson_merge(bson, bson) RETURNS bson
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+
+-- Aggregates over the value at a dotpath.  They read the BSON directly
+-- instead of making a Datum per row with a getter, and run in parallel:
+--
+--   select bson_sum_decimal128(data, 'd.amt') from btest;
+--   select bson_get_datetime(bson_minmax(data, 'd.ts'), 'max') from btest;
+--
+-- Rows where the path is missing or of the wrong type are skipped.
+--
+--   bson_sum_decimal128, bson_avg_decimal128:  exact, decimal128 only
+--   bson_sum:  int32, int64 and decimal128 exactly; doubles as float8
+--   bson_minmax:  {"min": v, "max": v} in bson ordering, any type
+--   bson_count_type:  {"int": 10, "missing": 2, ...} ($type names)
+--   bson_agg(bson):  an array of the documents
+CREATE FUNCTION bson_decimal128_accum(internal, bson, text) RETURNS internal
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION bson_sum_accum(internal, bson, text) RETURNS internal
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION bson_sum_combine(internal, internal) RETURNS internal
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION bson_sum_serialize(internal) RETURNS bytea
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION bson_sum_deserialize(bytea, internal) RETURNS internal
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION bson_decimal128_sum_final(internal) RETURNS numeric
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION bson_decimal128_avg_final(internal) RETURNS numeric
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION bson_sum_final(internal) RETURNS numeric
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE AGGREGATE bson_sum_decimal128(bson, text) (
+    SFUNC = bson_decimal128_accum,
+    STYPE = internal,
+    FINALFUNC = bson_decimal128_sum_final,
+    COMBINEFUNC = bson_sum_combine,
+    SERIALFUNC = bson_sum_serialize,
+    DESERIALFUNC = bson_sum_deserialize,
+    PARALLEL = SAFE
+);
+
+CREATE AGGREGATE bson_avg_decimal128(bson, text) (
+    SFUNC = bson_decimal128_accum,
+    STYPE = internal,
+    FINALFUNC = bson_decimal128_avg_final,
+    COMBINEFUNC = bson_sum_combine,
+    SERIALFUNC = bson_sum_serialize,
+    DESERIALFUNC = bson_sum_deserialize,
+    PARALLEL = SAFE
+);
+
+CREATE AGGREGATE bson_sum(bson, text) (
+    SFUNC = bson_sum_accum,
+    STYPE = internal,
+    FINALFUNC = bson_sum_final,
+    COMBINEFUNC = bson_sum_combine,
+    SERIALFUNC = bson_sum_serialize,
+    DESERIALFUNC = bson_sum_deserialize,
+    PARALLEL = SAFE
+);
+
+CREATE FUNCTION bson_minmax_accum(internal, bson, text) RETURNS internal
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION bson_minmax_combine(internal, internal) RETURNS internal
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION bson_minmax_serialize(internal) RETURNS bytea
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION bson_minmax_deserialize(bytea, internal) RETURNS internal
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION bson_minmax_final(internal) RETURNS bson
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE AGGREGATE bson_minmax(bson, text) (
+    SFUNC = bson_minmax_accum,
+    STYPE = internal,
+    FINALFUNC = bson_minmax_final,
+    COMBINEFUNC = bson_minmax_combine,
+    SERIALFUNC = bson_minmax_serialize,
+    DESERIALFUNC = bson_minmax_deserialize,
+    PARALLEL = SAFE
+);
+
+CREATE FUNCTION bson_count_type_accum(internal, bson, text) RETURNS internal
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION bson_count_type_combine(internal, internal) RETURNS internal
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION bson_count_type_serialize(internal) RETURNS bytea
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION bson_count_type_deserialize(bytea, internal) RETURNS internal
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION bson_count_type_final(internal) RETURNS bson
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE AGGREGATE bson_count_type(bson, text) (
+    SFUNC = bson_count_type_accum,
+    STYPE = internal,
+    FINALFUNC = bson_count_type_final,
+    COMBINEFUNC = bson_count_type_combine,
+    SERIALFUNC = bson_count_type_serialize,
+    DESERIALFUNC = bson_count_type_deserialize,
+    PARALLEL = SAFE
+);
+
+CREATE FUNCTION bson_agg_accum(internal, bson) RETURNS internal
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION bson_agg_combine(internal, internal) RETURNS internal
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION bson_agg_serialize(internal) RETURNS bytea
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION bson_agg_deserialize(bytea, internal) RETURNS internal
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION bson_agg_final(internal) RETURNS bson
+AS 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE AGGREGATE bson_agg(bson) (
+    SFUNC = bson_agg_accum,
+    STYPE = internal,
+    FINALFUNC = bson_agg_final,
+    COMBINEFUNC = bson_agg_combine,
+    SERIALFUNC = bson_agg_serialize,
+    DESERIALFUNC = bson_agg_deserialize,
+    PARALLEL = SAFE
+);
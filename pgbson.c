@@ -22,23 +22,83 @@
 #include <stdio.h>    // only for fprintf() debugging....
 #endif
 
+#include <math.h>     // isnan, isinf
+#include <ctype.h>    // isdigit
+
 
 // The Postgres family of #includes
 #include <postgres.h>  // always need this first, and the deps are indented:
 #include "utils/builtins.h"  // text_to_cstring, extern numeric_in
 #include "utils/jsonb.h"  // JsonbPair type, funcs
+#include "common/base64.h"  // pg_b64_encode for $binary in bson::jsonb
+#include "common/shortest_dec.h"  // double_to_shortest_decimal_buf, as float8out
+#include "miscadmin.h"  // check_stack_depth
+#include "mb/pg_wchar.h"  // unicode_to_utf8 for \u escapes in bson_in
+#include "utils/float.h"  // get_float8_nan, get_float8_infinity
 
 // includes to support BSON<->timestamp
 #include <utils/timestamp.h>
 #include <datatype/timestamp.h>
+#include <common/int.h>  // pg_mul_s64_overflow
 
 // includes to support BSON<->numeric
 #include <utils/numeric.h>
+#include <utils/datum.h>  // datumCopy for aggregate state
 
 // includes to support BSON binary send/receive:
 #include <lib/stringinfo.h>  // technically, #included by pgformat but OK
 #include <libpq/pqformat.h>
 
+// includes to support record and array args/results e.g. bson_extract:
+#include <funcapi.h>
+#include <access/htup_details.h>
+#include <catalog/pg_type.h>
+#include <utils/array.h>
+
+// includes to support the planner support function:
+#include <nodes/makefuncs.h>
+#include <nodes/nodeFuncs.h>
+#include <nodes/supportnodes.h>
+#include <optimizer/cost.h>
+#include <utils/lsyscache.h>
+#include <utils/selfuncs.h>
+
+// includes to support zero-copy subdocs (expanded bson):
+#include <utils/expandeddatum.h>
+#include <utils/memutils.h>
+
+// includes to support sliced detoast in the getters:
+#include <access/detoast.h>
+
+// includes to support the GIN opclass:
+#include <access/gin.h>
+#include <access/stratnum.h>
+#include <common/hashfn.h>
+
+// includes to support SortSupport with abbreviated keys:
+#include <lib/hyperloglog.h>
+#include <port/pg_bswap.h>
+#include <utils/sortsupport.h>
+
+// includes to support GUCs (pgbson.*):
+#include <utils/guc.h>
+
+// includes to support ANALYZE path statistics:
+#include <commands/vacuum.h>
+#include <utils/acl.h>
+#include <utils/hsearch.h>
+#include <utils/rls.h>
+#include <utils/syscache.h>
+
+// includes to support pgbson_stats counters:
+#include <portability/instr_time.h>
+#include <postmaster/autovacuum.h>
+#include <replication/walsender.h>
+#include <storage/ipc.h>
+#include <storage/lwlock.h>
+#include <storage/proc.h>
+#include <storage/shmem.h>
+
 #include <fmgr.h> // always need this
 
 
@@ -49,17 +109,86 @@
 
 
 
+// A bson value is usually a plain varlena, but bson_get_bson() may also
+// hand back an "expanded" bson:  a read-only view (pointer + length) into
+// the bytes of the document it came from.  Chained accessors in one
+// expression then slice the parent instead of copying subdocuments.
+// Anything that needs a real varlena (storing it, bson::bytea, ...)
+// makes postgres call flatten_into, which copies the bytes just once.
+typedef struct
+{
+    ExpandedObjectHeader hdr;
+    const uint8_t* data;   // NOT owned; lives in the parent's memory
+    uint32 len;
+} ExpandedBson;
+
+// A bsonx value is plain BSON, or an offset index followed by the
+// untouched BSON:
+//
+//   uint32 magic, uint32 nentries, uint32 bson_off,
+//   nentries x { uint32 key hash, uint32 element offset } sorted,
+//   BSON (at bson_off from the start of the data)
+//
+// The magic read as a little-endian int32 is negative, either way round,
+// so it can never be mistaken for the length that starts real BSON.
+// Fields are native-endian and may be unaligned (short varlena), so
+// always memcpy them out.
+#define BSONX_MAGIC       0x8B5B5B8BU
+#define BSONX_HDR_SIZE    12
+#define BSONX_ENTRY_SIZE  8
+
+// Bytes of index in front of the BSON of a bsonx value; 0 if it has
+// none.  Only ever ask this of bsonx:  plain bson is never indexed.  The
+// header must describe exactly the value it is in, so a bad offset is an
+// error and not a read out of bounds.
+static uint32 _bsonx_skip(const struct varlena* v)
+{
+    uint32 size = VARSIZE_ANY_EXHDR(v);
+    const char* data = VARDATA_ANY(v);
+    uint32 m;
+    uint32 n;
+    uint32 off;
+    int32_t blen;
+
+    if(size < BSONX_HDR_SIZE + 5) {
+	return 0;
+    }
+    memcpy(&m, data, 4);
+    if(m != BSONX_MAGIC) {
+	return 0;
+    }
+
+    memcpy(&n, data + 4, 4);
+    memcpy(&off, data + 8, 4);
+    if(n > (size - BSONX_HDR_SIZE - 5) / BSONX_ENTRY_SIZE
+       || off != BSONX_HDR_SIZE + n * BSONX_ENTRY_SIZE
+       || (memcpy(&blen, data + off, 4), (uint32) BSON_UINT32_FROM_LE(blen) != size - off)) {
+	ereport(
+	    ERROR,
+	    (errcode(ERRCODE_DATA_CORRUPTED), errmsg("corrupted bsonx offset index"))
+	    );
+    }
+    return off;
+}
+
+#define BSON_IS_EXPANDED(X)  VARATT_IS_EXTERNAL_EXPANDED(X)
+#define BSON_EXPANDED(X)     ((ExpandedBson*) DatumGetEOHP(PointerGetDatum(X)))
+
 // Our namespace for macros is BSON_ , acknowledging PG_ as the base namespace
-#define DatumGetBson(X) ((bytea *) PG_DETOAST_DATUM_PACKED(X))
+// Expanded bson is passed through as-is:  no detoast, no copy, and
+// PG_FREE_IF_COPY sees the same pointer and leaves it alone.
+#define DatumGetBson(X) (BSON_IS_EXPANDED(DatumGetPointer(X)) ? (bytea *) DatumGetPointer(X) : (bytea *) PG_DETOAST_DATUM_PACKED(X))
 #define BSON_GETARG_BSON(n)  DatumGetBson(PG_GETARG_DATUM(n))
 
 //  uint8_t* is "same" as char[] so hush up the compiler
 //  AND:  Don't forget; we must use VARDATA_ANY when using PG_DETOAST_DATUM_PACKED
-#define BSON_VARDATA_ANY(X)  (uint8_t*)VARDATA_ANY(X)      
+//  These two must be used on anything that came from BSON_GETARG_BSON:
+#define BSON_VARDATA_ANY(X)  (BSON_IS_EXPANDED(X) ? (uint8_t*) BSON_EXPANDED(X)->data : (uint8_t*)VARDATA_ANY(X))
+#define BSON_VARSIZE_ANY_EXHDR(X)  (BSON_IS_EXPANDED(X) ? BSON_EXPANDED(X)->len : VARSIZE_ANY_EXHDR(X))
 
 #define BSON_ERRMSG_BUF_SIZE   256   // Plenty big to hold a message.
 #define BSON_STATIC_INIT(BPTR,AA)					\
-      do {if(!bson_init_static(BPTR, BSON_VARDATA_ANY(AA), VARSIZE_ANY_EXHDR(AA))) { char emsg[BSON_ERRMSG_BUF_SIZE] = "cannot init bson in "; strcat(emsg,__func__); ereport(ERROR, (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg(emsg))); } }  while(0)
+      do {if(!bson_init_static(BPTR, BSON_VARDATA_ANY(AA), BSON_VARSIZE_ANY_EXHDR(AA))) { char emsg[BSON_ERRMSG_BUF_SIZE] = "cannot init bson in "; strcat(emsg,__func__); ereport(ERROR, (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg(emsg))); } }  while(0)
 
       
 
@@ -69,214 +198,499 @@ PG_MODULE_MAGIC;
 #endif
 
 
+// Not in bson.h but exported by libbson; used to render datetime as ISO 8601
+extern void
+_bson_iso8601_date_format (int64_t msec_since_epoch, bson_string_t *str);
 
 
-static text* mk_text(const char* cstr)
+// GUCs
+// pgbson.validate:  how hard the bytea::bson cast (pgbson_validate) looks
+// at incoming bytes.  Each level includes the ones before it.  Superuser
+// only:  unchecked bytes in a shared table are everyone's problem, and the
+// cast stays IMMUTABLE only because ordinary sessions cannot change it.
+typedef enum
 {
-    int s_len = strlen(cstr);
-    int tot_len = s_len + VARHDRSZ;
+    BSON_VALIDATE_LEVEL_NONE,       // trust the bytes completely
+    BSON_VALIDATE_LEVEL_HEADER,     // length prefix and trailing NUL
+    BSON_VALIDATE_LEVEL_STRUCTURE,  // walk every element (the old behavior)
+    BSON_VALIDATE_LEVEL_UTF8,       // ... and strings must be valid UTF-8
+    BSON_VALIDATE_LEVEL_FULL        // ... and no empty, $-prefixed or dotted keys
+} BsonValidateLevel;
+
+static const struct config_enum_entry bson_validate_options[] = {
+    {"none", BSON_VALIDATE_LEVEL_NONE, false},
+    {"header", BSON_VALIDATE_LEVEL_HEADER, false},
+    {"structure", BSON_VALIDATE_LEVEL_STRUCTURE, false},
+    {"utf8", BSON_VALIDATE_LEVEL_UTF8, false},
+    {"full", BSON_VALIDATE_LEVEL_FULL, false},
+    {NULL, 0, false}
+};
+
+static int bson_validate_level = BSON_VALIDATE_LEVEL_STRUCTURE;
+
+// pgbson.output_mode:  which EJSON flavor bson_out writes (see "EJSON output").
+typedef enum
+{
+    BSON_OUTPUT_RELAXED,
+    BSON_OUTPUT_CANONICAL,
+    BSON_OUTPUT_POSTGRES
+} BsonOutputMode;
 
-    text* t = (text *) palloc(tot_len);
-    SET_VARSIZE(t, tot_len);
+static const struct config_enum_entry bson_output_options[] = {
+    {"relaxed", BSON_OUTPUT_RELAXED, false},
+    {"canonical", BSON_OUTPUT_CANONICAL, false},
+    {"postgres", BSON_OUTPUT_POSTGRES, false},
+    {NULL, 0, false}
+};
 
-    memcpy((void *) VARDATA(t), (void *) cstr, s_len);
+static int bson_output_mode = BSON_OUTPUT_RELAXED;
 
-    return t;
-}
+// pgbson.slice_detoast:  let the getters fetch just a prefix of big
+// out-of-line documents (see "Sliced detoast").
+static bool bson_slice_detoast = true;
+
+// pgbson.hot_paths:  comma separated dotpaths to move first in every
+// incoming document (see "Hot fields first").  Empty means leave as is.
+static char* bson_hot_paths = NULL;
+
+// pgbson.recv_validate:  walk the whole structure of BSON arriving via the
+// binary protocol (bson_recv).  The length prefix is always checked; turn
+// this off only for trusted loaders that already validate upstream.
+// Superuser only, as pgbson.validate.
+static bool bson_recv_validate = true;
+
+// pgbson.analyze_paths:  how many dotpaths per bson column ANALYZE keeps
+// statistics for (see "Path statistics").  0 means only the standard stats.
+static int bson_analyze_paths = 32;
+
+// pgbson.track_stats:  count calls, bytes and time in the hot paths for
+// pgbson_stats() (see "Instrumentation").  Off, each site costs one branch.
+static bool bson_track_stats = false;
 
 
-static char* mk_cstring(const char* cstr)
+//
+//  Instrumentation
+//
+//  With pgbson.track_stats on, the hot paths bump a slot of counters.
+//  When loaded via shared_preload_libraries the slots live in shared
+//  memory, one per PGPROC and each written only by the backend owning it,
+//  so no locking; pgbson_stats() adds them all up.  Loaded any other way
+//  there is only the backend's own slot and pgbson_stats() shows just
+//  this session.
+//
+
+typedef enum
 {
-    int s_len = strlen(cstr);
-    int tot_len = s_len + 1;  // just 1 extra NULL...
+    BSON_STAT_GET,          // the bson_get_* getters, ->>, path operators
+    BSON_STAT_IN,           // bson_in (EJSON text)
+    BSON_STAT_OUT,          // bson_out
+    BSON_STAT_VALIDATE,     // bytea cast and binary receive checks
+    BSON_STAT_TO_JSONB,     // bson to jsonb
+    BSON_STAT_FROM_JSONB,   // jsonb to bson
+    BSON_STAT_COPY,         // mk_palloc_bytea
+    BSON_STAT_NSITES
+} BsonStatSite;
+
+static const char* const bson_stat_site_names[BSON_STAT_NSITES] = {
+    "get", "in", "out", "validate", "to_jsonb", "from_jsonb", "copy"
+};
+
+typedef enum
+{
+    BSON_STAT_CALLS,
+    BSON_STAT_BYTES,        // get: detoasted; others: handled or produced
+    BSON_STAT_TIME_US,      // timed sites only
+    BSON_STAT_MISSES,       // get: path not there
+    BSON_STAT_MISMATCHES,   // get: there, but not the type asked for
+    BSON_STAT_NFIELDS
+} BsonStatField;
+
+typedef struct
+{
+    uint64 v[BSON_STAT_NSITES][BSON_STAT_NFIELDS];
+} BsonStatSlot;
+
+static BsonStatSlot bson_local_stats;
+static BsonStatSlot* bson_shared_stats = NULL;  // _stats_nslots() of them
+static BsonStatSlot* bson_my_stats = NULL;
 
-    char* p = (char*) palloc(tot_len);
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
 
-    memcpy((void *) p, (void *) cstr, tot_len); // incl NULL!
+#if PG_VERSION_NUM >= 170000
+#define BSON_MY_PROCNO  MyProcNumber
+#else
+#define BSON_MY_PROCNO  (MyProc->pgprocno)
+#endif
 
-    return p;
+static int _stats_nslots(void)
+{
+#if PG_VERSION_NUM >= 150000
+    return MaxBackends + NUM_AUXILIARY_PROCS;
+#else
+    // MaxBackends is not computed yet while _PG_init runs in the
+    // postmaster, so spell out what InitializeMaxBackends() adds up.
+    return MaxConnections + autovacuum_max_workers + 1 +
+	max_worker_processes + max_wal_senders + NUM_AUXILIARY_PROCS;
+#endif
 }
 
+static Size _stats_shmem_size(void)
+{
+    return mul_size(_stats_nslots(), sizeof(BsonStatSlot));
+}
 
-static bytea* mk_palloc_bytea(bson_t* b)
+static BsonStatSlot* _stats_attach(void)
 {
-    // b->len seems to be the official way to get at BSON length.
+    if(bson_shared_stats != NULL && MyProc != NULL &&
+       BSON_MY_PROCNO >= 0 && BSON_MY_PROCNO < _stats_nslots()) {
+	bson_my_stats = &bson_shared_stats[BSON_MY_PROCNO];
+    } else {
+	bson_my_stats = &bson_local_stats;
+    }
+    return bson_my_stats;
+}
 
-    int tot_size = b->len + VARHDRSZ; // MUST add varlena hdr!
-    
-    bytea* aa = (bytea*) palloc(tot_size);
-    SET_VARSIZE(aa, tot_size);
+#define BSON_STATS(SITE)  ((bson_my_stats != NULL ? bson_my_stats : _stats_attach())->v[SITE])
 
-    /*
-     * VARDATA is a pointer to the data region of the new struct.  The source
-     * could be a short datum, so retrieve its data through VARDATA_ANY.
-     */
-    memcpy((void *) VARDATA_ANY(aa), /* destination */
-           (void *) bson_get_data(b), // ooo! an actual function, not b->data
-	   b->len); 
+// One call handling BYTES bytes at an untimed site.
+#define BSON_STATS_COUNT(SITE, BYTES)					\
+    do {								\
+	if(unlikely(bson_track_stats)) {				\
+	    uint64* c_ = BSON_STATS(SITE);				\
+	    c_[BSON_STAT_CALLS]++;					\
+	    c_[BSON_STAT_BYTES] += (BYTES);				\
+	}								\
+    } while(0)
 
-    return aa;
-}
+#define BSON_STATS_ADD(SITE, FIELD, N)					\
+    do { if(unlikely(bson_track_stats)) BSON_STATS(SITE)[FIELD] += (N); } while(0)
 
+// Timed sites:  BSON_STATS_START(t); ... BSON_STATS_END(SITE, t, bytes);
+// The clock is only read when tracking was on at the start.
+#define BSON_STATS_START(T)						\
+    instr_time T;							\
+    INSTR_TIME_SET_ZERO(T);						\
+    if(unlikely(bson_track_stats)) INSTR_TIME_SET_CURRENT(T)
 
+#define BSON_STATS_END(SITE, T, BYTES)					\
+    do { if(unlikely(!INSTR_TIME_IS_ZERO(T))) _stats_end(SITE, &(T), BYTES); } while(0)
 
-PG_FUNCTION_INFO_V1(pgbson_version);
-Datum pgbson_version(PG_FUNCTION_ARGS)
+static void _stats_end(BsonStatSite site, instr_time* start, uint64 bytes)
 {
-    PG_RETURN_TEXT_P(mk_text("2.1"));
+    instr_time now;
+
+    INSTR_TIME_SET_CURRENT(now);
+    INSTR_TIME_SUBTRACT(now, *start);
+
+    uint64* c = BSON_STATS(site);
+    c[BSON_STAT_CALLS]++;
+    c[BSON_STAT_BYTES] += bytes;
+    c[BSON_STAT_TIME_US] += INSTR_TIME_GET_MICROSEC(now);
 }
 
-// This is: take EJSON in, give back bytea* of BSON for storage in DB
-PG_FUNCTION_INFO_V1(bson_in);
-Datum bson_in(PG_FUNCTION_ARGS)
+#if PG_VERSION_NUM >= 150000
+static void _stats_shmem_request(void)
 {
-// Inbound string is EJSON
-    char* jsons = PG_GETARG_CSTRING(0);
-    int slen = strlen(jsons);
+    if(prev_shmem_request_hook) {
+	prev_shmem_request_hook();
+    }
+    RequestAddinShmemSpace(_stats_shmem_size());
+}
+#endif
 
-    bson_error_t err; // on stack
+static void _stats_shmem_startup(void)
+{
+    bool found;
 
-#ifdef PGBSON_DEBUG
-    (void) fprintf(stderr, "bson_in()\n");
-#endif
-    
-    bson_t* b = bson_new_from_json((const uint8_t *)jsons, slen, &err);
+    if(prev_shmem_startup_hook) {
+	prev_shmem_startup_hook();
+    }
 
-    if(b != NULL) {
-	// Must generate a palloc'd copy so postgres can track the
-	// memory!  Important to destroy b afterwards:
-	bytea* aa = mk_palloc_bytea(b);
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+    bson_shared_stats = (BsonStatSlot*) ShmemInitStruct("pgbson stats", _stats_shmem_size(), &found);
+    if(!found) {
+	memset(bson_shared_stats, 0, _stats_shmem_size());
+    }
+    LWLockRelease(AddinShmemInitLock);
+}
 
-	bson_destroy(b);
+PG_FUNCTION_INFO_V1(pgbson_stats);
+Datum pgbson_stats(PG_FUNCTION_ARGS)
+{
+    FuncCallContext* funcctx;
 
-	PG_RETURN_BYTEA_P(aa);
+    if(SRF_IS_FIRSTCALL()) {
+	funcctx = SRF_FIRSTCALL_INIT();
+	MemoryContext old = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
 
-    } else {
-	ereport(
-	    ERROR,
-	    (errcode(ERRCODE_INVALID_JSON_TEXT), errmsg(err.message))
-	    );
+	TupleDesc tupdesc;
+	if(get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
+	    elog(ERROR, "return type must be a row type");
+	}
+	funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+	// Sum up front so every row comes from the same pass.  Other
+	// backends may be writing; a torn read is off by one event at most.
+	const BsonStatSlot* slots = bson_shared_stats != NULL ? bson_shared_stats : &bson_local_stats;
+	int nslots = bson_shared_stats != NULL ? _stats_nslots() : 1;
+	BsonStatSlot* sum = (BsonStatSlot*) palloc0(sizeof(BsonStatSlot));
+
+	for(int i = 0; i < nslots; i++) {
+	    for(int s = 0; s < BSON_STAT_NSITES; s++) {
+		for(int f = 0; f < BSON_STAT_NFIELDS; f++) {
+		    sum->v[s][f] += slots[i].v[s][f];
+		}
+	    }
+	}
 
-	PG_RETURN_NULL();
+	funcctx->user_fctx = sum;
+	funcctx->max_calls = BSON_STAT_NSITES;
+	MemoryContextSwitchTo(old);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+
+    if(funcctx->call_cntr < funcctx->max_calls) {
+	const uint64* c = ((BsonStatSlot*) funcctx->user_fctx)->v[funcctx->call_cntr];
+	Datum values[6];
+	bool nulls[6] = {false};
+
+	values[0] = CStringGetTextDatum(bson_stat_site_names[funcctx->call_cntr]);
+	values[1] = Int64GetDatum((int64) c[BSON_STAT_CALLS]);
+	values[2] = Int64GetDatum((int64) c[BSON_STAT_BYTES]);
+	values[3] = Float8GetDatum(c[BSON_STAT_TIME_US] / 1000.0);
+	values[4] = Int64GetDatum((int64) c[BSON_STAT_MISSES]);
+	values[5] = Int64GetDatum((int64) c[BSON_STAT_MISMATCHES]);
+
+	HeapTuple tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+	SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
     }
 
+    SRF_RETURN_DONE(funcctx);
 }
 
-// This is: get BSON pointer from DB, emit EJSON out
-// VERY important consumers of this are the CLI and the to-JSON casting
-// subsystem.
-PG_FUNCTION_INFO_V1(bson_out);
-Datum bson_out(PG_FUNCTION_ARGS)
+PG_FUNCTION_INFO_V1(pgbson_stats_reset);
+Datum pgbson_stats_reset(PG_FUNCTION_ARGS)
 {
-    bytea* aa = BSON_GETARG_BSON(0);
+    if(bson_shared_stats != NULL) {
+	memset(bson_shared_stats, 0, _stats_shmem_size());
+    }
+    memset(&bson_local_stats, 0, sizeof(bson_local_stats));
+    PG_RETURN_VOID();
+}
 
-    bson_t b; // on stack
-    BSON_STATIC_INIT(&b, aa);
 
-#ifdef PGBSON_DEBUG
-    (void) fprintf(stderr, "bson_out()\n");    
+void _PG_init(void);
+void _PG_init(void)
+{
+    DefineCustomEnumVariable("pgbson.validate",
+			     "How thoroughly the bytea to bson cast validates its input.",
+			     "none, header, structure, utf8, or full.",
+			     &bson_validate_level,
+			     BSON_VALIDATE_LEVEL_STRUCTURE,
+			     bson_validate_options,
+			     PGC_SUSET,
+			     0,
+			     NULL, NULL, NULL);
+
+    DefineCustomEnumVariable("pgbson.output_mode",
+			     "EJSON flavor written by the bson output function.",
+			     "relaxed, canonical, or postgres.",
+			     &bson_output_mode,
+			     BSON_OUTPUT_RELAXED,
+			     bson_output_options,
+			     PGC_USERSET,
+			     0,
+			     NULL, NULL, NULL);
+
+    DefineCustomBoolVariable("pgbson.slice_detoast",
+			     "Let getters detoast only a prefix of large out-of-line bson.",
+			     NULL,
+			     &bson_slice_detoast,
+			     true,
+			     PGC_USERSET,
+			     0,
+			     NULL, NULL, NULL);
+
+    DefineCustomStringVariable("pgbson.hot_paths",
+			       "Comma separated dotpaths moved to the front of incoming bson.",
+			       NULL,
+			       &bson_hot_paths,
+			       "",
+			       PGC_SIGHUP,
+			       0,
+			       check_hot_paths, assign_hot_paths, NULL);
+
+    DefineCustomBoolVariable("pgbson.recv_validate",
+			     "Validate the structure of BSON received in binary format.",
+			     NULL,
+			     &bson_recv_validate,
+			     true,
+			     PGC_SUSET,
+			     0,
+			     NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pgbson.analyze_paths",
+			    "Number of dotpaths per bson column that ANALYZE keeps statistics for.",
+			    "0 keeps only the standard statistics.",
+			    &bson_analyze_paths,
+			    32,
+			    0, 1000,
+			    PGC_USERSET,
+			    0,
+			    NULL, NULL, NULL);
+
+    DefineCustomBoolVariable("pgbson.track_stats",
+			     "Count calls, bytes and time in bson hot paths for pgbson_stats().",
+			     NULL,
+			     &bson_track_stats,
+			     false,
+			     PGC_SUSET,
+			     0,
+			     NULL, NULL, NULL);
+
+    if(process_shared_preload_libraries_in_progress) {
+#if PG_VERSION_NUM >= 150000
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = _stats_shmem_request;
+#else
+	RequestAddinShmemSpace(_stats_shmem_size());
 #endif
-    
-    //char* jsons = bson_as_json(&b, &blen); 
-    // Use relaxed because it makes date handling in SQL MUCH easier...
-    size_t blen;
-    char* jsons = bson_as_relaxed_extended_json(&b, &blen);
-
-    PG_FREE_IF_COPY(aa,0); // no need for ptr into &b anymore; char* jsons is
-			   // alloc'd and stands on its own...
-    
-    if(jsons != NULL) {
-	char* pstring = mk_cstring(jsons);  // palloc
-	bson_free(jsons); // per bson.h
-	PG_RETURN_CSTRING(pstring);
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = _stats_shmem_startup;
     }
-	
-    PG_RETURN_NULL();
+
+#if PG_VERSION_NUM >= 150000
+    MarkGUCPrefixReserved("pgbson");
+#else
+    EmitWarningsOnPlaceholders("pgbson");
+#endif
 }
 
 
-// This is: take BSON pointer from DB, emit BSON to client
-PG_FUNCTION_INFO_V1(bson_send);
-Datum bson_send(PG_FUNCTION_ARGS)
+
+
+static text* mk_text(const char* cstr)
 {
-    bytea* arg = BSON_GETARG_BSON(0);
+    int s_len = strlen(cstr);
+    int tot_len = s_len + VARHDRSZ;
 
-    uint8_t* data = BSON_VARDATA_ANY(arg);
-    uint32 sz = VARSIZE_ANY_EXHDR(arg);
+    text* t = (text *) palloc(tot_len);
+    SET_VARSIZE(t, tot_len);
 
-    StringInfoData buf;
+    memcpy((void *) VARDATA(t), (void *) cstr, s_len);
 
-    pq_begintypsend(&buf);
-    pq_sendbytes(&buf, (char *) data, sz);
+    return t;
+}
 
-    PG_FREE_IF_COPY(arg,0);
-    
-    PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+
+static bytea* mk_palloc_bytea(bson_t* b)
+{
+    // b->len seems to be the official way to get at BSON length.
+
+    int tot_size = b->len + VARHDRSZ; // MUST add varlena hdr!
+
+    BSON_STATS_COUNT(BSON_STAT_COPY, b->len);
+
+    bytea* aa = (bytea*) palloc(tot_size);
+    SET_VARSIZE(aa, tot_size);
+
+    /*
+     * VARDATA is a pointer to the data region of the new struct.  The source
+     * could be a short datum, so retrieve its data through VARDATA_ANY.
+     */
+    memcpy((void *) VARDATA_ANY(aa), /* destination */
+           (void *) bson_get_data(b), // ooo! an actual function, not b->data
+	   b->len); 
+
+    return aa;
 }
 
 
-// This is: get BSON pointer from outside, save BSON in DB
-PG_FUNCTION_INFO_V1(bson_recv);
-Datum bson_recv(PG_FUNCTION_ARGS)
-{   
-    StringInfo	buf = (StringInfo) PG_GETARG_POINTER(0);
+// libbson lets us supply the realloc for a bson_writer_t.  Pointing it at
+// palloc/repalloc and starting the writer at offset VARHDRSZ means
+// libbson builds the BSON *directly* in a varlena that postgres owns; no
+// bson_t heap buffer and no mk_palloc_bytea copy at the end.
+static void* _bson_palloc_realloc(void* mem, size_t num_bytes, void* ctx)
+{
+    return (mem == NULL) ? palloc(num_bytes) : repalloc(mem, num_bytes);
+}
 
-    bson_t b; // on stack
-    bson_init_static(&b, (const uint8_t*) buf, buf->len);
-    
-    bytea* aa = mk_palloc_bytea(&b);
-	
-    PG_RETURN_BYTEA_P(aa);
+// buf and buflen must stay in scope until _end_varlena_writer() because
+// the writer holds on to their addresses.  hint is the expected total
+// size in bytes, including the varlena header.
+static bson_writer_t* _begin_varlena_writer(uint8_t** buf, size_t* buflen, size_t hint, bson_t** b)
+{
+    if(hint < VARHDRSZ + 5) {
+	hint = VARHDRSZ + 5;  // smallest legal BSON is 5 bytes
+    }
+    *buflen = hint;
+    *buf = (uint8_t*) palloc(hint);
+
+    bson_writer_t* writer = bson_writer_new(buf, buflen, VARHDRSZ, _bson_palloc_realloc, NULL);
+    bson_writer_begin(writer, b);
+
+    return writer;
 }
 
+static bytea* _end_varlena_writer(bson_writer_t* writer, uint8_t** buf)
+{
+    bson_writer_end(writer);
 
-// This is: get bytea pointer from outside, validate it is good
-// BSON, then make a copy and return it.
-// Very important for safe insertion of BSON as bytea i.e.
-//   insert into (bson_column) values ('\x000000'::bytea)
-// to avoid as much as possible storing malformed/corrupt BSON
-// It is pgbson_validate() because bson_validate() already exists!
-PG_FUNCTION_INFO_V1(pgbson_validate);
-Datum pgbson_validate(PG_FUNCTION_ARGS)
+    size_t tot_size = bson_writer_get_length(writer); // includes VARHDRSZ offset
+    bson_writer_destroy(writer); // does NOT free buf; buf is palloc'd and ours
+
+    bytea* aa = (bytea*) *buf;
+    SET_VARSIZE(aa, tot_size);
+
+    return aa;
+}
+
+
+
+// Check len bytes at data at the given level; ereport(ERROR) on failure.
+static void _check_bson_bytes(const uint8_t* data, uint32 len, int level)
 {
-#ifdef PGBSON_DEBUG
-    (void) fprintf(stderr, "bson_validate()\n");
-#endif
-    
-    bytea* aa = BSON_GETARG_BSON(0); // No validation here...
-    
-    bson_t b; // on stack
+    if(level == BSON_VALIDATE_LEVEL_NONE) {
+	return;
+    }
 
-    if(VARSIZE_ANY_EXHDR(aa) < 5) {
+    if(len < 5) {
 	ereport(
 	    ERROR,
 	    (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("bytea too short to be BSON"))
 	    );
     }
-    
-    bool rc = bson_init_static(&b, BSON_VARDATA_ANY(aa), VARSIZE_ANY_EXHDR(aa));
 
-    if(!rc) {
+    int32_t blen;
+    memcpy(&blen, data, sizeof(blen));
+    blen = BSON_UINT32_FROM_LE(blen);
+    if(blen != len || data[len - 1] != '\0') {
 	ereport(
 	    ERROR,
 	    (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("basic BSON init fails; not BSON?"))
 	    );
     }
-	
-    bson_error_t error; // on stack
 
-    /*  No need for special checks for mongodb...
-    bson_validate_flags_t flags = BSON_VALIDATE_UTF8
-	| BSON_VALIDATE_DOLLAR_KEYS
-	| BSON_VALIDATE_DOT_KEYS
-	| BSON_VALIDATE_UTF8_ALLOW_NULL
-	| BSON_VALIDATE_EMPTY_KEYS;
-    */
-    
+    if(level == BSON_VALIDATE_LEVEL_HEADER) {
+	return;
+    }
+
     bson_validate_flags_t flags = 0; // just walk the structure...
-    rc = bson_validate_with_error(&b, flags, &error);
-    
-    if(!rc) {
+    if(level >= BSON_VALIDATE_LEVEL_UTF8) {
+	flags |= BSON_VALIDATE_UTF8;
+    }
+    if(level >= BSON_VALIDATE_LEVEL_FULL) {
+	flags |= BSON_VALIDATE_DOLLAR_KEYS | BSON_VALIDATE_DOT_KEYS | BSON_VALIDATE_EMPTY_KEYS;
+    }
+
+    bson_t b; // on stack
+    bson_error_t error; // on stack
+
+    if(!bson_init_static(&b, data, len) || !bson_validate_with_error(&b, flags, &error)) {
 	ereport(
 	    ERROR,
 	    (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("invalid BSON"))
@@ -284,687 +698,8281 @@ Datum pgbson_validate(PG_FUNCTION_ARGS)
 	    // where the corruption occurred.
 	    );	
     }
-    
-    // OK!
-    bytea* bbb = mk_palloc_bytea(&b);
-
-    PG_FREE_IF_COPY(aa,0);
-    
-    PG_RETURN_BYTEA_P(bbb);
 }
 
+static void _validate_bson_bytes(const uint8_t* data, uint32 len, int level)
+{
+    BSON_STATS_START(t);
+    _check_bson_bytes(data, len, level);
+    BSON_STATS_END(BSON_STAT_VALIDATE, t, len);
+}
 
-/**** 
- operators
-****/
 
-// Logical comparison
-PG_FUNCTION_INFO_V1(pgbson_compare);
-Datum pgbson_compare(PG_FUNCTION_ARGS)
+PG_FUNCTION_INFO_V1(pgbson_version);
+Datum pgbson_version(PG_FUNCTION_ARGS)
 {
-    bytea* first = BSON_GETARG_BSON(0);
-    bytea* second = BSON_GETARG_BSON(1);
+    PG_RETURN_TEXT_P(mk_text("2.1"));
+}
 
-    bson_t b1; // on stack
-    bson_init_static(&b1, BSON_VARDATA_ANY(first), VARSIZE_ANY_EXHDR(first));
-    bson_t b2; // on stack
-    bson_init_static(&b2, BSON_VARDATA_ANY(second), VARSIZE_ANY_EXHDR(second));
+// In "Hot fields first" below; called by the input functions.
+static bytea* _apply_hot_paths(bytea* aa);
+static bool check_hot_paths(char** newval, void** extra, GucSource source);
+static void assign_hot_paths(const char* newval, void* extra);
 
-    int cmp = bson_compare(&b1, &b2);
+#ifdef HAVE_INT128
+// In "decimal128 -> numeric without a string" below; also used to compare.
+static uint128 _pow10_u128(int k);
+static bool _dec128_decode(const bson_decimal128_t* val, bool* neg, uint128* coeff, int* exp);
+#endif
 
-    PG_FREE_IF_COPY(first,0);
-    PG_FREE_IF_COPY(second,1);
-    
-    PG_RETURN_INT32(cmp);
-}
+//
+//  EJSON input
+//
+//  bson_in parses the text itself with a small recursive descent parser
+//  and appends straight into a bson_writer_t over a palloc'd varlena (see
+//  _begin_varlena_writer), so there is no yajl token stream, no heap
+//  bson_t, and no mk_palloc_bytea copy at the end.  Strings without
+//  escapes, i.e. nearly all of them, are scanned 8 bytes at a time and
+//  appended directly from the input with no intermediate copy.
+//
+//  The common EJSON wrappers are recognized as soon as the first key of
+//  an object is seen:
+//    {"$numberInt":"1"}  {"$numberLong":"1"}  {"$numberDouble":"1.5"}
+//    {"$numberDecimal":"1.5"}  {"$oid":"..."}
+//    {"$date":"2022-06-06T12:13:14.500Z"}  {"$date":{"$numberLong":"123"}}
+//  Anything else that starts with "$", and any syntax error, makes the
+//  fast path give up, and the whole input goes through bson_new_from_json
+//  as before.  Rare types and error messages therefore come out exactly
+//  as they always have.
+//
 
+// Not in bson.h but exported by libbson next to _bson_iso8601_date_format
+extern bool
+_bson_iso8601_date_parse (const char *str, int32_t len, int64_t *out, bson_error_t *error);
 
-//  binary equality
-PG_FUNCTION_INFO_V1(bson_binary_equal);
-Datum bson_binary_equal(PG_FUNCTION_ARGS)
+typedef struct
 {
-    bytea* first = BSON_GETARG_BSON(0);
-    bytea* second = BSON_GETARG_BSON(1);
+    const char* p;    // next unread byte
+    const char* end;  // the terminating NUL of the input
+    StringInfoData sbuf; // decoded string values that had escapes
+} EjsonParser;
 
-    bson_t b1; // on stack
-    bson_init_static(&b1, BSON_VARDATA_ANY(first), VARSIZE_ANY_EXHDR(first));
-    bson_t b2; // on stack
-    bson_init_static(&b2, BSON_VARDATA_ANY(second), VARSIZE_ANY_EXHDR(second));
-    
-    bool cmp = bson_equal(&b1, &b2);
- 
-    PG_FREE_IF_COPY(first,0);
-    PG_FREE_IF_COPY(second,1);
-    
-    PG_RETURN_BOOL(cmp);
+static bool _ejp_value(EjsonParser* P, bson_t* parent, const char* key, int keylen);
+
+static inline void _ejp_ws(EjsonParser* P)
+{
+    while(*P->p == ' ' || *P->p == '\n' || *P->p == '\t' || *P->p == '\r') {
+	P->p++;
+    }
 }
 
-// hash index support
-PG_FUNCTION_INFO_V1(bson_hash);
-Datum bson_hash(PG_FUNCTION_ARGS)
+#define BSON_SWAR_ONES  UINT64CONST(0x0101010101010101)
+#define BSON_SWAR_HIGH  UINT64CONST(0x8080808080808080)
+#define BSON_SWAR_HAS_LESS(w,n)  (((w) - BSON_SWAR_ONES * (n)) & ~(w) & BSON_SWAR_HIGH)
+#define BSON_SWAR_HAS_BYTE(w,c)  BSON_SWAR_HAS_LESS((w) ^ (BSON_SWAR_ONES * (c)), 1)
+
+// First byte at or after p that is '"', '\', or a control char.  Checks 8
+// bytes at a time with the usual "has zero byte" bit trick.
+static const char* _ejp_scan_string(const char* p, const char* end)
 {
-    bytea* aa = BSON_GETARG_BSON(0);
+    while(p + 8 <= end) {
+	uint64 w;
+	memcpy(&w, p, 8);
+	if(BSON_SWAR_HAS_BYTE(w, '"') | BSON_SWAR_HAS_BYTE(w, '\\') | BSON_SWAR_HAS_LESS(w, 0x20)) {
+	    break;
+	}
+	p += 8;
+    }
+    while(p < end && *p != '"' && *p != '\\' && (unsigned char) *p >= 0x20) {
+	p++;
+    }
+    return p;
+}
 
-    uint8_t* data = BSON_VARDATA_ANY(aa);
-    uint32 sz = VARSIZE_ANY_EXHDR(aa);
+static int _ejp_hex4(const char* p)
+{
+    int v = 0;
+    for(int i = 0; i < 4; i++) {
+	char c = p[i];
+	v <<= 4;
+	if(c >= '0' && c <= '9') v |= c - '0';
+	else if(c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+	else if(c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+	else return -1;
+    }
+    return v;
+}
 
-    int hash = 5381; // ?
-    int c;
+// P->p is at the opening quote.  On success *s and *len are the string:
+// either straight from the input (no escapes) or the decoded copy in
+// P->sbuf, which is only good until the next string is parsed.
+static bool _ejp_string(EjsonParser* P, const char** s, int* len)
+{
+    const char* start = ++P->p;
+    const char* q = _ejp_scan_string(start, P->end);
+
+    if(*q == '"') {
+	*s = start;
+	*len = q - start;
+	P->p = q + 1;
+	return true;
+    }
+
+    resetStringInfo(&P->sbuf);
+    appendBinaryStringInfo(&P->sbuf, start, q - start);
+
+    while(*q == '\\') {
+	char c = q[1];
+	q += 2;
+	switch(c) {
+	case '"':  appendStringInfoCharMacro(&P->sbuf, '"'); break;
+	case '\\': appendStringInfoCharMacro(&P->sbuf, '\\'); break;
+	case '/':  appendStringInfoCharMacro(&P->sbuf, '/'); break;
+	case 'b':  appendStringInfoCharMacro(&P->sbuf, '\b'); break;
+	case 'f':  appendStringInfoCharMacro(&P->sbuf, '\f'); break;
+	case 'n':  appendStringInfoCharMacro(&P->sbuf, '\n'); break;
+	case 'r':  appendStringInfoCharMacro(&P->sbuf, '\r'); break;
+	case 't':  appendStringInfoCharMacro(&P->sbuf, '\t'); break;
+	case 'u': {
+	    if(q + 4 > P->end) return false;
+	    int32 cp = _ejp_hex4(q);
+	    if(cp < 0) return false;
+	    q += 4;
+	    if(cp >= 0xD800 && cp <= 0xDBFF) {
+		// surrogate pair
+		if(q + 6 > P->end || q[0] != '\\' || q[1] != 'u') return false;
+		int32 lo = _ejp_hex4(q + 2);
+		if(lo < 0xDC00 || lo > 0xDFFF) return false;
+		cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+		q += 6;
+	    } else if(cp >= 0xDC00 && cp <= 0xDFFF) {
+		return false;
+	    }
+	    unsigned char u8[4];
+	    unicode_to_utf8(cp, u8);
+	    appendBinaryStringInfo(&P->sbuf, (const char*) u8, pg_utf_mblen(u8));
+	    break;
+	}
+	default:
+	    return false;
+	}
 
-    for(uint32 n = 0; n < sz; n++) {
-	c = *data++;
-        hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+	const char* r = _ejp_scan_string(q, P->end);
+	appendBinaryStringInfo(&P->sbuf, q, r - q);
+	q = r;
     }
 
-    PG_FREE_IF_COPY(aa,0);    
-    
-    PG_RETURN_INT32(hash);
+    if(*q != '"') {
+	return false;  // control char or ran off the end
+    }
+    *s = P->sbuf.data;
+    *len = P->sbuf.len;
+    P->p = q + 1;
+    return true;
 }
 
+// Object keys must outlive the value (and P->sbuf) so the rare escaped
+// key is copied.  Keys with an embedded NUL are left to libbson.
+static bool _ejp_key(EjsonParser* P, const char** key, int* keylen)
+{
+    _ejp_ws(P);
+    if(*P->p != '"' || !_ejp_string(P, key, keylen)) {
+	return false;
+    }
+    if(*key == P->sbuf.data) {
+	if(memchr(*key, '\0', *keylen) != NULL) {
+	    return false;
+	}
+	*key = pnstrdup(*key, *keylen);
+    }
+    _ejp_ws(P);
+    if(*P->p != ':') {
+	return false;
+    }
+    P->p++;
+    return true;
+}
 
-// For now, no fancy conversions.  If you want fancy, let the casting machinery
-// do its thing.  The overall API design is to mimic the bson lib itself,
-// where you pull specific types from the object and "that's that."  In
-// general, such explicit calls and behaviors minimizes implicit funny business
-// that can happen when the deep C code starts making assumptions about things,
-// for example numeric precision.
-// We further optimize/mem-safe the environment by taking a text* as it would
-// be passed from postgres and converting it to a regular char* here because
-// we then have to pfree().
-static bool _get_bson_iter(bson_t* b, text* dotpath, bson_iter_t* target, bson_type_t tt)
+// Parse the (whole) string s of length len as a base 10 int64.
+static bool _ejp_int64_from(const char* s, int len, int64* out)
 {
-    bool rc = false;
-    bson_iter_t iter;
+    if(len == 0 || len >= 32) {
+	return false;
+    }
+    char buf[32];
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+
+    char* endp;
+    errno = 0;
+    long long v = strtoll(buf, &endp, 10);
+    if(errno != 0 || *endp != '\0') {
+	return false;
+    }
+    *out = (int64) v;
+    return true;
+}
 
-    if (!bson_iter_init (&iter, b)) {
-	ereport(
-	    ERROR,
-	    (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("iter BSON bytes corrupted"))
-	    );
-    } else {
-	char* c_dotpath = text_to_cstring(dotpath);
-	// Careful:  target is *already* pointer...
-	rc = bson_iter_find_descendant(&iter, c_dotpath, target);
-	pfree(c_dotpath);
+// JSON number.  Integers become int32 if they fit, else int64, the same
+// as libbson; anything with a fraction or exponent is a double.
+static bool _ejp_number(EjsonParser* P, bson_t* parent, const char* key, int keylen)
+{
+    const char* start = P->p;
+    const char* q = start;
+    bool integral = true;
+
+    if(*q == '-') q++;
+    if(!isdigit((unsigned char) *q)) return false;
+    if(*q == '0' && isdigit((unsigned char) q[1])) return false;  // no leading zeros in JSON
+    while(isdigit((unsigned char) *q)) q++;
+    if(*q == '.') {
+	integral = false;
+	q++;
+	if(!isdigit((unsigned char) *q)) return false;
+	while(isdigit((unsigned char) *q)) q++;
     }
-    if(rc) {
-	bson_type_t ft = bson_iter_type(target);
-	if(ft != tt) {
-	    rc = false;
+    if(*q == 'e' || *q == 'E') {
+	integral = false;
+	q++;
+	if(*q == '+' || *q == '-') q++;
+	if(!isdigit((unsigned char) *q)) return false;
+	while(isdigit((unsigned char) *q)) q++;
+    }
+    P->p = q;
+
+    if(integral) {
+	int64 v;
+	if(!_ejp_int64_from(start, q - start, &v)) {
+	    return false;  // too big for int64; let libbson decide
+	}
+	if(v >= PG_INT32_MIN && v <= PG_INT32_MAX) {
+	    return bson_append_int32(parent, key, keylen, (int32_t) v);
 	}
+	return bson_append_int64(parent, key, keylen, v);
     }
 
-    return rc;
+    char* endp;
+    double d = strtod(start, &endp);  // input is NUL terminated
+    if(endp != q) {
+	return false;
+    }
+    return bson_append_double(parent, key, keylen, d);
 }
 
-//
-//  The get_<type> family all follow the same logic:
-//
-//  Put bson_t on the stack and init from bytea.  This avoids 
-//  allocs at the extension level, essentially "setting the bytea into place"
-//  and making the get_ very high performance.
-//
-//  Call our _get_bson_iter.  All bson_iter things rely on the host bson_t
-//  remaining in scope; furthermore, if the thing is found, the per-type
-//  extractors e.g. bson_iter_utf8() and bson_iter_int32() return material
-//  that should NOT be freed and must also be used while the host bson_t
-//  is in scope.  This is fine -- because returned material has to be
-//  palloc'd anyway and the calling machinery will free() the text* and
-//  bytea* material after the call is complete.
-//
-//  In all cases, be sure to clean up expanded TOAST data!
-//
+// The value of a wrapper, which must be a string.
+static bool _ejp_wrapped_string(EjsonParser* P, const char** s, int* len)
+{
+    _ejp_ws(P);
+    return *P->p == '"' && _ejp_string(P, s, len);
+}
 
+// End of a one-key wrapper object.
+static bool _ejp_close(EjsonParser* P)
+{
+    _ejp_ws(P);
+    if(*P->p != '}') {
+	return false;
+    }
+    P->p++;
+    return true;
+}
 
-PG_FUNCTION_INFO_V1(bson_get_string);  // text bson_get_string(bson, dotpath)
-Datum bson_get_string(PG_FUNCTION_ARGS)
+// We are just past the ':' after wkey, the first key of an object that
+// started with '$'.  Append the wrapped value, or return false to let
+// libbson handle everything.
+static bool _ejp_wrapper(EjsonParser* P, bson_t* parent, const char* key, int keylen,
+			 const char* wkey, int wkeylen)
 {
-    bytea* aa = BSON_GETARG_BSON(0);
-    text* dotpath = PG_GETARG_TEXT_PP(1);
+    const char* s;
+    int len;
 
-    bson_t b; // on stack
-    BSON_STATIC_INIT(&b,aa);
-    
-    bson_iter_t target;
-    bool rc = false;
-    rc = _get_bson_iter(&b, dotpath, &target, BSON_TYPE_UTF8);
+#define WKEY_IS(X)  (wkeylen == sizeof(X) - 1 && memcmp(wkey, X, wkeylen) == 0)
 
-    text* txt = 0;
-    if(rc) {
-	uint32_t len;
-	// bson_iter_utf8() returns a pointer that MUST NOT be
-	// modified or freed; fine, because we have to palloc it into
-	// text anyway....
-	txt = mk_text( bson_iter_utf8(&target, &len) );
+    if(WKEY_IS("$numberInt") || WKEY_IS("$numberLong")) {
+	int64 v;
+	if(!_ejp_wrapped_string(P, &s, &len) || !_ejp_int64_from(s, len, &v) || !_ejp_close(P)) {
+	    return false;
+	}
+	if(WKEY_IS("$numberInt")) {
+	    if(v < PG_INT32_MIN || v > PG_INT32_MAX) {
+		return false;
+	    }
+	    return bson_append_int32(parent, key, keylen, (int32_t) v);
+	}
+	return bson_append_int64(parent, key, keylen, v);
     }
 
-    PG_FREE_IF_COPY(aa,0);
+    if(WKEY_IS("$numberDouble")) {
+	if(!_ejp_wrapped_string(P, &s, &len) || len == 0 || len >= 64) {
+	    return false;
+	}
+	char buf[64];
+	memcpy(buf, s, len);
+	buf[len] = '\0';
+
+	double d;
+	if(strcmp(buf, "NaN") == 0) {
+	    d = get_float8_nan();
+	} else if(strcmp(buf, "Infinity") == 0) {
+	    d = get_float8_infinity();
+	} else if(strcmp(buf, "-Infinity") == 0) {
+	    d = -get_float8_infinity();
+	} else {
+	    char* endp;
+	    d = strtod(buf, &endp);
+	    if(*endp != '\0') {
+		return false;
+	    }
+	}
+	return _ejp_close(P) && bson_append_double(parent, key, keylen, d);
+    }
 
-    if(rc == true) PG_RETURN_TEXT_P(txt); else PG_RETURN_NULL();
+    if(WKEY_IS("$numberDecimal")) {
+	bson_decimal128_t dec;
+	if(!_ejp_wrapped_string(P, &s, &len) || !_ejp_close(P)
+	   || !bson_decimal128_from_string_w_len(s, len, &dec)) {
+	    return false;
+	}
+	return bson_append_decimal128(parent, key, keylen, &dec);
+    }
+
+    if(WKEY_IS("$oid")) {
+	bson_oid_t oid;
+	if(!_ejp_wrapped_string(P, &s, &len) || !_ejp_close(P)
+	   || !bson_oid_is_valid(s, len)) {
+	    return false;
+	}
+	bson_oid_init_from_string(&oid, s);
+	return bson_append_oid(parent, key, keylen, &oid);
+    }
+
+    if(WKEY_IS("$date")) {
+	int64 millis;
+	_ejp_ws(P);
+	if(*P->p == '"') {
+	    bson_error_t err;
+	    int64_t parsed;
+	    if(!_ejp_string(P, &s, &len) || !_bson_iso8601_date_parse(s, len, &parsed, &err)) {
+		return false;
+	    }
+	    millis = parsed;
+	} else if(*P->p == '{') {
+	    // {"$date":{"$numberLong":"123"}}
+	    const char* ikey;
+	    int ikeylen;
+	    P->p++;
+	    if(!_ejp_key(P, &ikey, &ikeylen)
+	       || ikeylen != 11 || memcmp(ikey, "$numberLong", 11) != 0
+	       || !_ejp_wrapped_string(P, &s, &len)
+	       || !_ejp_int64_from(s, len, &millis)
+	       || !_ejp_close(P)) {
+		return false;
+	    }
+	} else {
+	    return false;
+	}
+	return _ejp_close(P) && bson_append_date_time(parent, key, keylen, millis);
+    }
+
+#undef WKEY_IS
+
+    return false;
 }
 
+// Members of an object up to and including the closing '}'.  The first
+// key has already been read.
+static bool _ejp_members(EjsonParser* P, bson_t* doc, const char* key, int keylen)
+{
+    for(;;) {
+	if(!_ejp_value(P, doc, key, keylen)) {
+	    return false;
+	}
+	_ejp_ws(P);
+	if(*P->p == '}') {
+	    P->p++;
+	    return true;
+	}
+	if(*P->p != ',') {
+	    return false;
+	}
+	P->p++;
+	if(!_ejp_key(P, &key, &keylen)) {
+	    return false;
+	}
+    }
+}
 
-static Timestamp _cvt_datetime_to_ts(int64_t millis_since_epoch)
+static bool _ejp_object(EjsonParser* P, bson_t* parent, const char* key, int keylen)
 {
-    Timestamp ts;
-    struct pg_tm tt, *tm = &tt;
-    fsec_t fsec;
-    
-    time_t t_unix = millis_since_epoch/1000; // get seconds..
-    unsigned t_ms = millis_since_epoch%1000; // ... and the millis...
+    P->p++;  // the '{'
+    _ejp_ws(P);
+
+    bson_t child;
+    if(*P->p == '}') {
+	P->p++;
+	return bson_append_document_begin(parent, key, keylen, &child)
+	    && bson_append_document_end(parent, &child);
+    }
 
-    struct tm unix_tm = *gmtime(&t_unix); // gmtime returns pointer; copy via *
+    const char* k1;
+    int k1len;
+    if(!_ejp_key(P, &k1, &k1len)) {
+	return false;
+    }
+    if(k1len > 0 && k1[0] == '$') {
+	return _ejp_wrapper(P, parent, key, keylen, k1, k1len);
+    }
 
-    tt.tm_mday = unix_tm.tm_mday;
-    tt.tm_mon  = unix_tm.tm_mon + 1;  // POSIX is 0-11; must add 1 for postgres
-    tt.tm_year = unix_tm.tm_year + 1900; // POSIX is 1900; postgres starts at 1
-	
-    tt.tm_hour = unix_tm.tm_hour;
-    tt.tm_min  = unix_tm.tm_min;
-    tt.tm_sec  = unix_tm.tm_sec;
+    return bson_append_document_begin(parent, key, keylen, &child)
+	&& _ejp_members(P, &child, k1, k1len)
+	&& bson_append_document_end(parent, &child);
+}
 
-    fsec = t_ms * 1000; // turn millis to micros
+static bool _ejp_array(EjsonParser* P, bson_t* parent, const char* key, int keylen)
+{
+    P->p++;  // the '['
+    _ejp_ws(P);
 
-    tm2timestamp(tm, fsec, NULL, &ts);
+    bson_t child;
+    if(!bson_append_array_begin(parent, key, keylen, &child)) {
+	return false;
+    }
 
-    return ts;
+    if(*P->p == ']') {
+	P->p++;
+    } else {
+	for(uint32_t n = 0; ; n++) {
+	    char ibuf[16];
+	    const char* ikey;
+	    size_t ikeylen = bson_uint32_to_string(n, &ikey, ibuf, sizeof(ibuf));
+
+	    _ejp_ws(P);
+	    if(!_ejp_value(P, &child, ikey, (int) ikeylen)) {
+		return false;
+	    }
+	    _ejp_ws(P);
+	    if(*P->p == ']') {
+		P->p++;
+		break;
+	    }
+	    if(*P->p != ',') {
+		return false;
+	    }
+	    P->p++;
+	}
+    }
+
+    return bson_append_array_end(parent, &child);
 }
 
+static bool _ejp_literal(EjsonParser* P, const char* lit, int len)
+{
+    if(strncmp(P->p, lit, len) != 0) {
+	return false;
+    }
+    P->p += len;
+    return true;
+}
 
-PG_FUNCTION_INFO_V1(bson_get_datetime);
-Datum bson_get_datetime(PG_FUNCTION_ARGS)
+static bool _ejp_value(EjsonParser* P, bson_t* parent, const char* key, int keylen)
 {
-    bytea* aa = BSON_GETARG_BSON(0);
-    text* dotpath = PG_GETARG_TEXT_PP(1);
+    check_stack_depth();  // deeply nested input must not blow the C stack
+
+    _ejp_ws(P);
+
+    switch(*P->p) {
+    case '{':
+	return _ejp_object(P, parent, key, keylen);
+    case '[':
+	return _ejp_array(P, parent, key, keylen);
+    case '"': {
+	const char* s;
+	int len;
+	return _ejp_string(P, &s, &len) && bson_append_utf8(parent, key, keylen, s, len);
+    }
+    case 't':
+	return _ejp_literal(P, "true", 4) && bson_append_bool(parent, key, keylen, true);
+    case 'f':
+	return _ejp_literal(P, "false", 5) && bson_append_bool(parent, key, keylen, false);
+    case 'n':
+	return _ejp_literal(P, "null", 4) && bson_append_null(parent, key, keylen);
+    default:
+	return _ejp_number(P, parent, key, keylen);
+    }
+}
 
-    bson_t b; // on stack
-    BSON_STATIC_INIT(&b,aa);
+// Fast path for bson_in.  Returns NULL if the input needs libbson.
+static bytea* _ejson_to_bson(const char* jsons, int slen)
+{
+    EjsonParser P;
+    P.p = jsons;
+    P.end = jsons + slen;
+    initStringInfo(&P.sbuf);
+
+    _ejp_ws(&P);
+    if(*P.p != '{') {
+	return NULL;  // top-level arrays etc.
+    }
+    P.p++;
+
+    uint8_t* buf;
+    size_t buflen;
+    bson_t* b;
+    // BSON is usually a bit smaller than the EJSON text:
+    bson_writer_t* writer = _begin_varlena_writer(&buf, &buflen, VARHDRSZ + slen, &b);
+
+    bool ok;
+    _ejp_ws(&P);
+    if(*P.p == '}') {
+	P.p++;
+	ok = true;
+    } else {
+	const char* k1;
+	int k1len;
+	ok = _ejp_key(&P, &k1, &k1len)
+	    && !(k1len > 0 && k1[0] == '$')
+	    && _ejp_members(&P, b, k1, k1len);
+    }
+    if(ok) {
+	_ejp_ws(&P);
+	ok = (P.p == P.end);
+    }
 
-    Timestamp ts;
+    pfree(P.sbuf.data);
 
-    bson_iter_t target;
-    bool rc = false;
-    rc = _get_bson_iter(&b, dotpath, &target, BSON_TYPE_DATE_TIME);
-    if(rc) {
-	int64_t millis_since_epoch = bson_iter_date_time (&target);
+    if(!ok) {
+	bson_writer_rollback(writer);
+	bson_writer_destroy(writer);
+	pfree(buf);
+	return NULL;
+    }
 
-	ts = _cvt_datetime_to_ts(millis_since_epoch);
+    return _end_varlena_writer(writer, &buf);
+}
+
+
+// This is: take EJSON in, give back bytea* of BSON for storage in DB
+PG_FUNCTION_INFO_V1(bson_in);
+Datum bson_in(PG_FUNCTION_ARGS)
+{
+// Inbound string is EJSON
+    char* jsons = PG_GETARG_CSTRING(0);
+    int slen = strlen(jsons);
+
+    bson_error_t err; // on stack
+
+#ifdef PGBSON_DEBUG
+    (void) fprintf(stderr, "bson_in()\n");
+#endif
+
+    BSON_STATS_START(t);
+
+    bytea* aa = _ejson_to_bson(jsons, slen);
+    if(aa == NULL) {
+	bson_t* b = bson_new_from_json((const uint8_t *)jsons, slen, &err);
+
+	if(b == NULL) {
+	    ereport(
+		ERROR,
+		(errcode(ERRCODE_INVALID_JSON_TEXT), errmsg(err.message))
+		);
+	}
+
+	// Must generate a palloc'd copy so postgres can track the
+	// memory!  Important to destroy b afterwards:
+	aa = mk_palloc_bytea(b);
+
+	bson_destroy(b);
     }
 
-    PG_FREE_IF_COPY(aa,0);
+    aa = _apply_hot_paths(aa);
 
-    if(rc) PG_RETURN_TIMESTAMP(ts); else PG_RETURN_NULL();
+    BSON_STATS_END(BSON_STAT_IN, t, slen);
+
+    PG_RETURN_BYTEA_P(aa);
 }
 
+//
+//  EJSON output
+//
+//  bson_out walks the BSON itself and writes EJSON straight into one
+//  palloc'd StringInfo pre-sized from the BSON length:  no malloc'd
+//  libbson string that grows as it goes, and no copy of it at the end.
+//  The layout ({ "a" : 1, "b" : [ 1, 2 ] }) is the same as libbson's so
+//  consumers see no change except that doubles print in the shortest form
+//  that round-trips (as float8out does) instead of %.20g.
+//
+//  pgbson.output_mode picks the flavor:
+//    relaxed    (default) libbson relaxed EJSON; what bson_out always did
+//    canonical  every number and date is wrapped so bson_in rebuilds the
+//               exact BSON types, e.g. { "$numberInt" : "1" }
+//    postgres   plain JSON wherever a type has an obvious JSON value:
+//               decimal128 as a bare number, dates as ISO 8601 strings,
+//               oids as hex and binary as base64 strings.  Types do NOT
+//               survive a trip back through bson_in.
+//
 
+// Largest millis that still formats as an ISO 8601 date (9999-12-31T23:59:59.999Z);
+// this is the same cutoff that libbson uses for relaxed EJSON.
+#define BSON_RELAXED_DATE_MAX  253402300799999LL
 
-PG_FUNCTION_INFO_V1(bson_get_decimal128);
-Datum bson_get_decimal128(PG_FUNCTION_ARGS)
+// Smallest millis with a 4 digit year (0001-01-01T00:00:00Z); only the
+// postgres output mode goes before 1970.
+#define BSON_POSTGRES_DATE_MIN  (-62135596800000LL)
+
+static void _ejson_value(StringInfo out, bson_iter_t* iter, int mode);
+
+// Append len bytes of s as a quoted, escaped JSON string.  Runs of bytes
+// that need no escaping (nearly all of them) are appended in one go.
+static void _ejson_string(StringInfo out, const char* s, uint32 len)
 {
-    bytea* aa = BSON_GETARG_BSON(0);
-    text* dotpath = PG_GETARG_TEXT_PP(1);
+    const char* run = s;
+    const char* end = s + len;
+
+    appendStringInfoCharMacro(out, '"');
+    for(const char* p = s; p < end; p++) {
+	unsigned char c = (unsigned char) *p;
+	if(c >= 0x20 && c != '"' && c != '\\') {
+	    continue;
+	}
+	if(p > run) {
+	    appendBinaryStringInfo(out, run, p - run);
+	}
+	switch(c) {
+	case '"':  appendStringInfoString(out, "\\\""); break;
+	case '\\': appendStringInfoString(out, "\\\\"); break;
+	case '\b': appendStringInfoString(out, "\\b"); break;
+	case '\f': appendStringInfoString(out, "\\f"); break;
+	case '\n': appendStringInfoString(out, "\\n"); break;
+	case '\r': appendStringInfoString(out, "\\r"); break;
+	case '\t': appendStringInfoString(out, "\\t"); break;
+	default:   appendStringInfo(out, "\\u%04x", c); break;
+	}
+	run = p + 1;
+    }
+    if(end > run) {
+	appendBinaryStringInfo(out, run, end - run);
+    }
+    appendStringInfoCharMacro(out, '"');
+}
 
-    bson_t b; // on stack
-    BSON_STATIC_INIT(&b,aa);
+static void _ejson_int64(StringInfo out, int64 v)
+{
+    char buf[32];
+    int n = pg_lltoa(v, buf);
+    appendBinaryStringInfo(out, buf, n);
+}
 
-    bson_iter_t target;
-    bool rc = false;
+// Shortest digits that read back as the same double, plus ".0" if that
+// looks like an integer so it stays a double through bson_in.
+static void _ejson_double_digits(StringInfo out, double d)
+{
+    char buf[DOUBLE_SHORTEST_DECIMAL_LEN];
+    int n = double_to_shortest_decimal_buf(d, buf);
+    appendBinaryStringInfo(out, buf, n);
+    if((int) strspn(buf, "0123456789-") == n) {
+	appendStringInfoString(out, ".0");
+    }
+}
 
-    Numeric nm;
-							     
-    rc = _get_bson_iter(&b, dotpath, &target, BSON_TYPE_DECIMAL128);
-    if(rc) {
-	bson_decimal128_t val;
+// Write d (1 to width digits) zero padded to width into p.
+static char* _put_digits(char* p, int d, int width)
+{
+    for(int i = width - 1; i >= 0; i--) {
+	p[i] = '0' + d % 10;
+	d /= 10;
+    }
+    return p + width;
+}
 
-	if(bson_iter_decimal128(&target, &val)) {
+// Same text as libbson's _bson_iso8601_date_format, e.g.
+// 2022-06-06T12:13:14.500Z, with the millis left off when zero, but
+// written straight into out.  Caller keeps millis within 4 digit years.
+static void _ejson_iso8601(StringInfo out, int64 millis)
+{
+    int64 days = millis / 86400000;
+    int64 rem = millis % 86400000;
+    if(rem < 0) {
+	rem += 86400000;
+	days--;
+    }
 
-	    // Safest way to convert is through a string bridge.
-	    // From bson.h: max length of decimal128 string: BSON_DECIMAL128_STRING 43
-	    char strbuf[43]; // TBD: #include bson-decimal128.h   ?
-	    bson_decimal128_to_string(&val, strbuf);
-	    
-	    // OMG.   Googled this out of nowhere:
-	    // https://www.spinics.net/lists/pgsql/msg185320.html
-	    // This is how a "regular" piece of code can call the PG wrapper
-	    // stuff, I guess mocking up the call semantics.  numeric_in is
-	    // The Official string-to-numeric encoder from the postgres lib.
-	    nm = DatumGetNumeric(DirectFunctionCall3(numeric_in,
-							     CStringGetDatum(strbuf), 0, -1));
-	} else {
-	    rc = false;
-	}
+    // civil_from_days() from H. Hinnant's date algorithms:
+    int64 z = days + 719468;
+    int64 era = (z >= 0 ? z : z - 146096) / 146097;
+    int64 doe = z - era * 146097;
+    int64 yoe = (doe - doe/1460 + doe/36524 - doe/146096) / 365;
+    int64 doy = doe - (365*yoe + yoe/4 - yoe/100);
+    int64 mp = (5*doy + 2) / 153;
+    int day = (int) (doy - (153*mp + 2)/5 + 1);
+    int month = (int) (mp < 10 ? mp + 3 : mp - 9);
+    int year = (int) (yoe + era * 400 + (month <= 2));
+
+    char buf[32];
+    char* p = buf;
+    p = _put_digits(p, year, 4);    *p++ = '-';
+    p = _put_digits(p, month, 2);   *p++ = '-';
+    p = _put_digits(p, day, 2);     *p++ = 'T';
+    p = _put_digits(p, (int) (rem / 3600000), 2);     *p++ = ':';
+    p = _put_digits(p, (int) (rem / 60000 % 60), 2);  *p++ = ':';
+    p = _put_digits(p, (int) (rem / 1000 % 60), 2);
+    if(rem % 1000 != 0) {
+	*p++ = '.';
+	p = _put_digits(p, (int) (rem % 1000), 3);
     }
+    *p++ = 'Z';
 
-    PG_FREE_IF_COPY(aa,0);
+    appendBinaryStringInfo(out, buf, p - buf);
+}
 
-    if(rc) PG_RETURN_NUMERIC(nm); else PG_RETURN_NULL();
+// { "$name" : "s" }
+static void _ejson_wrapped_string(StringInfo out, const char* name, const char* s, uint32 len)
+{
+    appendStringInfo(out, "{ \"%s\" : ", name);
+    _ejson_string(out, s, len);
+    appendStringInfoString(out, " }");
 }
 
+// { "$name" : "123" }
+static void _ejson_wrapped_int64(StringInfo out, const char* name, int64 v)
+{
+    appendStringInfo(out, "{ \"%s\" : \"", name);
+    _ejson_int64(out, v);
+    appendStringInfoString(out, "\" }");
+}
 
-static bool _get_obj_or_arr(bson_t* parent, text* dotpath, bson_t* child)
+static void _ejson_base64(StringInfo out, const uint8_t* data, uint32 len)
 {
-    bson_iter_t iter;
-    bson_iter_t target;
+    int b64len = pg_b64_enc_len(len);
 
-    if(!bson_iter_init (&iter, parent)) {
+    appendStringInfoCharMacro(out, '"');
+    enlargeStringInfo(out, b64len);
+    out->len += pg_b64_encode((const char*) data, len, out->data + out->len, b64len);
+    out->data[out->len] = '\0';
+    appendStringInfoCharMacro(out, '"');
+}
+
+// Print every item at iter (positioned before the first one) as an
+// object or an array.
+static void _ejson_container(StringInfo out, bson_iter_t* iter, bool is_array, int mode)
+{
+    check_stack_depth();  // deeply nested BSON must not blow the C stack
+
+    appendStringInfoString(out, is_array ? "[ " : "{ ");
+
+    bool first = true;
+    while(bson_iter_next(iter)) {
+	if(!first) {
+	    appendStringInfoString(out, ", ");
+	}
+	first = false;
+
+	if(!is_array) {
+	    const char* key = bson_iter_key(iter);
+	    _ejson_string(out, key, strlen(key));
+	    appendStringInfoString(out, " : ");
+	}
+	_ejson_value(out, iter, mode);
+    }
+
+    if(iter->err_off != 0) {
 	ereport(
 	    ERROR,
-	    (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("BSON iter bytes corrupted in bson_get_bson"))
+	    (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("BSON iter bytes corrupted in bson_out"))
 	    );
     }
 
-    char* c_dotpath = text_to_cstring(dotpath);
-    bool rc = bson_iter_find_descendant(&iter, c_dotpath, &target);
-    pfree(c_dotpath); // dotpath no longer needed
-    
-    if(rc) {
-	uint32_t subdoc_len;
-	const uint8_t* subdoc_data = 0;
+    // libbson prints empty containers as { } and [ ]
+    if(first) {
+	appendStringInfoChar(out, is_array ? ']' : '}');
+    } else {
+	appendStringInfoString(out, is_array ? " ]" : " }");
+    }
+}
+
+static void _ejson_value(StringInfo out, bson_iter_t* iter, int mode)
+{
+    bson_type_t ft = bson_iter_type(iter);
+
+    switch(ft) {
+    case BSON_TYPE_UTF8: {
+	uint32_t len;
+	const char* s = bson_iter_utf8(iter, &len);
+	_ejson_string(out, s, len);
+	break;
+    }
+    case BSON_TYPE_INT32: {
+	if(mode == BSON_OUTPUT_CANONICAL) {
+	    _ejson_wrapped_int64(out, "$numberInt", bson_iter_int32(iter));
+	} else {
+	    _ejson_int64(out, bson_iter_int32(iter));
+	}
+	break;
+    }
+    case BSON_TYPE_INT64: {
+	if(mode == BSON_OUTPUT_CANONICAL) {
+	    _ejson_wrapped_int64(out, "$numberLong", bson_iter_int64(iter));
+	} else {
+	    _ejson_int64(out, bson_iter_int64(iter));
+	}
+	break;
+    }
+    case BSON_TYPE_DOUBLE: {
+	double d = bson_iter_double(iter);
+	bool finite = !isnan(d) && !isinf(d);
+	if(finite && mode != BSON_OUTPUT_CANONICAL) {
+	    _ejson_double_digits(out, d);
+	} else {
+	    appendStringInfoString(out, "{ \"$numberDouble\" : \"");
+	    if(isnan(d)) {
+		appendStringInfoString(out, "NaN");
+	    } else if(isinf(d)) {
+		appendStringInfoString(out, d > 0 ? "Infinity" : "-Infinity");
+	    } else {
+		_ejson_double_digits(out, d);
+	    }
+	    appendStringInfoString(out, "\" }");
+	}
+	break;
+    }
+    case BSON_TYPE_DECIMAL128: {
+	bson_decimal128_t val;
+	char strbuf[BSON_DECIMAL128_STRING];
+	bson_iter_decimal128(iter, &val);
+	bson_decimal128_to_string(&val, strbuf);
+	// NaN, Inf, -Inf are not JSON numbers; conveniently, everything
+	// else starts with a digit or a minus and a digit:
+	bool finite = isdigit((unsigned char) strbuf[strbuf[0] == '-' ? 1 : 0]);
+	if(mode == BSON_OUTPUT_POSTGRES && finite) {
+	    appendStringInfoString(out, strbuf);
+	} else {
+	    _ejson_wrapped_string(out, "$numberDecimal", strbuf, strlen(strbuf));
+	}
+	break;
+    }
+    case BSON_TYPE_BOOL: {
+	appendStringInfoString(out, bson_iter_bool(iter) ? "true" : "false");
+	break;
+    }
+    case BSON_TYPE_NULL: {
+	appendStringInfoString(out, "null");
+	break;
+    }
+    case BSON_TYPE_DOCUMENT:
+    case BSON_TYPE_ARRAY: {
+	bson_iter_t child;
+	if(!bson_iter_recurse(iter, &child)) {
+	    ereport(
+		ERROR,
+		(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("BSON iter bytes corrupted in bson_out"))
+		);
+	}
+	_ejson_container(out, &child, ft == BSON_TYPE_ARRAY, mode);
+	break;
+    }
+    case BSON_TYPE_DATE_TIME: {
+	int64_t millis = bson_iter_date_time(iter);
+	if(mode == BSON_OUTPUT_POSTGRES) {
+	    if(millis >= BSON_POSTGRES_DATE_MIN && millis <= BSON_RELAXED_DATE_MAX) {
+		appendStringInfoCharMacro(out, '"');
+		_ejson_iso8601(out, millis);
+		appendStringInfoCharMacro(out, '"');
+	    } else {
+		_ejson_int64(out, millis);
+	    }
+	} else if(mode == BSON_OUTPUT_RELAXED && millis >= 0 && millis <= BSON_RELAXED_DATE_MAX) {
+	    appendStringInfoString(out, "{ \"$date\" : \"");
+	    _ejson_iso8601(out, millis);
+	    appendStringInfoString(out, "\" }");
+	} else {
+	    appendStringInfoString(out, "{ \"$date\" : ");
+	    _ejson_wrapped_int64(out, "$numberLong", millis);
+	    appendStringInfoString(out, " }");
+	}
+	break;
+    }
+    case BSON_TYPE_OID: {
+	char oidbuf[25];  // 24 hex chars + NULL
+	bson_oid_to_string(bson_iter_oid(iter), oidbuf);
+	if(mode == BSON_OUTPUT_POSTGRES) {
+	    _ejson_string(out, oidbuf, 24);
+	} else {
+	    _ejson_wrapped_string(out, "$oid", oidbuf, 24);
+	}
+	break;
+    }
+    case BSON_TYPE_BINARY: {
+	bson_subtype_t subtype;
+	uint32_t len;
+	const uint8_t* data;
+	bson_iter_binary(iter, &subtype, &len, &data);
+
+	if(mode == BSON_OUTPUT_POSTGRES) {
+	    _ejson_base64(out, data, len);
+	} else {
+	    appendStringInfoString(out, "{ \"$binary\" : { \"base64\" : ");
+	    _ejson_base64(out, data, len);
+	    appendStringInfo(out, ", \"subType\" : \"%02x\" } }", (uint8_t) subtype);
+	}
+	break;
+    }
+    case BSON_TYPE_REGEX: {
+	const char* options;
+	const char* pattern = bson_iter_regex(iter, &options);
+	appendStringInfoString(out, "{ \"$regularExpression\" : { \"pattern\" : ");
+	_ejson_string(out, pattern, strlen(pattern));
+	appendStringInfoString(out, ", \"options\" : ");
+	_ejson_string(out, options, strlen(options));
+	appendStringInfoString(out, " } }");
+	break;
+    }
+    case BSON_TYPE_TIMESTAMP: {
+	uint32_t t, i;
+	bson_iter_timestamp(iter, &t, &i);
+	appendStringInfo(out, "{ \"$timestamp\" : { \"t\" : %u, \"i\" : %u } }", t, i);
+	break;
+    }
+    case BSON_TYPE_CODE: {
+	uint32_t len;
+	const char* code = bson_iter_code(iter, &len);
+	_ejson_wrapped_string(out, "$code", code, len);
+	break;
+    }
+    case BSON_TYPE_CODEWSCOPE: {
+	uint32_t len;
+	uint32_t scope_len;
+	const uint8_t* scope_data;
+	const char* code = bson_iter_codewscope(iter, &len, &scope_len, &scope_data);
+
+	bson_t scope; // on stack
+	bson_iter_t child;
+	if(!bson_init_static(&scope, scope_data, scope_len) || !bson_iter_init(&child, &scope)) {
+	    ereport(
+		ERROR,
+		(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("BSON iter bytes corrupted in bson_out"))
+		);
+	}
+	appendStringInfoString(out, "{ \"$code\" : ");
+	_ejson_string(out, code, len);
+	appendStringInfoString(out, ", \"$scope\" : ");
+	_ejson_container(out, &child, false, mode);
+	appendStringInfoString(out, " }");
+	break;
+    }
+    case BSON_TYPE_SYMBOL: {
+	uint32_t len;
+	const char* sym = bson_iter_symbol(iter, &len);
+	if(mode == BSON_OUTPUT_POSTGRES) {
+	    _ejson_string(out, sym, len);
+	} else {
+	    _ejson_wrapped_string(out, "$symbol", sym, len);
+	}
+	break;
+    }
+    case BSON_TYPE_DBPOINTER: {
+	uint32_t len;
+	const char* coll;
+	const bson_oid_t* oid;
+	char oidbuf[25];
+	bson_iter_dbpointer(iter, &len, &coll, &oid);
+	bson_oid_to_string(oid, oidbuf);
+	appendStringInfoString(out, "{ \"$dbPointer\" : { \"$ref\" : ");
+	_ejson_string(out, coll, len);
+	appendStringInfoString(out, ", \"$id\" : ");
+	_ejson_wrapped_string(out, "$oid", oidbuf, 24);
+	appendStringInfoString(out, " } }");
+	break;
+    }
+    case BSON_TYPE_UNDEFINED: {
+	appendStringInfoString(out, "{ \"$undefined\" : true }");
+	break;
+    }
+    case BSON_TYPE_MINKEY: {
+	appendStringInfoString(out, "{ \"$minKey\" : 1 }");
+	break;
+    }
+    case BSON_TYPE_MAXKEY: {
+	appendStringInfoString(out, "{ \"$maxKey\" : 1 }");
+	break;
+    }
+    default: {
+	ereport(
+	    ERROR,
+	    (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("unknown BSON type 0x%02x in bson_out", (int) ft))
+	    );
+    }
+    }
+}
+
+// This is: get BSON pointer from DB, emit EJSON out
+// VERY important consumers of this are the CLI and the to-JSON casting
+// subsystem.
+// aa as EJSON of the given flavor, in one palloc'd string.
+static char* _bson_to_ejson_cstring(bytea* aa, int mode, int* len)
+{
+    bson_t b; // on stack
+    BSON_STATIC_INIT(&b, aa);
+
+#ifdef PGBSON_DEBUG
+    (void) fprintf(stderr, "bson_out()\n");    
+#endif
+
+    bson_iter_t iter;
+    if(!bson_iter_init(&iter, &b)) {
+	ereport(
+	    ERROR,
+	    (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("iter BSON bytes corrupted in bson_out"))
+	    );
+    }
+
+    // EJSON is typically a bit bigger than the BSON; start there and let
+    // StringInfo double if needed.
+    StringInfoData out;
+    initStringInfo(&out);
+    size_t hint = (size_t) b.len + b.len / 2 + 16;
+    if(hint > out.maxlen && hint < MaxAllocSize / 2) {
+	enlargeStringInfo(&out, (int) hint);
+    }
+
+    _ejson_container(&out, &iter, false, mode);
+
+    *len = out.len;
+    return out.data;
+}
+
+// The flavor comes from pgbson.output_mode, so bson_out (and with it the
+// bson::text and bson::json casts) is STABLE, like timestamptz_out and
+// DateStyle.  Expression indexes use bson_to_ejson with a constant mode.
+PG_FUNCTION_INFO_V1(bson_out);
+Datum bson_out(PG_FUNCTION_ARGS)
+{
+    BSON_STATS_START(t);
+
+    bytea* aa = BSON_GETARG_BSON(0);
+    int len;
+
+    char* s = _bson_to_ejson_cstring(aa, bson_output_mode, &len);
+
+    PG_FREE_IF_COPY(aa,0); // every string was copied into out
+
+    BSON_STATS_END(BSON_STAT_OUT, t, len);
+    
+    PG_RETURN_CSTRING(s);
+}
+
+// bson_to_ejson(bson, mode):  bson_out with the flavor given by name
+// instead of pgbson.output_mode, so it is IMMUTABLE.
+PG_FUNCTION_INFO_V1(bson_to_ejson);
+Datum bson_to_ejson(PG_FUNCTION_ARGS)
+{
+    bytea* aa = BSON_GETARG_BSON(0);
+    char* name = text_to_cstring(PG_GETARG_TEXT_PP(1));
+
+    const struct config_enum_entry* e;
+    for(e = bson_output_options; e->name != NULL; e++) {
+	if(pg_strcasecmp(e->name, name) == 0) break;
+    }
+    if(e->name == NULL) {
+	ereport(
+	    ERROR,
+	    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+	     errmsg("unknown EJSON output mode \"%s\"", name),
+	     errhint("Use relaxed, canonical, or postgres."))
+	    );
+    }
+
+    int len;
+    char* s = _bson_to_ejson_cstring(aa, e->val, &len);
+
+    PG_FREE_IF_COPY(aa,0);
+
+    PG_RETURN_TEXT_P(cstring_to_text_with_len(s, len));
+}
+
+// This is: take BSON pointer from DB, emit BSON to client
+PG_FUNCTION_INFO_V1(bson_send);
+Datum bson_send(PG_FUNCTION_ARGS)
+{
+    bytea* arg = BSON_GETARG_BSON(0);
+
+    uint8_t* data = BSON_VARDATA_ANY(arg);
+    uint32 sz = BSON_VARSIZE_ANY_EXHDR(arg);
+
+    StringInfoData buf;
+
+    pq_begintypsend(&buf);
+    pq_sendbytes(&buf, (char *) data, sz);
+
+    PG_FREE_IF_COPY(arg,0);
+    
+    PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+
+// This is: get BSON pointer from outside, save BSON in DB
+// The bytes are copied exactly once, straight from the message buffer
+// into the new varlena, and validated there.
+PG_FUNCTION_INFO_V1(bson_recv);
+Datum bson_recv(PG_FUNCTION_ARGS)
+{   
+    StringInfo	buf = (StringInfo) PG_GETARG_POINTER(0);
+
+    int avail = buf->len - buf->cursor;
+    if(avail < 5) {
+	ereport(
+	    ERROR,
+	    (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("binary message too short to be BSON"))
+	    );
+    }
+
+    // The BSON int32 length prefix must account for the whole message:
+    int32_t blen;
+    memcpy(&blen, buf->data + buf->cursor, sizeof(blen));
+    blen = BSON_UINT32_FROM_LE(blen);
+    if(blen != avail) {
+	ereport(
+	    ERROR,
+	    (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+	     errmsg("BSON length %d does not match binary message length %d", blen, avail))
+	    );
+    }
+
+    int tot_size = blen + VARHDRSZ;
+    bytea* aa = (bytea*) palloc(tot_size);
+    SET_VARSIZE(aa, tot_size);
+    pq_copymsgbytes(buf, VARDATA(aa), blen);  // advances buf->cursor
+
+    // Client bytes are at least walked unless recv_validate is off; the
+    // utf8 and full levels of pgbson.validate apply here too.
+    _validate_bson_bytes((const uint8_t*) VARDATA(aa), blen,
+			 bson_recv_validate
+			 ? Max(bson_validate_level, BSON_VALIDATE_LEVEL_STRUCTURE)
+			 : BSON_VALIDATE_LEVEL_HEADER);
+	
+    PG_RETURN_BYTEA_P(_apply_hot_paths(aa));
+}
+
+// This is: get bytea pointer from outside, validate it is good
+// BSON per pgbson.validate, then return it.
+// Very important for safe insertion of BSON as bytea i.e.
+//   insert into (bson_column) values ('\x000000'::bytea)
+// to avoid as much as possible storing malformed/corrupt BSON
+// It is pgbson_validate() because bson_validate() already exists!
+// bytea and bson are the same varlena so the incoming datum is handed
+// back untouched:  no copy, and no detoast at all when validate = none.
+PG_FUNCTION_INFO_V1(pgbson_validate);
+Datum pgbson_validate(PG_FUNCTION_ARGS)
+{
+#ifdef PGBSON_DEBUG
+    (void) fprintf(stderr, "bson_validate()\n");
+#endif
+
+    if(bson_validate_level != BSON_VALIDATE_LEVEL_NONE) {
+	bytea* aa = PG_GETARG_BYTEA_PP(0);
+
+	_validate_bson_bytes((const uint8_t*) VARDATA_ANY(aa), VARSIZE_ANY_EXHDR(aa),
+			     bson_validate_level);
+
+	PG_FREE_IF_COPY(aa,0);
+    }
+
+    // Only rewritten (and so copied) when pgbson.hot_paths is set:
+    if(bson_hot_path_list != NULL && bson_hot_path_list->n > 0) {
+	bytea* aa = PG_GETARG_BYTEA_PP(0);
+	PG_RETURN_BYTEA_P(_apply_hot_paths(aa));
+    }
+
+    PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+}
+
+
+// Logical comparison
+//
+// This is the MongoDB / BSON spec ordering, not bytes.  Documents compare
+// element by element; for each pair of elements first the "canonical type"
+// (below), then the field name, then the value.  Running out of elements
+// first means less.  Numbers of any BSON type compare by value so int32 1,
+// int64 1, and double 1.0 are all equal.  decimal128 is compared exactly
+// against the other number types (see _bson_compare_numbers).
+
+// The raw bytes of the value at iter, e.g. for a UTF8 the int32 length,
+// chars, and trailing NULL.  bson.h has no accessor for these but the
+// offsets are right there in the iterator.
+static const uint8_t* _iter_value_bytes(const bson_iter_t* iter, uint32_t* len)
+{
+    *len = iter->next_off - iter->d1;
+    return iter->raw + iter->d1;
+}
+
+// Order of the "canonical types" in the BSON spec; 0 is reserved to mean
+// "no element at all" for the abbreviated sort keys.
+static int _bson_type_rank(bson_type_t ft)
+{
+    switch(ft) {
+    case BSON_TYPE_MINKEY:      return 1;
+    case BSON_TYPE_UNDEFINED:
+    case BSON_TYPE_NULL:        return 2;
+    case BSON_TYPE_INT32:
+    case BSON_TYPE_INT64:
+    case BSON_TYPE_DOUBLE:
+    case BSON_TYPE_DECIMAL128:  return 3;
+    case BSON_TYPE_SYMBOL:
+    case BSON_TYPE_UTF8:        return 4;
+    case BSON_TYPE_DOCUMENT:    return 5;
+    case BSON_TYPE_ARRAY:       return 6;
+    case BSON_TYPE_BINARY:      return 7;
+    case BSON_TYPE_OID:         return 8;
+    case BSON_TYPE_BOOL:        return 9;
+    case BSON_TYPE_DATE_TIME:   return 10;
+    case BSON_TYPE_TIMESTAMP:   return 11;
+    case BSON_TYPE_REGEX:       return 12;
+    case BSON_TYPE_DBPOINTER:   return 13;
+    case BSON_TYPE_CODE:        return 14;
+    case BSON_TYPE_CODEWSCOPE:  return 15;
+    case BSON_TYPE_MAXKEY:      return 16;
+    default:                    return 17;
+    }
+}
+
+static long double _iter_number_as_ld(const bson_iter_t* iter)
+{
+    switch(bson_iter_type(iter)) {
+    case BSON_TYPE_INT32:  return bson_iter_int32(iter);
+    case BSON_TYPE_INT64:  return bson_iter_int64(iter);
+    case BSON_TYPE_DOUBLE: return bson_iter_double(iter);
+    default: {
+	bson_decimal128_t val;
+	char strbuf[BSON_DECIMAL128_STRING];
+	if(!bson_iter_decimal128(iter, &val)) return NAN;
+	bson_decimal128_to_string(&val, strbuf);
+	return strtold(strbuf, NULL);  // understands NaN and Inf too
+    }
+    }
+}
+
+#define BSON_CMP(A,B)  ((A) < (B) ? -1 : ((A) > (B) ? 1 : 0))
+
+static int _bson_compare_iters(bson_iter_t* a, bson_iter_t* b);
+
+static bool _iter_is_integer(const bson_iter_t* iter)
+{
+    return bson_iter_type(iter) == BSON_TYPE_INT32 || bson_iter_type(iter) == BSON_TYPE_INT64;
+}
+
+// i against x (a double, or without int128 a decimal128 too) without
+// widening i, which would round past 2^53 or 2^64.  x is cut down to its integer part
+// only once it is known to be inside the int64 range.
+static int _compare_int64_ld(int64 i, long double x)
+{
+    if(isnan(x)) return 1;  // NaN is less than all other numbers
+
+    // -2^63 and 2^63 are exact in every floating type:
+    if(x >= 9223372036854775808.0L) return -1;
+    if(x < -9223372036854775808.0L) return 1;
+
+    long double fl = floorl(x);
+    int64 xi = (int64) fl;
+    if(i != xi) return BSON_CMP(i, xi);
+    return (fl == x) ? 0 : -1;  // x is xi plus a fraction
+}
+
+#ifdef HAVE_INT128
+// A number as sign * coeff * 10^exp, so that decimal128 compares exactly
+// with anything; kind orders the specials around the finite values.
+typedef struct {
+    int kind;   // DECNUM_*
+    bool neg;
+    uint128 coeff;
+    int exp;
+} BsonDecNum;
+
+#define DECNUM_NAN     0  // NaN is less than all other numbers
+#define DECNUM_NEGINF  1
+#define DECNUM_FINITE  2
+#define DECNUM_POSINF  3
+
+static void _decnum_from_dec128(const bson_decimal128_t* val, BsonDecNum* n)
+{
+    n->kind = DECNUM_FINITE;
+    if(_dec128_decode(val, &n->neg, &n->coeff, &n->exp)) {
+	return;
+    }
+
+    uint64 hi = val->high;
+    if(((hi >> 58) & 0x1F) == 0x1F) {
+	n->kind = DECNUM_NAN;
+    } else if(((hi >> 58) & 0x1F) == 0x1E) {
+	n->kind = (hi >> 63) ? DECNUM_NEGINF : DECNUM_POSINF;
+    } else {
+	n->coeff = 0;  // non-canonical coefficients are zero (IEEE 754)
+	n->neg = (hi >> 63) != 0;
+	n->exp = 0;
+    }
+}
+
+// A double is taken at its value rounded to 34 digits, as MongoDB does.
+// That rounding is monotonic and no two doubles share a result, so the
+// order stays a total order over all numeric types.
+static void _iter_decnum(const bson_iter_t* iter, BsonDecNum* n)
+{
+    switch(bson_iter_type(iter)) {
+    case BSON_TYPE_INT32:
+    case BSON_TYPE_INT64: {
+	int64 v = bson_iter_as_int64(iter);
+	n->kind = DECNUM_FINITE;
+	n->neg = v < 0;
+	n->coeff = (v < 0) ? (uint128) (-(v + 1)) + 1 : (uint128) v;  // INT64_MIN too
+	n->exp = 0;
+	break;
+    }
+    case BSON_TYPE_DOUBLE: {
+	double d = bson_iter_double(iter);
+	bson_decimal128_t val;
+	char strbuf[64];
+	if(isnan(d)) {
+	    n->kind = DECNUM_NAN;
+	    break;
+	}
+	if(isinf(d)) {
+	    n->kind = (d < 0) ? DECNUM_NEGINF : DECNUM_POSINF;
+	    break;
+	}
+	snprintf(strbuf, sizeof(strbuf), "%.33e", d);
+	bson_decimal128_from_string(strbuf, &val);
+	_decnum_from_dec128(&val, n);
+	break;
+    }
+    default: {
+	bson_decimal128_t val;
+	if(!bson_iter_decimal128(iter, &val)) {
+	    n->kind = DECNUM_NAN;
+	    break;
+	}
+	_decnum_from_dec128(&val, n);
+	break;
+    }
+    }
+}
+
+static int _u128_digits(uint128 c)
+{
+    int d = 1;
+    while(c >= 10) {
+	c /= 10;
+	d++;
+    }
+    return d;
+}
+
+static int _compare_decnums(const BsonDecNum* a, const BsonDecNum* b)
+{
+    if(a->kind != DECNUM_FINITE || b->kind != DECNUM_FINITE) {
+	return BSON_CMP(a->kind, b->kind);
+    }
+
+    int sa = (a->coeff == 0) ? 0 : (a->neg ? -1 : 1);
+    int sb = (b->coeff == 0) ? 0 : (b->neg ? -1 : 1);
+    if(sa != sb || sa == 0) {
+	return BSON_CMP(sa, sb);
+    }
+
+    // Same sign:  the one with the higher leading digit position is the
+    // bigger magnitude.  Otherwise the exponents differ by no more than the
+    // digit counts do, so scaling the higher one down to the other's
+    // exponent stays within 34 digits.
+    int da = _u128_digits(a->coeff) + a->exp;
+    int db = _u128_digits(b->coeff) + b->exp;
+    int c;
+    if(da != db) {
+	c = BSON_CMP(da, db);
+    } else {
+	uint128 ca = a->coeff;
+	uint128 cb = b->coeff;
+	if(a->exp > b->exp) {
+	    ca *= _pow10_u128(a->exp - b->exp);
+	} else {
+	    cb *= _pow10_u128(b->exp - a->exp);
+	}
+	c = BSON_CMP(ca, cb);
+    }
+    return (sa < 0) ? -c : c;
+}
+#endif
+
+// Numbers of any BSON type by value.  Integers against integers compare
+// exactly as int64, and integers against doubles as in _compare_int64_ld.
+// Anything with a decimal128 in it compares exactly as sign, coefficient
+// and exponent; long double is left for doubles (and for decimal128 where
+// there is no int128).
+static int _bson_compare_numbers(const bson_iter_t* a, const bson_iter_t* b)
+{
+    bool ia = _iter_is_integer(a);
+    bool ib = _iter_is_integer(b);
+
+    if(ia && ib) {
+	return BSON_CMP(bson_iter_as_int64(a), bson_iter_as_int64(b));
+    }
+
+#ifdef HAVE_INT128
+    if(bson_iter_type(a) == BSON_TYPE_DECIMAL128 || bson_iter_type(b) == BSON_TYPE_DECIMAL128) {
+	BsonDecNum x, y;
+	_iter_decnum(a, &x);
+	_iter_decnum(b, &y);
+	return _compare_decnums(&x, &y);
+    }
+#endif
+
+    if(ia) {
+	return _compare_int64_ld(bson_iter_as_int64(a), _iter_number_as_ld(b));
+    }
+    if(ib) {
+	return -_compare_int64_ld(bson_iter_as_int64(b), _iter_number_as_ld(a));
+    }
+
+    long double x = _iter_number_as_ld(a);
+    long double y = _iter_number_as_ld(b);
+    // NaN is less than all other numbers and equal to itself:
+    if(isnan(x)) return isnan(y) ? 0 : -1;
+    if(isnan(y)) return 1;
+    return BSON_CMP(x, y);
+}
+
+static int _bson_compare_values(const bson_iter_t* a, const bson_iter_t* b)
+{
+    bson_type_t ta = bson_iter_type(a);
+    int rank = _bson_type_rank(ta);
+    
+    switch(rank) {
+    case 1:
+    case 2:
+    case 16: {
+	return 0;  // minkey, null, maxkey:  all alike
+    }
+    case 3: {
+	return _bson_compare_numbers(a, b);
+    }
+    case 4: {
+	uint32_t la, lb;
+	const char* sa = (bson_iter_type(a) == BSON_TYPE_UTF8) ? bson_iter_utf8(a, &la) : bson_iter_symbol(a, &la);
+	const char* sb = (bson_iter_type(b) == BSON_TYPE_UTF8) ? bson_iter_utf8(b, &lb) : bson_iter_symbol(b, &lb);
+	int c = memcmp(sa, sb, Min(la, lb));
+	return (c != 0) ? BSON_CMP(c, 0) : BSON_CMP(la, lb);
+    }
+    case 5:
+    case 6: {
+	bson_iter_t ca;
+	bson_iter_t cb;
+	if(!bson_iter_recurse(a, &ca) || !bson_iter_recurse(b, &cb)) {
+	    ereport(
+		ERROR,
+		(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("iter BSON bytes corrupted"))
+		);
+	}
+	return _bson_compare_iters(&ca, &cb);
+    }
+    case 7: {
+	// length first, then subtype, then bytes
+	bson_subtype_t sta, stb;
+	uint32_t la, lb;
+	const uint8_t* da;
+	const uint8_t* db;
+	bson_iter_binary(a, &sta, &la, &da);
+	bson_iter_binary(b, &stb, &lb, &db);
+	if(la != lb) return BSON_CMP(la, lb);
+	if(sta != stb) return BSON_CMP(sta, stb);
+	return BSON_CMP(memcmp(da, db, la), 0);
+    }
+    case 8: {
+	return BSON_CMP(bson_oid_compare(bson_iter_oid(a), bson_iter_oid(b)), 0);
+    }
+    case 9: {
+	return BSON_CMP(bson_iter_bool(a), bson_iter_bool(b));
+    }
+    case 10: {
+	return BSON_CMP(bson_iter_date_time(a), bson_iter_date_time(b));
+    }
+    case 11: {
+	uint32_t t1, i1, t2, i2;
+	bson_iter_timestamp(a, &t1, &i1);
+	bson_iter_timestamp(b, &t2, &i2);
+	return (t1 != t2) ? BSON_CMP(t1, t2) : BSON_CMP(i1, i2);
+    }
+    case 12: {
+	const char* oa;
+	const char* ob;
+	const char* pa = bson_iter_regex(a, &oa);
+	const char* pb = bson_iter_regex(b, &ob);
+	int c = strcmp(pa, pb);
+	return (c != 0) ? BSON_CMP(c, 0) : BSON_CMP(strcmp(oa, ob), 0);
+    }
+    default: {
+	// the rarely seen rest:  bytewise
+	uint32_t la, lb;
+	const uint8_t* pa = _iter_value_bytes(a, &la);
+	const uint8_t* pb = _iter_value_bytes(b, &lb);
+	int c = memcmp(pa, pb, Min(la, lb));
+	return (c != 0) ? BSON_CMP(c, 0) : BSON_CMP(la, lb);
+    }
+    }
+}
+
+// a and b are positioned before the first element of their containers.
+static int _bson_compare_iters(bson_iter_t* a, bson_iter_t* b)
+{
+    check_stack_depth();
+
+    for(;;) {
+	bool na = bson_iter_next(a);
+	bool nb = bson_iter_next(b);
+
+	if(!na || !nb) {
+	    return BSON_CMP(na, nb);  // the one that ran out first is less
+	}
+
+	int c = BSON_CMP(_bson_type_rank(bson_iter_type(a)), _bson_type_rank(bson_iter_type(b)));
+	if(c != 0) return c;
+
+	c = strcmp(bson_iter_key(a), bson_iter_key(b));
+	if(c != 0) return BSON_CMP(c, 0);
+
+	c = _bson_compare_values(a, b);
+	if(c != 0) return c;
+    }
+}
+
+static int _bson_compare(const uint8_t* d1, uint32 l1, const uint8_t* d2, uint32 l2)
+{
+    bson_iter_t a;
+    bson_iter_t b;
+
+    if(!bson_iter_init_from_data(&a, d1, l1) || !bson_iter_init_from_data(&b, d2, l2)) {
+	ereport(
+	    ERROR,
+	    (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("iter BSON bytes corrupted"))
+	    );
+    }
+    return _bson_compare_iters(&a, &b);
+}
+
+PG_FUNCTION_INFO_V1(pgbson_compare);
+Datum pgbson_compare(PG_FUNCTION_ARGS)
+{
+    bytea* first = BSON_GETARG_BSON(0);
+    bytea* second = BSON_GETARG_BSON(1);
+
+    int cmp = _bson_compare(BSON_VARDATA_ANY(first), BSON_VARSIZE_ANY_EXHDR(first),
+			    BSON_VARDATA_ANY(second), BSON_VARSIZE_ANY_EXHDR(second));
+
+    PG_FREE_IF_COPY(first,0);
+    PG_FREE_IF_COPY(second,1);
+    
+    PG_RETURN_INT32(cmp);
+}
+
+
+//
+//  SortSupport (btree support function 2)
+//
+//  Sorts and CREATE INDEX go through here instead of the fmgr call to
+//  pgbson_compare.  Better still, each value gets an abbreviated key packed
+//  into a Datum that compares as an unsigned integer:
+//    byte 0:      canonical type rank of the first element (0 if empty doc)
+//    next bytes:  the first field name, including its NULL terminator
+//    remaining:   an order preserving prefix of the first value, for
+//                 numbers, strings, booleans, and dates
+//  A smaller abbreviated key always means a smaller document; only ties
+//  need the full comparison (and the detoast that goes with it).
+//
+
+typedef struct
+{
+    hyperLogLogState abbr_card;  // cardinality of abbreviated keys
+    int64 input_count;
+    bool estimating;
+} BsonSortSupport;
+
+static int _bson_fastcmp(Datum x, Datum y, SortSupport ssup)
+{
+    bytea* a = DatumGetBson(x);
+    bytea* b = DatumGetBson(y);
+
+    int cmp = _bson_compare(BSON_VARDATA_ANY(a), BSON_VARSIZE_ANY_EXHDR(a),
+			    BSON_VARDATA_ANY(b), BSON_VARSIZE_ANY_EXHDR(b));
+
+    if((Pointer) a != DatumGetPointer(x)) pfree(a);
+    if((Pointer) b != DatumGetPointer(y)) pfree(b);
+
+    return cmp;
+}
+
+static int _bson_abbrev_cmp(Datum x, Datum y, SortSupport ssup)
+{
+    return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+// Order preserving big-endian bytes of a double:  flip all bits of
+// negatives, just the sign bit of positives.
+static uint64 _double_sort_bits(double d)
+{
+    uint64 u;
+    if(isnan(d)) return 0;  // NaN sorts first
+    if(d == 0) d = 0.0;     // -0 and 0 are equal so must abbreviate the same
+    memcpy(&u, &d, sizeof(u));
+    return (u & UINT64CONST(0x8000000000000000)) ? ~u : (u | UINT64CONST(0x8000000000000000));
+}
+
+static Datum _bson_abbrev_convert(Datum original, SortSupport ssup)
+{
+    BsonSortSupport* bss = (BsonSortSupport*) ssup->ssup_extra;
+    bytea* aa = DatumGetBson(original);
+
+    uint8 key[sizeof(Datum)];
+    int n = 0;
+    memset(key, 0, sizeof(key));
+    
+    bson_iter_t iter;
+    if(bson_iter_init_from_data(&iter, BSON_VARDATA_ANY(aa), BSON_VARSIZE_ANY_EXHDR(aa))
+       && bson_iter_next(&iter)) {
+
+	bson_type_t ft = bson_iter_type(&iter);
+	key[n++] = (uint8) _bson_type_rank(ft);
+
+	const char* fname = bson_iter_key(&iter);
+	bool name_done = false;
+	while(n < sizeof(key)) {
+	    key[n++] = (uint8) *fname;
+	    if(*fname++ == '\0') {
+		name_done = true;
+		break;
+	    }
+	}
+
+	// The value only matters if all of the name made it in:
+	uint8 vbuf[8];
+	int vlen = 0;
+	if(name_done && n < sizeof(key)) {
+	    switch(_bson_type_rank(ft)) {
+	    case 3: {
+		uint64 u = _double_sort_bits((double) _iter_number_as_ld(&iter));
+		for(int i = 0; i < 8; i++) vbuf[i] = (uint8) (u >> (56 - 8*i));
+		vlen = 8;
+		break;
+	    }
+	    case 4: {
+		uint32_t len;
+		const char* s = (ft == BSON_TYPE_UTF8) ? bson_iter_utf8(&iter, &len) : bson_iter_symbol(&iter, &len);
+		vlen = Min(len, 8);
+		memcpy(vbuf, s, vlen);
+		break;
+	    }
+	    case 9: {
+		vbuf[0] = bson_iter_bool(&iter) ? 1 : 0;
+		vlen = 1;
+		break;
+	    }
+	    case 10: {
+		uint64 u = ((uint64) bson_iter_date_time(&iter)) ^ UINT64CONST(0x8000000000000000);
+		for(int i = 0; i < 8; i++) vbuf[i] = (uint8) (u >> (56 - 8*i));
+		vlen = 8;
+		break;
+	    }
+	    default:
+		break;
+	    }
+	}
+	for(int i = 0; i < vlen && n < sizeof(key); i++) {
+	    key[n++] = vbuf[i];
+	}
+    }
+
+    if((Pointer) aa != DatumGetPointer(original)) pfree(aa);
+
+    Datum res;
+    memcpy(&res, key, sizeof(Datum));
+    res = DatumBigEndianToNative(res);
+
+    if(bss->estimating) {
+	uint32 h = hash_bytes((const unsigned char*) &res, sizeof(res));
+	addHyperLogLog(&bss->abbr_card, h);
+    }
+    bss->input_count++;
+    
+    return res;
+}
+
+// Same heuristic as numeric:  give up on abbreviation if the keys are
+// mostly all the same (e.g. every document starts with "_id" : ObjectId).
+static bool _bson_abbrev_abort(int memtupcount, SortSupport ssup)
+{
+    BsonSortSupport* bss = (BsonSortSupport*) ssup->ssup_extra;
+
+    if(memtupcount < 10000 || bss->input_count < 10000 || !bss->estimating) {
+	return false;
+    }
+
+    double abbr_card = estimateHyperLogLog(&bss->abbr_card);
+
+    if(abbr_card > 100000.0) {
+	bss->estimating = false;  // plenty distinct; stop checking
+	return false;
+    }
+    
+    return abbr_card < memtupcount / 10000.0 + 0.5;
+}
+
+PG_FUNCTION_INFO_V1(bson_sortsupport);
+Datum bson_sortsupport(PG_FUNCTION_ARGS)
+{
+    SortSupport ssup = (SortSupport) PG_GETARG_POINTER(0);
+
+    ssup->comparator = _bson_fastcmp;
+
+    if(ssup->abbreviate) {
+	MemoryContext old = MemoryContextSwitchTo(ssup->ssup_cxt);
+
+	BsonSortSupport* bss = (BsonSortSupport*) palloc(sizeof(BsonSortSupport));
+	initHyperLogLog(&bss->abbr_card, 10);
+	bss->input_count = 0;
+	bss->estimating = true;
+
+	ssup->ssup_extra = bss;
+	ssup->comparator = _bson_abbrev_cmp;
+	ssup->abbrev_converter = _bson_abbrev_convert;
+	ssup->abbrev_abort = _bson_abbrev_abort;
+	ssup->abbrev_full_comparator = _bson_fastcmp;
+
+	MemoryContextSwitchTo(old);
+    }
+
+    PG_RETURN_VOID();
+}
+
+
+//  binary equality
+PG_FUNCTION_INFO_V1(bson_binary_equal);
+Datum bson_binary_equal(PG_FUNCTION_ARGS)
+{
+    bytea* first = BSON_GETARG_BSON(0);
+    bytea* second = BSON_GETARG_BSON(1);
+
+    bson_t b1; // on stack
+    bson_init_static(&b1, BSON_VARDATA_ANY(first), BSON_VARSIZE_ANY_EXHDR(first));
+    bson_t b2; // on stack
+    bson_init_static(&b2, BSON_VARDATA_ANY(second), BSON_VARSIZE_ANY_EXHDR(second));
+    
+    bool cmp = bson_equal(&b1, &b2);
+ 
+    PG_FREE_IF_COPY(first,0);
+    PG_FREE_IF_COPY(second,1);
+    
+    PG_RETURN_BOOL(cmp);
+}
+
+// hash index support
+//
+// == is byte equality so hash the raw bytes.  hash_any() does a word at a
+// time, much faster than a byte-at-a-time loop on multi-KB documents, and
+// the extended (seeded, 64 bit) flavor is what hash partitioning and
+// parallel hash joins want.  Seed 0 must give the same low 32 bits as
+// bson_hash(); hash_any_extended() guarantees that.
+PG_FUNCTION_INFO_V1(bson_hash);
+Datum bson_hash(PG_FUNCTION_ARGS)
+{
+    bytea* aa = BSON_GETARG_BSON(0);
+
+    Datum h = hash_any(BSON_VARDATA_ANY(aa), BSON_VARSIZE_ANY_EXHDR(aa));
+
+    PG_FREE_IF_COPY(aa,0);    
+    
+    PG_RETURN_DATUM(h);
+}
+
+PG_FUNCTION_INFO_V1(bson_hash_extended);
+Datum bson_hash_extended(PG_FUNCTION_ARGS)
+{
+    bytea* aa = BSON_GETARG_BSON(0);
+    uint64 seed = PG_GETARG_INT64(1);
+
+    Datum h = hash_any_extended(BSON_VARDATA_ANY(aa),
+				BSON_VARSIZE_ANY_EXHDR(aa), seed);
+
+    PG_FREE_IF_COPY(aa,0);    
+    
+    PG_RETURN_DATUM(h);
+}
+
+
+//
+//  Dotpaths
+//
+//  A dotpath like 'data.payments.0.amt' is split ONCE into its segments
+//  and cached in fn_extra for the rest of the scan; in practice the path
+//  is almost always a constant so per-row we only memcmp the incoming
+//  text against the cached copy.  Each segment that looks like an array
+//  index has the index precomputed so that descending into an array
+//  just counts items instead of comparing "0", "1", "2", ... keys.
+//
+//  Everything lives in ONE palloc'd chunk so a cache miss (a path that
+//  changes per row) pfrees the old entry in one shot.
+//
+typedef struct
+{
+    int len;            // of raw, for cache compare
+    const char* raw;    // the path as given, NOT NULL terminated
+    int nsegs;
+    const char** segs;  // NULL terminated
+    int* seglens;
+    int* idx;           // array index if segment is all digits, else -1
+} BsonPath;
+
+// Bytes needed to hold the parsed form of dotpath in one chunk.
+static Size _dotpath_size(const char* dotpath, int len)
+{
+    int n = 1;
+    for(int i = 0; i < len; i++) {
+	if(dotpath[i] == '.') n++;
+    }
+
+    // Pointers first, then ints, then chars to keep alignment happy:
+    return sizeof(BsonPath) + n * (sizeof(char*) + 2 * sizeof(int)) + 2 * (len + 1);
+}
+
+// Lay the parsed form of dotpath out in chunk, which has at least
+// _dotpath_size() bytes.  Cannot fail, so it is safe from GUC hooks.
+static BsonPath* _dotpath_fill(char* chunk, const char* dotpath, int len)
+{
+    int n = 1;
+    for(int i = 0; i < len; i++) {
+	if(dotpath[i] == '.') n++;
+    }
+
+    BsonPath* path = (BsonPath*) chunk;
+    path->segs = (const char**) (chunk + sizeof(BsonPath));
+    path->seglens = (int*) (path->segs + n);
+    path->idx = path->seglens + n;
+
+    char* raw = (char*) (path->idx + n);
+    memcpy(raw, dotpath, len);
+    raw[len] = '\0';
+    path->raw = raw;
+    path->len = len;
+
+    char* buf = raw + len + 1;
+    memcpy(buf, dotpath, len + 1);
+    
+    path->nsegs = n;
+    n = 0;
+    char* start = buf;
+    for(int i = 0; i <= len; i++) {
+	if(buf[i] == '.' || buf[i] == '\0') {
+	    buf[i] = '\0';
+	    int slen = (buf + i) - start;
+
+	    path->segs[n] = start;
+	    path->seglens[n] = slen;
+
+	    // "0" or [1-9][0-9]* up to 9 digits; "01" is not an index.
+	    path->idx[n] = -1;
+	    if(slen > 0 && slen < 10 && (start[0] != '0' || slen == 1)) {
+		int v = 0;
+		int k;
+		for(k = 0; k < slen && start[k] >= '0' && start[k] <= '9'; k++) {
+		    v = v * 10 + (start[k] - '0');
+		}
+		if(k == slen) {
+		    path->idx[n] = v;
+		}
+	    }
+
+	    n++;
+	    start = buf + i + 1;
+	}
+    }
+
+    return path;
+}
+
+static BsonPath* _parse_dotpath(const char* dotpath, int len)
+{
+    return _dotpath_fill((char*) palloc(_dotpath_size(dotpath, len)), dotpath, len);
+}
+
+// Make *slot the parsed form of dotpath, reusing what is already there
+// if it is the same path as last time.  New paths live in fn_mcxt.
+static BsonPath* _refresh_cached_path(FmgrInfo* flinfo, BsonPath** slot, text* dotpath)
+{
+    const char* p = VARDATA_ANY(dotpath);
+    int len = VARSIZE_ANY_EXHDR(dotpath);
+
+    BsonPath* path = *slot;
+
+    if(path == NULL || path->len != len || memcmp(path->raw, p, len) != 0) {
+	MemoryContext old = MemoryContextSwitchTo(flinfo->fn_mcxt);
+	if(path != NULL) {
+	    pfree(path);
+	}
+	path = _parse_dotpath(p, len);
+	MemoryContextSwitchTo(old);
+
+	*slot = path;
+    }
+
+    return path;
+}
+
+// Return the parsed form of dotpath, reusing the one cached in fn_extra
+// if it is the same path as last time.
+static BsonPath* _get_cached_path(FunctionCallInfo fcinfo, text* dotpath)
+{
+    return _refresh_cached_path(fcinfo->flinfo, (BsonPath**) &fcinfo->flinfo->fn_extra, dotpath);
+}
+
+#define BSON_GETARG_PATH(n)  _get_cached_path(fcinfo, PG_GETARG_TEXT_PP(n))
+
+// Move iter (positioned before the first item of its container) to the
+// item named by segment d of path.
+static bool _find_segment(bson_iter_t* iter, BsonPath* path, int d, bool in_array)
+{
+    if(in_array && path->idx[d] >= 0) {
+	// BSON arrays are keyed "0", "1", ... in order; just count.
+	int n = path->idx[d];
+	while(bson_iter_next(iter)) {
+	    if(n-- == 0) return true;
+	}
+	return false;
+    }
+
+    const char* seg = path->segs[d];
+    int seglen = path->seglens[d];
+    
+    while(bson_iter_next(iter)) {
+	const char* key = bson_iter_key(iter);
+	// strncmp (not memcmp) so we never read past the end of a short key:
+	if(strncmp(key, seg, seglen) == 0 && key[seglen] == '\0') {
+	    return true;
+	}
+    }
+    return false;
+}
+
+// Resolve segments d0.. of path, starting in the container that start is
+// positioned before the first item of.
+static bool _find_descendant_from(bson_iter_t* start, BsonPath* path, int d0, bool in_array, bson_iter_t* target)
+{
+    bson_iter_t cur = *start;
+
+    for(int d = d0; d < path->nsegs; d++) {
+	if(!_find_segment(&cur, path, d, in_array)) {
+	    return false;
+	}
+	if(d == path->nsegs - 1) {
+	    break;
+	}
+
+	bson_type_t ft = bson_iter_type(&cur);
+	if(ft != BSON_TYPE_DOCUMENT && ft != BSON_TYPE_ARRAY) {
+	    return false;
+	}
+	in_array = (ft == BSON_TYPE_ARRAY);
+
+	bson_iter_t child;
+	if(!bson_iter_recurse(&cur, &child)) {
+	    return false;
+	}
+	cur = child;
+    }
+
+    *target = cur;
+    return true;
+}
+
+// Our own bson_iter_find_descendant() that uses the pre-split path.
+// iter must be freshly initialized on the top level document.
+static bool _find_descendant(bson_iter_t* iter, BsonPath* path, bson_iter_t* target)
+{
+    return _find_descendant_from(iter, path, 0, false, target);
+}
+
+
+// For now, no fancy conversions.  If you want fancy, let the casting machinery
+// do its thing.  The overall API design is to mimic the bson lib itself,
+// where you pull specific types from the object and "that's that."  In
+// general, such explicit calls and behaviors minimizes implicit funny business
+// that can happen when the deep C code starts making assumptions about things,
+// for example numeric precision.
+// The dotpath arrives already split and cached (see BSON_GETARG_PATH) so
+// there is nothing to convert or pfree() on each call.  *mismatch says
+// whether a false return means "there, but the wrong type".
+static bool _get_bson_iter(bson_t* b, BsonPath* dotpath, bson_iter_t* target, bson_type_t tt,
+			   bool* mismatch)
+{
+    bool rc = false;
+    bson_iter_t iter;
+
+    if (!bson_iter_init (&iter, b)) {
+	ereport(
+	    ERROR,
+	    (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("iter BSON bytes corrupted"))
+	    );
+    } else {
+	// Careful:  target is *already* pointer...
+	rc = _find_descendant(&iter, dotpath, target);
+    }
+    if(rc) {
+	bson_type_t ft = bson_iter_type(target);
+	if(ft != tt) {
+	    rc = false;
+	    *mismatch = true;
+	}
+    }
+
+    return rc;
+}
+
+//
+//  Offset index (bsonx)
+//
+//  bsonx is bson plus, for documents with at least BSONX_MIN_KEYS top
+//  level keys, a sorted table of (key hash, element offset) in front of
+//  the untouched BSON (layout at BSONX_MAGIC).  The getters binary search
+//  the table for the first path segment and jump straight to the element
+//  instead of scanning hundreds of keys; deeper segments are scanned as
+//  usual.  Only the bsonx entry points know about the table:  the
+//  getters check that their argument was declared bsonx (_arg_is_bsonx),
+//  and bsonx_out, bsonx_send and the bson and bytea casts hand on the
+//  untouched BSON after it.  Everything else takes bsonx through the
+//  implicit cast to bson, so plain bson bytes are never read as a table.
+//
+#define BSONX_MIN_KEYS  16
+
+typedef struct
+{
+    uint32 hash;
+    uint32 off;
+} BsonxEntry;
+
+static int _bsonx_entry_cmp(const void* a, const void* b)
+{
+    const BsonxEntry* ea = (const BsonxEntry*) a;
+    const BsonxEntry* eb = (const BsonxEntry*) b;
+    if(ea->hash != eb->hash) return ea->hash < eb->hash ? -1 : 1;
+    if(ea->off != eb->off) return ea->off < eb->off ? -1 : 1;  // first dup key wins, as in a scan
+    return 0;
+}
+
+// A new bsonx varlena for the len bytes of BSON at data.
+static bytea* _bsonx_build(const uint8_t* data, uint32 len)
+{
+    bson_t b; // on stack
+    bson_iter_t iter;
+    if(!bson_init_static(&b, data, len) || !bson_iter_init(&iter, &b)) {
+	ereport(
+	    ERROR,
+	    (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("iter BSON bytes corrupted in bsonx"))
+	    );
+    }
+
+    uint32 nkeys = bson_count_keys(&b);
+    if(nkeys < BSONX_MIN_KEYS) {
+	bytea* aa = (bytea*) palloc(VARHDRSZ + len);
+	SET_VARSIZE(aa, VARHDRSZ + len);
+	memcpy(VARDATA(aa), data, len);
+	return aa;
+    }
+
+    BsonxEntry* ents = (BsonxEntry*) palloc(nkeys * sizeof(BsonxEntry));
+    uint32 n = 0;
+    while(n < nkeys && bson_iter_next(&iter)) {
+	const char* key = bson_iter_key(&iter);
+	ents[n].hash = hash_bytes((const unsigned char*) key, strlen(key));
+	ents[n].off = iter.off;  // libbson private: start of the element
+	n++;
+    }
+    qsort(ents, n, sizeof(BsonxEntry), _bsonx_entry_cmp);
+
+    uint32 magic = BSONX_MAGIC;
+    uint32 bson_off = BSONX_HDR_SIZE + n * BSONX_ENTRY_SIZE;
+    uint32 tot_size = VARHDRSZ + bson_off + len;
+
+    bytea* aa = (bytea*) palloc(tot_size);
+    SET_VARSIZE(aa, tot_size);
+    char* p = VARDATA(aa);
+    memcpy(p, &magic, 4);
+    memcpy(p + 4, &n, 4);
+    memcpy(p + 8, &bson_off, 4);
+    for(uint32 i = 0; i < n; i++) {
+	memcpy(p + BSONX_HDR_SIZE + i * BSONX_ENTRY_SIZE, &ents[i].hash, 4);
+	memcpy(p + BSONX_HDR_SIZE + i * BSONX_ENTRY_SIZE + 4, &ents[i].off, 4);
+    }
+    memcpy(p + bson_off, data, len);
+
+    pfree(ents);
+
+    return aa;
+}
+
+// Was argument argno of the current call declared bsonx?  A type's Oid
+// never changes what it names, so the answer is remembered.
+static bool _arg_is_bsonx(FunctionCallInfo fcinfo, int argno)
+{
+    static Oid bsonx_oid = InvalidOid;
+    static Oid other_oid = InvalidOid;
+
+    Oid t = get_fn_expr_argtype(fcinfo->flinfo, argno);
+    if(t == InvalidOid || t == other_oid) {
+	return false;
+    }
+    if(t == bsonx_oid) {
+	return true;
+    }
+
+    bool is_bsonx = false;
+    HeapTuple tp = SearchSysCache1(TYPEOID, ObjectIdGetDatum(t));
+    if(HeapTupleIsValid(tp)) {
+	is_bsonx = (strcmp(NameStr(((Form_pg_type) GETSTRUCT(tp))->typname), "bsonx") == 0);
+	ReleaseSysCache(tp);
+    }
+    if(is_bsonx) {
+	bsonx_oid = t;
+    } else {
+	other_oid = t;
+    }
+    return is_bsonx;
+}
+
+// _find_descendant() for an indexed value:  hdr is the index and data,
+// len the BSON after it.
+static bool _bsonx_find_descendant(const uint8_t* hdr, const uint8_t* data, uint32 len,
+				   BsonPath* path, bson_iter_t* target)
+{
+    if(path->nsegs == 0) {
+	return false;
+    }
+
+    uint32 n;
+    memcpy(&n, hdr + 4, 4);
+    const uint8_t* ents = hdr + BSONX_HDR_SIZE;
+    uint32 h = hash_bytes((const unsigned char*) path->segs[0], path->seglens[0]);
+
+    // lower bound of h
+    uint32 lo = 0, hi = n;
+    while(lo < hi) {
+	uint32 mid = lo + (hi - lo) / 2;
+	uint32 eh;
+	memcpy(&eh, ents + mid * BSONX_ENTRY_SIZE, 4);
+	if(eh < h) lo = mid + 1; else hi = mid;
+    }
+
+    for(; lo < n; lo++) {
+	uint32 eh, eoff;
+	memcpy(&eh, ents + lo * BSONX_ENTRY_SIZE, 4);
+	if(eh != h) {
+	    break;
+	}
+	memcpy(&eoff, ents + lo * BSONX_ENTRY_SIZE + 4, 4);
+
+	// Jump straight to the element at eoff:  type byte, then the key.
+	if(eoff < 4 || eoff + 2 > len) {
+	    ereport(
+		ERROR,
+		(errcode(ERRCODE_DATA_CORRUPTED), errmsg("corrupted bsonx offset index"))
+		);
+	}
+	const char* key = (const char*) data + eoff + 1;
+	if((uint32) path->seglens[0] >= len - eoff - 1
+	   || strncmp(key, path->segs[0], path->seglens[0]) != 0 || key[path->seglens[0]] != '\0') {
+	    continue;  // hash collision
+	}
+
+	bson_iter_t cur;
+	if(!bson_iter_init_from_data_at_offset(&cur, data, len, eoff, path->seglens[0])) {
+	    ereport(
+		ERROR,
+		(errcode(ERRCODE_DATA_CORRUPTED), errmsg("corrupted bsonx offset index"))
+		);
+	}
+
+	if(path->nsegs == 1) {
+	    *target = cur;
+	    return true;
+	}
+	bson_type_t ft = bson_iter_type(&cur);
+	bson_iter_t child;
+	if((ft != BSON_TYPE_DOCUMENT && ft != BSON_TYPE_ARRAY) || !bson_iter_recurse(&cur, &child)) {
+	    return false;
+	}
+	return _find_descendant_from(&child, path, 1, ft == BSON_TYPE_ARRAY, target);
+    }
+
+    return false;
+}
+
+PG_FUNCTION_INFO_V1(bsonx_in);
+Datum bsonx_in(PG_FUNCTION_ARGS)
+{
+    bytea* aa = DatumGetByteaPP(DirectFunctionCall1(bson_in, PG_GETARG_DATUM(0)));
+    PG_RETURN_BYTEA_P(_bsonx_build((const uint8_t*) VARDATA_ANY(aa), VARSIZE_ANY_EXHDR(aa)));
+}
+
+PG_FUNCTION_INFO_V1(bsonx_recv);
+Datum bsonx_recv(PG_FUNCTION_ARGS)
+{
+    bytea* aa = DatumGetByteaPP(DirectFunctionCall1(bson_recv, PG_GETARG_DATUM(0)));
+    PG_RETURN_BYTEA_P(_bsonx_build((const uint8_t*) VARDATA_ANY(aa), VARSIZE_ANY_EXHDR(aa)));
+}
+
+// bson::bsonx and bytea::bsonx (after validation by the caller's cast)
+PG_FUNCTION_INFO_V1(bson_to_bsonx);
+Datum bson_to_bsonx(PG_FUNCTION_ARGS)
+{
+    bytea* aa = BSON_GETARG_BSON(0);
+
+    bytea* bb = _bsonx_build(BSON_VARDATA_ANY(aa), BSON_VARSIZE_ANY_EXHDR(aa));
+
+    PG_FREE_IF_COPY(aa,0);
+
+    PG_RETURN_BYTEA_P(bb);
+}
+
+PG_FUNCTION_INFO_V1(bytea_to_bsonx);
+Datum bytea_to_bsonx(PG_FUNCTION_ARGS)
+{
+    bytea* aa = DatumGetByteaPP(DirectFunctionCall1(pgbson_validate, PG_GETARG_DATUM(0)));
+    PG_RETURN_BYTEA_P(_bsonx_build((const uint8_t*) VARDATA_ANY(aa), VARSIZE_ANY_EXHDR(aa)));
+}
+
+// bsonx::bson and bsonx::bytea:  just the BSON.  Plain values (too few
+// keys to index) are returned as-is.
+PG_FUNCTION_INFO_V1(bsonx_to_bson);
+Datum bsonx_to_bson(PG_FUNCTION_ARGS)
+{
+    bytea* aa = PG_GETARG_BYTEA_PP(0);
+
+    uint32 skip = _bsonx_skip((struct varlena*) aa);
+    if(skip == 0) {
+	PG_RETURN_BYTEA_P(aa);
+    }
+
+    uint32 len = VARSIZE_ANY_EXHDR(aa) - skip;
+    bytea* bb = (bytea*) palloc(VARHDRSZ + len);
+    SET_VARSIZE(bb, VARHDRSZ + len);
+    memcpy(VARDATA(bb), VARDATA_ANY(aa) + skip, len);
+
+    PG_FREE_IF_COPY(aa,0);
+
+    PG_RETURN_BYTEA_P(bb);
+}
+
+// bsonx text and binary output are those of the BSON after the index.
+PG_FUNCTION_INFO_V1(bsonx_out);
+Datum bsonx_out(PG_FUNCTION_ARGS)
+{
+    return DirectFunctionCall1(bson_out, DirectFunctionCall1(bsonx_to_bson, PG_GETARG_DATUM(0)));
+}
+
+PG_FUNCTION_INFO_V1(bsonx_send);
+Datum bsonx_send(PG_FUNCTION_ARGS)
+{
+    return DirectFunctionCall1(bson_send, DirectFunctionCall1(bsonx_to_bson, PG_GETARG_DATUM(0)));
+}
+
+
+//
+//  Sliced detoast
+//
+//  A getter that wants one field near the start of a big out-of-line
+//  document does not need the whole thing.  BSON elements are length
+//  prefixed and in order, so we can fetch a prefix of the value with
+//  PG_DETOAST_DATUM_SLICE, walk as far as it goes, and either find the
+//  target completely inside it, prove that it is not there, or fetch a
+//  prefix 4x bigger and try again.  Once the prefix would be more than
+//  half the document we stop and detoast all of it as usual.
+//
+//  This is cheapest for columns stored EXTERNAL (out of line but not
+//  compressed) because then a slice reads only the TOAST chunks it
+//  covers; compressed values still have to be decompressed up to the end
+//  of the slice.  pgbson.slice_detoast = off turns it off.
+//
+#define BSON_SLICE_FIRST   8192
+#define BSON_SLICE_GROWTH  4
+
+typedef enum
+{
+    BSON_SLICE_FOUND,
+    BSON_SLICE_ABSENT,
+    BSON_SLICE_NEED_MORE,
+    BSON_SLICE_GIVE_UP    // looks corrupt; let the full detoast complain
+} BsonSliceResult;
+
+static int32 _slice_int32(const uint8_t* p)
+{
+    int32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (int32) BSON_UINT32_FROM_LE(v);
+}
+
+// Size of the value of type t at buf[v], or -1 if more than n bytes are
+// needed to tell, or -2 if it makes no sense.
+static int64 _slice_value_size(const uint8_t* buf, int64 n, int64 v, uint8_t t)
+{
+#define NEED(X)  do { if(v + (X) > n) return -1; } while(0)
+    switch(t) {
+    case BSON_TYPE_DOUBLE:
+    case BSON_TYPE_DATE_TIME:
+    case BSON_TYPE_TIMESTAMP:
+    case BSON_TYPE_INT64:       return 8;
+    case BSON_TYPE_DECIMAL128:  return 16;
+    case BSON_TYPE_OID:         return 12;
+    case BSON_TYPE_INT32:       return 4;
+    case BSON_TYPE_BOOL:        return 1;
+    case BSON_TYPE_UNDEFINED:
+    case BSON_TYPE_NULL:
+    case BSON_TYPE_MINKEY:
+    case BSON_TYPE_MAXKEY:      return 0;
+    case BSON_TYPE_UTF8:
+    case BSON_TYPE_CODE:
+    case BSON_TYPE_SYMBOL: {
+	NEED(4);
+	int32 l = _slice_int32(buf + v);
+	return l < 1 ? -2 : 4 + (int64) l;
+    }
+    case BSON_TYPE_DBPOINTER: {
+	NEED(4);
+	int32 l = _slice_int32(buf + v);
+	return l < 1 ? -2 : 4 + (int64) l + 12;
+    }
+    case BSON_TYPE_BINARY: {
+	NEED(4);
+	int32 l = _slice_int32(buf + v);
+	return l < 0 ? -2 : 5 + (int64) l;
+    }
+    case BSON_TYPE_DOCUMENT:
+    case BSON_TYPE_ARRAY:
+    case BSON_TYPE_CODEWSCOPE: {
+	NEED(4);
+	int32 l = _slice_int32(buf + v);
+	return l < 5 ? -2 : (int64) l;
+    }
+    case BSON_TYPE_REGEX: {
+	// two cstrings
+	const uint8_t* e1 = memchr(buf + v, '\0', n - v);
+	if(e1 == NULL) return -1;
+	const uint8_t* e2 = memchr(e1 + 1, '\0', n - (e1 + 1 - buf));
+	if(e2 == NULL) return -1;
+	return (e2 + 1) - (buf + v);
+    }
+    default:
+	return -2;
+    }
+#undef NEED
+}
+
+// Look for path in the first n bytes of a document.  On FOUND, *type,
+// *voff and *vlen locate the complete value within buf.
+static BsonSliceResult _slice_find(const uint8_t* buf, int64 n, BsonPath* path,
+				   uint8_t* type, int64* voff, int64* vlen)
+{
+    int64 coff = 0;        // the container we are in
+    bool in_array = false;
+
+    for(int d = 0; d < path->nsegs; d++) {
+	if(coff + 4 > n) return BSON_SLICE_NEED_MORE;
+	int64 cend = coff + _slice_int32(buf + coff);
+	int64 pos = coff + 4;
+	int nth = 0;
+
+	for(;;) {
+	    if(pos >= n) return BSON_SLICE_NEED_MORE;
+	    if(pos >= cend) return BSON_SLICE_GIVE_UP;
+
+	    uint8_t t = buf[pos];
+	    if(t == 0) {
+		return BSON_SLICE_ABSENT;  // end of container
+	    }
+
+	    const uint8_t* kend = memchr(buf + pos + 1, '\0', n - pos - 1);
+	    if(kend == NULL) return BSON_SLICE_NEED_MORE;
+	    const char* key = (const char*) buf + pos + 1;
+	    int keylen = (const char*) kend - key;
+	    int64 v = (kend + 1) - buf;
+
+	    int64 sz = _slice_value_size(buf, n, v, t);
+	    if(sz == -1) return BSON_SLICE_NEED_MORE;
+	    if(sz < 0 || v + sz > cend) return BSON_SLICE_GIVE_UP;
+
+	    bool match;
+	    if(in_array && path->idx[d] >= 0) {
+		match = (nth == path->idx[d]);
+	    } else {
+		match = (keylen == path->seglens[d]
+			 && memcmp(key, path->segs[d], keylen) == 0);
+	    }
+	    nth++;
+
+	    if(match) {
+		if(d == path->nsegs - 1) {
+		    if(v + sz > n) return BSON_SLICE_NEED_MORE;
+		    *type = t;
+		    *voff = v;
+		    *vlen = sz;
+		    return BSON_SLICE_FOUND;
+		}
+		if(t != BSON_TYPE_DOCUMENT && t != BSON_TYPE_ARRAY) {
+		    return BSON_SLICE_ABSENT;
+		}
+		in_array = (t == BSON_TYPE_ARRAY);
+		coff = v;
+		break;  // on to the next segment
+	    }
+
+	    pos = v + sz;
+	}
+    }
+
+    return BSON_SLICE_ABSENT;  // empty path
+}
+
+// What _fetch_path_value() allocated for the caller to let go of.
+typedef struct
+{
+    bytea* aa;      // detoasted argument, or NULL
+    uint8_t* mini;  // one-element document copied out of a slice, or NULL
+    int argno;      // which argument aa came from
+    bool mismatch;  // not found because the value had the wrong type
+} BsonFetch;
+
+// Try the sliced lookup.  Returns false if the caller should just
+// detoast everything.  On true *found says whether target is set.
+static bool _fetch_sliced(Datum d, BsonPath* path, bson_type_t tt,
+			  bson_iter_t* target, BsonFetch* f, bool* found)
+{
+    struct varlena* raw = (struct varlena*) DatumGetPointer(d);
+
+    if(!bson_slice_detoast || !VARATT_IS_EXTERNAL_ONDISK(raw)) {
+	return false;
+    }
+
+    struct varatt_external toast_pointer;
+    VARATT_EXTERNAL_GET_POINTER(toast_pointer, raw);
+    int64 total = toast_pointer.va_rawsize - VARHDRSZ;
+
+    for(int64 want = BSON_SLICE_FIRST; want * 2 <= total; want *= BSON_SLICE_GROWTH) {
+	struct varlena* part = PG_DETOAST_DATUM_SLICE(d, 0, want);
+	const uint8_t* buf = (const uint8_t*) VARDATA_ANY(part);
+	int64 n = VARSIZE_ANY_EXHDR(part);
+
+	BSON_STATS_ADD(BSON_STAT_GET, BSON_STAT_BYTES, n);
+
+	uint32 m;
+	if(n >= 4 && (memcpy(&m, buf, 4), m == BSONX_MAGIC)) {
+	    pfree(part);
+	    return false;  // bsonx; the index is faster anyway
+	}
+
+	uint8_t t;
+	int64 voff, vlen;
+	BsonSliceResult r = _slice_find(buf, n, path, &t, &voff, &vlen);
+
+	if(r == BSON_SLICE_FOUND) {
+	    *found = false;
+	    if(tt == BSON_TYPE_EOD || t == tt) {
+		// { "v": <value> } so the usual bson_iter_* work on it:
+		int32 mlen = 4 + 1 + 2 + vlen + 1;
+		uint8_t* m = palloc(mlen);
+		int32_t le = BSON_UINT32_TO_LE(mlen);
+		memcpy(m, &le, 4);
+		m[4] = t;
+		m[5] = 'v';
+		m[6] = '\0';
+		memcpy(m + 7, buf + voff, vlen);
+		m[mlen - 1] = '\0';
+
+		bson_t mb; // on stack
+		if(bson_init_static(&mb, m, mlen) && bson_iter_init_find(target, &mb, "v")) {
+		    f->mini = m;
+		    *found = true;
+		} else {
+		    pfree(m);
+		}
+	    } else {
+		f->mismatch = true;
+	    }
+	}
+	pfree(part);
+
+	if(r == BSON_SLICE_FOUND || r == BSON_SLICE_ABSENT) {
+	    if(r == BSON_SLICE_ABSENT) {
+		*found = false;
+	    }
+	    return true;
+	}
+	if(r == BSON_SLICE_GIVE_UP) {
+	    break;
+	}
+    }
+
+    return false;
+}
+
+// _fetch_path_value_arg() minus the pgbson_stats bookkeeping.
+static bool _lookup_path_value_arg(FunctionCallInfo fcinfo, int argno, BsonPath* path, bson_type_t tt,
+				   bson_iter_t* target, BsonFetch* f)
+{
+    bool found;
+    if(_fetch_sliced(PG_GETARG_DATUM(argno), path, tt, target, f, &found)) {
+	return found;
+    }
+
+    f->aa = BSON_GETARG_BSON(argno);
+
+    uint32 skip = 0;
+    if(!BSON_IS_EXPANDED(f->aa) && _arg_is_bsonx(fcinfo, argno)) {
+	skip = _bsonx_skip((struct varlena*) f->aa);
+    }
+    if(skip != 0) {
+	const uint8_t* hdr = (const uint8_t*) VARDATA_ANY(f->aa);
+	if(!_bsonx_find_descendant(hdr, hdr + skip, VARSIZE_ANY_EXHDR(f->aa) - skip, path, target)) {
+	    return false;
+	}
+	f->mismatch = (tt != BSON_TYPE_EOD && bson_iter_type(target) != tt);
+	return !f->mismatch;
+    }
+
+    bson_t b; // on stack
+    BSON_STATIC_INIT(&b,f->aa);
+
+    if(tt == BSON_TYPE_EOD) {
+	bson_iter_t iter;
+	if (!bson_iter_init (&iter, &b)) {
+	    ereport(
+		ERROR,
+		(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("iter BSON bytes corrupted"))
+		);
+	}
+	return _find_descendant(&iter, path, target);
+    }
+    return _get_bson_iter(&b, path, target, tt, &f->mismatch);
+}
+
+// The first half of a getter:  find the value at path in argument argno
+// and check that it is of type tt (BSON_TYPE_EOD means any type).  target
+// is good until _release_fetch().
+static bool _fetch_path_value_arg(FunctionCallInfo fcinfo, int argno, BsonPath* path, bson_type_t tt,
+				  bson_iter_t* target, BsonFetch* f)
+{
+    f->aa = NULL;
+    f->mini = NULL;
+    f->argno = argno;
+    f->mismatch = false;
+
+    bool found = _lookup_path_value_arg(fcinfo, argno, path, tt, target, f);
+
+    if(unlikely(bson_track_stats)) {
+	uint64* c = BSON_STATS(BSON_STAT_GET);
+	c[BSON_STAT_CALLS]++;
+	if(f->aa != NULL && (Pointer) f->aa != DatumGetPointer(PG_GETARG_DATUM(argno))) {
+	    c[BSON_STAT_BYTES] += VARSIZE_ANY(f->aa);  // detoasted whole
+	}
+	if(!found) {
+	    c[f->mismatch ? BSON_STAT_MISMATCHES : BSON_STAT_MISSES]++;
+	}
+    }
+
+    return found;
+}
+
+static bool _fetch_path_value(FunctionCallInfo fcinfo, BsonPath* path, bson_type_t tt,
+			      bson_iter_t* target, BsonFetch* f)
+{
+    return _fetch_path_value_arg(fcinfo, 0, path, tt, target, f);
+}
+
+static void _release_fetch(FunctionCallInfo fcinfo, BsonFetch* f)
+{
+    if(f->aa != NULL) {
+	PG_FREE_IF_COPY(f->aa,f->argno);
+    }
+    if(f->mini != NULL) {
+	pfree(f->mini);
+    }
+}
+
+
+//
+//  The get_<type> family all follow the same logic:
+//
+//  Call _fetch_path_value.  It puts a bson_t on the stack and inits it
+//  from the bytea (or from just a slice of a big TOASTed value, see
+//  above).  This avoids allocs at the extension level, essentially
+//  "setting the bytea into place" and making the get_ very high
+//  performance.
+//
+//  If the thing is found, the per-type extractors e.g. bson_iter_utf8()
+//  and bson_iter_int32() return material that should NOT be freed and
+//  must be used before _release_fetch.  This is fine -- because returned
+//  material has to be palloc'd anyway and the calling machinery will
+//  free() the text* and bytea* material after the call is complete.
+//
+//  In all cases, be sure to clean up with _release_fetch!
+//
+
+
+PG_FUNCTION_INFO_V1(bson_get_string);  // text bson_get_string(bson, dotpath)
+Datum bson_get_string(PG_FUNCTION_ARGS)
+{
+    BsonPath* dotpath = BSON_GETARG_PATH(1);
+    BsonFetch f;
+    
+    bson_iter_t target;
+    bool rc = false;
+    rc = _fetch_path_value(fcinfo, dotpath, BSON_TYPE_UTF8, &target, &f);
+
+    text* txt = 0;
+    if(rc) {
+	uint32_t len;
+	// bson_iter_utf8() returns a pointer that MUST NOT be
+	// modified or freed; fine, because we have to palloc it into
+	// text anyway....
+	txt = mk_text( bson_iter_utf8(&target, &len) );
+    }
+
+    _release_fetch(fcinfo, &f);
+
+    if(rc == true) PG_RETURN_TEXT_P(txt); else PG_RETURN_NULL();
+}
+
+
+// BSON datetime is signed millis since 1970-01-01 UTC; postgres timestamp
+// (and timestamptz) is signed micros since 2000-01-01 UTC.  No calendar
+// math needed, and negative (pre-1970) millis just work.
+static Timestamp _cvt_datetime_to_ts(int64_t millis_since_epoch)
+{
+    static const int64 epoch_diff_usecs =
+	(int64) (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * USECS_PER_DAY;
+
+    int64 usecs;
+    Timestamp ts;
+    if(pg_mul_s64_overflow((int64) millis_since_epoch, 1000, &usecs)
+       || pg_sub_s64_overflow(usecs, epoch_diff_usecs, &ts)
+       || !IS_VALID_TIMESTAMP(ts)) {
+	ereport(
+	    ERROR,
+	    (errcode(ERRCODE_DATETIME_VALUE_OUT_OF_RANGE), errmsg("timestamp out of range"))
+	    );
+    }
+
+    return ts;
+}
+
+
+PG_FUNCTION_INFO_V1(bson_get_datetime);
+Datum bson_get_datetime(PG_FUNCTION_ARGS)
+{
+    BsonPath* dotpath = BSON_GETARG_PATH(1);
+    BsonFetch f;
+
+    Timestamp ts;
+
+    bson_iter_t target;
+    bool rc = false;
+    rc = _fetch_path_value(fcinfo, dotpath, BSON_TYPE_DATE_TIME, &target, &f);
+    if(rc) {
+	int64_t millis_since_epoch = bson_iter_date_time (&target);
+
+	ts = _cvt_datetime_to_ts(millis_since_epoch);
+    }
+
+    _release_fetch(fcinfo, &f);
+
+    if(rc) PG_RETURN_TIMESTAMP(ts); else PG_RETURN_NULL();
+}
+
+// Same as bson_get_datetime; the BSON datetime is UTC so the value is
+// identical, only the SQL type differs.
+PG_FUNCTION_INFO_V1(bson_get_datetime_tz);
+Datum bson_get_datetime_tz(PG_FUNCTION_ARGS)
+{
+    return bson_get_datetime(fcinfo);
+}
+
+// The raw millis since epoch.  Range predicates compare these directly
+// without making a timestamp.
+PG_FUNCTION_INFO_V1(bson_get_datetime_millis);
+Datum bson_get_datetime_millis(PG_FUNCTION_ARGS)
+{
+    BsonPath* dotpath = BSON_GETARG_PATH(1);
+    BsonFetch f;
+
+    int64 millis_since_epoch = 0;
+
+    bson_iter_t target;
+    bool rc = false;
+    rc = _fetch_path_value(fcinfo, dotpath, BSON_TYPE_DATE_TIME, &target, &f);
+    if(rc) {
+	millis_since_epoch = bson_iter_date_time (&target);
+    }
+
+    _release_fetch(fcinfo, &f);
+
+    if(rc) PG_RETURN_INT64(millis_since_epoch); else PG_RETURN_NULL();
+}
+
+
+
+#ifdef HAVE_INT128
+//
+//  decimal128 -> numeric without a string
+//
+//  A finite decimal128 is sign * coefficient * 10^exponent with a binary
+//  coefficient below 10^34.  Numeric is base-10000 digits and a weight,
+//  so scale the coefficient by 10^r (r = 0..3) until the exponent is a
+//  multiple of 4, and then every group of 4 decimal digits is exactly one
+//  numeric digit.  The result is written in numeric's on-disk format (the
+//  same layout numeric.c's make_result() produces; it is fixed by
+//  pg_upgrade) so no NumericVar or numeric_in() is needed.
+//
+#define DEC128_COEFF_LIMIT  ((uint128) 10000000000000000ULL * 1000000000000000000ULL)   // 10^34
+#define DEC128_ACC_LIMIT    ((uint128) 100000000000000000ULL * 1000000000000000000ULL)  // 10^35
+#define DEC128_EXP_BIAS     6176
+
+// From numeric.c
+#define NUMERIC_SHORT_               0x8000
+#define NUMERIC_SHORT_SIGN_MASK_     0x2000
+#define NUMERIC_SHORT_DSCALE_SHIFT_  7
+#define NUMERIC_SHORT_DSCALE_MAX_    0x3F
+#define NUMERIC_SHORT_WEIGHT_SIGN_   0x0040
+#define NUMERIC_SHORT_WEIGHT_MASK_   0x003F
+#define NUMERIC_SHORT_WEIGHT_MAX_    63
+#define NUMERIC_SHORT_WEIGHT_MIN_    (-64)
+#define NUMERIC_NEG_                 0x4000
+
+static uint128 _pow10_u128(int k)
+{
+    uint128 p = 1;
+    while(k-- > 0) p *= 10;
+    return p;
+}
+
+// Split a finite, canonical decimal128 into sign, coefficient and
+// exponent.  False for NaN, +/-Inf and non-canonical encodings.
+static bool _dec128_decode(const bson_decimal128_t* val, bool* neg, uint128* coeff, int* exp)
+{
+    uint64 hi = val->high;
+
+    if(((hi >> 61) & 3) == 3) {
+	return false; // Inf, NaN, or the form whose coefficient is >= 2^113
+    }
+
+    *neg = (hi >> 63) != 0;
+    *exp = (int) ((hi >> 49) & 0x3FFF) - DEC128_EXP_BIAS;
+    *coeff = ((uint128) (hi & 0x1FFFFFFFFFFFFULL) << 64) | val->low;
+
+    return *coeff < DEC128_COEFF_LIMIT;
+}
+
+// The numeric sign * mag * 10^exp.  mag must be below 2 * 10^35 so that
+// scaling it by up to 1000 still fits.
+static Numeric _make_numeric(bool neg, uint128 mag, int exp)
+{
+    int r = ((exp % 4) + 4) % 4;
+    int lowpos = (exp - r) / 4;  // weight of the lowest base-10000 digit
+    mag *= (uint128) (r == 0 ? 1 : r == 1 ? 10 : r == 2 ? 100 : 1000);
+
+    // Three chunks of 16 decimal digits, then 4 numeric digits per chunk
+    // with plain 64-bit math.
+    const uint64 e16 = 10000000000000000ULL;
+    uint64 chunks[3];
+    chunks[0] = (uint64) (mag % e16);
+    mag /= e16;
+    chunks[1] = (uint64) (mag % e16);
+    chunks[2] = (uint64) (mag / e16);
+
+    int16 digs[12];  // numeric digits, least significant first
+    for(int c = 0; c < 3; c++) {
+	for(int j = 0; j < 4; j++) {
+	    digs[c * 4 + j] = (int16) (chunks[c] % 10000);
+	    chunks[c] /= 10000;
+	}
+    }
+
+    int hi = 11;
+    while(hi >= 0 && digs[hi] == 0) hi--;
+    int lo = 0;
+    while(lo <= hi && digs[lo] == 0) lo++;
+
+    int ndigits = hi - lo + 1;
+    int weight = (ndigits > 0) ? lowpos + hi : 0;
+    int dscale = (exp < 0) ? -exp : 0;
+    if(ndigits == 0) {
+	neg = false;
+    }
+
+    bool use_short = dscale <= NUMERIC_SHORT_DSCALE_MAX_
+	&& weight <= NUMERIC_SHORT_WEIGHT_MAX_ && weight >= NUMERIC_SHORT_WEIGHT_MIN_;
+    int hdrsz = use_short ? sizeof(uint16) : 2 * sizeof(uint16);
+    Size len = VARHDRSZ + hdrsz + ndigits * sizeof(int16);
+
+    Numeric nm = (Numeric) palloc(len);
+    SET_VARSIZE(nm, len);
+
+    uint16* h = (uint16*) ((char*) nm + VARHDRSZ);
+    if(use_short) {
+	h[0] = NUMERIC_SHORT_
+	    | (neg ? NUMERIC_SHORT_SIGN_MASK_ : 0)
+	    | (dscale << NUMERIC_SHORT_DSCALE_SHIFT_)
+	    | (weight < 0 ? NUMERIC_SHORT_WEIGHT_SIGN_ : 0)
+	    | (weight & NUMERIC_SHORT_WEIGHT_MASK_);
+    } else {
+	h[0] = (neg ? NUMERIC_NEG_ : 0) | dscale;
+	h[1] = (uint16) (int16) weight;
+    }
+
+    int16* out = (int16*) ((char*) h + hdrsz);
+    for(int i = 0; i < ndigits; i++) {
+	out[i] = digs[hi - i];  // most significant first
+    }
+
+    return nm;
+}
+#endif
+
+static bool _iter_decimal128_numeric(bson_iter_t* target, Numeric* nm)
+{
+    bson_decimal128_t val;
+
+    if(!bson_iter_decimal128(target, &val)) {
+	return false;
+    }
+
+#ifdef HAVE_INT128
+    bool neg;
+    uint128 coeff;
+    int exp;
+    if(_dec128_decode(&val, &neg, &coeff, &exp)) {
+	*nm = _make_numeric(neg, coeff, exp);
+	return true;
+    }
+#endif
+
+    // NaN, Inf and odd encodings go the long way, through a string bridge.
+    // From bson.h: max length of decimal128 string: BSON_DECIMAL128_STRING 43
+    char strbuf[43]; // TBD: #include bson-decimal128.h   ?
+    bson_decimal128_to_string(&val, strbuf);
+	    
+    // OMG.   Googled this out of nowhere:
+    // https://www.spinics.net/lists/pgsql/msg185320.html
+    // This is how a "regular" piece of code can call the PG wrapper
+    // stuff, I guess mocking up the call semantics.  numeric_in is
+    // The Official string-to-numeric encoder from the postgres lib.
+    *nm = DatumGetNumeric(DirectFunctionCall3(numeric_in,
+					      CStringGetDatum(strbuf), 0, -1));
+    return true;
+}
+
+
+PG_FUNCTION_INFO_V1(bson_get_decimal128);
+Datum bson_get_decimal128(PG_FUNCTION_ARGS)
+{
+    BsonPath* dotpath = BSON_GETARG_PATH(1);
+    BsonFetch f;
+
+    bson_iter_t target;
+    bool rc = false;
+
+    Numeric nm;
+							     
+    rc = _fetch_path_value(fcinfo, dotpath, BSON_TYPE_DECIMAL128, &target, &f);
+    if(rc) {
+	rc = _iter_decimal128_numeric(&target, &nm);
+    }
+
+    _release_fetch(fcinfo, &f);
+
+    if(rc) PG_RETURN_NUMERIC(nm); else PG_RETURN_NULL();
+}
+
+
+static bool _get_obj_or_arr(bson_t* parent, BsonPath* dotpath, bson_t* child)
+{
+    bson_iter_t iter;
+    bson_iter_t target;
+
+    if(!bson_iter_init (&iter, parent)) {
+	ereport(
+	    ERROR,
+	    (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("BSON iter bytes corrupted in bson_get_bson"))
+	    );
+    }
+
+    bool rc = _find_descendant(&iter, dotpath, &target);
+    
+    if(rc) {
+	uint32_t subdoc_len;
+	const uint8_t* subdoc_data = 0;
+
+	bson_type_t ft = bson_iter_type(&target);
+	switch(ft) {
+	case BSON_TYPE_DOCUMENT:  {
+	    bson_iter_document(&target, &subdoc_len, &subdoc_data);
+	    break;
+	}
+	case BSON_TYPE_ARRAY:  {
+	    bson_iter_array(&target, &subdoc_len, &subdoc_data);
+	    break;
+	}
+	default: {
+	    // ?  TBD How to "better" handle "object representation" of
+	    // noncomplex types.  For now, not found.
+	    rc = false;
+	}
+	}
+	if(subdoc_data != 0) {
+	    bson_init_static(child, subdoc_data, subdoc_len);
+	}
+    }
+    
+    return rc;
+}
+    
+
+// Subdocs smaller than this are just copied:  a memcpy of a few hundred
+// bytes is cheaper than setting up the memory context an expanded object
+// needs.
+#define BSON_EXPANDED_MIN_SIZE  2048
+
+static Size _ebson_get_flat_size(ExpandedObjectHeader* eohptr)
+{
+    ExpandedBson* eb = (ExpandedBson*) eohptr;
+    return VARHDRSZ + eb->len;
+}
+
+static void _ebson_flatten_into(ExpandedObjectHeader* eohptr, void* result, Size allocated_size)
+{
+    ExpandedBson* eb = (ExpandedBson*) eohptr;
+
+    SET_VARSIZE(result, allocated_size);
+    memcpy(VARDATA(result), eb->data, eb->len);
+}
+
+static const ExpandedObjectMethods _ebson_methods =
+{
+    _ebson_get_flat_size,
+    _ebson_flatten_into
+};
+
+// Returned as a READ-ONLY pointer so nothing (e.g. plpgsql) will try to
+// take ownership and move it to a longer lived context than the bytes
+// it points into; they will flatten it instead.
+static Datum _make_expanded_bson(const uint8_t* data, uint32 len)
+{
+    MemoryContext ctx = AllocSetContextCreate(CurrentMemoryContext, "expanded bson", ALLOCSET_SMALL_SIZES);
+
+    ExpandedBson* eb = (ExpandedBson*) MemoryContextAlloc(ctx, sizeof(ExpandedBson));
+    EOH_init_header(&eb->hdr, &_ebson_methods, ctx);
+    eb->data = data;
+    eb->len = len;
+
+    return EOHPGetRODatum(&eb->hdr);
+}
+
+PG_FUNCTION_INFO_V1(bson_get_bson);  // bson bson_get_bson(bson, dotpath)
+Datum bson_get_bson(PG_FUNCTION_ARGS)
+{
+    BsonPath* dotpath = BSON_GETARG_PATH(1);
+    BsonFetch f;
+
+    // Through _fetch_path_value like the other getters, so bsonx goes
+    // through its index and big documents are sliced.
+    bson_iter_t target;
+    if(!_fetch_path_value(fcinfo, dotpath, BSON_TYPE_EOD, &target, &f)) {
+	_release_fetch(fcinfo, &f);
+	PG_RETURN_NULL();
+    }
+
+    uint32_t len = 0;
+    const uint8_t* data = NULL;
+    switch(bson_iter_type(&target)) {
+    case BSON_TYPE_DOCUMENT:
+	bson_iter_document(&target, &len, &data);
+	break;
+    case BSON_TYPE_ARRAY:
+	bson_iter_array(&target, &len, &data);
+	break;
+    default:
+	// ?  TBD How to "better" handle "object representation" of
+	// noncomplex types.  For now, not found.
+	f.mismatch = true;
+	break;
+    }
+
+    if(data == NULL) {
+	_release_fetch(fcinfo, &f);
+	PG_RETURN_NULL();
+    }
+
+    if(len >= BSON_EXPANDED_MIN_SIZE) {
+	// Big enough that a view beats a copy.  Do NOT release the fetch; the
+	// view points into the detoasted copy or the slice.  Both are in the
+	// current context, which is also the parent of the view's context.
+	PG_RETURN_DATUM(_make_expanded_bson(data, len));
+    }
+
+    bson_t b2; // on stack
+    bson_init_static(&b2, data, len);
+    bytea* bbb = mk_palloc_bytea(&b2); // alloc a *new* bytea to hold b2
+    _release_fetch(fcinfo, &f);
+    PG_RETURN_BYTEA_P(bbb);
+}
+
+
+//
+//  BSON -> jsonb
+//
+//  Walk the BSON with bson_iter_t and push JsonbValues directly into a
+//  JsonbParseState instead of printing relaxed EJSON with libbson and then
+//  parsing it all over again with jsonb_in.  The shapes produced are the
+//  same as relaxed EJSON so existing jsonb expressions on things like
+//  '$date' and '$numberDecimal' continue to work:  
+//    int32, int64, double         -> jsonb number
+//    date (1970-9999 years)       -> {"$date": "2022-03-03T12:13:14.789Z"}
+//    date (outside that)          -> {"$date": {"$numberLong": "-1234"}}
+//    decimal128                   -> {"$numberDecimal": "77777809838.97"}
+//    binary                       -> {"$binary": {"base64": "...", "subType": "00"}}
+//    oid                          -> {"$oid": "5f3a..."}
+//  and so on for the rarer types.
+//
+//  Strings point directly into the BSON bytes; this is safe because
+//  JsonbValueToJsonb() copies everything into the final Jsonb before
+//  the caller lets go of the source bson_t.
+//
+
+static JsonbValue* _jbv_string(JsonbValue* v, const char* s, int len)
+{
+    v->type = jbvString;
+    v->val.string.val = (char*) s;
+    v->val.string.len = len;
+    return v;
+}
+
+static JsonbValue* _jbv_numeric(JsonbValue* v, Numeric n)
+{
+    v->type = jbvNumeric;
+    v->val.numeric = n;
+    return v;
+}
+
+static void _push_key(JsonbParseState** state, const char* key)
+{
+    JsonbValue k;
+    pushJsonbValue(state, WJB_KEY, _jbv_string(&k, key, strlen(key)));
+}
+
+// Emit {"$key": "val"} in the current value position:
+static void _push_wrapped_string(JsonbParseState** state, const char* key, const char* val, int vlen)
+{
+    JsonbValue v;
+
+    pushJsonbValue(state, WJB_BEGIN_OBJECT, NULL);
+    _push_key(state, key);
+    pushJsonbValue(state, WJB_VALUE, _jbv_string(&v, val, vlen));
+    pushJsonbValue(state, WJB_END_OBJECT, NULL);
+}
+
+static JsonbValue* _push_bson_container(JsonbParseState** state, bson_iter_t* iter, bool is_array);
+
+// Push the value at iter.  tok is WJB_VALUE for object members and
+// WJB_ELEM for array items; complex values ignore it and just open a new
+// container in that position.
+static void _push_bson_value(JsonbParseState** state, bson_iter_t* iter, JsonbIteratorToken tok)
+{
+    JsonbValue v;
+    
+    bson_type_t ft = bson_iter_type(iter);
+
+    switch(ft) {
+    case BSON_TYPE_UTF8: {
+	uint32_t len;
+	const char* s = bson_iter_utf8(iter, &len);
+	pushJsonbValue(state, tok, _jbv_string(&v, s, len));
+	break;
+    }
+    case BSON_TYPE_INT32: {
+	pushJsonbValue(state, tok, _jbv_numeric(&v, int64_to_numeric(bson_iter_int32(iter))));
+	break;
+    }
+    case BSON_TYPE_INT64: {
+	pushJsonbValue(state, tok, _jbv_numeric(&v, int64_to_numeric(bson_iter_int64(iter))));
+	break;
+    }
+    case BSON_TYPE_DOUBLE: {
+	double d = bson_iter_double(iter);
+	if(isnan(d) || isinf(d)) {
+	    // jsonb numbers cannot be NaN/Infinity; relaxed EJSON wraps them:
+	    const char* s = isnan(d) ? "NaN" : (d > 0 ? "Infinity" : "-Infinity");
+	    _push_wrapped_string(state, "$numberDouble", s, strlen(s));
+	} else {
+	    // float8_numeric rounds to DBL_DIG digits; go through the shortest
+	    // text that reads back as d instead, as float8out does:
+	    char buf[DOUBLE_SHORTEST_DECIMAL_LEN];
+	    (void) double_to_shortest_decimal_buf(d, buf);
+	    Numeric n = DatumGetNumeric(DirectFunctionCall3(numeric_in, CStringGetDatum(buf),
+							    ObjectIdGetDatum(InvalidOid),
+							    Int32GetDatum(-1)));
+	    pushJsonbValue(state, tok, _jbv_numeric(&v, n));
+	}
+	break;
+    }
+    case BSON_TYPE_BOOL: {
+	v.type = jbvBool;
+	v.val.boolean = bson_iter_bool(iter);
+	pushJsonbValue(state, tok, &v);
+	break;
+    }
+    case BSON_TYPE_NULL: {
+	v.type = jbvNull;
+	pushJsonbValue(state, tok, &v);
+	break;
+    }
+    case BSON_TYPE_DOCUMENT:
+    case BSON_TYPE_ARRAY: {
+	bson_iter_t child;
+	if(!bson_iter_recurse(iter, &child)) {
+	    ereport(
+		ERROR,
+		(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("BSON iter bytes corrupted in bson to jsonb"))
+		);
+	}
+	(void) _push_bson_container(state, &child, ft == BSON_TYPE_ARRAY);
+	break;
+    }
+    case BSON_TYPE_DATE_TIME: {
+	int64_t millis_since_epoch = bson_iter_date_time(iter);
+	if(millis_since_epoch >= 0 && millis_since_epoch <= BSON_RELAXED_DATE_MAX) {
+	    bson_string_t* str = bson_string_new(NULL);
+	    _bson_iso8601_date_format(millis_since_epoch, str);
+	    // pstrdup because the bson_string_t is about to go away:
+	    _push_wrapped_string(state, "$date", pstrdup(str->str), str->len);
+	    bson_string_free(str, true);
+	} else {
+	    char valbuf[32];
+	    snprintf(valbuf, sizeof(valbuf), "%lld", (long long) millis_since_epoch);
+
+	    pushJsonbValue(state, WJB_BEGIN_OBJECT, NULL);
+	    _push_key(state, "$date");
+	    _push_wrapped_string(state, "$numberLong", pstrdup(valbuf), strlen(valbuf));
+	    pushJsonbValue(state, WJB_END_OBJECT, NULL);
+	}
+	break;
+    }
+    case BSON_TYPE_DECIMAL128: {
+	bson_decimal128_t val;
+	if(!bson_iter_decimal128(iter, &val)) {
+	    // Pushing nothing would leave the key without a value:
+	    ereport(
+		ERROR,
+		(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("BSON decimal128 bytes corrupted in bson to jsonb"))
+		);
+	}
+	char* strbuf = palloc(BSON_DECIMAL128_STRING);
+	bson_decimal128_to_string(&val, strbuf);
+	_push_wrapped_string(state, "$numberDecimal", strbuf, strlen(strbuf));
+	break;
+    }
+    case BSON_TYPE_OID: {
+	char* oidbuf = palloc(25);  // 24 hex chars + NULL
+	bson_oid_to_string(bson_iter_oid(iter), oidbuf);
+	_push_wrapped_string(state, "$oid", oidbuf, 24);
+	break;
+    }
+    case BSON_TYPE_BINARY: {
+	bson_subtype_t subtype;
+	uint32_t len;
+	const uint8_t* data;
+	bson_iter_binary(iter, &subtype, &len, &data);
+
+	int b64len = pg_b64_enc_len(len);
+	char* b64 = palloc(b64len + 1);
+	b64len = pg_b64_encode((const char*) data, len, b64, b64len);
+
+	char* st = palloc(3);
+	snprintf(st, 3, "%02x", (uint8_t) subtype);
+
+	pushJsonbValue(state, WJB_BEGIN_OBJECT, NULL);
+	_push_key(state, "$binary");
+	pushJsonbValue(state, WJB_BEGIN_OBJECT, NULL);
+	_push_key(state, "base64");
+	pushJsonbValue(state, WJB_VALUE, _jbv_string(&v, b64, b64len));
+	_push_key(state, "subType");
+	pushJsonbValue(state, WJB_VALUE, _jbv_string(&v, st, 2));
+	pushJsonbValue(state, WJB_END_OBJECT, NULL);
+	pushJsonbValue(state, WJB_END_OBJECT, NULL);
+	break;
+    }
+    case BSON_TYPE_REGEX: {
+	const char* options;
+	const char* pattern = bson_iter_regex(iter, &options);
+
+	pushJsonbValue(state, WJB_BEGIN_OBJECT, NULL);
+	_push_key(state, "$regularExpression");
+	pushJsonbValue(state, WJB_BEGIN_OBJECT, NULL);
+	_push_key(state, "pattern");
+	pushJsonbValue(state, WJB_VALUE, _jbv_string(&v, pattern, strlen(pattern)));
+	_push_key(state, "options");
+	pushJsonbValue(state, WJB_VALUE, _jbv_string(&v, options, strlen(options)));
+	pushJsonbValue(state, WJB_END_OBJECT, NULL);
+	pushJsonbValue(state, WJB_END_OBJECT, NULL);
+	break;
+    }
+    case BSON_TYPE_TIMESTAMP: {
+	uint32_t t, i;
+	bson_iter_timestamp(iter, &t, &i);
+
+	pushJsonbValue(state, WJB_BEGIN_OBJECT, NULL);
+	_push_key(state, "$timestamp");
+	pushJsonbValue(state, WJB_BEGIN_OBJECT, NULL);
+	_push_key(state, "t");
+	pushJsonbValue(state, WJB_VALUE, _jbv_numeric(&v, int64_to_numeric(t)));
+	_push_key(state, "i");
+	pushJsonbValue(state, WJB_VALUE, _jbv_numeric(&v, int64_to_numeric(i)));
+	pushJsonbValue(state, WJB_END_OBJECT, NULL);
+	pushJsonbValue(state, WJB_END_OBJECT, NULL);
+	break;
+    }
+    case BSON_TYPE_CODE: {
+	uint32_t len;
+	const char* code = bson_iter_code(iter, &len);
+	_push_wrapped_string(state, "$code", code, len);
+	break;
+    }
+    case BSON_TYPE_SYMBOL: {
+	uint32_t len;
+	const char* sym = bson_iter_symbol(iter, &len);
+	_push_wrapped_string(state, "$symbol", sym, len);
+	break;
+    }
+    case BSON_TYPE_CODEWSCOPE: {
+	uint32_t len;
+	uint32_t scope_len;
+	const uint8_t* scope_data;
+	const char* code = bson_iter_codewscope(iter, &len, &scope_len, &scope_data);
+
+	bson_t scope; // on stack
+	bson_iter_t child;
+	if(!bson_init_static(&scope, scope_data, scope_len) || !bson_iter_init(&child, &scope)) {
+	    ereport(
+		ERROR,
+		(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("BSON iter bytes corrupted in bson to jsonb"))
+		);
+	}
+	
+	pushJsonbValue(state, WJB_BEGIN_OBJECT, NULL);
+	_push_key(state, "$code");
+	pushJsonbValue(state, WJB_VALUE, _jbv_string(&v, code, len));
+	_push_key(state, "$scope");
+	(void) _push_bson_container(state, &child, false);
+	pushJsonbValue(state, WJB_END_OBJECT, NULL);
+	break;
+    }
+    case BSON_TYPE_DBPOINTER: {
+	uint32_t len;
+	const char* coll;
+	const bson_oid_t* oid;
+	bson_iter_dbpointer(iter, &len, &coll, &oid);
+
+	char* oidbuf = palloc(25);
+	bson_oid_to_string(oid, oidbuf);
+
+	pushJsonbValue(state, WJB_BEGIN_OBJECT, NULL);
+	_push_key(state, "$dbPointer");
+	pushJsonbValue(state, WJB_BEGIN_OBJECT, NULL);
+	_push_key(state, "$ref");
+	pushJsonbValue(state, WJB_VALUE, _jbv_string(&v, coll, len));
+	_push_key(state, "$id");
+	_push_wrapped_string(state, "$oid", oidbuf, 24);
+	pushJsonbValue(state, WJB_END_OBJECT, NULL);
+	pushJsonbValue(state, WJB_END_OBJECT, NULL);
+	break;
+    }
+    case BSON_TYPE_UNDEFINED: {
+	pushJsonbValue(state, WJB_BEGIN_OBJECT, NULL);
+	_push_key(state, "$undefined");
+	v.type = jbvBool;
+	v.val.boolean = true;
+	pushJsonbValue(state, WJB_VALUE, &v);
+	pushJsonbValue(state, WJB_END_OBJECT, NULL);
+	break;
+    }
+    case BSON_TYPE_MINKEY:
+    case BSON_TYPE_MAXKEY: {
+	pushJsonbValue(state, WJB_BEGIN_OBJECT, NULL);
+	_push_key(state, ft == BSON_TYPE_MINKEY ? "$minKey" : "$maxKey");
+	pushJsonbValue(state, WJB_VALUE, _jbv_numeric(&v, int64_to_numeric(1)));
+	pushJsonbValue(state, WJB_END_OBJECT, NULL);
+	break;
+    }
+    default: {
+	ereport(
+	    ERROR,
+	    (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("unknown BSON type in bson to jsonb"))
+	    );
+    }
+    }
+}
+
+// Push every item at iter as either an object or an array.  Returns the
+// result of the closing token which, at the top level, is the whole tree.
+static JsonbValue* _push_bson_container(JsonbParseState** state, bson_iter_t* iter, bool is_array)
+{
+    check_stack_depth();
+
+    pushJsonbValue(state, is_array ? WJB_BEGIN_ARRAY : WJB_BEGIN_OBJECT, NULL);
+
+    while(bson_iter_next(iter)) {
+	if(!is_array) {
+	    JsonbValue k;
+	    const char* key = bson_iter_key(iter);
+	    pushJsonbValue(state, WJB_KEY, _jbv_string(&k, key, strlen(key)));
+	}
+	_push_bson_value(state, iter, is_array ? WJB_ELEM : WJB_VALUE);
+    }
+
+    return pushJsonbValue(state, is_array ? WJB_END_ARRAY : WJB_END_OBJECT, NULL);
+}
+
+static Jsonb* _bson_to_jsonb(bson_t* b, bool is_array)
+{
+    JsonbParseState* state = NULL;
+    bson_iter_t iter;
+
+    BSON_STATS_START(t);
+
+    if(!bson_iter_init(&iter, b)) {
+	ereport(
+	    ERROR,
+	    (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("BSON iter bytes corrupted in bson to jsonb"))
+	    );
+    }
+    
+    Jsonb* jb = JsonbValueToJsonb(_push_bson_container(&state, &iter, is_array));
+
+    BSON_STATS_END(BSON_STAT_TO_JSONB, t, b->len);
+
+    return jb;
+}
+
+
+// Backs the bson::jsonb cast.
+PG_FUNCTION_INFO_V1(bson_to_jsonb);
+Datum bson_to_jsonb(PG_FUNCTION_ARGS)
+{
+    bytea* aa = BSON_GETARG_BSON(0);
+
+    bson_t b; // on stack
+    BSON_STATIC_INIT(&b,aa);
+
+    Jsonb* jsonb = _bson_to_jsonb(&b, false);
+
+    PG_FREE_IF_COPY(aa,0);
+
+    PG_RETURN_JSONB_P(jsonb);
+}
+
+
+PG_FUNCTION_INFO_V1(bson_get_jsonb_array);
+Datum bson_get_jsonb_array(PG_FUNCTION_ARGS)
+{
+    bytea* aa = BSON_GETARG_BSON(0);    
+    BsonPath* dotpath = BSON_GETARG_PATH(1);
+
+    bson_t b; // on stack
+    BSON_STATIC_INIT(&b,aa);
+
+    bson_t b2; // on stack    
+    bool rc = _get_obj_or_arr(&b, dotpath, &b2);
+
+    if(rc) {
+	// Same builder as the bson::jsonb cast, but emit the items as an array:
+	Jsonb *jsonb = _bson_to_jsonb(&b2, true);
+	
+	PG_FREE_IF_COPY(aa,0);
+	
+	PG_RETURN_POINTER(jsonb);
+    }
+    
+    PG_FREE_IF_COPY(aa,0);
+    PG_RETURN_NULL();
+}
+
+
+//
+//  jsonb -> BSON
+//
+//  Walk the JsonbContainer and append straight into a bson_t that lives
+//  in a palloc'd varlena (see _begin_varlena_writer), instead of printing
+//  the jsonb to text and parsing that back with bson_new_from_json.
+//
+//  Numbers follow the same rules as EJSON text input so the types do not
+//  change depending on which cast was used:  integral values become int32
+//  if they fit, else int64; integral values too big for int64 become
+//  decimal128 (exact) instead of a lossy double; everything else is double.
+//
+//  EJSON "dollar-typename" wrappers like {"$numberDecimal": "1.23"} are
+//  still honored.  The common ones are converted here; anything else is
+//  handed -- just that small object -- to the libbson EJSON parser.
+//
+
+static void _append_jsonb_container(bson_t* dst, JsonbContainer* c);
+
+static void _append_jsonb_numeric(bson_t* dst, const char* key, int keylen, Numeric n)
+{
+    char* s = DatumGetCString(DirectFunctionCall1(numeric_out, NumericGetDatum(n)));
+
+    if(strchr(s, '.') == NULL) {
+	errno = 0;
+	long long ll = strtoll(s, NULL, 10);
+	if(errno == 0) {
+	    if(ll >= PG_INT32_MIN && ll <= PG_INT32_MAX) {
+		bson_append_int32(dst, key, keylen, (int32_t) ll);
+	    } else {
+		bson_append_int64(dst, key, keylen, (int64_t) ll);
+	    }
+	    pfree(s);
+	    return;
+	}
+
+	bson_decimal128_t dec;
+	if(bson_decimal128_from_string(s, &dec)) {
+	    bson_append_decimal128(dst, key, keylen, &dec);
+	    pfree(s);
+	    return;
+	}
+	// else really, really big; fall through to double like EJSON does
+    }
+
+    bson_append_double(dst, key, keylen, strtod(s, NULL));
+    pfree(s);
+}
+
+// True if the object looks like {"$something": ...}.  jsonb sorts keys
+// shortest first, so the $ key of all the EJSON forms is the first key.
+static bool _is_ejson_wrapper(JsonbContainer* c)
+{
+    if(!JsonContainerIsObject(c) || JsonContainerSize(c) < 1 || JsonContainerSize(c) > 2) {
+	return false;
+    }
+
+    JsonbIterator* it = JsonbIteratorInit(c);
+    JsonbValue v;
+
+    (void) JsonbIteratorNext(&it, &v, true); // WJB_BEGIN_OBJECT
+    if(JsonbIteratorNext(&it, &v, true) != WJB_KEY) {
+	return false;
+    }
+    return v.val.string.len > 1 && v.val.string.val[0] == '$';
+}
+
+static void _append_ejson_wrapper(bson_t* dst, const char* key, int keylen, JsonbContainer* c)
+{
+    JsonbIterator* it = JsonbIteratorInit(c);
+    JsonbValue k;
+    JsonbValue v;
+
+    (void) JsonbIteratorNext(&it, &k, true); // WJB_BEGIN_OBJECT
+    (void) JsonbIteratorNext(&it, &k, true); // WJB_KEY
+    (void) JsonbIteratorNext(&it, &v, true); // WJB_VALUE
+
+    if(JsonContainerSize(c) == 1 && v.type == jbvString) {
+	const char* tn = k.val.string.val;
+	int tnlen = k.val.string.len;
+	char* str = pnstrdup(v.val.string.val, v.val.string.len); // NULL terminated
+	char* end;
+	bool done = false;
+
+#define BSON_TYPENAME_IS(X) (tnlen == sizeof(X)-1 && memcmp(tn, X, tnlen) == 0)
+	
+	if(BSON_TYPENAME_IS("$numberDecimal")) {
+	    bson_decimal128_t dec;
+	    if(bson_decimal128_from_string(str, &dec)) {
+		done = bson_append_decimal128(dst, key, keylen, &dec);
+	    }
+	} else if(BSON_TYPENAME_IS("$numberLong")) {
+	    errno = 0;
+	    long long ll = strtoll(str, &end, 10);
+	    if(errno == 0 && *str != '\0' && *end == '\0') {
+		done = bson_append_int64(dst, key, keylen, (int64_t) ll);
+	    }
+	} else if(BSON_TYPENAME_IS("$numberInt")) {
+	    errno = 0;
+	    long l = strtol(str, &end, 10);
+	    if(errno == 0 && *str != '\0' && *end == '\0' && l >= PG_INT32_MIN && l <= PG_INT32_MAX) {
+		done = bson_append_int32(dst, key, keylen, (int32_t) l);
+	    }
+	} else if(BSON_TYPENAME_IS("$oid")) {
+	    if(bson_oid_is_valid(str, v.val.string.len)) {
+		bson_oid_t oid;
+		bson_oid_init_from_string(&oid, str);
+		done = bson_append_oid(dst, key, keylen, &oid);
+	    }
+	}
+#undef BSON_TYPENAME_IS
+
+	pfree(str);
+	if(done) {
+	    return;
+	}
+    }
+
+    // Everything else ($date, $binary, $regularExpression, malformed
+    // wrappers, ...):  let libbson deal with it exactly as bson_in would.
+    StringInfoData si;
+    initStringInfo(&si);
+    appendStringInfoString(&si, "{\"v\":");
+    (void) JsonbToCString(&si, c, 64);
+    appendStringInfoChar(&si, '}');
+
+    bson_t tmp; // on stack
+    bson_error_t err; // on stack
+    if(!bson_init_from_json(&tmp, si.data, si.len, &err)) {
+	ereport(
+	    ERROR,
+	    (errcode(ERRCODE_INVALID_JSON_TEXT), errmsg(err.message))
+	    );
+    }
+
+    bson_iter_t iter;
+    if(bson_iter_init_find(&iter, &tmp, "v")) {
+	bson_append_iter(dst, key, keylen, &iter);
+    }
+    bson_destroy(&tmp);
+    pfree(si.data);
+}
+
+static void _append_jsonb_value(bson_t* dst, const char* key, int keylen, JsonbValue* v)
+{
+    switch(v->type) {
+    case jbvNull: {
+	bson_append_null(dst, key, keylen);
+	break;
+    }
+    case jbvBool: {
+	bson_append_bool(dst, key, keylen, v->val.boolean);
+	break;
+    }
+    case jbvString: {
+	bson_append_utf8(dst, key, keylen, v->val.string.val, v->val.string.len);
+	break;
+    }
+    case jbvNumeric: {
+	_append_jsonb_numeric(dst, key, keylen, v->val.numeric);
+	break;
+    }
+    case jbvBinary: {
+	JsonbContainer* c = v->val.binary.data;
+	bson_t child; // on stack
+
+	if(JsonContainerIsArray(c)) {
+	    bson_append_array_begin(dst, key, keylen, &child);
+	    _append_jsonb_container(&child, c);
+	    bson_append_array_end(dst, &child);
+	} else if(_is_ejson_wrapper(c)) {
+	    _append_ejson_wrapper(dst, key, keylen, c);
+	} else {
+	    bson_append_document_begin(dst, key, keylen, &child);
+	    _append_jsonb_container(&child, c);
+	    bson_append_document_end(dst, &child);
+	}
+	break;
+    }
+    default: {
+	ereport(
+	    ERROR,
+	    (errcode(ERRCODE_INVALID_JSON_TEXT), errmsg("unexpected jsonb value type in jsonb to bson"))
+	    );
+    }
+    }
+}
+
+// Append every item of c into dst.  Object keys are used as-is; array
+// items get the "0", "1", ... keys that BSON arrays require.
+static void _append_jsonb_container(bson_t* dst, JsonbContainer* c)
+{
+    JsonbIterator* it = JsonbIteratorInit(c);
+    JsonbValue v;
+    JsonbIteratorToken tok;
+
+    const char* key = NULL;
+    int keylen = 0;
+    char idxbuf[16];
+    uint32_t idx = 0;
+
+    // skipNested = true:  nested containers come back as jbvBinary and
+    // _append_jsonb_value recurses on its own.
+    while((tok = JsonbIteratorNext(&it, &v, true)) != WJB_DONE) {
+	switch(tok) {
+	case WJB_KEY: {
+	    key = v.val.string.val;
+	    keylen = v.val.string.len;
+	    break;
+	}
+	case WJB_VALUE: {
+	    _append_jsonb_value(dst, key, keylen, &v);
+	    break;
+	}
+	case WJB_ELEM: {
+	    keylen = bson_uint32_to_string(idx++, &key, idxbuf, sizeof(idxbuf));
+	    _append_jsonb_value(dst, key, keylen, &v);
+	    break;
+	}
+	default: {
+	    break; // BEGIN/END tokens
+	}
+	}
+    }
+}
+
+
+// Backs the jsonb::bson cast.
+PG_FUNCTION_INFO_V1(jsonb_to_bson);
+Datum jsonb_to_bson(PG_FUNCTION_ARGS)
+{
+    BSON_STATS_START(t);
+
+    Jsonb* jb = PG_GETARG_JSONB_P(0);
+
+    if(!JB_ROOT_IS_OBJECT(jb)) {
+	ereport(
+	    ERROR,
+	    (errcode(ERRCODE_INVALID_JSON_TEXT), errmsg("jsonb must be an object to become BSON"))
+	    );
+    }
+
+    // jsonb and BSON are usually about the same size; start there so the
+    // writer rarely has to repalloc.
+    uint8_t* buf;
+    size_t buflen;
+    bson_t* b;
+    bson_writer_t* writer = _begin_varlena_writer(&buf, &buflen, VARHDRSZ + VARSIZE(jb), &b);
+
+    _append_jsonb_container(b, &jb->root);
+
+    bytea* aa = _end_varlena_writer(writer, &buf);
+
+    PG_FREE_IF_COPY(jb,0);
+
+    BSON_STATS_END(BSON_STAT_FROM_JSONB, t, VARSIZE(aa) - VARHDRSZ);
+
+    PG_RETURN_BYTEA_P(aa);
+}
+
+
+PG_FUNCTION_INFO_V1(bson_get_double);  // double bson_get_double(bson, dotpath)
+Datum bson_get_double(PG_FUNCTION_ARGS)
+{
+    BsonPath* dotpath = BSON_GETARG_PATH(1);
+    BsonFetch f;
+
+    bson_iter_t target;
+    bool rc = false;
+    double dbl = 0;  // doesnt matter
+    rc = _fetch_path_value(fcinfo, dotpath, BSON_TYPE_DOUBLE, &target, &f);
+    if(rc) {
+	dbl = bson_iter_double(&target);
+    }
+
+    _release_fetch(fcinfo, &f);
+
+    if(rc == true) PG_RETURN_FLOAT8(dbl); else PG_RETURN_NULL();    
+}
+
+PG_FUNCTION_INFO_V1(bson_get_int32);  // int32 bson_get_int32(bson, dotpath)
+Datum bson_get_int32(PG_FUNCTION_ARGS)
+{
+    BsonPath* dotpath = BSON_GETARG_PATH(1);
+    BsonFetch f;
+
+    bson_iter_t target;
+    bool rc = false;
+    int32_t val = 0; // doesnt matter
+    rc = _fetch_path_value(fcinfo, dotpath, BSON_TYPE_INT32, &target, &f);
+    if(rc) {
+	val = bson_iter_int32(&target);
+    }
+
+    _release_fetch(fcinfo, &f);
+
+    if(rc == true) PG_RETURN_INT32(val); else PG_RETURN_NULL();
+}
+
+PG_FUNCTION_INFO_V1(bson_get_boolean);  // long bson_get_int64(bson, dotpath)
+Datum bson_get_boolean(PG_FUNCTION_ARGS)
+{
+    BsonPath* dotpath = BSON_GETARG_PATH(1);
+    BsonFetch f;
+    
+    bson_iter_t target; 
+    bool rc = false;
+    
+    bool val = false; // doesnt matter
+    rc = _fetch_path_value(fcinfo, dotpath, BSON_TYPE_BOOL, &target, &f);
+    if(rc) {
+	val = bson_iter_bool(&target);
+    }
+
+    _release_fetch(fcinfo, &f);
+
+    if(rc == true) PG_RETURN_BOOL(val); else PG_RETURN_NULL();    
+}
+
+
+PG_FUNCTION_INFO_V1(bson_get_int64);  // long bson_get_int64(bson, dotpath)
+Datum bson_get_int64(PG_FUNCTION_ARGS)
+{
+    BsonPath* dotpath = BSON_GETARG_PATH(1);
+    BsonFetch f;
+    
+    bson_iter_t target; 
+    bool rc = false;
+    
+    int64_t val = 0; // doesnt matter
+    
+    rc = _fetch_path_value(fcinfo, dotpath, BSON_TYPE_INT64, &target, &f);
+    if(rc) {
+	val = bson_iter_int64(&target);
+    }
+
+    _release_fetch(fcinfo, &f);
+
+    if(rc == true) PG_RETURN_INT64(val); else PG_RETURN_NULL();    
+}
+
+
+static bytea* _iter_binary_bytea(bson_iter_t* target)
+{
+    bson_subtype_t subtype;
+    uint32_t len;
+    const uint8_t* data;
+    
+    bson_iter_binary (target, &subtype, &len, &data);
+
+    // The subtype is dropped here; bson_get_bindata returns it too.
+	
+    int tot_size = len + VARHDRSZ; // MUST add varlena hdr!
+    
+    bytea* aa2 = (bytea*) palloc(tot_size);
+    SET_VARSIZE(aa2, tot_size);
+
+    memcpy((void *) VARDATA(aa2), (void *) data, len); // VARDATA_ANY...?
+
+    return aa2;
+}
+
+PG_FUNCTION_INFO_V1(bson_get_binary);
+Datum bson_get_binary(PG_FUNCTION_ARGS)
+{
+    BsonPath* dotpath = BSON_GETARG_PATH(1);
+    BsonFetch f;
+
+    bson_iter_t target;
+    if(_fetch_path_value(fcinfo, dotpath, BSON_TYPE_BINARY, &target, &f)) {
+	bytea* aa2 = _iter_binary_bytea(&target);
+	
+	_release_fetch(fcinfo, &f);
+	PG_RETURN_BYTEA_P(aa2);
+    }
+
+    _release_fetch(fcinfo, &f);
+    PG_RETURN_NULL();
+}
+
+// Binary as text.  The result is sized up front and written in place,
+// with no intermediate buffer and no strlen.
+
+static const char bson_hex_digits[] = "0123456789abcdef";
+
+// "\x0a1b..." (bytea's hex format)
+static text* _hex_text(const uint8_t* data, uint32 len)
+{
+    Size tot_len = VARHDRSZ + 2 + (Size) len * 2;
+    text* t = (text*) palloc(tot_len);
+    SET_VARSIZE(t, tot_len);
+
+    char* p = VARDATA(t);
+    *p++ = '\\';
+    *p++ = 'x';
+    for(uint32 i = 0; i < len; i++) {
+	*p++ = bson_hex_digits[data[i] >> 4];
+	*p++ = bson_hex_digits[data[i] & 0x0F];
+    }
+
+    return t;
+}
+
+static text* _base64_text(const uint8_t* data, uint32 len)
+{
+    int b64len = pg_b64_enc_len(len);
+    text* t = (text*) palloc(VARHDRSZ + b64len);
+
+    int n = pg_b64_encode((const char*) data, len, VARDATA(t), b64len);
+    if(n < 0) {
+	elog(ERROR, "could not encode binary value as base64");
+    }
+    SET_VARSIZE(t, VARHDRSZ + n);
+
+    return t;
+}
+
+PG_FUNCTION_INFO_V1(bson_get_binary_base64);
+Datum bson_get_binary_base64(PG_FUNCTION_ARGS)
+{
+    BsonPath* dotpath = BSON_GETARG_PATH(1);
+    BsonFetch f;
+
+    bson_iter_t target;
+    if(_fetch_path_value(fcinfo, dotpath, BSON_TYPE_BINARY, &target, &f)) {
+	bson_subtype_t subtype;
+	uint32_t len;
+	const uint8_t* data;
+	bson_iter_binary(&target, &subtype, &len, &data);
+
+	text* t = _base64_text(data, len);
+
+	_release_fetch(fcinfo, &f);
+	PG_RETURN_TEXT_P(t);
+    }
+
+    _release_fetch(fcinfo, &f);
+    PG_RETURN_NULL();
+}
+
+// (subtype int4, data bytea) in one lookup.
+PG_FUNCTION_INFO_V1(bson_get_bindata);
+Datum bson_get_bindata(PG_FUNCTION_ARGS)
+{
+    BsonPath* dotpath = BSON_GETARG_PATH(1);
+    BsonFetch f;
+
+    TupleDesc tupdesc;
+    if(get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
+	elog(ERROR, "return type must be a row type");
+    }
+
+    bson_iter_t target;
+    if(_fetch_path_value(fcinfo, dotpath, BSON_TYPE_BINARY, &target, &f)) {
+	bson_subtype_t subtype;
+	uint32_t len;
+	const uint8_t* data;
+	bson_iter_binary(&target, &subtype, &len, &data);
+
+	Datum values[2];
+	bool nulls[2] = {false, false};
+	values[0] = Int32GetDatum((int32) subtype);
+	values[1] = PointerGetDatum(_iter_binary_bytea(&target));
+
+	HeapTuple tuple = heap_form_tuple(BlessTupleDesc(tupdesc), values, nulls);
+
+	_release_fetch(fcinfo, &f);
+	PG_RETURN_DATUM(HeapTupleGetDatum(tuple));
+    }
+
+    _release_fetch(fcinfo, &f);
+    PG_RETURN_NULL();
+}
+
+
+
+
+// Numbers go straight into a text result sized for the longest case:
+// shortest digits that read back as the same double (what float8out
+// writes by default, NaN and Infinity included), pg_ltoa/pg_lltoa for
+// integers.
+#define BSON_INT32_TEXT_LEN  12   // -2147483648 and the NUL pg_ltoa adds
+#define BSON_INT64_TEXT_LEN  21   // -9223372036854775808 and NUL
+
+static text* _double_text(double v)
+{
+    text* t = (text*) palloc(VARHDRSZ + DOUBLE_SHORTEST_DECIMAL_LEN);
+    SET_VARSIZE(t, VARHDRSZ + double_to_shortest_decimal_buf(v, VARDATA(t)));
+    return t;
+}
+
+static text* _int32_text(int32 v)
+{
+    text* t = (text*) palloc(VARHDRSZ + BSON_INT32_TEXT_LEN);
+    SET_VARSIZE(t, VARHDRSZ + pg_ltoa(v, VARDATA(t)));
+    return t;
+}
+
+static text* _int64_text(int64 v)
+{
+    text* t = (text*) palloc(VARHDRSZ + BSON_INT64_TEXT_LEN);
+    SET_VARSIZE(t, VARHDRSZ + pg_lltoa(v, VARDATA(t)));
+    return t;
+}
+
+// Render whatever is at target as text the way the ->> operator does.
+// Returns NULL for types that have no text representation (yet).
+static text* _iter_as_text(bson_iter_t* target)
+{
+    bson_type_t ft = bson_iter_type(target);
+    switch(ft) {
+    case BSON_TYPE_UTF8: {
+	uint32_t len;		
+	// mk_text stops at an embedded NUL, which text cannot hold anyway
+	return mk_text(bson_iter_utf8(target, &len)); // NO NEED TO free()
+    }
+    case BSON_TYPE_DOUBLE: {
+	return _double_text(bson_iter_double(target));
+    }
+    case BSON_TYPE_INT32: {
+	return _int32_text(bson_iter_int32(target));
+    }
+    case BSON_TYPE_INT64: {
+	return _int64_text(bson_iter_int64(target));
+    }
+    case BSON_TYPE_DECIMAL128: {
+	bson_decimal128_t val;
+	if(bson_iter_decimal128(target, &val)) {
+	    char valbuf[BSON_DECIMAL128_STRING];
+	    bson_decimal128_to_string(&val, valbuf);
+	    return mk_text(valbuf);
+	}
+	break;		
+    }
+    case BSON_TYPE_DATE_TIME: {
+	int64_t millis_since_epoch = bson_iter_date_time (target);
+	bson_string_t* str = bson_string_new (NULL);
+	_bson_iso8601_date_format(millis_since_epoch, str);
+	text* t = cstring_to_text_with_len(str->str, str->len);
+	bson_string_free(str, true); // true means "free segment" ?
+	return t;
+    }								
+
+    case BSON_TYPE_DOCUMENT: 
+    case BSON_TYPE_ARRAY: {		
+	uint32_t subdoc_len;
+	const uint8_t* subdoc_data;
+
+	if(ft == BSON_TYPE_DOCUMENT) {
+	    bson_iter_document(target, &subdoc_len, &subdoc_data);
+	} else {
+	    bson_iter_array(target, &subdoc_len, &subdoc_data);
+	}
+
+	bson_t b; // on stack
+	bson_init_static(&b, subdoc_data, subdoc_len);
+
+	size_t blen;
+	char* json = bson_as_relaxed_extended_json(&b, &blen);
+	text* t = cstring_to_text_with_len(json, blen);
+	bson_free(json);
+	return t;
+    }
+
+    case BSON_TYPE_BINARY: {				
+	bson_subtype_t subtype;
+	uint32_t len;
+	const uint8_t* data;
+    
+	// Output is "\x54252031...", same as bytea; the subtype is not shown.
+	bson_iter_binary (target, &subtype, &len, &data);
+	return _hex_text(data, len);
+    }
+
+    default: {
+	break; // ?
+    }		
+    }
+
+    return NULL;
+}
+
+PG_FUNCTION_INFO_V1(bson_as_text);  // text bson_get(bson, dotpath)
+Datum bson_as_text(PG_FUNCTION_ARGS)
+{
+    BsonPath* dotpath = BSON_GETARG_PATH(1);
+    BsonFetch f;
+
+    bson_iter_t target;
+
+    text* t = 0;
+
+    if(_fetch_path_value(fcinfo, dotpath, BSON_TYPE_EOD, &target, &f)) {
+	t = _iter_as_text(&target);
+    }
+
+    _release_fetch(fcinfo, &f);
+
+    if(t != 0) PG_RETURN_TEXT_P(t); else PG_RETURN_NULL();
+}
+
+
+//
+//  Set-returning functions
+//
+//  bson_array_elements(doc, path) and friends return the items of the
+//  array at path one per call, holding a single bson_iter_t across calls
+//  in the SRF's multi-call context, so there is no jsonb or text in
+//  between and rows stream out as they are found.  bson_each does the same
+//  for the keys of the document at path.  An empty path means the document
+//  itself.  A path that is missing or not an array (not a document or
+//  array, for bson_each) gives no rows, as the getters give NULL.
+//
+typedef enum
+{
+    BSON_SRF_BSON,      // subdocs and subarrays as bson, other items NULL
+    BSON_SRF_TEXT,      // as ->> renders them
+    BSON_SRF_INT8,      // int32 and int64, others NULL
+    BSON_SRF_NUMERIC,   // any number, others NULL
+    BSON_SRF_EACH,      // (key, value bson)
+    BSON_SRF_EACH_TEXT  // (key, value text)
+} BsonSrfKind;
+
+typedef struct
+{
+    bson_t b;          // over the argument; stable for the whole set
+    bson_iter_t iter;  // over the items of the container
+    bool done;
+} BsonSrfState;
+
+// Point iter at the items of the container at path in b.  An empty path
+// is b itself.  False if there is no such container.
+static bool _srf_container(bson_t* b, text* pathtxt, bool any_container, bson_iter_t* iter)
+{
+    bson_iter_t top;
+    if(!bson_iter_init(&top, b)) {
+	ereport(
+	    ERROR,
+	    (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("iter BSON bytes corrupted"))
+	    );
+    }
+
+    if(VARSIZE_ANY_EXHDR(pathtxt) == 0) {
+	*iter = top;
+	return any_container;
+    }
+
+    BsonPath* path = _parse_dotpath(VARDATA_ANY(pathtxt), VARSIZE_ANY_EXHDR(pathtxt));
+    bson_iter_t target;
+    bool rc = false;
+    if(_find_descendant(&top, path, &target)) {
+	bson_type_t ft = bson_iter_type(&target);
+	rc = (ft == BSON_TYPE_ARRAY || (any_container && ft == BSON_TYPE_DOCUMENT))
+	    && bson_iter_recurse(&target, iter);
+    }
+    pfree(path);
+    return rc;
+}
+
+static Datum _srf_item(BsonSrfKind kind, bson_iter_t* it, bool* isnull)
+{
+    bson_type_t ft = bson_iter_type(it);
+    *isnull = false;
+
+    switch(kind) {
+    case BSON_SRF_BSON:
+    case BSON_SRF_EACH: {
+	uint32_t len;
+	const uint8_t* data = NULL;
+	if(ft == BSON_TYPE_DOCUMENT) {
+	    bson_iter_document(it, &len, &data);
+	} else if(ft == BSON_TYPE_ARRAY) {
+	    bson_iter_array(it, &len, &data);
+	}
+	if(data == NULL) {
+	    break;
+	}
+	bytea* aa = (bytea*) palloc(VARHDRSZ + len);
+	SET_VARSIZE(aa, VARHDRSZ + len);
+	memcpy(VARDATA(aa), data, len);
+	return PointerGetDatum(aa);
+    }
+    case BSON_SRF_TEXT:
+    case BSON_SRF_EACH_TEXT: {
+	text* t = _iter_as_text(it);
+	if(t == NULL) {
+	    break;
+	}
+	return PointerGetDatum(t);
+    }
+    case BSON_SRF_INT8: {
+	if(ft == BSON_TYPE_INT32) return Int64GetDatum(bson_iter_int32(it));
+	if(ft == BSON_TYPE_INT64) return Int64GetDatum(bson_iter_int64(it));
+	break;
+    }
+    case BSON_SRF_NUMERIC: {
+	Numeric nm;
+	if(ft == BSON_TYPE_INT32) return NumericGetDatum(int64_to_numeric(bson_iter_int32(it)));
+	if(ft == BSON_TYPE_INT64) return NumericGetDatum(int64_to_numeric(bson_iter_int64(it)));
+	if(ft == BSON_TYPE_DOUBLE) return DirectFunctionCall1(float8_numeric, Float8GetDatum(bson_iter_double(it)));
+	if(ft == BSON_TYPE_DECIMAL128 && _iter_decimal128_numeric(it, &nm)) return NumericGetDatum(nm);
+	break;
+    }
+    }
+
+    *isnull = true;
+    return (Datum) 0;
+}
+
+static Datum _bson_srf(FunctionCallInfo fcinfo, BsonSrfKind kind)
+{
+    FuncCallContext* funcctx;
+    BsonSrfState* st;
+    bool each = (kind == BSON_SRF_EACH || kind == BSON_SRF_EACH_TEXT);
+
+    if(SRF_IS_FIRSTCALL()) {
+	funcctx = SRF_FIRSTCALL_INIT();
+	MemoryContext old = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+	// fn_extra belongs to the SRF machinery here, so the path is parsed
+	// once per set instead of cached.  The detoasted document lives in
+	// the multi-call context with the iterator that points into it.
+	st = (BsonSrfState*) palloc0(sizeof(BsonSrfState));
+	bytea* aa = BSON_GETARG_BSON(0);
+	BSON_STATIC_INIT(&st->b, aa);
+	st->done = !_srf_container(&st->b, PG_GETARG_TEXT_PP(1), each, &st->iter);
+
+	if(each) {
+	    TupleDesc tupdesc;
+	    if(get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
+		ereport(
+		    ERROR,
+		    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		     errmsg("function returning record called in context that cannot accept type record"))
+		    );
+	    }
+	    funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+	}
+
+	funcctx->user_fctx = st;
+	MemoryContextSwitchTo(old);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    st = (BsonSrfState*) funcctx->user_fctx;
+
+    if(!st->done && bson_iter_next(&st->iter)) {
+	bool isnull;
+	Datum d = _srf_item(kind, &st->iter, &isnull);
+
+	if(each) {
+	    Datum values[2];
+	    bool nulls[2] = {false, isnull};
+	    values[0] = PointerGetDatum(mk_text(bson_iter_key(&st->iter)));
+	    values[1] = d;
+	    HeapTuple tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+	    SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+	}
+	if(isnull) {
+	    SRF_RETURN_NEXT_NULL(funcctx);
+	}
+	SRF_RETURN_NEXT(funcctx, d);
+    }
+
+    st->done = true;
+    SRF_RETURN_DONE(funcctx);
+}
+
+PG_FUNCTION_INFO_V1(bson_array_elements);
+Datum bson_array_elements(PG_FUNCTION_ARGS)
+{
+    return _bson_srf(fcinfo, BSON_SRF_BSON);
+}
+
+PG_FUNCTION_INFO_V1(bson_array_elements_text);
+Datum bson_array_elements_text(PG_FUNCTION_ARGS)
+{
+    return _bson_srf(fcinfo, BSON_SRF_TEXT);
+}
+
+PG_FUNCTION_INFO_V1(bson_array_elements_int8);
+Datum bson_array_elements_int8(PG_FUNCTION_ARGS)
+{
+    return _bson_srf(fcinfo, BSON_SRF_INT8);
+}
+
+PG_FUNCTION_INFO_V1(bson_array_elements_numeric);
+Datum bson_array_elements_numeric(PG_FUNCTION_ARGS)
+{
+    return _bson_srf(fcinfo, BSON_SRF_NUMERIC);
+}
+
+PG_FUNCTION_INFO_V1(bson_each);
+Datum bson_each(PG_FUNCTION_ARGS)
+{
+    return _bson_srf(fcinfo, BSON_SRF_EACH);
+}
+
+PG_FUNCTION_INFO_V1(bson_each_text);
+Datum bson_each_text(PG_FUNCTION_ARGS)
+{
+    return _bson_srf(fcinfo, BSON_SRF_EACH_TEXT);
+}
+
+// Row estimate for the SRFs:  exact when the document and path are both
+// constants, otherwise the ROWS given in CREATE FUNCTION.  Each family has
+// its own support function so we know whether to count array items or
+// document keys without looking at the function name.
+static Node* _srf_rows(Node* rawreq, bool each)
+{
+    Node* ret = NULL;
+
+    if(IsA(rawreq, SupportRequestRows)) {
+	SupportRequestRows* req = (SupportRequestRows*) rawreq;
+
+	if(req->node != NULL && IsA(req->node, FuncExpr)) {
+	    FuncExpr* fexpr = (FuncExpr*) req->node;
+
+	    if(list_length(fexpr->args) == 2
+	       && IsA(linitial(fexpr->args), Const) && !((Const*) linitial(fexpr->args))->constisnull
+	       && IsA(lsecond(fexpr->args), Const) && !((Const*) lsecond(fexpr->args))->constisnull) {
+		bytea* aa = DatumGetBson(((Const*) linitial(fexpr->args))->constvalue);
+		text* path = DatumGetTextPP(((Const*) lsecond(fexpr->args))->constvalue);
+
+		bson_t b; // on stack
+		BSON_STATIC_INIT(&b, aa);
+		bson_iter_t iter;
+		double n = 0;
+		if(_srf_container(&b, path, each, &iter)) {
+		    while(bson_iter_next(&iter)) n++;
+		}
+
+		req->rows = n;
+		ret = (Node*) req;
+	    }
+	}
+    }
+
+    return ret;
+}
+
+PG_FUNCTION_INFO_V1(bson_array_elements_support);
+Datum bson_array_elements_support(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_POINTER(_srf_rows((Node*) PG_GETARG_POINTER(0), false));
+}
+
+PG_FUNCTION_INFO_V1(bson_each_support);
+Datum bson_each_support(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_POINTER(_srf_rows((Node*) PG_GETARG_POINTER(0), true));
+}
+
+
+//
+//  Path hashing
+//
+//  bson_path_hash(doc, path) and bson_path_equal(doc1, path1, doc2, path2)
+//  are for joining on an embedded key without first pulling it out into a
+//  text or numeric Datum.  Both work on the raw BSON value bytes in place,
+//  with the type tag folded in, so like == they are "same bytes, same type"
+//  and int32 1 is NOT equal to double 1.0.  A path that is not there gives
+//  NULL, just like bson_get_string() et al.
+//
+static bool _find_path_value(bytea* aa, BsonPath* path, bson_iter_t* target)
+{
+    bson_t b; // on stack
+    BSON_STATIC_INIT(&b,aa);
+
+    bson_iter_t iter;
+    if(!bson_iter_init(&iter, &b)) {
+	ereport(
+	    ERROR,
+	    (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("path BSON bytes corrupted"))
+	    );
+    }
+    return _find_descendant(&iter, path, target);
+}
+
+PG_FUNCTION_INFO_V1(bson_path_hash);  // int4 bson_path_hash(bson, dotpath)
+Datum bson_path_hash(PG_FUNCTION_ARGS)
+{
+    bytea* aa = BSON_GETARG_BSON(0);
+    BsonPath* dotpath = BSON_GETARG_PATH(1);
+
+    bson_iter_t target;
+    bool found = _find_path_value(aa, dotpath, &target);
+
+    uint32 h = 0;
+    if(found) {
+	uint32_t len;
+	const uint8_t* p = _iter_value_bytes(&target, &len);
+	h = hash_combine(DatumGetUInt32(hash_any(p, len)), (uint32) bson_iter_type(&target));
+    }
+
+    PG_FREE_IF_COPY(aa,0);
+
+    if(!found) PG_RETURN_NULL();
+
+    PG_RETURN_INT32((int32) h);
+}
+
+PG_FUNCTION_INFO_V1(bson_path_equal);  // bool bson_path_equal(bson, dotpath, bson, dotpath)
+Datum bson_path_equal(PG_FUNCTION_ARGS)
+{
+    bytea* aa = BSON_GETARG_BSON(0);
+    bytea* bb = BSON_GETARG_BSON(2);
+
+    // Two paths so fn_extra holds a pair of cached BsonPath:
+    if(fcinfo->flinfo->fn_extra == NULL) {
+	fcinfo->flinfo->fn_extra = MemoryContextAllocZero(fcinfo->flinfo->fn_mcxt,
+							  2 * sizeof(BsonPath*));
+    }
+    BsonPath** paths = (BsonPath**) fcinfo->flinfo->fn_extra;
+    BsonPath* p1 = _refresh_cached_path(fcinfo->flinfo, &paths[0], PG_GETARG_TEXT_PP(1));
+    BsonPath* p2 = _refresh_cached_path(fcinfo->flinfo, &paths[1], PG_GETARG_TEXT_PP(3));
+
+    bson_iter_t t1;
+    bson_iter_t t2;
+    bool found = _find_path_value(aa, p1, &t1) && _find_path_value(bb, p2, &t2);
+
+    bool rc = false;
+    if(found && bson_iter_type(&t1) == bson_iter_type(&t2)) {
+	uint32_t l1, l2;
+	const uint8_t* v1 = _iter_value_bytes(&t1, &l1);
+	const uint8_t* v2 = _iter_value_bytes(&t2, &l2);
+	rc = (l1 == l2 && memcmp(v1, v2, l1) == 0);
+    }
+
+    PG_FREE_IF_COPY(aa,0);
+    PG_FREE_IF_COPY(bb,2);
+
+    if(!found) PG_RETURN_NULL();
+
+    PG_RETURN_BOOL(rc);
+}
+
+//
+//  Multi-path extraction
+//
+//  bson_extract(bson, text[]) resolves N dotpaths in ONE walk of the
+//  document:  detoast once, init once, and at each level look at each
+//  element once, handing it to every path whose next segment matches.
+//  Paths with a common prefix therefore share the descent.  As with
+//  bson_iter_find_descendant, the first matching key at each level wins.
+//
+
+// Walk the container at iter once.  pending holds the indexes (into paths)
+// of the paths still looking for a match at this depth.
+static void _find_paths(bson_iter_t* iter, BsonPath** paths, int* pending, int npending, int depth,
+			bson_iter_t* found, bool* isfound)
+{
+    check_stack_depth();
+
+    int* next = (int*) palloc(npending * sizeof(int));
+
+    while(npending > 0 && bson_iter_next(iter)) {
+	const char* key = bson_iter_key(iter);
+	int nnext = 0;
+
+	for(int k = 0; k < npending; k++) {
+	    BsonPath* p = paths[pending[k]];
+	    int seglen = p->seglens[depth];
+
+	    if(strncmp(key, p->segs[depth], seglen) == 0 && key[seglen] == '\0') {
+		if(depth == p->nsegs - 1) {
+		    found[pending[k]] = *iter;
+		    isfound[pending[k]] = true;
+		} else {
+		    next[nnext++] = pending[k];
+		}
+		// First match wins; this path is done at this level:
+		pending[k--] = pending[--npending];
+	    }
+	}
+
+	if(nnext > 0 && (BSON_ITER_HOLDS_DOCUMENT(iter) || BSON_ITER_HOLDS_ARRAY(iter))) {
+	    bson_iter_t child;
+	    if(bson_iter_recurse(iter, &child)) {
+		_find_paths(&child, paths, next, nnext, depth + 1, found, isfound);
+	    }
+	}
+    }
+
+    pfree(next);
+}
+
+// Turn the value at target into a Datum of type typid using the same
+// rules as the bson_get_{type} functions:  wrong BSON type means NULL.
+static Datum _iter_to_datum(bson_iter_t* target, Oid typid, Oid bsontypid, bool* isnull)
+{
+    bson_type_t ft = bson_iter_type(target);
+
+    *isnull = false;
+
+    switch(typid) {
+    case TEXTOID: {
+	text* t = _iter_as_text(target);
+	if(t != 0) return PointerGetDatum(t);
+	break;
+    }
+    case INT4OID: {
+	if(ft == BSON_TYPE_INT32) return Int32GetDatum(bson_iter_int32(target));
+	break;
+    }
+    case INT8OID: {
+	if(ft == BSON_TYPE_INT64) return Int64GetDatum(bson_iter_int64(target));
+	break;
+    }
+    case FLOAT8OID: {
+	if(ft == BSON_TYPE_DOUBLE) return Float8GetDatum(bson_iter_double(target));
+	break;
+    }
+    case BOOLOID: {
+	if(ft == BSON_TYPE_BOOL) return BoolGetDatum(bson_iter_bool(target));
+	break;
+    }
+    case NUMERICOID: {
+	Numeric nm;
+	if(ft == BSON_TYPE_DECIMAL128 && _iter_decimal128_numeric(target, &nm)) {
+	    return NumericGetDatum(nm);
+	}
+	break;
+    }
+    case TIMESTAMPOID:
+    case TIMESTAMPTZOID: {
+	if(ft == BSON_TYPE_DATE_TIME) {
+	    return TimestampGetDatum(_cvt_datetime_to_ts(bson_iter_date_time(target)));
+	}
+	break;
+    }
+    case BYTEAOID: {
+	if(ft == BSON_TYPE_BINARY) return PointerGetDatum(_iter_binary_bytea(target));
+	break;
+    }
+    default: {
+	if(typid != JSONBOID && typid != bsontypid) {
+	    ereport(
+		ERROR,
+		(errcode(ERRCODE_DATATYPE_MISMATCH),
+		 errmsg("bson_extract cannot return type %s", format_type_be(typid)))
+		);
+	}
+	if(ft == BSON_TYPE_DOCUMENT || ft == BSON_TYPE_ARRAY) {
+	    uint32_t subdoc_len;
+	    const uint8_t* subdoc_data;
+	    bson_t child; // on stack
+	    
+	    if(ft == BSON_TYPE_DOCUMENT) {
+		bson_iter_document(target, &subdoc_len, &subdoc_data);
+	    } else {
+		bson_iter_array(target, &subdoc_len, &subdoc_data);
+	    }
+	    bson_init_static(&child, subdoc_data, subdoc_len);
+
+	    if(typid == JSONBOID) {
+		return JsonbPGetDatum(_bson_to_jsonb(&child, ft == BSON_TYPE_ARRAY));
+	    }
+	    return PointerGetDatum(mk_palloc_bytea(&child));
+	}
+    }
+    }
+
+    *isnull = true;
+    return (Datum) 0;
+}
+
+
+// The bson_extract flavor of the fn_extra path cache:  the whole text[]
+// is kept (it is usually a constant) along with each parsed path.  A
+// NULL element in the array gives a NULL path, which always yields NULL.
+typedef struct
+{
+    ArrayType* arr;
+    int npaths;
+    BsonPath** paths;
+} BsonExtractPaths;
+
+static BsonExtractPaths* _get_cached_extract_paths(FunctionCallInfo fcinfo, ArrayType* patharr)
+{
+    BsonExtractPaths* xp = (BsonExtractPaths*) fcinfo->flinfo->fn_extra;
+
+    if(xp != NULL
+       && VARSIZE(xp->arr) == VARSIZE(patharr)
+       && memcmp(xp->arr, patharr, VARSIZE(patharr)) == 0) {
+	return xp;
+    }
+
+    MemoryContext old = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+
+    if(xp != NULL) {
+	for(int i = 0; i < xp->npaths; i++) {
+	    if(xp->paths[i] != NULL) pfree(xp->paths[i]);
+	}
+	pfree(xp->paths);
+	pfree(xp->arr);
+	pfree(xp);
+    }
+
+    Datum* pathdatums;
+    bool* pathnulls;
+    int npaths;
+    deconstruct_array(patharr, TEXTOID, -1, false, TYPALIGN_INT, &pathdatums, &pathnulls, &npaths);
+
+    xp = (BsonExtractPaths*) palloc(sizeof(BsonExtractPaths));
+    xp->arr = (ArrayType*) palloc(VARSIZE(patharr));
+    memcpy(xp->arr, patharr, VARSIZE(patharr));
+    xp->npaths = npaths;
+    xp->paths = (BsonPath**) palloc(npaths * sizeof(BsonPath*));
+
+    for(int i = 0; i < npaths; i++) {
+	xp->paths[i] = NULL;
+	if(!pathnulls[i]) {
+	    text* dotpath = DatumGetTextPP(pathdatums[i]);
+	    xp->paths[i] = _parse_dotpath(VARDATA_ANY(dotpath), VARSIZE_ANY_EXHDR(dotpath));
+	}
+    }
+    pfree(pathdatums);
+    pfree(pathnulls);
+
+    MemoryContextSwitchTo(old);
+
+    fcinfo->flinfo->fn_extra = xp;
+
+    return xp;
+}
+
+
+// record bson_extract(bson, text[])
+// The caller supplies the column names and types, e.g.
+//   select x.* from btest,
+//     bson_extract(data, array['d.recordId','d.amt','d.ts']) as x(id text, amt numeric, ts timestamp);
+PG_FUNCTION_INFO_V1(bson_extract);
+Datum bson_extract(PG_FUNCTION_ARGS)
+{
+    bytea* aa = BSON_GETARG_BSON(0);
+    ArrayType* patharr = PG_GETARG_ARRAYTYPE_P(1);
+
+    TupleDesc tupdesc;
+    if(get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
+	ereport(
+	    ERROR,
+	    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+	     errmsg("bson_extract must be called with a column definition list"))
+	    );
+    }
+    tupdesc = BlessTupleDesc(tupdesc);
+
+    BsonExtractPaths* xp = _get_cached_extract_paths(fcinfo, patharr);
+    int npaths = xp->npaths;
+
+    if(npaths != tupdesc->natts) {
+	ereport(
+	    ERROR,
+	    (errcode(ERRCODE_DATATYPE_MISMATCH),
+	     errmsg("bson_extract got %d paths but %d result columns", npaths, tupdesc->natts))
+	    );
+    }
+
+    // _find_paths consumes pending so the cached one cannot be used directly:
+    int* pending = (int*) palloc(npaths * sizeof(int));
+    int npending = 0;
+    bson_iter_t* found = (bson_iter_t*) palloc(npaths * sizeof(bson_iter_t));
+    bool* isfound = (bool*) palloc0(npaths * sizeof(bool));
+
+    for(int i = 0; i < npaths; i++) {
+	if(xp->paths[i] != NULL) {
+	    pending[npending++] = i;
+	}
+    }
+
+    bson_t b; // on stack
+    BSON_STATIC_INIT(&b,aa);
+
+    bson_iter_t iter;
+    if(!bson_iter_init(&iter, &b)) {
+	ereport(
+	    ERROR,
+	    (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("iter BSON bytes corrupted"))
+	    );
+    }
+    _find_paths(&iter, xp->paths, pending, npending, 0, found, isfound);
+
+    Oid bsontypid = get_fn_expr_argtype(fcinfo->flinfo, 0);
+    Datum* values = (Datum*) palloc(npaths * sizeof(Datum));
+    bool* nulls = (bool*) palloc(npaths * sizeof(bool));
+
+    for(int i = 0; i < npaths; i++) {
+	if(isfound[i]) {
+	    values[i] = _iter_to_datum(&found[i], TupleDescAttr(tupdesc, i)->atttypid, bsontypid, &nulls[i]);
+	} else {
+	    values[i] = (Datum) 0;
+	    nulls[i] = true;
+	}
+    }
+
+    // All values are palloc'd copies now; ok to let go of the source.
+    HeapTuple tuple = heap_form_tuple(tupdesc, values, nulls);
+
+    PG_FREE_IF_COPY(aa,0);
+
+    PG_RETURN_DATUM(HeapTupleGetDatum(tuple));
+}
+
+
+//
+//  Hot fields first
+//
+//  Lookups scan each level in order, so a field's cost grows with its
+//  position.  bson_reorder(doc, paths) rewrites doc so that, at every
+//  level named by the paths, the named keys come first (in the order
+//  given) and everything else follows in its original order.  Arrays are
+//  never reordered but the documents inside them are, e.g. with
+//  'pmts.0.amt' only the first item gets amt moved up.
+//
+//  pgbson.hot_paths applies the same thing to every document coming in
+//  through bson_in, the binary receive, and the bytea::bson cast.  It
+//  changes the bytes those IMMUTABLE functions return, so it is SIGHUP
+//  (postgresql.conf or ALTER SYSTEM only):  one order for the whole
+//  server, never per database, role or session.  It is a storage setting;
+//  rows and plans from before a change keep the order they were made with.
+//
+
+// Does segment d of path name element key (the nth item of its container)?
+static bool _path_seg_matches(BsonPath* path, int d, const char* key, int nth, bool in_array)
+{
+    if(in_array && path->idx[d] >= 0) {
+	return path->idx[d] == nth;
+    }
+    return strncmp(key, path->segs[d], path->seglens[d]) == 0 && key[path->seglens[d]] == '\0';
+}
+
+static void _reorder_container(bson_iter_t* src, bson_t* dst, BsonPath** paths,
+			       int* pending, int npending, int depth, bool is_array);
+
+// Copy the element at iter into dst, reordering inside it for the paths
+// in kids (which all go deeper than depth).
+static void _reorder_element(bson_iter_t* iter, bson_t* dst, BsonPath** paths,
+			     int* kids, int nkids, int depth)
+{
+    bson_type_t ft = bson_iter_type(iter);
+
+    if(nkids == 0 || (ft != BSON_TYPE_DOCUMENT && ft != BSON_TYPE_ARRAY)) {
+	bson_append_iter(dst, NULL, 0, iter);
+	return;
+    }
+
+    bson_iter_t child_src;
+    bson_t child;
+    if(!bson_iter_recurse(iter, &child_src)) {
+	ereport(
+	    ERROR,
+	    (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("BSON iter bytes corrupted in reorder"))
+	    );
+    }
+    const char* key = bson_iter_key(iter);
+    if(ft == BSON_TYPE_ARRAY) {
+	bson_append_array_begin(dst, key, -1, &child);
+	_reorder_container(&child_src, &child, paths, kids, nkids, depth + 1, true);
+	bson_append_array_end(dst, &child);
+    } else {
+	bson_append_document_begin(dst, key, -1, &child);
+	_reorder_container(&child_src, &child, paths, kids, nkids, depth + 1, false);
+	bson_append_document_end(dst, &child);
+    }
+}
+
+// The paths that continue below the element (key, nth) at depth.
+static int _reorder_kids(BsonPath** paths, int* pending, int npending, int depth,
+			 const char* key, int nth, bool in_array, int* kids)
+{
+    int nkids = 0;
+    for(int j = 0; j < npending; j++) {
+	BsonPath* path = paths[pending[j]];
+	if(path->nsegs > depth + 1 && _path_seg_matches(path, depth, key, nth, in_array)) {
+	    kids[nkids++] = pending[j];
+	}
+    }
+    return nkids;
+}
+
+static void _reorder_container(bson_iter_t* src, bson_t* dst, BsonPath** paths,
+			       int* pending, int npending, int depth, bool is_array)
+{
+    check_stack_depth();
+
+    int* kids = (int*) palloc(npending * sizeof(int));
+    bson_iter_t iter;
+
+    if(is_array) {
+	// Keep the order; just look inside the items.
+	iter = *src;
+	for(int nth = 0; bson_iter_next(&iter); nth++) {
+	    const char* key = bson_iter_key(&iter);
+	    int nkids = _reorder_kids(paths, pending, npending, depth, key, nth, true, kids);
+	    _reorder_element(&iter, dst, paths, kids, nkids, depth);
+	}
+	pfree(kids);
+	return;
+    }
+
+    // The hot keys, in the order the paths first mention them:
+    int* hot = (int*) palloc(npending * sizeof(int));
+    int nhot = 0;
+    for(int j = 0; j < npending; j++) {
+	BsonPath* pj = paths[pending[j]];
+	bool dup = false;
+	for(int h = 0; h < nhot && !dup; h++) {
+	    BsonPath* ph = paths[hot[h]];
+	    dup = (ph->seglens[depth] == pj->seglens[depth]
+		   && memcmp(ph->segs[depth], pj->segs[depth], pj->seglens[depth]) == 0);
+	}
+	if(!dup) {
+	    hot[nhot++] = pending[j];
+	}
+    }
+
+    // One pass per hot key, then one for the rest.  nhot is small.
+    for(int h = 0; h < nhot; h++) {
+	iter = *src;
+	while(bson_iter_next(&iter)) {
+	    const char* key = bson_iter_key(&iter);
+	    if(_path_seg_matches(paths[hot[h]], depth, key, 0, false)) {
+		int nkids = _reorder_kids(paths, pending, npending, depth, key, 0, false, kids);
+		_reorder_element(&iter, dst, paths, kids, nkids, depth);
+	    }
+	}
+    }
+
+    iter = *src;
+    while(bson_iter_next(&iter)) {
+	const char* key = bson_iter_key(&iter);
+	bool is_hot = false;
+	for(int h = 0; h < nhot && !is_hot; h++) {
+	    is_hot = _path_seg_matches(paths[hot[h]], depth, key, 0, false);
+	}
+	if(!is_hot) {
+	    bson_append_iter(dst, NULL, 0, &iter);
+	}
+    }
+
+    pfree(hot);
+    pfree(kids);
+}
+
+// Returns a new bson with the hot paths first.  NULL paths are ignored.
+static bytea* _bson_reorder(const uint8_t* data, uint32 len, BsonPath** paths, int npaths)
+{
+    bson_t b; // on stack
+    bson_iter_t iter;
+    if(!bson_init_static(&b, data, len) || !bson_iter_init(&iter, &b)) {
+	ereport(
+	    ERROR,
+	    (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("iter BSON bytes corrupted in reorder"))
+	    );
+    }
+
+    int* pending = (int*) palloc((npaths + 1) * sizeof(int));
+    int npending = 0;
+    for(int i = 0; i < npaths; i++) {
+	if(paths[i] != NULL && paths[i]->nsegs > 0) {
+	    pending[npending++] = i;
+	}
+    }
+
+    uint8_t* buf;
+    size_t buflen;
+    bson_t* dst;
+    bson_writer_t* writer = _begin_varlena_writer(&buf, &buflen, VARHDRSZ + len, &dst);
+
+    _reorder_container(&iter, dst, paths, pending, npending, 0, false);
+
+    pfree(pending);
+
+    return _end_varlena_writer(writer, &buf);
+}
+
+PG_FUNCTION_INFO_V1(bson_reorder);  // bson bson_reorder(bson, text[])
+Datum bson_reorder(PG_FUNCTION_ARGS)
+{
+    bytea* aa = BSON_GETARG_BSON(0);
+    BsonExtractPaths* xp = _get_cached_extract_paths(fcinfo, PG_GETARG_ARRAYTYPE_P(1));
+
+    bytea* bb = _bson_reorder(BSON_VARDATA_ANY(aa), BSON_VARSIZE_ANY_EXHDR(aa), xp->paths, xp->npaths);
+
+    PG_FREE_IF_COPY(aa,0);
+
+    PG_RETURN_BYTEA_P(bb);
+}
+
+// pgbson.hot_paths in parsed form.  check_hot_paths builds it as the GUC
+// "extra" (one malloc'd block: the header, the pointer list, then each
+// BsonPath MAXALIGNed), assign_hot_paths only swaps the pointer, so a bad
+// or failed parse never leaves a half built list behind.
+typedef struct {
+    int n;
+    BsonPath* paths[FLEXIBLE_ARRAY_MEMBER];
+} BsonHotPaths;
+
+static BsonHotPaths* bson_hot_path_list = NULL;
+
+// Calls f(start, len, arg) for each path in the comma separated setting;
+// blanks around each path are ignored.
+static void _each_hot_path(const char* setting, void (*f)(const char*, int, void*), void* arg)
+{
+    const char* p = setting;
+    while(*p) {
+	while(*p == ' ' || *p == ',') p++;
+	const char* start = p;
+	while(*p && *p != ',') p++;
+	const char* end = p;
+	while(end > start && end[-1] == ' ') end--;
+	if(end > start) {
+	    f(start, end - start, arg);
+	}
+    }
+}
+
+typedef struct {
+    int n;
+    Size bytes;
+} HotPathsSize;
+
+static void _hot_path_size(const char* start, int len, void* arg)
+{
+    HotPathsSize* sz = (HotPathsSize*) arg;
+    sz->n++;
+    sz->bytes += MAXALIGN(_dotpath_size(start, len));
+}
+
+typedef struct {
+    BsonHotPaths* hp;
+    char* next;
+} HotPathsFill;
+
+static void _hot_path_fill(const char* start, int len, void* arg)
+{
+    HotPathsFill* fill = (HotPathsFill*) arg;
+    fill->hp->paths[fill->hp->n++] = _dotpath_fill(fill->next, start, len);
+    fill->next += MAXALIGN(_dotpath_size(start, len));
+}
+
+static bool check_hot_paths(char** newval, void** extra, GucSource source)
+{
+    const char* setting = (*newval == NULL) ? "" : *newval;
+
+    HotPathsSize sz = {0, 0};
+    _each_hot_path(setting, _hot_path_size, &sz);
+
+    Size head = MAXALIGN(offsetof(BsonHotPaths, paths) + sz.n * sizeof(BsonPath*));
+    // extra must come from the allocator guc.c releases it with:  from
+    // PG16 that is guc_free() (a pfree in its own context), before that
+    // plain free().
+#if PG_VERSION_NUM >= 160000
+    char* block = (char*) guc_malloc(LOG, head + sz.bytes);
+#else
+    char* block = (char*) malloc(head + sz.bytes);
+#endif
+    if(block == NULL) {
+	GUC_check_errcode(ERRCODE_OUT_OF_MEMORY);
+	return false;
+    }
+
+    HotPathsFill fill = {(BsonHotPaths*) block, block + head};
+    fill.hp->n = 0;
+    _each_hot_path(setting, _hot_path_fill, &fill);
+
+    *extra = block;
+    return true;
+}
+
+static void assign_hot_paths(const char* newval, void* extra)
+{
+    bson_hot_path_list = (BsonHotPaths*) extra;
+}
+
+// Used on the way in:  aa reordered per pgbson.hot_paths, or aa itself
+// when there is nothing to do.
+static bytea* _apply_hot_paths(bytea* aa)
+{
+    if(bson_hot_path_list == NULL || bson_hot_path_list->n == 0) {
+	return aa;
+    }
+    return _bson_reorder((const uint8_t*) VARDATA_ANY(aa), VARSIZE_ANY_EXHDR(aa),
+			 bson_hot_path_list->paths, bson_hot_path_list->n);
+}
+
+
+//
+//  Modification
+//
+//  bson_set, bson_unset, bson_array_append and bson_merge build the new
+//  document by splicing:  everything before and after the change is
+//  copied with one memcpy each, so untouched subtrees come out byte for
+//  byte, and only the length prefixes of the enclosing containers are
+//  patched.  The walk down the path is the same byte scan as the sliced
+//  getters (_slice_value_size), with the whole document in hand.
+//
+
+// A SQL value on its way into BSON; see _append_sql_value.
+typedef struct
+{
+    Datum d;
+    bool isnull;
+    Oid typid;
+    Oid bsontypid;  // our bson type, so bson values become subdocuments
+} BsonSqlValue;
+
+// Timestamp -> BSON datetime millis, rounding toward -infinity.
+static int64 _cvt_ts_to_datetime(Timestamp ts)
+{
+    static const int64 epoch_diff_millis =
+	(int64) (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * SECS_PER_DAY * 1000;
+
+    if(TIMESTAMP_NOT_FINITE(ts)) {
+	ereport(
+	    ERROR,
+	    (errcode(ERRCODE_DATETIME_VALUE_OUT_OF_RANGE), errmsg("timestamp out of range"))
+	    );
+    }
+    int64 ms = ts / 1000;
+    if(ts % 1000 < 0) {
+	ms--;
+    }
+    return ms + epoch_diff_millis;
+}
+
+static void _append_sql_value(bson_t* dst, const char* key, int keylen, const BsonSqlValue* sv)
+{
+    if(sv->isnull) {
+	bson_append_null(dst, key, keylen);
+	return;
+    }
+
+    Datum d = sv->d;
+    switch(sv->typid) {
+    case BOOLOID:
+	bson_append_bool(dst, key, keylen, DatumGetBool(d));
+	break;
+    case INT2OID:
+	bson_append_int32(dst, key, keylen, DatumGetInt16(d));
+	break;
+    case INT4OID:
+	bson_append_int32(dst, key, keylen, DatumGetInt32(d));
+	break;
+    case INT8OID:
+	bson_append_int64(dst, key, keylen, DatumGetInt64(d));
+	break;
+    case FLOAT4OID:
+	bson_append_double(dst, key, keylen, DatumGetFloat4(d));
+	break;
+    case FLOAT8OID:
+	bson_append_double(dst, key, keylen, DatumGetFloat8(d));
+	break;
+    case NUMERICOID: {
+	char* s = DatumGetCString(DirectFunctionCall1(numeric_out, d));
+	bson_decimal128_t dec;
+	if(!bson_decimal128_from_string(s, &dec)) {
+	    ereport(
+		ERROR,
+		(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE), errmsg("numeric %s does not fit in decimal128", s))
+		);
+	}
+	bson_append_decimal128(dst, key, keylen, &dec);
+	pfree(s);
+	break;
+    }
+    case TIMESTAMPOID:
+    case TIMESTAMPTZOID:
+	bson_append_date_time(dst, key, keylen, _cvt_ts_to_datetime(DatumGetTimestamp(d)));
+	break;
+    case TEXTOID:
+    case VARCHAROID:
+    case BPCHAROID: {
+	text* t = DatumGetTextPP(d);
+	bson_append_utf8(dst, key, keylen, VARDATA_ANY(t), VARSIZE_ANY_EXHDR(t));
+	break;
+    }
+    case BYTEAOID: {
+	bytea* bb = DatumGetByteaPP(d);
+	bson_append_binary(dst, key, keylen, BSON_SUBTYPE_BINARY,
+			   (const uint8_t*) VARDATA_ANY(bb), VARSIZE_ANY_EXHDR(bb));
+	break;
+    }
+    case JSONBOID: {
+	Jsonb* jb = DatumGetJsonbP(d);
+	JsonbValue jv;
+	if(JB_ROOT_IS_SCALAR(jb)) {
+	    (void) JsonbExtractScalar(&jb->root, &jv);
+	} else {
+	    jv.type = jbvBinary;
+	    jv.val.binary.data = &jb->root;
+	    jv.val.binary.len = VARSIZE(jb) - VARHDRSZ;
+	}
+	_append_jsonb_value(dst, key, keylen, &jv);
+	break;
+    }
+    default: {
+	if(sv->typid != sv->bsontypid) {
+	    ereport(
+		ERROR,
+		(errcode(ERRCODE_DATATYPE_MISMATCH),
+		 errmsg("cannot store type %s in bson", format_type_be(sv->typid)))
+		);
+	}
+	bytea* aa = DatumGetBson(d);
+	bson_t child; // on stack
+	BSON_STATIC_INIT(&child, aa);
+	bson_append_document(dst, key, keylen, &child);
+	break;
+    }
+    }
+}
+
+// Make the element bytes (type, key, value) for key in a temporary doc;
+// the element is bson_get_data(tmp) + 4 for tmp->len - 5 bytes.  segs
+// d+1 .. nsegs-1 of path, if any, become nested documents around the
+// value.  as_array puts the value in a one-item array.
+static void _make_element(bson_t* tmp, const char* key, int keylen, BsonPath* path, int d,
+			  const BsonSqlValue* sv, bool as_array)
+{
+    bson_t child; // on stack
+
+    if(d + 1 < path->nsegs) {
+	bson_append_document_begin(tmp, key, keylen, &child);
+	_make_element(&child, path->segs[d + 1], path->seglens[d + 1], path, d + 1, sv, as_array);
+	bson_append_document_end(tmp, &child);
+    } else if(as_array) {
+	bson_append_array_begin(tmp, key, keylen, &child);
+	_append_sql_value(&child, "0", 1, sv);
+	bson_append_array_end(tmp, &child);
+    } else {
+	_append_sql_value(tmp, key, keylen, sv);
+    }
+}
+
+typedef struct
+{
+    int ncont;
+    uint32* cont;   // offsets of the enclosing containers, outermost first
+    bool in_array;  // innermost container is an array
+    int depth;      // segment the walk stopped at
+    bool found;
+    uint8_t etype;  // found:  the element at [eoff, eend), value at voff
+    uint32 eoff;
+    uint32 eend;
+    uint32 voff;
+    bool blocked;   // not found because a segment hit a scalar
+    uint32 nitems;  // not found:  items in the innermost container ...
+    uint32 end;     // ... and the offset of its trailing NUL
+} BsonSpot;
+
+static void _splice_corrupt(void)
+{
+    ereport(
+	ERROR,
+	(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("BSON bytes corrupted"))
+	);
+}
+
+static void _splice_walk(const uint8_t* data, uint32 len, BsonPath* path, BsonSpot* s)
+{
+    uint32 c = 0;
+    bool in_array = false;
+
+    memset(s, 0, sizeof(BsonSpot));
+    s->cont = (uint32*) palloc((path->nsegs + 1) * sizeof(uint32));
+
+    for(int d = 0; d < path->nsegs; d++) {
+	if(c + 5 > len) _splice_corrupt();
+	int64 cend = c + (int64) _slice_int32(data + c);
+	if(cend > len || cend < c + 5) _splice_corrupt();
+
+	s->cont[s->ncont++] = c;
+	s->in_array = in_array;
+	s->depth = d;
+
+	uint32 pos = c + 4;
+	uint32 nth = 0;
+	bool descended = false;
+	while(!descended) {
+	    if(pos >= cend) _splice_corrupt();
+	    uint8_t t = data[pos];
+	    if(t == 0) {
+		s->nitems = nth;
+		s->end = pos;
+		return;
+	    }
+
+	    const uint8_t* kend = memchr(data + pos + 1, '\0', cend - pos - 1);
+	    if(kend == NULL) _splice_corrupt();
+	    int keylen = (const char*) kend - (const char*) (data + pos + 1);
+	    uint32 v = (kend + 1) - data;
+	    int64 sz = _slice_value_size(data, cend, v, t);
+	    if(sz < 0) _splice_corrupt();
+
+	    bool match;
+	    if(in_array && path->idx[d] >= 0) {
+		match = (nth == (uint32) path->idx[d]);
+	    } else {
+		match = (keylen == path->seglens[d] && memcmp(data + pos + 1, path->segs[d], keylen) == 0);
+	    }
+
+	    if(match) {
+		if(d == path->nsegs - 1) {
+		    s->found = true;
+		    s->etype = t;
+		    s->eoff = pos;
+		    s->eend = v + sz;
+		    s->voff = v;
+		    return;
+		}
+		if(t != BSON_TYPE_DOCUMENT && t != BSON_TYPE_ARRAY) {
+		    s->blocked = true;
+		    return;
+		}
+		in_array = (t == BSON_TYPE_ARRAY);
+		c = v;
+		descended = true;
+	    }
+
+	    nth++;
+	    pos = v + sz;
+	}
+    }
+}
+
+static void _patch_len(uint8_t* p, int64 delta)
+{
+    uint32 le = BSON_UINT32_TO_LE((uint32) (_slice_int32(p) + delta));
+    memcpy(p, &le, 4);
+}
+
+// The len bytes at data with [cut_start, cut_end) replaced by ins, and
+// the length prefixes at s->cont (and extra, unless 0) adjusted.
+static bytea* _splice(const uint8_t* data, uint32 len, const BsonSpot* s, uint32 extra,
+		      uint32 cut_start, uint32 cut_end, const uint8_t* ins, uint32 inslen)
+{
+    int64 delta = (int64) inslen - (int64) (cut_end - cut_start);
+    int64 newlen = (int64) len + delta;
+    if(newlen > PG_INT32_MAX || !AllocSizeIsValid(VARHDRSZ + newlen)) {
+	ereport(
+	    ERROR,
+	    (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED), errmsg("bson document would be too large"))
+	    );
+    }
+
+    bytea* aa = (bytea*) palloc(VARHDRSZ + newlen);
+    SET_VARSIZE(aa, VARHDRSZ + newlen);
+    uint8_t* p = (uint8_t*) VARDATA(aa);
+
+    memcpy(p, data, cut_start);
+    memcpy(p + cut_start, ins, inslen);
+    memcpy(p + cut_start + inslen, data + cut_end, len - cut_end);
+
+    for(int i = 0; i < s->ncont; i++) {
+	_patch_len(p + s->cont[i], delta);
+    }
+    if(extra != 0) {
+	_patch_len(p + extra, delta);
+    }
+
+    return aa;
+}
+
+static void _modify_error(BsonPath* path, const char* why)
+{
+    ereport(
+	ERROR,
+	(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+	 errmsg("cannot modify bson at \"%.*s\": %s", path->len, path->raw, why))
+	);
+}
+
+// Common to bson_set and bson_array_append.  The value is the third
+// argument; NULL means BSON null.  Other NULL arguments give NULL.
+static Datum _bson_modify(FunctionCallInfo fcinfo, bool append)
+{
+    if(PG_ARGISNULL(0) || PG_ARGISNULL(1)) {
+	PG_RETURN_NULL();
+    }
+
+    bytea* aa = BSON_GETARG_BSON(0);
+    BsonPath* path = BSON_GETARG_PATH(1);
+    const uint8_t* data = BSON_VARDATA_ANY(aa);
+    uint32 len = BSON_VARSIZE_ANY_EXHDR(aa);
+
+    BsonSqlValue sv;
+    sv.isnull = PG_ARGISNULL(2);
+    sv.d = sv.isnull ? (Datum) 0 : PG_GETARG_DATUM(2);
+    sv.typid = get_fn_expr_argtype(fcinfo->flinfo, 2);
+    sv.bsontypid = get_fn_expr_argtype(fcinfo->flinfo, 0);
+
+    if(path->nsegs == 0) {
+	_modify_error(path, "empty dotpath");
+    }
+
+    BsonSpot s;
+    _splice_walk(data, len, path, &s);
+    if(s.blocked) {
+	_modify_error(path, "a parent is not a document or array");
+    }
+
+    bson_t tmp;
+    bson_init(&tmp);
+    uint32 cut_start;
+    uint32 cut_end;
+    uint32 extra = 0;
+
+    if(s.found && append) {
+	if(s.etype != BSON_TYPE_ARRAY) {
+	    bson_destroy(&tmp);
+	    _modify_error(path, "not an array");
+	}
+	// Count the items to get the next key; the element goes in front
+	// of the array's trailing NUL.
+	uint32 alen = (uint32) _slice_int32(data + s.voff);
+	uint32 n = 0;
+	uint32 pos = s.voff + 4;
+	while(data[pos] != 0) {
+	    const uint8_t* kend = memchr(data + pos + 1, '\0', s.voff + alen - pos - 1);
+	    if(kend == NULL) _splice_corrupt();
+	    uint32 v = (kend + 1) - data;
+	    int64 sz = _slice_value_size(data, s.voff + alen, v, data[pos]);
+	    if(sz < 0) _splice_corrupt();
+	    pos = v + sz;
+	    n++;
+	}
+	char idxbuf[16];
+	const char* key;
+	int keylen = bson_uint32_to_string(n, &key, idxbuf, sizeof(idxbuf));
+	_append_sql_value(&tmp, key, keylen, &sv);
+	cut_start = cut_end = pos;
+	extra = s.voff;
+    } else if(s.found) {
+	// Replace the value, keeping the key exactly as it was.
+	const char* key = (const char*) data + s.eoff + 1;
+	_append_sql_value(&tmp, key, s.voff - s.eoff - 2, &sv);
+	cut_start = s.eoff;
+	cut_end = s.eend;
+    } else {
+	int d = s.depth;
+	if(s.in_array && (path->idx[d] < 0 || (uint32) path->idx[d] != s.nitems)) {
+	    bson_destroy(&tmp);
+	    _modify_error(path, "array index out of range");
+	}
+	_make_element(&tmp, path->segs[d], path->seglens[d], path, d, &sv, append);
+	cut_start = cut_end = s.end;
+    }
+
+    bytea* bb = _splice(data, len, &s, extra, cut_start, cut_end,
+			bson_get_data(&tmp) + 4, tmp.len - 5);
+    bson_destroy(&tmp);
+
+    PG_FREE_IF_COPY(aa,0);
+
+    PG_RETURN_BYTEA_P(bb);
+}
+
+PG_FUNCTION_INFO_V1(bson_set);
+Datum bson_set(PG_FUNCTION_ARGS)
+{
+    return _bson_modify(fcinfo, false);
+}
+
+PG_FUNCTION_INFO_V1(bson_array_append);
+Datum bson_array_append(PG_FUNCTION_ARGS)
+{
+    return _bson_modify(fcinfo, true);
+}
+
+// Missing paths leave the document as it is.  An array item is set to
+// null rather than removed so the other items keep their indexes.
+PG_FUNCTION_INFO_V1(bson_unset);
+Datum bson_unset(PG_FUNCTION_ARGS)
+{
+    bytea* aa = BSON_GETARG_BSON(0);
+    BsonPath* path = BSON_GETARG_PATH(1);
+    const uint8_t* data = BSON_VARDATA_ANY(aa);
+    uint32 len = BSON_VARSIZE_ANY_EXHDR(aa);
+
+    BsonSpot s;
+    _splice_walk(data, len, path, &s);
+    if(!s.found) {
+	PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+    }
+
+    bytea* bb;
+    if(s.in_array) {
+	uint8_t* ins = (uint8_t*) palloc(s.voff - s.eoff);
+	memcpy(ins, data + s.eoff, s.voff - s.eoff); // type, key, NUL
+	ins[0] = BSON_TYPE_NULL;
+	bb = _splice(data, len, &s, 0, s.eoff, s.eend, ins, s.voff - s.eoff);
+	pfree(ins);
+    } else {
+	bb = _splice(data, len, &s, 0, s.eoff, s.eend, NULL, 0);
+    }
+
+    PG_FREE_IF_COPY(aa,0);
+
+    PG_RETURN_BYTEA_P(bb);
+}
+
+
+// bson_merge(a, b):  the top level of a with the keys of b set on it, as
+// jsonb || does.  Keys of a stay where they are (with b's value if b has
+// them); keys only in b follow, in b's order.
+typedef struct
+{
+    const char* key;
+    int keylen;
+    uint32 eoff;
+    uint32 eend;
+    bool used;
+} BsonMergeKey;
+
+static int _merge_key_cmp(const void* a, const void* b)
+{
+    const BsonMergeKey* ka = (const BsonMergeKey*) a;
+    const BsonMergeKey* kb = (const BsonMergeKey*) b;
+    int c = memcmp(ka->key, kb->key, Min(ka->keylen, kb->keylen));
+    if(c != 0) return c;
+    if(ka->keylen != kb->keylen) return ka->keylen < kb->keylen ? -1 : 1;
+    return ka->eoff < kb->eoff ? -1 : (ka->eoff > kb->eoff ? 1 : 0);
+}
+
+// Step *pos (start at 4) over the top-level elements of the document at
+// data.  False at the end.
+static bool _next_element(const uint8_t* data, uint32 len, uint32* pos,
+			  const char** key, int* keylen, uint32* eend)
+{
+    uint32 p = *pos;
+    if(p >= len || data[p] == 0) {
+	return false;
+    }
+    const uint8_t* kend = memchr(data + p + 1, '\0', len - p - 1);
+    if(kend == NULL) _splice_corrupt();
+    *key = (const char*) data + p + 1;
+    *keylen = (const char*) kend - *key;
+    uint32 v = (kend + 1) - data;
+    int64 sz = _slice_value_size(data, len, v, data[p]);
+    if(sz < 0) _splice_corrupt();
+    *eend = v + sz;
+    return true;
+}
+
+PG_FUNCTION_INFO_V1(bson_merge);
+Datum bson_merge(PG_FUNCTION_ARGS)
+{
+    bytea* aa = BSON_GETARG_BSON(0);
+    bytea* bb = BSON_GETARG_BSON(1);
+    const uint8_t* da = BSON_VARDATA_ANY(aa);
+    uint32 la = BSON_VARSIZE_ANY_EXHDR(aa);
+    const uint8_t* db = BSON_VARDATA_ANY(bb);
+    uint32 lb = BSON_VARSIZE_ANY_EXHDR(bb);
+
+    int nb = 0;
+    int maxb = 16;
+    BsonMergeKey* keys = (BsonMergeKey*) palloc(maxb * sizeof(BsonMergeKey));
+    const char* key;
+    int keylen;
+    uint32 pos;
+    uint32 eend;
+
+    for(pos = 4; _next_element(db, lb, &pos, &key, &keylen, &eend); pos = eend) {
+	if(nb == maxb) {
+	    maxb *= 2;
+	    keys = (BsonMergeKey*) repalloc(keys, maxb * sizeof(BsonMergeKey));
+	}
+	keys[nb].key = key;
+	keys[nb].keylen = keylen;
+	keys[nb].eoff = pos;
+	keys[nb].eend = eend;
+	keys[nb].used = false;
+	nb++;
+    }
+    qsort(keys, nb, sizeof(BsonMergeKey), _merge_key_cmp);
+
+    StringInfoData out;
+    initStringInfo(&out);
+    appendStringInfoSpaces(&out, VARHDRSZ + 4);
+
+    // Runs of a that b does not touch go out with one memcpy each.
+    uint32 run = 4;
+    for(pos = 4; _next_element(da, la, &pos, &key, &keylen, &eend); pos = eend) {
+	BsonMergeKey probe;
+	probe.key = key;
+	probe.keylen = keylen;
+	probe.eoff = 0;  // lower bound:  the first b element with this key
+	int lo = 0;
+	int hi = nb;
+	while(lo < hi) {
+	    int mid = lo + (hi - lo) / 2;
+	    if(_merge_key_cmp(&keys[mid], &probe) < 0) lo = mid + 1; else hi = mid;
+	}
+	if(lo < nb && !keys[lo].used && keys[lo].keylen == keylen
+	   && memcmp(keys[lo].key, key, keylen) == 0) {
+	    appendBinaryStringInfo(&out, (const char*) da + run, pos - run);
+	    appendBinaryStringInfo(&out, (const char*) db + keys[lo].eoff, keys[lo].eend - keys[lo].eoff);
+	    keys[lo].used = true;
+	    run = eend;
+	}
+    }
+    appendBinaryStringInfo(&out, (const char*) da + run, (la - 1) - run);
+
+    // The rest of b, in b's order.
+    run = 4;
+    for(pos = 4; _next_element(db, lb, &pos, &key, &keylen, &eend); pos = eend) {
+	BsonMergeKey probe;
+	probe.key = key;
+	probe.keylen = keylen;
+	probe.eoff = pos;
+	BsonMergeKey* k = (BsonMergeKey*) bsearch(&probe, keys, nb, sizeof(BsonMergeKey), _merge_key_cmp);
+	if(k != NULL && k->used) {
+	    appendBinaryStringInfo(&out, (const char*) db + run, pos - run);
+	    run = eend;
+	}
+    }
+    appendBinaryStringInfo(&out, (const char*) db + run, (lb - 1) - run);
+    appendStringInfoChar(&out, '\0');
+
+    SET_VARSIZE(out.data, out.len);
+    uint32 le = BSON_UINT32_TO_LE((uint32) (out.len - VARHDRSZ));
+    memcpy(out.data + VARHDRSZ, &le, 4);
+
+    pfree(keys);
+    PG_FREE_IF_COPY(aa,0);
+    PG_FREE_IF_COPY(bb,1);
+
+    PG_RETURN_BYTEA_P((bytea*) out.data);
+}
+
+
+//
+//  Aggregates
+//
+//  These read the value at path straight from the BSON instead of going
+//  through a getter and a Datum per row, and use the path cached in the
+//  transition function's fn_extra.  All of them have combine and
+//  serialize functions so they run under parallel aggregation.
+//
+//  bson_sum_decimal128(doc, path) and bson_avg_decimal128(doc, path) add
+//  up the decimal128 at path.  Values are kept as an exact 128-bit integer
+//  scaled by 10^exp, so most rows are an integer add and numeric math
+//  happens once, in the final function.  Values that would not fit
+//  (wildly different exponents, sums past 10^35, NaN, Inf) spill into a
+//  numeric running sum instead.  Anything at path that is not a
+//  decimal128 is skipped, like NULL in sum().
+//
+//  bson_sum(doc, path) is the same for any number:  int32, int64 and
+//  decimal128 go into the exact sum; doubles are summed as float8 and
+//  added in at the end.
+//
+//  bson_minmax(doc, path) is {"min": v, "max": v} of whatever is at path,
+//  in bson ordering.  bson_count_type(doc, path) counts the type found at
+//  path per row, as {"int": 10, "missing": 2, ...} with MongoDB's $type
+//  names.  bson_agg(doc) is an array of the docs.
+//
+typedef struct
+{
+    int64 count;     // exact (non-double) values seen
+#ifdef HAVE_INT128
+    bool acc_used;
+    int acc_exp;
+    int128 acc;      // |acc| < 10^35
+#endif
+    Numeric spill;   // in the aggregate context; NULL if nothing spilled
+    int64 dcount;    // doubles seen (bson_sum only)
+    float8 dsum;
+} BsonDecAggState;
+
+static void _dec_agg_spill(BsonDecAggState* st, Numeric nm, MemoryContext aggcontext)
+{
+    MemoryContext old = MemoryContextSwitchTo(aggcontext);
+    Numeric prev = st->spill;
+    st->spill = (prev == NULL) ? DatumGetNumeric(datumCopy(NumericGetDatum(nm), false, -1))
+	: DatumGetNumeric(DirectFunctionCall2(numeric_add, NumericGetDatum(prev), NumericGetDatum(nm)));
+    MemoryContextSwitchTo(old);
+    if(prev != NULL) {
+	pfree(prev);
+    }
+}
+
+#ifdef HAVE_INT128
+static Numeric _int128_numeric(int128 v, int exp)
+{
+    return _make_numeric(v < 0, (uint128) (v < 0 ? -v : v), exp);
+}
+
+static void _dec_agg_flush(BsonDecAggState* st, MemoryContext aggcontext)
+{
+    if(st->acc_used) {
+	_dec_agg_spill(st, _int128_numeric(st->acc, st->acc_exp), aggcontext);
+	st->acc_used = false;
+    }
+}
+
+// Add sign * coeff * 10^exp; coeff < 10^35.
+static void _dec_agg_add(BsonDecAggState* st, bool neg, uint128 coeff, int exp, MemoryContext aggcontext)
+{
+    if(!st->acc_used) {
+	st->acc = neg ? -(int128) coeff : (int128) coeff;
+	st->acc_exp = exp;
+	st->acc_used = true;
+	return;
+    }
+
+    if(exp > st->acc_exp) {
+	int k = exp - st->acc_exp;
+	if(k > 35 || coeff >= DEC128_ACC_LIMIT / _pow10_u128(k)) {
+	    _dec_agg_spill(st, _make_numeric(neg, coeff, exp), aggcontext);
+	    return;
+	}
+	coeff *= _pow10_u128(k);
+    } else if(exp < st->acc_exp) {
+	int k = st->acc_exp - exp;
+	uint128 m = (uint128) (st->acc < 0 ? -st->acc : st->acc);
+	if(k > 35 || m >= DEC128_ACC_LIMIT / _pow10_u128(k)) {
+	    _dec_agg_flush(st, aggcontext);
+	    _dec_agg_add(st, neg, coeff, exp, aggcontext);
+	    return;
+	}
+	st->acc *= (int128) _pow10_u128(k);
+	st->acc_exp = exp;
+    }
+
+    st->acc += neg ? -(int128) coeff : (int128) coeff;
+    if((uint128) (st->acc < 0 ? -st->acc : st->acc) >= DEC128_ACC_LIMIT) {
+	_dec_agg_flush(st, aggcontext);
+    }
+}
+#endif
+
+static void _dec_agg_add_int64(BsonDecAggState* st, int64 v, MemoryContext aggcontext)
+{
+    st->count++;
+#ifdef HAVE_INT128
+    _dec_agg_add(st, v < 0, (uint128) (v < 0 ? -(int128) v : (int128) v), 0, aggcontext);
+#else
+    _dec_agg_spill(st, int64_to_numeric(v), aggcontext);
+#endif
+}
+
+static void _dec_agg_add_decimal128(BsonDecAggState* st, bson_iter_t* target, MemoryContext aggcontext)
+{
+    st->count++;
+#ifdef HAVE_INT128
+    bson_decimal128_t val;
+    bool neg;
+    uint128 coeff;
+    int exp;
+    if(bson_iter_decimal128(target, &val) && _dec128_decode(&val, &neg, &coeff, &exp)) {
+	_dec_agg_add(st, neg, coeff, exp, aggcontext);
+	return;
+    }
+#endif
+    Numeric nm;
+    if(_iter_decimal128_numeric(target, &nm)) {
+	_dec_agg_spill(st, nm, aggcontext);
+    }
+}
+
+// The transition functions are not strict:  the state starts out NULL,
+// and NULL docs/paths are skipped.  This gets (or makes) the state.
+static void* _agg_state(FunctionCallInfo fcinfo, Size sz, MemoryContext* aggcontext)
+{
+    if(!AggCheckCallContext(fcinfo, aggcontext)) {
+	elog(ERROR, "bson aggregate function called in non-aggregate context");
+    }
+    if(!PG_ARGISNULL(0)) {
+	return PG_GETARG_POINTER(0);
+    }
+    return MemoryContextAllocZero(*aggcontext, sz);
+}
+
+// A serialized state, as a StringInfo to read with pq_getmsg*().
+static void _agg_state_buf(StringInfo buf, bytea* sstate)
+{
+    initStringInfo(buf);
+    appendBinaryStringInfo(buf, VARDATA_ANY(sstate), VARSIZE_ANY_EXHDR(sstate));
+}
+
+PG_FUNCTION_INFO_V1(bson_decimal128_accum);
+Datum bson_decimal128_accum(PG_FUNCTION_ARGS)
+{
+    MemoryContext aggcontext;
+    BsonDecAggState* st = (BsonDecAggState*) _agg_state(fcinfo, sizeof(BsonDecAggState), &aggcontext);
+
+    if(PG_ARGISNULL(1) || PG_ARGISNULL(2)) {
+	PG_RETURN_POINTER(st);
+    }
+
+    BsonPath* dotpath = BSON_GETARG_PATH(2);
+    BsonFetch f;
+    bson_iter_t target;
+
+    if(_fetch_path_value_arg(fcinfo, 1, dotpath, BSON_TYPE_DECIMAL128, &target, &f)) {
+	_dec_agg_add_decimal128(st, &target, aggcontext);
+    }
+
+    _release_fetch(fcinfo, &f);
+
+    PG_RETURN_POINTER(st);
+}
+
+PG_FUNCTION_INFO_V1(bson_sum_accum);
+Datum bson_sum_accum(PG_FUNCTION_ARGS)
+{
+    MemoryContext aggcontext;
+    BsonDecAggState* st = (BsonDecAggState*) _agg_state(fcinfo, sizeof(BsonDecAggState), &aggcontext);
+
+    if(PG_ARGISNULL(1) || PG_ARGISNULL(2)) {
+	PG_RETURN_POINTER(st);
+    }
+
+    BsonPath* dotpath = BSON_GETARG_PATH(2);
+    BsonFetch f;
+    bson_iter_t target;
+
+    if(_fetch_path_value_arg(fcinfo, 1, dotpath, BSON_TYPE_EOD, &target, &f)) {
+	switch(bson_iter_type(&target)) {
+	case BSON_TYPE_INT32:
+	    _dec_agg_add_int64(st, bson_iter_int32(&target), aggcontext);
+	    break;
+	case BSON_TYPE_INT64:
+	    _dec_agg_add_int64(st, bson_iter_int64(&target), aggcontext);
+	    break;
+	case BSON_TYPE_DECIMAL128:
+	    _dec_agg_add_decimal128(st, &target, aggcontext);
+	    break;
+	case BSON_TYPE_DOUBLE:
+	    st->dcount++;
+	    st->dsum += bson_iter_double(&target);
+	    break;
+	default:
+	    break;
+	}
+    }
+
+    _release_fetch(fcinfo, &f);
+
+    PG_RETURN_POINTER(st);
+}
+
+PG_FUNCTION_INFO_V1(bson_sum_combine);
+Datum bson_sum_combine(PG_FUNCTION_ARGS)
+{
+    MemoryContext aggcontext;
+    BsonDecAggState* st = (BsonDecAggState*) _agg_state(fcinfo, sizeof(BsonDecAggState), &aggcontext);
+
+    if(PG_ARGISNULL(1)) {
+	PG_RETURN_POINTER(st);
+    }
+    BsonDecAggState* st2 = (BsonDecAggState*) PG_GETARG_POINTER(1);
+
+    st->count += st2->count;
+    st->dcount += st2->dcount;
+    st->dsum += st2->dsum;
+#ifdef HAVE_INT128
+    if(st2->acc_used) {
+	_dec_agg_add(st, st2->acc < 0, (uint128) (st2->acc < 0 ? -st2->acc : st2->acc), st2->acc_exp, aggcontext);
+    }
+#endif
+    if(st2->spill != NULL) {
+	_dec_agg_spill(st, st2->spill, aggcontext);
+    }
+
+    PG_RETURN_POINTER(st);
+}
+
+PG_FUNCTION_INFO_V1(bson_sum_serialize);
+Datum bson_sum_serialize(PG_FUNCTION_ARGS)
+{
+    BsonDecAggState* st = (BsonDecAggState*) PG_GETARG_POINTER(0);
+    StringInfoData buf;
+
+    pq_begintypsend(&buf);
+    pq_sendint64(&buf, st->count);
+    pq_sendint64(&buf, st->dcount);
+    pq_sendfloat8(&buf, st->dsum);
+#ifdef HAVE_INT128
+    pq_sendbyte(&buf, st->acc_used);
+    pq_sendint32(&buf, st->acc_exp);
+    pq_sendint64(&buf, (uint64) ((uint128) st->acc >> 64));
+    pq_sendint64(&buf, (uint64) st->acc);
+#endif
+    pq_sendbyte(&buf, st->spill != NULL);
+    if(st->spill != NULL) {
+	bytea* nb = DatumGetByteaPP(DirectFunctionCall1(numeric_send, NumericGetDatum(st->spill)));
+	pq_sendint32(&buf, VARSIZE_ANY_EXHDR(nb));
+	pq_sendbytes(&buf, VARDATA_ANY(nb), VARSIZE_ANY_EXHDR(nb));
+    }
+
+    PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+PG_FUNCTION_INFO_V1(bson_sum_deserialize);
+Datum bson_sum_deserialize(PG_FUNCTION_ARGS)
+{
+    MemoryContext aggcontext;
+    if(!AggCheckCallContext(fcinfo, &aggcontext)) {
+	elog(ERROR, "bson aggregate function called in non-aggregate context");
+    }
+
+    bytea* sstate = PG_GETARG_BYTEA_PP(0);
+    StringInfoData buf;
+    _agg_state_buf(&buf, sstate);
+
+    BsonDecAggState* st = (BsonDecAggState*) MemoryContextAllocZero(aggcontext, sizeof(BsonDecAggState));
+    st->count = pq_getmsgint64(&buf);
+    st->dcount = pq_getmsgint64(&buf);
+    st->dsum = pq_getmsgfloat8(&buf);
+#ifdef HAVE_INT128
+    st->acc_used = pq_getmsgbyte(&buf);
+    st->acc_exp = pq_getmsgint(&buf, 4);
+    uint64 hi = pq_getmsgint64(&buf);
+    uint64 lo = pq_getmsgint64(&buf);
+    st->acc = (int128) (((uint128) hi << 64) | lo);
+#endif
+    if(pq_getmsgbyte(&buf)) {
+	int len = pq_getmsgint(&buf, 4);
+	StringInfoData nbuf;
+	initStringInfo(&nbuf);
+	appendBinaryStringInfo(&nbuf, pq_getmsgbytes(&buf, len), len);
+	Numeric nm = DatumGetNumeric(DirectFunctionCall3(numeric_recv, PointerGetDatum(&nbuf),
+							 ObjectIdGetDatum(InvalidOid), Int32GetDatum(-1)));
+	_dec_agg_spill(st, nm, aggcontext);
+    }
+    pq_getmsgend(&buf);
+
+    PG_RETURN_POINTER(st);
+}
+
+// The exact sum, or NULL if no exact values were seen.
+static Numeric _dec_agg_sum(BsonDecAggState* st)
+{
+    Numeric sum = st->spill;
+
+#ifdef HAVE_INT128
+    if(st->acc_used) {
+	Numeric nm = _int128_numeric(st->acc, st->acc_exp);
+	sum = (sum == NULL) ? nm
+	    : DatumGetNumeric(DirectFunctionCall2(numeric_add, NumericGetDatum(sum), NumericGetDatum(nm)));
+    }
+#endif
+    if(sum == NULL && st->count > 0) {
+	sum = int64_to_numeric(0);  // every value spilled and cancelled out
+    }
+
+    return sum;
+}
+
+PG_FUNCTION_INFO_V1(bson_decimal128_sum_final);
+Datum bson_decimal128_sum_final(PG_FUNCTION_ARGS)
+{
+    BsonDecAggState* st = PG_ARGISNULL(0) ? NULL : (BsonDecAggState*) PG_GETARG_POINTER(0);
+    if(st == NULL || st->count == 0) {
+	PG_RETURN_NULL();
+    }
+    PG_RETURN_NUMERIC(_dec_agg_sum(st));
+}
+
+PG_FUNCTION_INFO_V1(bson_decimal128_avg_final);
+Datum bson_decimal128_avg_final(PG_FUNCTION_ARGS)
+{
+    BsonDecAggState* st = PG_ARGISNULL(0) ? NULL : (BsonDecAggState*) PG_GETARG_POINTER(0);
+    if(st == NULL || st->count == 0) {
+	PG_RETURN_NULL();
+    }
+    PG_RETURN_DATUM(DirectFunctionCall2(numeric_div,
+					NumericGetDatum(_dec_agg_sum(st)),
+					NumericGetDatum(int64_to_numeric(st->count))));
+}
+
+PG_FUNCTION_INFO_V1(bson_sum_final);
+Datum bson_sum_final(PG_FUNCTION_ARGS)
+{
+    BsonDecAggState* st = PG_ARGISNULL(0) ? NULL : (BsonDecAggState*) PG_GETARG_POINTER(0);
+    if(st == NULL || (st->count == 0 && st->dcount == 0)) {
+	PG_RETURN_NULL();
+    }
+
+    Datum d = DirectFunctionCall1(float8_numeric, Float8GetDatum(st->dsum));
+    if(st->count > 0) {
+	d = DirectFunctionCall2(numeric_add, NumericGetDatum(_dec_agg_sum(st)), d);
+    }
+    PG_RETURN_DATUM(d);
+}
+
+
+// min and max are each a one-element document (the element exactly as it
+// was in its source, key and all), so the state is cheap to compare,
+// copy and serialize.
+typedef struct
+{
+    uint8_t* min;  // NULL until the first value
+    uint8_t* max;
+} BsonMinMaxState;
+
+static uint8_t* _mini_doc_alloc(MemoryContext cxt, const uint8_t* elem, uint32 elen)
+{
+    uint32 len = 4 + elen + 1;
+    uint8_t* d = (uint8_t*) MemoryContextAlloc(cxt, len);
+    uint32 le = BSON_UINT32_TO_LE(len);
+    memcpy(d, &le, 4);
+    memcpy(d + 4, elem, elen);
+    d[len - 1] = '\0';
+    return d;
+}
+
+static uint32 _mini_doc_len(const uint8_t* d)
+{
+    uint32 le;
+    memcpy(&le, d, 4);
+    return BSON_UINT32_FROM_LE(le);
+}
+
+static void _mini_doc_iter(const uint8_t* d, bson_iter_t* it)
+{
+    if(!bson_iter_init_from_data(it, d, _mini_doc_len(d)) || !bson_iter_next(it)) {
+	ereport(
+	    ERROR,
+	    (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("BSON bytes corrupted in aggregate state"))
+	    );
+    }
+}
+
+// Fold the element at elem into st.
+static void _minmax_add(BsonMinMaxState* st, const uint8_t* elem, uint32 elen, MemoryContext aggcontext)
+{
+    if(st->min == NULL) {
+	st->min = _mini_doc_alloc(aggcontext, elem, elen);
+	st->max = _mini_doc_alloc(aggcontext, elem, elen);
+	return;
+    }
+
+    uint8_t* cand = _mini_doc_alloc(CurrentMemoryContext, elem, elen);
+    bson_iter_t v, cur;
+    _mini_doc_iter(cand, &v);
+
+    _mini_doc_iter(st->min, &cur);
+    if(_bson_compare_values(&v, &cur) < 0) {
+	pfree(st->min);
+	st->min = _mini_doc_alloc(aggcontext, elem, elen);
+    }
+    _mini_doc_iter(st->max, &cur);
+    if(_bson_compare_values(&v, &cur) > 0) {
+	pfree(st->max);
+	st->max = _mini_doc_alloc(aggcontext, elem, elen);
+    }
+
+    pfree(cand);
+}
+
+PG_FUNCTION_INFO_V1(bson_minmax_accum);
+Datum bson_minmax_accum(PG_FUNCTION_ARGS)
+{
+    MemoryContext aggcontext;
+    BsonMinMaxState* st = (BsonMinMaxState*) _agg_state(fcinfo, sizeof(BsonMinMaxState), &aggcontext);
+
+    if(PG_ARGISNULL(1) || PG_ARGISNULL(2)) {
+	PG_RETURN_POINTER(st);
+    }
+
+    BsonPath* dotpath = BSON_GETARG_PATH(2);
+    BsonFetch f;
+    bson_iter_t target;
+
+    if(_fetch_path_value_arg(fcinfo, 1, dotpath, BSON_TYPE_EOD, &target, &f)) {
+	// The element again from its parts:  type byte, key, value bytes.
+	const char* key = bson_iter_key(&target);
+	uint32 klen = strlen(key) + 1;
+	uint32_t vlen;
+	const uint8_t* v = _iter_value_bytes(&target, &vlen);
+
+	uint32 elen = 1 + klen + vlen;
+	uint8_t* elem = (uint8_t*) palloc(elen);
+	elem[0] = (uint8_t) bson_iter_type(&target);
+	memcpy(elem + 1, key, klen);
+	memcpy(elem + 1 + klen, v, vlen);
+
+	_minmax_add(st, elem, elen, aggcontext);
+	pfree(elem);
+    }
+
+    _release_fetch(fcinfo, &f);
+
+    PG_RETURN_POINTER(st);
+}
+
+PG_FUNCTION_INFO_V1(bson_minmax_combine);
+Datum bson_minmax_combine(PG_FUNCTION_ARGS)
+{
+    MemoryContext aggcontext;
+    BsonMinMaxState* st = (BsonMinMaxState*) _agg_state(fcinfo, sizeof(BsonMinMaxState), &aggcontext);
+
+    if(PG_ARGISNULL(1)) {
+	PG_RETURN_POINTER(st);
+    }
+    BsonMinMaxState* st2 = (BsonMinMaxState*) PG_GETARG_POINTER(1);
+
+    if(st2->min != NULL) {
+	_minmax_add(st, st2->min + 4, _mini_doc_len(st2->min) - 5, aggcontext);
+	_minmax_add(st, st2->max + 4, _mini_doc_len(st2->max) - 5, aggcontext);
+    }
+
+    PG_RETURN_POINTER(st);
+}
+
+// Serialized:  nothing at all, or the min doc followed by the max doc.
+PG_FUNCTION_INFO_V1(bson_minmax_serialize);
+Datum bson_minmax_serialize(PG_FUNCTION_ARGS)
+{
+    BsonMinMaxState* st = (BsonMinMaxState*) PG_GETARG_POINTER(0);
+    StringInfoData buf;
+
+    pq_begintypsend(&buf);
+    if(st->min != NULL) {
+	pq_sendbytes(&buf, (const char*) st->min, _mini_doc_len(st->min));
+	pq_sendbytes(&buf, (const char*) st->max, _mini_doc_len(st->max));
+    }
+
+    PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+PG_FUNCTION_INFO_V1(bson_minmax_deserialize);
+Datum bson_minmax_deserialize(PG_FUNCTION_ARGS)
+{
+    MemoryContext aggcontext;
+    if(!AggCheckCallContext(fcinfo, &aggcontext)) {
+	elog(ERROR, "bson aggregate function called in non-aggregate context");
+    }
+
+    bytea* sstate = PG_GETARG_BYTEA_PP(0);
+    const uint8_t* p = (const uint8_t*) VARDATA_ANY(sstate);
+    uint32 n = VARSIZE_ANY_EXHDR(sstate);
+
+    BsonMinMaxState* st = (BsonMinMaxState*) MemoryContextAllocZero(aggcontext, sizeof(BsonMinMaxState));
+    if(n > 0) {
+	uint32 l1 = _mini_doc_len(p);
+	st->min = _mini_doc_alloc(aggcontext, p + 4, l1 - 5);
+	st->max = _mini_doc_alloc(aggcontext, p + l1 + 4, _mini_doc_len(p + l1) - 5);
+    }
+
+    PG_RETURN_POINTER(st);
+}
+
+PG_FUNCTION_INFO_V1(bson_minmax_final);
+Datum bson_minmax_final(PG_FUNCTION_ARGS)
+{
+    BsonMinMaxState* st = PG_ARGISNULL(0) ? NULL : (BsonMinMaxState*) PG_GETARG_POINTER(0);
+    if(st == NULL || st->min == NULL) {
+	PG_RETURN_NULL();
+    }
+
+    uint8_t* buf;
+    size_t buflen;
+    bson_t* b;
+    bson_writer_t* writer = _begin_varlena_writer(&buf, &buflen,
+						  VARHDRSZ + _mini_doc_len(st->min) + _mini_doc_len(st->max), &b);
+
+    bson_iter_t it;
+    _mini_doc_iter(st->min, &it);
+    bson_append_iter(b, "min", 3, &it);
+    _mini_doc_iter(st->max, &it);
+    bson_append_iter(b, "max", 3, &it);
+
+    PG_RETURN_BYTEA_P(_end_varlena_writer(writer, &buf));
+}
+
+
+// $type names by BSON type byte; slot 0 is "missing", minKey and maxKey
+// sit at the end.
+#define BSON_COUNT_TYPE_SLOTS  22
+static const char* const bson_count_type_names[BSON_COUNT_TYPE_SLOTS] = {
+    "missing", "double", "string", "object", "array", "binData", "undefined",
+    "objectId", "bool", "date", "null", "regex", "dbPointer", "javascript",
+    "symbol", "javascriptWithScope", "int", "timestamp", "long", "decimal",
+    "minKey", "maxKey"
+};
+
+static int _count_type_slot(bson_type_t t)
+{
+    if(t >= BSON_TYPE_DOUBLE && t <= BSON_TYPE_DECIMAL128) return (int) t;
+    if(t == BSON_TYPE_MINKEY) return 20;
+    if(t == BSON_TYPE_MAXKEY) return 21;
+    return 0;
+}
+
+typedef struct
+{
+    int64 counts[BSON_COUNT_TYPE_SLOTS];
+} BsonCountTypeState;
+
+PG_FUNCTION_INFO_V1(bson_count_type_accum);
+Datum bson_count_type_accum(PG_FUNCTION_ARGS)
+{
+    MemoryContext aggcontext;
+    BsonCountTypeState* st = (BsonCountTypeState*) _agg_state(fcinfo, sizeof(BsonCountTypeState), &aggcontext);
+
+    if(PG_ARGISNULL(1) || PG_ARGISNULL(2)) {
+	PG_RETURN_POINTER(st);
+    }
+
+    BsonPath* dotpath = BSON_GETARG_PATH(2);
+    BsonFetch f;
+    bson_iter_t target;
+
+    if(_fetch_path_value_arg(fcinfo, 1, dotpath, BSON_TYPE_EOD, &target, &f)) {
+	st->counts[_count_type_slot(bson_iter_type(&target))]++;
+    } else {
+	st->counts[0]++;
+    }
+
+    _release_fetch(fcinfo, &f);
+
+    PG_RETURN_POINTER(st);
+}
+
+PG_FUNCTION_INFO_V1(bson_count_type_combine);
+Datum bson_count_type_combine(PG_FUNCTION_ARGS)
+{
+    MemoryContext aggcontext;
+    BsonCountTypeState* st = (BsonCountTypeState*) _agg_state(fcinfo, sizeof(BsonCountTypeState), &aggcontext);
+
+    if(!PG_ARGISNULL(1)) {
+	BsonCountTypeState* st2 = (BsonCountTypeState*) PG_GETARG_POINTER(1);
+	for(int i = 0; i < BSON_COUNT_TYPE_SLOTS; i++) {
+	    st->counts[i] += st2->counts[i];
+	}
+    }
+
+    PG_RETURN_POINTER(st);
+}
+
+PG_FUNCTION_INFO_V1(bson_count_type_serialize);
+Datum bson_count_type_serialize(PG_FUNCTION_ARGS)
+{
+    BsonCountTypeState* st = (BsonCountTypeState*) PG_GETARG_POINTER(0);
+    StringInfoData buf;
+
+    pq_begintypsend(&buf);
+    for(int i = 0; i < BSON_COUNT_TYPE_SLOTS; i++) {
+	pq_sendint64(&buf, st->counts[i]);
+    }
+
+    PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+PG_FUNCTION_INFO_V1(bson_count_type_deserialize);
+Datum bson_count_type_deserialize(PG_FUNCTION_ARGS)
+{
+    MemoryContext aggcontext;
+    if(!AggCheckCallContext(fcinfo, &aggcontext)) {
+	elog(ERROR, "bson aggregate function called in non-aggregate context");
+    }
+
+    bytea* sstate = PG_GETARG_BYTEA_PP(0);
+    StringInfoData buf;
+    _agg_state_buf(&buf, sstate);
+
+    BsonCountTypeState* st = (BsonCountTypeState*) MemoryContextAllocZero(aggcontext, sizeof(BsonCountTypeState));
+    for(int i = 0; i < BSON_COUNT_TYPE_SLOTS; i++) {
+	st->counts[i] = pq_getmsgint64(&buf);
+    }
+    pq_getmsgend(&buf);
+
+    PG_RETURN_POINTER(st);
+}
+
+PG_FUNCTION_INFO_V1(bson_count_type_final);
+Datum bson_count_type_final(PG_FUNCTION_ARGS)
+{
+    BsonCountTypeState* st = PG_ARGISNULL(0) ? NULL : (BsonCountTypeState*) PG_GETARG_POINTER(0);
+    if(st == NULL) {
+	PG_RETURN_NULL();
+    }
+
+    uint8_t* buf;
+    size_t buflen;
+    bson_t* b;
+    bson_writer_t* writer = _begin_varlena_writer(&buf, &buflen, 128, &b);
+
+    for(int i = 0; i < BSON_COUNT_TYPE_SLOTS; i++) {
+	if(st->counts[i] != 0) {
+	    bson_append_int64(b, bson_count_type_names[i], -1, st->counts[i]);
+	}
+    }
+
+    PG_RETURN_BYTEA_P(_end_varlena_writer(writer, &buf));
+}
+
+
+// bson_agg keeps the docs back to back in a StringInfo; they carry their
+// own lengths, so combine and serialize are plain appends and copies, and
+// the array keys are only written at the end.
+typedef struct
+{
+    StringInfoData docs;
+    int64 n;
+} BsonAggState;
+
+static BsonAggState* _bson_agg_new(MemoryContext aggcontext)
+{
+    MemoryContext old = MemoryContextSwitchTo(aggcontext);
+    BsonAggState* st = (BsonAggState*) palloc0(sizeof(BsonAggState));
+    initStringInfo(&st->docs);
+    MemoryContextSwitchTo(old);
+    return st;
+}
+
+static BsonAggState* _bson_agg_state(FunctionCallInfo fcinfo, MemoryContext* aggcontext)
+{
+    if(!AggCheckCallContext(fcinfo, aggcontext)) {
+	elog(ERROR, "bson aggregate function called in non-aggregate context");
+    }
+    return PG_ARGISNULL(0) ? _bson_agg_new(*aggcontext) : (BsonAggState*) PG_GETARG_POINTER(0);
+}
+
+PG_FUNCTION_INFO_V1(bson_agg_accum);
+Datum bson_agg_accum(PG_FUNCTION_ARGS)
+{
+    MemoryContext aggcontext;
+    BsonAggState* st = _bson_agg_state(fcinfo, &aggcontext);
+
+    if(!PG_ARGISNULL(1)) {
+	bytea* aa = BSON_GETARG_BSON(1);
+	appendBinaryStringInfo(&st->docs, (const char*) BSON_VARDATA_ANY(aa), BSON_VARSIZE_ANY_EXHDR(aa));
+	st->n++;
+	PG_FREE_IF_COPY(aa,1);
+    }
+
+    PG_RETURN_POINTER(st);
+}
+
+PG_FUNCTION_INFO_V1(bson_agg_combine);
+Datum bson_agg_combine(PG_FUNCTION_ARGS)
+{
+    MemoryContext aggcontext;
+    BsonAggState* st = _bson_agg_state(fcinfo, &aggcontext);
+
+    if(!PG_ARGISNULL(1)) {
+	BsonAggState* st2 = (BsonAggState*) PG_GETARG_POINTER(1);
+	appendBinaryStringInfo(&st->docs, st2->docs.data, st2->docs.len);
+	st->n += st2->n;
+    }
+
+    PG_RETURN_POINTER(st);
+}
+
+PG_FUNCTION_INFO_V1(bson_agg_serialize);
+Datum bson_agg_serialize(PG_FUNCTION_ARGS)
+{
+    BsonAggState* st = (BsonAggState*) PG_GETARG_POINTER(0);
+    StringInfoData buf;
+
+    pq_begintypsend(&buf);
+    pq_sendint64(&buf, st->n);
+    pq_sendbytes(&buf, st->docs.data, st->docs.len);
+
+    PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+PG_FUNCTION_INFO_V1(bson_agg_deserialize);
+Datum bson_agg_deserialize(PG_FUNCTION_ARGS)
+{
+    MemoryContext aggcontext;
+    if(!AggCheckCallContext(fcinfo, &aggcontext)) {
+	elog(ERROR, "bson aggregate function called in non-aggregate context");
+    }
+
+    bytea* sstate = PG_GETARG_BYTEA_PP(0);
+    StringInfoData buf;
+    _agg_state_buf(&buf, sstate);
+
+    BsonAggState* st = _bson_agg_new(aggcontext);
+    st->n = pq_getmsgint64(&buf);
+    int len = buf.len - buf.cursor;
+    appendBinaryStringInfo(&st->docs, pq_getmsgbytes(&buf, len), len);
+
+    PG_RETURN_POINTER(st);
+}
+
+PG_FUNCTION_INFO_V1(bson_agg_final);
+Datum bson_agg_final(PG_FUNCTION_ARGS)
+{
+    BsonAggState* st = PG_ARGISNULL(0) ? NULL : (BsonAggState*) PG_GETARG_POINTER(0);
+    if(st == NULL || st->n == 0) {
+	PG_RETURN_NULL();
+    }
+
+    // Each element is type byte, decimal key, NUL, then the doc.
+    Size tot = VARHDRSZ + 4 + (Size) st->docs.len + 1;
+    for(int64 i = 0; i < st->n; i++) {
+	char key[24];
+	tot += 2 + pg_lltoa(i, key);
+    }
+    if(tot - VARHDRSZ > INT32_MAX || !AllocSizeIsValid(tot)) {
+	ereport(
+	    ERROR,
+	    (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED), errmsg("bson_agg result is too large"))
+	    );
+    }
+
+    bytea* aa = (bytea*) palloc(tot);
+    SET_VARSIZE(aa, tot);
+    uint8_t* p = (uint8_t*) VARDATA(aa);
+    uint32 le = BSON_UINT32_TO_LE((uint32) (tot - VARHDRSZ));
+    memcpy(p, &le, 4);
+    p += 4;
+
+    const uint8_t* d = (const uint8_t*) st->docs.data;
+    for(int64 i = 0; i < st->n; i++) {
+	uint32 dlen = _mini_doc_len(d);
+	*p++ = BSON_TYPE_DOCUMENT;
+	p += pg_lltoa(i, (char*) p) + 1;  // pg_lltoa writes the NUL
+	memcpy(p, d, dlen);
+	p += dlen;
+	d += dlen;
+    }
+    *p = '\0';
+
+    PG_RETURN_BYTEA_P(aa);
+}
+
+
+//
+//  BSON arrays -> postgres arrays
+//
+//  bson_get_{float8,int8,text,timestamp}_array(doc, path, strict) walk the
+//  BSON array at path once, check each type tag and build the result with
+//  one construct_md_array().  float8 takes doubles, int32s and int64s;
+//  int8 takes int32s and int64s; text takes strings; timestamp takes
+//  datetimes.  BSON null items become NULL elements.  Anything else is an
+//  error if strict, else left out.  A path that is missing or not an
+//  array gives NULL.
+//
+typedef enum
+{
+    BSON_ARR_FLOAT8,
+    BSON_ARR_INT8,
+    BSON_ARR_TEXT,
+    BSON_ARR_TIMESTAMP
+} BsonArrKind;
+
+// True and *d set if the item fits kind.
+static bool _arr_item(BsonArrKind kind, bson_iter_t* it, Datum* d)
+{
+    switch(bson_iter_type(it)) {
+    case BSON_TYPE_DOUBLE:
+	if(kind != BSON_ARR_FLOAT8) return false;
+	*d = Float8GetDatum(bson_iter_double(it));
+	return true;
+    case BSON_TYPE_INT32:
+	if(kind == BSON_ARR_FLOAT8) *d = Float8GetDatum((float8) bson_iter_int32(it));
+	else if(kind == BSON_ARR_INT8) *d = Int64GetDatum(bson_iter_int32(it));
+	else return false;
+	return true;
+    case BSON_TYPE_INT64:
+	if(kind == BSON_ARR_FLOAT8) *d = Float8GetDatum((float8) bson_iter_int64(it));
+	else if(kind == BSON_ARR_INT8) *d = Int64GetDatum(bson_iter_int64(it));
+	else return false;
+	return true;
+    case BSON_TYPE_UTF8: {
+	if(kind != BSON_ARR_TEXT) return false;
+	uint32_t len;
+	const char* s = bson_iter_utf8(it, &len);
+	*d = PointerGetDatum(cstring_to_text_with_len(s, len));
+	return true;
+    }
+    case BSON_TYPE_DATE_TIME:
+	if(kind != BSON_ARR_TIMESTAMP) return false;
+	*d = TimestampGetDatum(_cvt_datetime_to_ts(bson_iter_date_time(it)));
+	return true;
+    default:
+	return false;
+    }
+}
+
+static Datum _bson_get_array(FunctionCallInfo fcinfo, BsonArrKind kind)
+{
+    static const char* const kind_names[] = {"float8", "int8", "text", "timestamp"};
+    static const Oid kind_types[] = {FLOAT8OID, INT8OID, TEXTOID, TIMESTAMPOID};
+    // Fewest bytes an item that goes in the result can take:  type, key
+    // "0" and then an int32, an empty string, or a datetime.
+    static const int kind_min_item[] = {7, 7, 8, 11};
+
+    BsonPath* dotpath = BSON_GETARG_PATH(1);
+    bool strict = PG_GETARG_BOOL(2);
+    BsonFetch f;
+    bson_iter_t target;
+    bson_iter_t it;
+
+    if(!_fetch_path_value(fcinfo, dotpath, BSON_TYPE_ARRAY, &target, &f)
+       || !bson_iter_recurse(&target, &it)) {
+	_release_fetch(fcinfo, &f);
+	PG_RETURN_NULL();
+    }
+
+    // BSON does not store the item count but the array's length bounds
+    // it, so size for that up front; only nulls (3 bytes each) can take
+    // it past the bound and then the arrays grow as usual.
+    uint32_t alen;
+    const uint8_t* adata;
+    bson_iter_array(&target, &alen, &adata);
+
+    int cap = Max(16, (int) (alen / kind_min_item[kind]));
+    int n = 0;
+    Datum* values = (Datum*) palloc(cap * sizeof(Datum));
+    bool* nulls = NULL;  // only once there is a null
+
+    while(bson_iter_next(&it)) {
+	if(n == cap) {
+	    cap *= 2;
+	    values = (Datum*) repalloc(values, cap * sizeof(Datum));
+	    if(nulls != NULL) {
+		nulls = (bool*) repalloc(nulls, cap * sizeof(bool));
+	    }
+	}
+
+	if(bson_iter_type(&it) == BSON_TYPE_NULL) {
+	    if(nulls == NULL) {
+		nulls = (bool*) palloc0(cap * sizeof(bool));
+	    }
+	    nulls[n] = true;
+	    values[n++] = (Datum) 0;
+	    continue;
+	}
+
+	if(_arr_item(kind, &it, &values[n])) {
+	    if(nulls != NULL) {
+		nulls[n] = false;
+	    }
+	    n++;
+	} else if(strict) {
+	    ereport(
+		ERROR,
+		(errcode(ERRCODE_DATATYPE_MISMATCH),
+		 errmsg("item %s of bson array \"%.*s\" is %s, not %s",
+			bson_iter_key(&it), dotpath->len, dotpath->raw,
+			bson_count_type_names[_count_type_slot(bson_iter_type(&it))], kind_names[kind]),
+		 errhint("Pass false as the third argument to leave such items out."))
+		);
+	}
+    }
+
+    _release_fetch(fcinfo, &f);
+
+    int dims[1] = {n};
+    int lbs[1] = {1};
+    Oid elmtype = kind_types[kind];
+    ArrayType* arr = (n == 0) ? construct_empty_array(elmtype)
+	: construct_md_array(values, nulls, 1, dims, lbs, elmtype,
+			     (kind == BSON_ARR_TEXT) ? -1 : 8, (kind == BSON_ARR_TEXT) ? false : FLOAT8PASSBYVAL,
+			     (kind == BSON_ARR_TEXT) ? TYPALIGN_INT : TYPALIGN_DOUBLE);
+
+    PG_RETURN_ARRAYTYPE_P(arr);
+}
+
+PG_FUNCTION_INFO_V1(bson_get_float8_array);
+Datum bson_get_float8_array(PG_FUNCTION_ARGS)
+{
+    return _bson_get_array(fcinfo, BSON_ARR_FLOAT8);
+}
+
+PG_FUNCTION_INFO_V1(bson_get_int8_array);
+Datum bson_get_int8_array(PG_FUNCTION_ARGS)
+{
+    return _bson_get_array(fcinfo, BSON_ARR_INT8);
+}
+
+PG_FUNCTION_INFO_V1(bson_get_text_array);
+Datum bson_get_text_array(PG_FUNCTION_ARGS)
+{
+    return _bson_get_array(fcinfo, BSON_ARR_TEXT);
+}
+
+PG_FUNCTION_INFO_V1(bson_get_timestamp_array);
+Datum bson_get_timestamp_array(PG_FUNCTION_ARGS)
+{
+    return _bson_get_array(fcinfo, BSON_ARR_TIMESTAMP);
+}
+
+
+//
+//  Planner support
+//
+//  bson_column->'a'->'b'->>'c' makes postgres call bson_get_bson twice,
+//  building and copying a subdocument at each arrow, before bson_as_text
+//  finally runs.  When the keys are constants we can do better:  this
+//  SupportRequestSimplify handler rewrites
+//      f(bson_get_bson(X, 'a'), 'b')   into   f(X, 'a.b')
+//  for every f that takes (bson, dotpath, ...).  The planner simplifies
+//  arguments bottom-up so a whole chain collapses one level at a time into
+//  a single dotpath walk, e.g. bson_as_text(X, 'a.b.c').
+//
+//  The same function also answers SupportRequestCost (deeper paths cost
+//  more) and SupportRequestSelectivity (boolean getters used as quals).
+//
+
+// If n is a call (function or -> operator) to bson_get_bson in namespace
+// nsp with a constant, non-NULL dotpath, return its args.
+static bool _is_get_bson_call(Node* n, Oid nsp, Node** doc, Const** path)
+{
+    Oid funcid;
+    List* args;
+
+    if(IsA(n, FuncExpr)) {
+	funcid = ((FuncExpr*) n)->funcid;
+	args = ((FuncExpr*) n)->args;
+    } else if(IsA(n, OpExpr)) {
+	set_opfuncid((OpExpr*) n);
+	funcid = ((OpExpr*) n)->opfuncid;
+	args = ((OpExpr*) n)->args;
+    } else {
+	return false;
+    }
+
+    if(list_length(args) != 2 || !IsA(lsecond(args), Const) || ((Const*) lsecond(args))->constisnull) {
+	return false;
+    }
+
+    char* fname = get_func_name(funcid);
+    bool rc = (fname != NULL && strcmp(fname, "bson_get_bson") == 0 && get_func_namespace(funcid) == nsp);
+    if(fname != NULL) pfree(fname);
+
+    if(rc) {
+	*doc = (Node*) linitial(args);
+	*path = (Const*) lsecond(args);
+    }
+    return rc;
+}
+
+static bool _stats_boolean_sel(PlannerInfo* root, List* args, int varRelid, Selectivity* sel);
+
+PG_FUNCTION_INFO_V1(bson_path_support);
+Datum bson_path_support(PG_FUNCTION_ARGS)
+{
+    Node* rawreq = (Node*) PG_GETARG_POINTER(0);
+    Node* ret = NULL;
+
+    if(IsA(rawreq, SupportRequestSimplify)) {
+	SupportRequestSimplify* req = (SupportRequestSimplify*) rawreq;
+	FuncExpr* expr = req->fcall;
+
+	Node* doc;
+	Const* inner_path;
+
+	if(list_length(expr->args) >= 2
+	   && IsA(lsecond(expr->args), Const)
+	   && !((Const*) lsecond(expr->args))->constisnull
+	   && _is_get_bson_call((Node*) linitial(expr->args), get_func_namespace(expr->funcid), &doc, &inner_path)
+	   // e.g. bsonx->'a' is bson; only fold if f() takes what X is
+	   && exprType(doc) == exprType((Node*) linitial(expr->args))) {
+
+	    Const* outer_path = (Const*) lsecond(expr->args);
+
+	    char* p1 = TextDatumGetCString(inner_path->constvalue);
+	    char* p2 = TextDatumGetCString(outer_path->constvalue);
+	    char* joined = psprintf("%s.%s", p1, p2);
+
+	    Const* path = (Const*) copyObject(outer_path);
+	    path->constvalue = PointerGetDatum(cstring_to_text(joined));
+	    path->location = -1;
+
+	    FuncExpr* fexpr = makeFuncExpr(expr->funcid, expr->funcresulttype,
+					   lcons(doc, lcons(path, list_copy_tail(expr->args, 2))),
+					   expr->funccollid, expr->inputcollid,
+					   COERCE_EXPLICIT_CALL);
+	    fexpr->location = expr->location;
+
+	    ret = (Node*) fexpr;
+	}
+
+    } else if(IsA(rawreq, SupportRequestSelectivity)) {
+	// Only a boolean getter can be a qual on its own, as in
+	//   WHERE bson_get_boolean(doc, 'active')
+	// The planner default there is a flat 1/3.  boolvarsel() looks the
+	// call up as an expression and uses the stats ANALYZE gathered for a
+	// matching expression index; without one it says 0.5.  Comparisons
+	// like bson_get_string(doc, 'a') = 'x' do not come here:  the operator's
+	// estimator already finds the same index stats, and core has no hook
+	// that would let the column's path stats answer for it.
+	SupportRequestSelectivity* req = (SupportRequestSelectivity*) rawreq;
+
+	if(!req->is_join && get_func_rettype(req->funcid) == BOOLOID) {
+	    FuncExpr* fexpr = makeFuncExpr(req->funcid, BOOLOID, req->args,
+					   InvalidOid, req->inputcollid,
+					   COERCE_EXPLICIT_CALL);
+	    VariableStatData vardata;
+
+	    // An expression index knows best; next come the path stats of
+	    // the column itself (see "Path statistics").
+	    examine_variable(req->root, (Node*) fexpr, req->varRelid, &vardata);
+	    bool have_expr_stats = HeapTupleIsValid(vardata.statsTuple);
+	    ReleaseVariableStats(vardata);
+
+	    if(have_expr_stats || !_stats_boolean_sel(req->root, req->args, req->varRelid, &req->selectivity)) {
+		req->selectivity = boolvarsel(req->root, (Node*) fexpr, req->varRelid);
+	    }
+	    CLAMP_PROBABILITY(req->selectivity);
+	    ret = (Node*) req;
+	}
+
+    } else if(IsA(rawreq, SupportRequestCost)) {
+	// Start from the COST in the catalog and charge a quarter of it again
+	// for every dotpath segment past the first:  each one is another
+	// container to walk.  A non-constant path gets the catalog cost.
+	SupportRequestCost* req = (SupportRequestCost*) rawreq;
+	List* args = NIL;
+	int nsegs = 1;
+
+	if(req->node != NULL && IsA(req->node, FuncExpr)) {
+	    args = ((FuncExpr*) req->node)->args;
+	} else if(req->node != NULL && IsA(req->node, OpExpr)) {
+	    args = ((OpExpr*) req->node)->args;
+	}
+
+	if(list_length(args) >= 2 && IsA(lsecond(args), Const) && !((Const*) lsecond(args))->constisnull) {
+	    char* path = TextDatumGetCString(((Const*) lsecond(args))->constvalue);
+	    for(const char* p = path; *p; p++) {
+		if(*p == '.') nsegs++;
+	    }
+	    pfree(path);
+	}
+
+	req->startup = 0;
+	req->per_tuple = get_func_cost(req->funcid) * cpu_operator_cost * (1.0 + 0.25 * (nsegs - 1));
+	ret = (Node*) req;
+    }
+
+    PG_RETURN_POINTER(ret);
+}
+
+
+//
+//  GIN index support
+//
+//  Along the lines of jsonb_path_ops, each document is boiled down to a
+//  set of int4 hash keys:
+//    P-keys:  one per element, the hash of its full dotpath (array items
+//             by index).  These answer  doc ? 'a.b.0'  and ?| / ?&.
+//    V-keys:  one per scalar leaf, the hash of its path (array indexes
+//             left out, so order in arrays does not matter) and its typed
+//             value.  These answer  doc @> '{"a":{"b":3}}'.
+//  Hashes can collide so every match is rechecked with the real operator.
+//
+//  "Typed value" means the BSON type counts:  the string "3" is not the
+//  number 3.  Numbers are the exception:  int32 3, int64 3 and double 3.0
+//  are all the same number, as in MongoDB, and hash the same.
+//
+
+#define BSON_GIN_PATH_SEED   0x50415448   // "PATH"
+#define BSON_GIN_VALUE_SEED  0x56414c55   // "VALU"
+
+// Strategy numbers are the same as jsonb's.
+#define BSON_CONTAINS_STRATEGY    7
+#define BSON_EXISTS_STRATEGY      9
+#define BSON_EXISTS_ANY_STRATEGY  10
+#define BSON_EXISTS_ALL_STRATEGY  11
+#define BSON_MATCH_STRATEGY       16
+
+// Numbers compare (and hash) by value, not by BSON type:  anything integral
+// that fits is an int64, all else is a double.  Returns false if not a number.
+static bool _iter_canonical_number(const bson_iter_t* iter, int64_t* ival, double* dval, bool* is_int)
+{
+    switch(bson_iter_type(iter)) {
+    case BSON_TYPE_INT32:
+	*ival = bson_iter_int32(iter);
+	*is_int = true;
+	return true;
+    case BSON_TYPE_INT64:
+	*ival = bson_iter_int64(iter);
+	*is_int = true;
+	return true;
+    case BSON_TYPE_DOUBLE: {
+	double d = bson_iter_double(iter);
+	// 9.2e18 keeps us safely inside int64 range
+	if(d == trunc(d) && fabs(d) < 9.2e18) {
+	    *ival = (int64_t) d;
+	    *is_int = true;
+	} else {
+	    *dval = d;
+	    *is_int = false;
+	}
+	return true;
+    }
+    default:
+	return false;
+    }
+}
+
+static uint32 _hash_bson_scalar(const bson_iter_t* iter)
+{
+    int64_t ival;
+    double dval;
+    bool is_int;
+
+    if(_iter_canonical_number(iter, &ival, &dval, &is_int)) {
+	if(is_int) {
+	    return hash_combine(BSON_TYPE_INT64, hash_bytes((const unsigned char*) &ival, sizeof(ival)));
+	}
+	return hash_combine(BSON_TYPE_DOUBLE, hash_bytes((const unsigned char*) &dval, sizeof(dval)));
+    }
+
+    uint32_t len;
+    const uint8_t* p = _iter_value_bytes(iter, &len);
+    return hash_combine(bson_iter_type(iter), hash_bytes(p, len));
+}
+
+// Equality that agrees with _hash_bson_scalar.
+static bool _bson_scalars_equal(const bson_iter_t* a, const bson_iter_t* b)
+{
+    int64_t ia, ib;
+    double da, db;
+    bool inta, intb;
+
+    bool na = _iter_canonical_number(a, &ia, &da, &inta);
+    bool nb = _iter_canonical_number(b, &ib, &db, &intb);
+    if(na || nb) {
+	if(!(na && nb) || inta != intb) return false;
+	return inta ? (ia == ib) : (memcmp(&da, &db, sizeof(double)) == 0);
+    }
+    
+    if(bson_iter_type(a) != bson_iter_type(b)) {
+	return false;
+    }
+
+    uint32_t la, lb;
+    const uint8_t* pa = _iter_value_bytes(a, &la);
+    const uint8_t* pb = _iter_value_bytes(b, &lb);
+    return la == lb && memcmp(pa, pb, la) == 0;
+}
+
+static bool _value_contains(const bson_iter_t* a, const bson_iter_t* b);
+
+// Does container a (iter positioned before its first item) contain
+// container b?  Documents:  every key in b is in a with a value that
+// contains b's value.  Arrays:  every item of b is contained by SOME item
+// of a, in any order.
+static bool _container_contains(const bson_iter_t* a_start, bson_iter_t* b, bool is_array)
+{
+    while(bson_iter_next(b)) {
+	bson_iter_t a = *a_start;
+	bool found = false;
+
+	if(is_array) {
+	    while(!found && bson_iter_next(&a)) {
+		found = _value_contains(&a, b);
+	    }
+	} else {
+	    const char* key = bson_iter_key(b);
+	    while(bson_iter_next(&a)) {
+		if(strcmp(bson_iter_key(&a), key) == 0) {
+		    // first match wins, same as the dotpath accessors:
+		    found = _value_contains(&a, b);
+		    break;
+		}
+	    }
+	}
+
+	if(!found) {
+	    return false;
+	}
+    }
+    return true;
+}
+
+static bool _value_contains(const bson_iter_t* a, const bson_iter_t* b)
+{
+    check_stack_depth();
+
+    bson_type_t ta = bson_iter_type(a);
+    bson_type_t tb = bson_iter_type(b);
+    bson_iter_t ca;
+    bson_iter_t cb;
+
+    if((ta == BSON_TYPE_DOCUMENT || ta == BSON_TYPE_ARRAY) && ta == tb) {
+	if(!bson_iter_recurse(a, &ca) || !bson_iter_recurse(b, &cb)) return false;
+	return _container_contains(&ca, &cb, ta == BSON_TYPE_ARRAY);
+    }
+
+    if(ta == BSON_TYPE_ARRAY) {
+	// MongoDB style:  {"tags":"red"} is contained by {"tags":["red","blue"]}
+	if(!bson_iter_recurse(a, &ca)) return false;
+	while(bson_iter_next(&ca)) {
+	    if(_value_contains(&ca, b)) return true;
+	}
+	return false;
+    }
+
+    if(ta == BSON_TYPE_DOCUMENT || tb == BSON_TYPE_DOCUMENT || tb == BSON_TYPE_ARRAY) {
+	return false;
+    }
+    
+    return _bson_scalars_equal(a, b);
+}
+
+static bool _bson_contains(bson_t* a, bson_t* b)
+{
+    bson_iter_t ia;
+    bson_iter_t ib;
+
+    if(!bson_iter_init(&ia, a) || !bson_iter_init(&ib, b)) {
+	ereport(
+	    ERROR,
+	    (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("iter BSON bytes corrupted"))
+	    );
+    }
+    return _container_contains(&ia, &ib, false);
+}
+
+static bool _bson_exists(bson_t* b, BsonPath* path)
+{
+    bson_iter_t iter;
+    bson_iter_t target;
+
+    if(!bson_iter_init(&iter, b)) {
+	ereport(
+	    ERROR,
+	    (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("iter BSON bytes corrupted"))
+	    );
+    }
+    return _find_descendant(&iter, path, &target);
+}
+
+
+PG_FUNCTION_INFO_V1(bson_contains);  // bool bson_contains(bson, bson), the @> operator
+Datum bson_contains(PG_FUNCTION_ARGS)
+{
+    bytea* first = BSON_GETARG_BSON(0);
+    bytea* second = BSON_GETARG_BSON(1);
+
+    bson_t b1; // on stack
+    BSON_STATIC_INIT(&b1, first);
+    bson_t b2; // on stack
+    BSON_STATIC_INIT(&b2, second);
+
+    bool rc = _bson_contains(&b1, &b2);
+
+    PG_FREE_IF_COPY(first,0);
+    PG_FREE_IF_COPY(second,1);
+
+    PG_RETURN_BOOL(rc);
+}
+
+PG_FUNCTION_INFO_V1(bson_contained);  // bool bson_contained(bson, bson), the <@ operator
+Datum bson_contained(PG_FUNCTION_ARGS)
+{
+    bytea* first = BSON_GETARG_BSON(0);
+    bytea* second = BSON_GETARG_BSON(1);
+
+    bson_t b1; // on stack
+    BSON_STATIC_INIT(&b1, first);
+    bson_t b2; // on stack
+    BSON_STATIC_INIT(&b2, second);
+
+    bool rc = _bson_contains(&b2, &b1);
+
+    PG_FREE_IF_COPY(first,0);
+    PG_FREE_IF_COPY(second,1);
+
+    PG_RETURN_BOOL(rc);
+}
+
+PG_FUNCTION_INFO_V1(bson_exists);  // bool bson_exists(bson, dotpath), the ? operator
+Datum bson_exists(PG_FUNCTION_ARGS)
+{
+    bytea* aa = BSON_GETARG_BSON(0);
+    BsonPath* dotpath = BSON_GETARG_PATH(1);
+
+    bson_t b; // on stack
+    BSON_STATIC_INIT(&b,aa);
+
+    bool rc = _bson_exists(&b, dotpath);
+
+    PG_FREE_IF_COPY(aa,0);
+
+    PG_RETURN_BOOL(rc);
+}
+
+// ?| and ?& :  any/all paths in the array exist.  NULL paths are ignored.
+static bool _bson_exists_array(FunctionCallInfo fcinfo, bool want_all)
+{
+    bytea* aa = BSON_GETARG_BSON(0);
+    BsonExtractPaths* xp = _get_cached_extract_paths(fcinfo, PG_GETARG_ARRAYTYPE_P(1));
+
+    bson_t b; // on stack
+    BSON_STATIC_INIT(&b,aa);
+
+    bool rc = want_all;
+    for(int i = 0; i < xp->npaths; i++) {
+	if(xp->paths[i] == NULL) continue;
+	if(_bson_exists(&b, xp->paths[i]) != want_all) {
+	    rc = !want_all;
+	    break;
+	}
+    }
+
+    PG_FREE_IF_COPY(aa,0);
+
+    return rc;
+}
+
+PG_FUNCTION_INFO_V1(bson_exists_any);
+Datum bson_exists_any(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(_bson_exists_array(fcinfo, false));
+}
+
+PG_FUNCTION_INFO_V1(bson_exists_all);
+Datum bson_exists_all(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(_bson_exists_array(fcinfo, true));
+}
+
+
+// A growable array of GIN keys.
+typedef struct
+{
+    Datum* keys;
+    int n;
+    int max;
+} BsonGinKeys;
+
+static void _gin_add_key(BsonGinKeys* gk, uint32 h)
+{
+    if(gk->n == gk->max) {
+	gk->max *= 2;
+	gk->keys = (Datum*) repalloc(gk->keys, gk->max * sizeof(Datum));
+    }
+    gk->keys[gk->n++] = Int32GetDatum((int32) h);
+}
+
+static uint32 _hash_segment(uint32 h, const char* seg, int len)
+{
+    return hash_combine(h, hash_bytes((const unsigned char*) seg, len));
+}
+
+// vpath is the hash of the path without array indexes (for V-keys),
+// ppath is the hash of the full path (for P-keys).
+static void _gin_extract(bson_iter_t* iter, bool in_array, uint32 vpath, uint32 ppath,
+			 BsonGinKeys* gk, bool want_paths)
+{
+    check_stack_depth();
+
+    while(bson_iter_next(iter)) {
+	const char* key = bson_iter_key(iter);
+	int klen = strlen(key);
+
+	uint32 pp = _hash_segment(ppath, key, klen);
+	uint32 vp = in_array ? vpath : _hash_segment(vpath, key, klen);
+
+	if(want_paths) {
+	    _gin_add_key(gk, hash_combine(BSON_GIN_PATH_SEED, pp));
+	}
+
+	if(BSON_ITER_HOLDS_DOCUMENT(iter) || BSON_ITER_HOLDS_ARRAY(iter)) {
+	    bson_iter_t child;
+	    if(bson_iter_recurse(iter, &child)) {
+		_gin_extract(&child, BSON_ITER_HOLDS_ARRAY(iter), vp, pp, gk, want_paths);
+	    }
+	} else {
+	    _gin_add_key(gk, hash_combine(hash_combine(BSON_GIN_VALUE_SEED, vp), _hash_bson_scalar(iter)));
+	}
+    }
+}
+
+static Datum* _gin_extract_bson(bytea* aa, bool want_paths, int32* nentries)
+{
+    bson_t b; // on stack
+    BSON_STATIC_INIT(&b,aa);
+
+    bson_iter_t iter;
+    if(!bson_iter_init(&iter, &b)) {
+	ereport(
+	    ERROR,
+	    (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("iter BSON bytes corrupted"))
+	    );
+    }
+
+    BsonGinKeys gk;
+    gk.n = 0;
+    gk.max = 16;
+    gk.keys = (Datum*) palloc(gk.max * sizeof(Datum));
+
+    _gin_extract(&iter, false, 0, 0, &gk, want_paths);
+
+    *nentries = gk.n;
+    return gk.keys;
+}
+
+static uint32 _gin_path_key(const char* dotpath, int len)
+{
+    BsonPath* path = _parse_dotpath(dotpath, len);
+    uint32 h = 0;
+
+    for(int d = 0; d < path->nsegs; d++) {
+	h = _hash_segment(h, path->segs[d], path->seglens[d]);
+    }
+    pfree(path);
+
+    return hash_combine(BSON_GIN_PATH_SEED, h);
+}
+
+// gin_extract_bson(bson, internal, internal)
+PG_FUNCTION_INFO_V1(gin_extract_bson);
+Datum gin_extract_bson(PG_FUNCTION_ARGS)
+{
+    bytea* aa = BSON_GETARG_BSON(0);
+    int32* nentries = (int32*) PG_GETARG_POINTER(1);
+
+    Datum* entries = _gin_extract_bson(aa, true, nentries);
+
+    PG_RETURN_POINTER(entries);
+}
+
+//
+//  Query filters
+//
+//  bson_match(doc, filter), the @@ operator, tests doc against a MongoDB
+//  style query filter right on the BSON bytes, e.g.
+//    {"status": "A", "qty": {"$gte": 10, "$lt": 20}}
+//    {"$or": [{"tags": "red"}, {"dims.h": {"$exists": false}}]}
+//  Field operators are $eq $ne $gt $gte $lt $lte $in $nin $all $exists
+//  $type $size $elemMatch and $not; $and, $or and $nor combine filters.
+//  A field name is a dotpath that goes through arrays the MongoDB way:
+//  "items.sku" looks at sku in every document of the array items, and a
+//  numeric segment also picks an item by position.  A condition holds if
+//  it holds for a value found there or, when that is an array, for any of
+//  its items; $ne, $nin and $not are the opposite of the whole test, and
+//  {"f": null} also matches when f is missing.
+//
+//  Values are never converted.  Ranges compare only values of the same
+//  kind (all numbers, decimal128 included, are one kind, as are strings,
+//  datetimes, ...) in the btree order, and equality is that of @>.  The
+//  first condition that fails ends the evaluation.
+//
+//  The same walk over the filter is the GIN consistent function for @@.
+//  gin_extract_bson_query collects the @> style value key of every plain
+//  equality, including those in $in and $all, in filter order.  Given the
+//  item's check[] for those keys, an equality is "maybe" if its key is
+//  there and false if not, every other condition is "maybe", and $and,
+//  $or and the negations combine the three values as usual.  If the
+//  filter can hold with none of the keys present, the scan looks at
+//  every item.
+//
+
+typedef enum
+{
+    BSON_MATCH_EQ,
+    BSON_MATCH_GT,
+    BSON_MATCH_GTE,
+    BSON_MATCH_LT,
+    BSON_MATCH_LTE,
+    BSON_MATCH_EXISTS,
+    BSON_MATCH_TYPE,
+    BSON_MATCH_SIZE,
+    BSON_MATCH_ELEM_MATCH
+} BsonMatchOp;
+
+// Where a condition looks:  path in the document that doc is before the
+// first item of, or (inside $elemMatch) just the one value.  In an index
+// scan there is only the path.
+typedef struct
+{
+    const bson_iter_t* doc;
+    BsonPath* path;
+    const bson_iter_t* value;
+} BsonMatchTarget;
+
+// Evaluating for an index item instead of a document.
+typedef struct
+{
+    BsonGinKeys* keys;   // gin_extract_bson_query:  collect the keys here
+    const bool* check;   // gin_consistent_bson:  which of them the item has
+    int nkeys;           // equalities seen so far
+} BsonMatchIndex;
+
+static GinTernaryValue _match_filter(const bson_iter_t* doc, const bson_iter_t* filter, BsonMatchIndex* ix);
+static GinTernaryValue _match_ops(const BsonMatchTarget* t, const bson_iter_t* cond, BsonMatchIndex* ix);
+
+static GinTernaryValue _tri_and(GinTernaryValue a, GinTernaryValue b)
+{
+    if(a == GIN_FALSE || b == GIN_FALSE) return GIN_FALSE;
+    return (a == GIN_TRUE && b == GIN_TRUE) ? GIN_TRUE : GIN_MAYBE;
+}
+
+static GinTernaryValue _tri_or(GinTernaryValue a, GinTernaryValue b)
+{
+    if(a == GIN_TRUE || b == GIN_TRUE) return GIN_TRUE;
+    return (a == GIN_FALSE && b == GIN_FALSE) ? GIN_FALSE : GIN_MAYBE;
+}
+
+static GinTernaryValue _tri_not(GinTernaryValue a)
+{
+    if(a == GIN_MAYBE) return GIN_MAYBE;
+    return (a == GIN_TRUE) ? GIN_FALSE : GIN_TRUE;
+}
+
+// Is cond a document of operators, {"$gt": 1, ...}?  If so op is
+// positioned before the first of them.
+static bool _is_op_doc(const bson_iter_t* cond, bson_iter_t* op)
+{
+    bson_iter_t first;
+
+    if(!BSON_ITER_HOLDS_DOCUMENT(cond) || !bson_iter_recurse(cond, op)) {
+	return false;
+    }
+    first = *op;
+    if(!bson_iter_next(&first)) {
+	return false;  // {} is a value
+    }
+
+    const char* key = bson_iter_key(&first);
+    return key[0] == '$' && strcmp(key, "$and") != 0 && strcmp(key, "$or") != 0 && strcmp(key, "$nor") != 0;
+}
+
+static bool _match_equal(const bson_iter_t* v, const bson_iter_t* arg)
+{
+    bson_type_t ta = bson_iter_type(arg);
+
+    if(ta == BSON_TYPE_NULL) {
+	return v == NULL || BSON_ITER_HOLDS_NULL(v) || bson_iter_type(v) == BSON_TYPE_UNDEFINED;
+    }
+    if(v == NULL) {
+	return false;
+    }
+    if(ta == BSON_TYPE_DOCUMENT || ta == BSON_TYPE_ARRAY) {
+	return bson_iter_type(v) == ta && _bson_compare_values(v, arg) == 0;
+    }
+    return _bson_scalars_equal(v, arg);
+}
+
+// $type takes the $type names of bson_count_type, "number", or a BSON
+// type number (-1 is minKey).
+static bool _match_type(const bson_iter_t* v, const bson_iter_t* arg)
+{
+    bson_type_t t = bson_iter_type(v);
+    int64_t ival;
+    double dval;
+    bool is_int;
+
+    if(BSON_ITER_HOLDS_UTF8(arg)) {
+	const char* name = bson_iter_utf8(arg, NULL);
+	if(strcmp(name, "number") == 0) {
+	    return _bson_type_rank(t) == 3;
+	}
+	int slot = _count_type_slot(t);
+	return slot != 0 && strcmp(name, bson_count_type_names[slot]) == 0;
+    }
+    if(_iter_canonical_number(arg, &ival, &dval, &is_int) && is_int) {
+	return (ival == -1) ? (t == BSON_TYPE_MINKEY) : ((int64_t) t == ival);
+    }
+    return false;
+}
+
+// One $elemMatch argument against one array item:  either conditions on
+// the item itself, {"$gt": 1}, or a filter on an item that is a document.
+static bool _match_elem(const bson_iter_t* item, const bson_iter_t* arg)
+{
+    bson_iter_t sub;
+
+    if(_is_op_doc(arg, &sub)) {
+	BsonMatchTarget t = {NULL, NULL, item};
+	return _match_ops(&t, arg, NULL) == GIN_TRUE;
+    }
+
+    bson_iter_t child;
+    return BSON_ITER_HOLDS_DOCUMENT(item) && bson_iter_recurse(item, &child)
+	&& bson_iter_recurse(arg, &sub) && _match_filter(&child, &sub, NULL) == GIN_TRUE;
+}
+
+// Does v pass?  v is NULL when there is nothing at the path.
+static bool _match_value(const bson_iter_t* v, BsonMatchOp op, const bson_iter_t* arg)
+{
+    switch(op) {
+    case BSON_MATCH_EQ: {
+	return _match_equal(v, arg);
+    }
+    case BSON_MATCH_GT:
+    case BSON_MATCH_GTE:
+    case BSON_MATCH_LT:
+    case BSON_MATCH_LTE: {
+	if(v == NULL || _bson_type_rank(bson_iter_type(v)) != _bson_type_rank(bson_iter_type(arg))) {
+	    return false;
+	}
+	int c = _bson_compare_values(v, arg);
+	return (op == BSON_MATCH_GT) ? (c > 0) : (op == BSON_MATCH_GTE) ? (c >= 0) : (op == BSON_MATCH_LT) ? (c < 0) : (c <= 0);
+    }
+    case BSON_MATCH_EXISTS: {
+	return v != NULL;
+    }
+    case BSON_MATCH_TYPE: {
+	return v != NULL && _match_type(v, arg);
+    }
+    case BSON_MATCH_SIZE: {
+	int64_t want;
+	double dval;
+	bool is_int;
+	bson_iter_t item;
+
+	if(v == NULL || !BSON_ITER_HOLDS_ARRAY(v) || !bson_iter_recurse(v, &item)
+	   || !_iter_canonical_number(arg, &want, &dval, &is_int) || !is_int) {
+	    return false;
+	}
+	int64_t n = 0;
+	while(bson_iter_next(&item)) {
+	    n++;
+	}
+	return n == want;
+    }
+    case BSON_MATCH_ELEM_MATCH: {
+	bson_iter_t item;
+
+	if(v == NULL || !BSON_ITER_HOLDS_ARRAY(v) || !bson_iter_recurse(v, &item)) {
+	    return false;
+	}
+	while(bson_iter_next(&item)) {
+	    if(_match_elem(&item, arg)) return true;
+	}
+	return false;
+    }
+    }
+    return false;
+}
+
+// The value at the end of the path, or any item of it if it is an array.
+// $size and $elemMatch are about the array itself.
+static bool _match_leaf(const bson_iter_t* v, BsonMatchOp op, const bson_iter_t* arg)
+{
+    if(_match_value(v, op, arg)) {
+	return true;
+    }
+
+    bson_iter_t item;
+    if(v != NULL && BSON_ITER_HOLDS_ARRAY(v) && op != BSON_MATCH_SIZE && op != BSON_MATCH_ELEM_MATCH
+       && bson_iter_recurse(v, &item)) {
+	while(bson_iter_next(&item)) {
+	    if(_match_value(&item, op, arg)) return true;
+	}
+    }
+    return false;
+}
+
+static bool _match_path(const bson_iter_t* v, BsonPath* path, int d, BsonMatchOp op, const bson_iter_t* arg);
+
+// Segment d of path in the document that start is before the first item of.
+static bool _match_path_in(const bson_iter_t* start, BsonPath* path, int d, BsonMatchOp op, const bson_iter_t* arg)
+{
+    bson_iter_t it = *start;
+
+    if(!_find_segment(&it, path, d, false)) {
+	return _match_value(NULL, op, arg);
+    }
+    return _match_path(&it, path, d, op, arg);
+}
+
+// v holds the value of segment d of path.
+static bool _match_path(const bson_iter_t* v, BsonPath* path, int d, BsonMatchOp op, const bson_iter_t* arg)
+{
+    check_stack_depth();
+
+    if(d == path->nsegs - 1) {
+	return _match_leaf(v, op, arg);
+    }
+
+    bson_iter_t child;
+    if(BSON_ITER_HOLDS_DOCUMENT(v)) {
+	return bson_iter_recurse(v, &child) && _match_path_in(&child, path, d + 1, op, arg);
+    }
+    if(!BSON_ITER_HOLDS_ARRAY(v) || !bson_iter_recurse(v, &child)) {
+	return _match_value(NULL, op, arg);  // a scalar in the way
+    }
+
+    // "a.1.b":  b in the second item of a ...
+    bson_iter_t item = child;
+    if(path->idx[d + 1] >= 0 && _find_segment(&item, path, d + 1, true)
+       && _match_path(&item, path, d + 1, op, arg)) {
+	return true;
+    }
+
+    // ... and "a.b":  b in any document in a
+    item = child;
+    while(bson_iter_next(&item)) {
+	bson_iter_t sub;
+	if(BSON_ITER_HOLDS_DOCUMENT(&item) && bson_iter_recurse(&item, &sub)
+	   && _match_path_in(&sub, path, d + 1, op, arg)) {
+	    return true;
+	}
+    }
+    return false;
+}
+
+// The @> value key that a document matching an equality must have, if
+// there is one:  a scalar other than null, on a path without positions
+// (the value keys leave array positions out).
+static bool _match_eq_key(BsonPath* path, const bson_iter_t* arg, uint32* key)
+{
+    switch(bson_iter_type(arg)) {
+    case BSON_TYPE_DOCUMENT:
+    case BSON_TYPE_ARRAY:
+    case BSON_TYPE_NULL:
+    case BSON_TYPE_UNDEFINED:
+	return false;
+    default:
+	break;
+    }
+
+    uint32 vp = 0;
+    for(int d = 0; d < path->nsegs; d++) {
+	if(path->idx[d] >= 0) {
+	    return false;
+	}
+	vp = _hash_segment(vp, path->segs[d], path->seglens[d]);
+    }
+
+    *key = hash_combine(hash_combine(BSON_GIN_VALUE_SEED, vp), _hash_bson_scalar(arg));
+    return true;
+}
+
+// One condition, e.g. {"$gt": 5}, on target.
+static GinTernaryValue _match_cond(const BsonMatchTarget* t, BsonMatchOp op, const bson_iter_t* arg, BsonMatchIndex* ix)
+{
+    if(ix == NULL) {
+	bool rc = (t->value != NULL) ? _match_leaf(t->value, op, arg) : _match_path_in(t->doc, t->path, 0, op, arg);
+	return rc ? GIN_TRUE : GIN_FALSE;
+    }
+
+    uint32 key;
+    if(op != BSON_MATCH_EQ || !_match_eq_key(t->path, arg, &key)) {
+	return GIN_MAYBE;
+    }
+
+    int k = ix->nkeys++;
+    if(ix->keys != NULL) {
+	_gin_add_key(ix->keys, key);
+    }
+    return (ix->check == NULL || ix->check[k]) ? GIN_MAYBE : GIN_FALSE;
+}
+
+// $in (some item is equal) and $all (every item is).
+static GinTernaryValue _match_list(const BsonMatchTarget* t, const bson_iter_t* list, bool all, BsonMatchIndex* ix)
+{
+    bson_iter_t item;
+
+    if(!BSON_ITER_HOLDS_ARRAY(list) || !bson_iter_recurse(list, &item)) {
+	ereport(
+	    ERROR,
+	    (errcode(ERRCODE_INVALID_PARAMETER_VALUE), errmsg("%s needs an array", bson_iter_key(list)))
+	    );
+    }
+
+    GinTernaryValue rc = all ? GIN_TRUE : GIN_FALSE;
+    int n = 0;
+    while((ix != NULL || rc == (all ? GIN_TRUE : GIN_FALSE)) && bson_iter_next(&item)) {
+	GinTernaryValue r = _match_cond(t, BSON_MATCH_EQ, &item, ix);
+	rc = all ? _tri_and(rc, r) : _tri_or(rc, r);
+	n++;
+    }
+    return (n == 0) ? GIN_FALSE : rc;  // {"$all": []} matches nothing
+}
+
+// The conditions cond puts on target:  {"$gt": 1, "$lt": 9}, or just a
+// value, which means $eq.
+static GinTernaryValue _match_ops(const BsonMatchTarget* t, const bson_iter_t* cond, BsonMatchIndex* ix)
+{
+    check_stack_depth();
+
+    bson_iter_t op;
+
+    if(!_is_op_doc(cond, &op)) {
+	return _match_cond(t, BSON_MATCH_EQ, cond, ix);
+    }
+
+    GinTernaryValue rc = GIN_TRUE;
+    while((ix != NULL || rc == GIN_TRUE) && bson_iter_next(&op)) {
+	const char* name = bson_iter_key(&op);
+	bson_iter_t sub;
+	GinTernaryValue r;
+
+	if(strcmp(name, "$eq") == 0) {
+	    r = _match_cond(t, BSON_MATCH_EQ, &op, ix);
+	} else if(strcmp(name, "$ne") == 0) {
+	    r = _tri_not(_match_cond(t, BSON_MATCH_EQ, &op, ix));
+	} else if(strcmp(name, "$gt") == 0) {
+	    r = _match_cond(t, BSON_MATCH_GT, &op, ix);
+	} else if(strcmp(name, "$gte") == 0) {
+	    r = _match_cond(t, BSON_MATCH_GTE, &op, ix);
+	} else if(strcmp(name, "$lt") == 0) {
+	    r = _match_cond(t, BSON_MATCH_LT, &op, ix);
+	} else if(strcmp(name, "$lte") == 0) {
+	    r = _match_cond(t, BSON_MATCH_LTE, &op, ix);
+	} else if(strcmp(name, "$in") == 0) {
+	    r = _match_list(t, &op, false, ix);
+	} else if(strcmp(name, "$nin") == 0) {
+	    r = _tri_not(_match_list(t, &op, false, ix));
+	} else if(strcmp(name, "$all") == 0) {
+	    r = _match_list(t, &op, true, ix);
+	} else if(strcmp(name, "$exists") == 0) {
+	    r = _match_cond(t, BSON_MATCH_EXISTS, &op, ix);
+	    if(!bson_iter_as_bool(&op)) {
+		r = _tri_not(r);
+	    }
+	} else if(strcmp(name, "$type") == 0) {
+	    r = _match_cond(t, BSON_MATCH_TYPE, &op, ix);
+	} else if(strcmp(name, "$size") == 0) {
+	    r = _match_cond(t, BSON_MATCH_SIZE, &op, ix);
+	} else if(strcmp(name, "$elemMatch") == 0 && BSON_ITER_HOLDS_DOCUMENT(&op)) {
+	    r = _match_cond(t, BSON_MATCH_ELEM_MATCH, &op, ix);
+	} else if(strcmp(name, "$not") == 0 && _is_op_doc(&op, &sub)) {
+	    r = _tri_not(_match_ops(t, &op, ix));
+	} else {
+	    ereport(
+		ERROR,
+		(errcode(ERRCODE_INVALID_PARAMETER_VALUE), errmsg("unsupported query operator %s", name))
+		);
+	}
+	rc = _tri_and(rc, r);
+    }
+    return rc;
+}
+
+// $and, $or and $nor:  an array of filters.
+static GinTernaryValue _match_logical(const bson_iter_t* doc, const bson_iter_t* op, BsonMatchIndex* ix)
+{
+    check_stack_depth();
+
+    const char* name = bson_iter_key(op);
+    bool is_and = (strcmp(name, "$and") == 0);
+    bool is_nor = (strcmp(name, "$nor") == 0);
+    bson_iter_t item;
+
+    if(!is_and && !is_nor && strcmp(name, "$or") != 0) {
+	ereport(
+	    ERROR,
+	    (errcode(ERRCODE_INVALID_PARAMETER_VALUE), errmsg("unsupported query operator %s", name))
+	    );
+    }
+    if(!BSON_ITER_HOLDS_ARRAY(op) || !bson_iter_recurse(op, &item)) {
+	ereport(
+	    ERROR,
+	    (errcode(ERRCODE_INVALID_PARAMETER_VALUE), errmsg("%s needs an array of filters", name))
+	    );
+    }
+
+    // $or and $nor both look for a filter that holds
+    GinTernaryValue rc = is_and ? GIN_TRUE : GIN_FALSE;
+    int n = 0;
+    while((ix != NULL || rc == (is_and ? GIN_TRUE : GIN_FALSE)) && bson_iter_next(&item)) {
+	bson_iter_t sub;
+	if(!BSON_ITER_HOLDS_DOCUMENT(&item) || !bson_iter_recurse(&item, &sub)) {
+	    ereport(
+		ERROR,
+		(errcode(ERRCODE_INVALID_PARAMETER_VALUE), errmsg("%s needs an array of filters", name))
+		);
+	}
+	GinTernaryValue r = _match_filter(doc, &sub, ix);
+	rc = is_and ? _tri_and(rc, r) : _tri_or(rc, r);
+	n++;
+    }
+    if(n == 0) {
+	ereport(
+	    ERROR,
+	    (errcode(ERRCODE_INVALID_PARAMETER_VALUE), errmsg("%s needs a nonempty array", name))
+	    );
+    }
+    return is_nor ? _tri_not(rc) : rc;
+}
+
+// filter is positioned before the first item of a filter document, and
+// doc likewise for the document (NULL in an index scan).
+static GinTernaryValue _match_filter(const bson_iter_t* doc, const bson_iter_t* filter, BsonMatchIndex* ix)
+{
+    check_stack_depth();
+
+    bson_iter_t f = *filter;
+    GinTernaryValue rc = GIN_TRUE;
+
+    while((ix != NULL || rc == GIN_TRUE) && bson_iter_next(&f)) {
+	const char* key = bson_iter_key(&f);
+	GinTernaryValue r;
+
+	if(key[0] == '$') {
+	    r = _match_logical(doc, &f, ix);
+	} else {
+	    BsonMatchTarget t = {doc, _parse_dotpath(key, strlen(key)), NULL};
+	    r = _match_ops(&t, &f, ix);
+	    pfree(t.path);
+	}
+	rc = _tri_and(rc, r);
+    }
+    return rc;
+}
+
+// The filter in aa evaluated on what ix knows about an index item.
+static GinTernaryValue _match_index(bytea* aa, BsonMatchIndex* ix)
+{
+    bson_t b; // on stack
+    BSON_STATIC_INIT(&b, aa);
+
+    bson_iter_t iter;
+    if(!bson_iter_init(&iter, &b)) {
+	ereport(
+	    ERROR,
+	    (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("iter BSON bytes corrupted"))
+	    );
+    }
+    return _match_filter(NULL, &iter, ix);
+}
+
+PG_FUNCTION_INFO_V1(bson_match);  // bool bson_match(bson, bson), the @@ operator
+Datum bson_match(PG_FUNCTION_ARGS)
+{
+    bytea* first = BSON_GETARG_BSON(0);
+    bytea* second = BSON_GETARG_BSON(1);
+
+    bson_t b1; // on stack
+    BSON_STATIC_INIT(&b1, first);
+    bson_t b2; // on stack
+    BSON_STATIC_INIT(&b2, second);
+
+    bson_iter_t doc;
+    bson_iter_t filter;
+    if(!bson_iter_init(&doc, &b1) || !bson_iter_init(&filter, &b2)) {
+	ereport(
+	    ERROR,
+	    (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("iter BSON bytes corrupted"))
+	    );
+    }
+
+    bool rc = (_match_filter(&doc, &filter, NULL) == GIN_TRUE);
+
+    PG_FREE_IF_COPY(first,0);
+    PG_FREE_IF_COPY(second,1);
+
+    PG_RETURN_BOOL(rc);
+}
+
+
+// gin_extract_bson_query(query, internal, int2, internal, internal, internal, internal)
+PG_FUNCTION_INFO_V1(gin_extract_bson_query);
+Datum gin_extract_bson_query(PG_FUNCTION_ARGS)
+{
+    int32* nentries = (int32*) PG_GETARG_POINTER(1);
+    StrategyNumber strategy = PG_GETARG_UINT16(2);
+    int32* searchMode = (int32*) PG_GETARG_POINTER(6);
+    Datum* entries = NULL;
+
+    switch(strategy) {
+    case BSON_CONTAINS_STRATEGY: {
+	entries = _gin_extract_bson(BSON_GETARG_BSON(0), false, nentries);
+	// {} or only empty subdocs/arrays:  everything contains that.
+	if(*nentries == 0) {
+	    *searchMode = GIN_SEARCH_MODE_ALL;
+	}
+	break;
+    }
+    case BSON_EXISTS_STRATEGY: {
+	text* dotpath = PG_GETARG_TEXT_PP(0);
+	entries = (Datum*) palloc(sizeof(Datum));
+	entries[0] = Int32GetDatum((int32) _gin_path_key(VARDATA_ANY(dotpath), VARSIZE_ANY_EXHDR(dotpath)));
+	*nentries = 1;
+	break;
+    }
+    case BSON_EXISTS_ANY_STRATEGY:
+    case BSON_EXISTS_ALL_STRATEGY: {
+	Datum* pathdatums;
+	bool* pathnulls;
+	int npaths;
+	deconstruct_array(PG_GETARG_ARRAYTYPE_P(0), TEXTOID, -1, false, TYPALIGN_INT,
+			  &pathdatums, &pathnulls, &npaths);
+
+	entries = (Datum*) palloc((npaths + 1) * sizeof(Datum));
+	int n = 0;
+	for(int i = 0; i < npaths; i++) {
+	    if(!pathnulls[i]) {
+		text* dotpath = DatumGetTextPP(pathdatums[i]);
+		entries[n++] = Int32GetDatum((int32) _gin_path_key(VARDATA_ANY(dotpath), VARSIZE_ANY_EXHDR(dotpath)));
+	    }
+	}
+	*nentries = n;
+	// ?& of nothing is true for everything; ?| of nothing matches nothing,
+	// which is what nentries = 0 in default mode means.
+	if(n == 0 && strategy == BSON_EXISTS_ALL_STRATEGY) {
+	    *searchMode = GIN_SEARCH_MODE_ALL;
+	}
+	break;
+    }
+    case BSON_MATCH_STRATEGY: {
+	bytea* filter = BSON_GETARG_BSON(0);
+	BsonGinKeys gk;
+	gk.n = 0;
+	gk.max = 16;
+	gk.keys = (Datum*) palloc(gk.max * sizeof(Datum));
+
+	BsonMatchIndex ix = {&gk, NULL, 0};
+	_match_index(filter, &ix);
+
+	// If the filter can hold for an item with none of the keys, e.g.
+	// {"a": {"$ne": 1}}, the keys cannot narrow the scan.
+	ix.keys = NULL;
+	ix.check = (bool*) palloc0((gk.n + 1) * sizeof(bool));
+	ix.nkeys = 0;
+	if(_match_index(filter, &ix) != GIN_FALSE) {
+	    *searchMode = GIN_SEARCH_MODE_ALL;
+	}
+
+	entries = gk.keys;
+	*nentries = gk.n;
+	break;
+    }
+    default: {
+	elog(ERROR, "unrecognized strategy number: %d", strategy);
+    }
+    }
+
+    PG_RETURN_POINTER(entries);
+}
+
+// gin_consistent_bson(internal, int2, query, int4, internal, internal, internal, internal)
+PG_FUNCTION_INFO_V1(gin_consistent_bson);
+Datum gin_consistent_bson(PG_FUNCTION_ARGS)
+{
+    bool* check = (bool*) PG_GETARG_POINTER(0);
+    StrategyNumber strategy = PG_GETARG_UINT16(1);
+    int32 nkeys = PG_GETARG_INT32(3);
+    bool* recheck = (bool*) PG_GETARG_POINTER(5);
+
+    bool rc = (strategy != BSON_EXISTS_ANY_STRATEGY);
+
+    // Hash keys can collide:  always recheck.
+    *recheck = true;
+
+    if(strategy == BSON_MATCH_STRATEGY) {
+	BsonMatchIndex ix = {NULL, check, 0};
+	PG_RETURN_BOOL(_match_index(BSON_GETARG_BSON(2), &ix) != GIN_FALSE);
+    }
+
+    for(int32 i = 0; i < nkeys; i++) {
+	if(strategy == BSON_EXISTS_ANY_STRATEGY) {
+	    if(check[i]) {
+		rc = true;
+		break;
+	    }
+	} else if(!check[i]) {
+	    rc = false;
+	    break;
+	}
+    }
+
+    PG_RETURN_BOOL(rc);
+}
+
+
+//
+//  Path statistics
+//
+//  Expression indexes aside, the planner sees a bson column as one opaque
+//  value.  bson_typanalyze lets ANALYZE compute the standard stats as
+//  usual and then walks the sampled documents (into subdocuments; arrays
+//  are leaves) to keep, for the pgbson.analyze_paths most common dotpaths,
+//  one small bson document:
+//    path    the dotpath
+//    frac    fraction of rows that have it
+//    vfrac   ... with a scalar there, and afrac ... with an array there
+//    ndv     estimated number of distinct scalar values in the table
+//    types   $type name -> fraction of the rows that have the path
+//    mcv     most common values, and mcf their fractions of all rows
+//  They all go into one extra pg_statistic slot of our own kind.  The
+//  estimators for @>, ?, ?| and ?& and the planner support for a bare
+//  bson_get_boolean() read them back.
+//
+//  Values are told apart the way the GIN keys are:  int32 3, int64 3 and
+//  double 3.0 are one value.
+//
+
+// Anything outside core's 1..99 will do; this is "BS".
+#define STATISTIC_KIND_BSON_PATHS  16979
+
+#define BSON_STATS_PATH_MAX   256        // longer dotpaths are not tracked
+#define BSON_STATS_TRACK_MAX  256        // distinct dotpaths followed per column
+#define BSON_STATS_VALUE_MAX  256        // wider values count as distinct but are not kept
+#define BSON_STATS_ARENA_MAX  (64 * 1024 * 1024)
+#define BSON_STATS_MCV_MAX    25
+
+#if PG_VERSION_NUM >= 170000
+#define BSON_STATS_TARGET(S)  ((S)->attstattarget)
+#else
+#define BSON_STATS_TARGET(S)  ((S)->attr->attstattarget)
+#endif
+
+typedef struct
+{
+    uint32 hash;   // _hash_bson_scalar
+    uint32 off;    // of the value, as a one-element doc, in the arena
+} BsonStatsValue;
+
+typedef struct
+{
+    char path[BSON_STATS_PATH_MAX];  // hash key, must be first
+    int last_row;                    // count each row once
+    int count;
+    int narray;
+    int nwide;
+    int types[BSON_COUNT_TYPE_SLOTS];
+    BsonStatsValue* vals;
+    int nvals;
+    int maxvals;
+} BsonPathStats;
+
+typedef struct
+{
+    uint32 off;
+    int count;
+} BsonStatsGroup;
+
+// What std_typanalyze set up; we run it first.
+typedef struct
+{
+    AnalyzeAttrComputeStatsFunc std_compute;
+    void* std_extra;
+} BsonAnalyzeData;
+
+static void _stats_add_value(BsonPathStats* ps, bson_iter_t* iter, StringInfo arena)
+{
+    bson_type_t t = bson_iter_type(iter);
+
+    ps->types[_count_type_slot(t)]++;
+
+    if(t == BSON_TYPE_ARRAY) {
+	ps->narray++;
+	return;
+    }
+    if(t == BSON_TYPE_DOCUMENT) {
+	return;
+    }
+
+    uint32_t vlen;
+    const uint8_t* v = _iter_value_bytes(iter, &vlen);
+    if(vlen > BSON_STATS_VALUE_MAX || arena->len > BSON_STATS_ARENA_MAX) {
+	ps->nwide++;
+	return;
+    }
+
+    if(ps->nvals == ps->maxvals) {
+	ps->maxvals = (ps->maxvals == 0) ? 64 : ps->maxvals * 2;
+	ps->vals = (ps->vals == NULL)
+	    ? (BsonStatsValue*) palloc(ps->maxvals * sizeof(BsonStatsValue))
+	    : (BsonStatsValue*) repalloc(ps->vals, ps->maxvals * sizeof(BsonStatsValue));
+    }
+    ps->vals[ps->nvals].hash = _hash_bson_scalar(iter);
+    ps->vals[ps->nvals].off = arena->len;
+    ps->nvals++;
+
+    // { "": value }
+    uint32 le = BSON_UINT32_TO_LE(4 + 2 + vlen + 1);
+    appendBinaryStringInfo(arena, (char*) &le, 4);
+    appendStringInfoChar(arena, (char) t);
+    appendStringInfoChar(arena, '\0');
+    appendBinaryStringInfo(arena, (const char*) v, vlen);
+    appendStringInfoChar(arena, '\0');
+}
+
+// path[0..plen) is the dotpath of the container iter is in.
+static void _stats_walk(bson_iter_t* iter, char* path, int plen, int row, HTAB* paths, StringInfo arena)
+{
+    while(bson_iter_next(iter)) {
+	const char* key = bson_iter_key(iter);
+	int klen = strlen(key);
+	int len = plen + (plen > 0) + klen;
 
-	bson_type_t ft = bson_iter_type(&target);
-	switch(ft) {
-	case BSON_TYPE_DOCUMENT:  {
-	    bson_iter_document(&target, &subdoc_len, &subdoc_data);
-	    break;
-	}
-	case BSON_TYPE_ARRAY:  {
-	    bson_iter_array(&target, &subdoc_len, &subdoc_data);
-	    break;
+	if(len >= BSON_STATS_PATH_MAX) {
+	    continue;
 	}
-	default: {
-	    // ?  TBD How to "better" handle "object representation" of
-	    // noncomplex types
+	if(plen > 0) {
+	    path[plen] = '.';
 	}
+	memcpy(path + len - klen, key, klen);
+	path[len] = '\0';
+
+	bool found;
+	BsonPathStats* ps = (BsonPathStats*) hash_search(paths, path,
+							 hash_get_num_entries(paths) < BSON_STATS_TRACK_MAX ? HASH_ENTER : HASH_FIND,
+							 &found);
+	if(ps != NULL) {
+	    if(!found) {
+		memset((char*) ps + BSON_STATS_PATH_MAX, 0, sizeof(BsonPathStats) - BSON_STATS_PATH_MAX);
+		ps->last_row = -1;
+	    }
+	    if(ps->last_row != row) {
+		ps->last_row = row;
+		ps->count++;
+		_stats_add_value(ps, iter, arena);
+	    }
 	}
-	if(subdoc_data != 0) {
-	    bson_init_static(child, subdoc_data, subdoc_len);
+
+	if(BSON_ITER_HOLDS_DOCUMENT(iter)) {
+	    bson_iter_t child;
+	    if(bson_iter_recurse(iter, &child)) {
+		_stats_walk(&child, path, len, row, paths, arena);
+	    }
 	}
     }
-    
-    return rc;
 }
-    
 
-PG_FUNCTION_INFO_V1(bson_get_bson);  // bson bson_get_bson(bson, dotpath)
-Datum bson_get_bson(PG_FUNCTION_ARGS)
+static int _stats_value_cmp(const void* a, const void* b)
 {
-    bytea* aa = BSON_GETARG_BSON(0);    
-    text* dotpath = PG_GETARG_TEXT_PP(1);
+    uint32 ha = ((const BsonStatsValue*) a)->hash;
+    uint32 hb = ((const BsonStatsValue*) b)->hash;
+    return BSON_CMP(ha, hb);
+}
 
-    bson_t b; // on stack
-    BSON_STATIC_INIT(&b,aa);
+static int _stats_group_cmp(const void* a, const void* b)
+{
+    int ca = ((const BsonStatsGroup*) a)->count;
+    int cb = ((const BsonStatsGroup*) b)->count;
+    return BSON_CMP(cb, ca);
+}
 
-    bson_t b2; // on stack    
-    bool rc = _get_obj_or_arr(&b, dotpath, &b2);
-    
-    if(rc) {
-	bytea* bbb = mk_palloc_bytea(&b2); // alloc a *new* bytea to hold b2
-	PG_FREE_IF_COPY(aa,0); // free the original if necessary...
-	PG_RETURN_BYTEA_P(bbb); // return newly alloced material
+// Most common first, then by name so the choice is stable.
+static int _path_stats_cmp(const void* a, const void* b)
+{
+    const BsonPathStats* pa = *(const BsonPathStats* const*) a;
+    const BsonPathStats* pb = *(const BsonPathStats* const*) b;
+    if(pa->count != pb->count) {
+	return BSON_CMP(pb->count, pa->count);
     }
-    
-    PG_FREE_IF_COPY(aa,0);
-    PG_RETURN_NULL();
+    return strcmp(pa->path, pb->path);
 }
 
-
-PG_FUNCTION_INFO_V1(bson_get_jsonb_array);
-Datum bson_get_jsonb_array(PG_FUNCTION_ARGS)
+// The stats document for one path, palloc'd in cxt.
+static Datum _stats_path_doc(BsonPathStats* ps, StringInfo arena, int samplerows, double totalrows,
+			     int num_mcv, MemoryContext cxt)
 {
-    bytea* aa = BSON_GETARG_BSON(0);    
-    text* dotpath = PG_GETARG_TEXT_PP(1);
+    BsonStatsGroup* groups = (BsonStatsGroup*) palloc(Max(ps->nvals, 1) * sizeof(BsonStatsGroup));
+    int ngroups = 0;
+
+    // Equal hashes are taken to be equal values; it is only an estimate.
+    qsort(ps->vals, ps->nvals, sizeof(BsonStatsValue), _stats_value_cmp);
+    for(int i = 0; i < ps->nvals; i++) {
+	if(i == 0 || ps->vals[i].hash != ps->vals[i - 1].hash) {
+	    groups[ngroups].off = ps->vals[i].off;
+	    groups[ngroups].count = 0;
+	    ngroups++;
+	}
+	groups[ngroups - 1].count++;
+    }
 
-    bson_t b; // on stack
-    BSON_STATIC_INIT(&b,aa);
+    // Haas and Stokes, as compute_distinct_stats() in analyze.c.  Values
+    // too wide to keep are taken to be distinct.
+    double n = ps->nvals + ps->nwide;
+    double d = ngroups + ps->nwide;
+    double f1 = ps->nwide;
+    for(int i = 0; i < ngroups; i++) {
+	if(groups[i].count == 1) f1++;
+    }
 
-    bson_t b2; // on stack    
-    bool rc = _get_obj_or_arr(&b, dotpath, &b2);
+    double N = totalrows * n / samplerows;  // rows in the table with a value here
+    double ndv;
+    if(n == 0) {
+	ndv = 0;
+    } else if(f1 == d) {
+	ndv = N;   // all unique
+    } else if(f1 == 0) {
+	ndv = d;   // all seen more than once:  assume we saw them all
+    } else {
+	ndv = (n * d) / ((n - f1) + f1 * n / N);
+	ndv = Max(ndv, d);
+	ndv = Min(ndv, N);
+    }
+    ndv = floor(ndv + 0.5);
 
-    if(rc) {
-	size_t blen;
-	// This is what makes it all possible:
-	char* jsons = bson_array_as_json(&b2, &blen);
+    qsort(groups, ngroups, sizeof(BsonStatsGroup), _stats_group_cmp);
+    int nmcv = 0;
+    while(nmcv < ngroups && nmcv < num_mcv && groups[nmcv].count > 1) {
+	nmcv++;
+    }
 
-	// Well ...  HELLO there!
-	Jsonb *jsonb =
-	    DatumGetJsonbP(DirectFunctionCall1(jsonb_in, CStringGetDatum(jsons)));
-	bson_free(jsons); // per bson.h
-	
-	PG_FREE_IF_COPY(aa,0);
-	
-	PG_RETURN_POINTER(jsonb);
+    bson_t doc;
+    bson_t child;
+    char ibuf[16];
+    const char* ikey;
+
+    bson_init(&doc);
+    bson_append_utf8(&doc, "path", -1, ps->path, -1);
+    bson_append_double(&doc, "frac", -1, (double) ps->count / samplerows);
+    bson_append_double(&doc, "vfrac", -1, n / samplerows);
+    bson_append_double(&doc, "afrac", -1, (double) ps->narray / samplerows);
+    bson_append_double(&doc, "ndv", -1, ndv);
+
+    bson_append_document_begin(&doc, "types", -1, &child);
+    for(int i = 0; i < BSON_COUNT_TYPE_SLOTS; i++) {
+	if(ps->types[i] > 0) {
+	    bson_append_double(&child, bson_count_type_names[i], -1, (double) ps->types[i] / ps->count);
+	}
     }
-    
-    PG_FREE_IF_COPY(aa,0);
-    PG_RETURN_NULL();
-}
+    bson_append_document_end(&doc, &child);
+
+    bson_append_array_begin(&doc, "mcv", -1, &child);
+    for(int i = 0; i < nmcv; i++) {
+	const uint8_t* v = (const uint8_t*) arena->data + groups[i].off;
+	bson_iter_t it;
+	if(bson_iter_init_from_data(&it, v, _mini_doc_len(v)) && bson_iter_next(&it)) {
+	    size_t ikeylen = bson_uint32_to_string(i, &ikey, ibuf, sizeof(ibuf));
+	    bson_append_iter(&child, ikey, ikeylen, &it);
+	}
+    }
+    bson_append_array_end(&doc, &child);
 
+    bson_append_array_begin(&doc, "mcf", -1, &child);
+    for(int i = 0; i < nmcv; i++) {
+	size_t ikeylen = bson_uint32_to_string(i, &ikey, ibuf, sizeof(ibuf));
+	bson_append_double(&child, ikey, ikeylen, (double) groups[i].count / samplerows);
+    }
+    bson_append_array_end(&doc, &child);
 
+    MemoryContext old = MemoryContextSwitchTo(cxt);
+    bytea* aa = mk_palloc_bytea(&doc);
+    MemoryContextSwitchTo(old);
 
-PG_FUNCTION_INFO_V1(bson_get_double);  // double bson_get_double(bson, dotpath)
-Datum bson_get_double(PG_FUNCTION_ARGS)
+    bson_destroy(&doc);
+    pfree(groups);
+
+    return PointerGetDatum(aa);
+}
+
+static void _bson_compute_stats(VacAttrStats* stats, AnalyzeAttrFetchFunc fetchfunc,
+				int samplerows, double totalrows)
 {
-    bytea* aa = BSON_GETARG_BSON(0);
-    text* dotpath = PG_GETARG_TEXT_PP(1);
+    BsonAnalyzeData* ad = (BsonAnalyzeData*) stats->extra_data;
 
-    bson_t b; // on stack
-    BSON_STATIC_INIT(&b,aa);
+    stats->extra_data = ad->std_extra;
+    ad->std_compute(stats, fetchfunc, samplerows, totalrows);
+    stats->extra_data = ad;
 
-    bson_iter_t target;
-    bool rc = false;
-    double dbl = 0;  // doesnt matter
-    rc = _get_bson_iter(&b, dotpath, &target, BSON_TYPE_DOUBLE);
-    if(rc) {
-	dbl = bson_iter_double(&target);
+    int slot = 0;
+    while(slot < STATISTIC_NUM_SLOTS && stats->stakind[slot] != 0) {
+	slot++;
+    }
+    if(!stats->stats_valid || slot == STATISTIC_NUM_SLOTS) {
+	return;
     }
 
-    PG_FREE_IF_COPY(aa,0);
+    HASHCTL ctl;
+    ctl.keysize = BSON_STATS_PATH_MAX;
+    ctl.entrysize = sizeof(BsonPathStats);
+    ctl.hcxt = CurrentMemoryContext;
+    HTAB* paths = hash_create("bson path stats", 64, &ctl, HASH_ELEM | HASH_STRINGS | HASH_CONTEXT);
 
-    if(rc == true) PG_RETURN_FLOAT8(dbl); else PG_RETURN_NULL();    
-}
+    StringInfoData arena;
+    initStringInfo(&arena);
+    char path[BSON_STATS_PATH_MAX];
 
-PG_FUNCTION_INFO_V1(bson_get_int32);  // int32 bson_get_int32(bson, dotpath)
-Datum bson_get_int32(PG_FUNCTION_ARGS)
-{
-    bytea* aa = BSON_GETARG_BSON(0);
-    text* dotpath = PG_GETARG_TEXT_PP(1);
+    for(int i = 0; i < samplerows; i++) {
+	bool isnull;
 
-    bson_t b; // on stack
-    BSON_STATIC_INIT(&b,aa);
+	vacuum_delay_point();
 
-    bson_iter_t target;
-    bool rc = false;
-    int32_t val = 0; // doesnt matter
-    rc = _get_bson_iter(&b, dotpath, &target, BSON_TYPE_INT32);
-    if(rc) {
-	val = bson_iter_int32(&target);
-	PG_RETURN_INT32(val);
-    }
+	Datum value = fetchfunc(stats, i, &isnull);
+	if(isnull) {
+	    continue;
+	}
 
-    PG_FREE_IF_COPY(aa,0);
+	bytea* aa = DatumGetBson(value);
+	bson_t b; // on stack
+	BSON_STATIC_INIT(&b, aa);
 
-    if(rc == true) PG_RETURN_INT32(val); else PG_RETURN_NULL();
-}
+	bson_iter_t iter;
+	if(bson_iter_init(&iter, &b)) {
+	    _stats_walk(&iter, path, 0, i, paths, &arena);
+	}
 
-PG_FUNCTION_INFO_V1(bson_get_boolean);  // long bson_get_int64(bson, dotpath)
-Datum bson_get_boolean(PG_FUNCTION_ARGS)
-{
-    bytea* aa = BSON_GETARG_BSON(0);
-    text* dotpath = PG_GETARG_TEXT_PP(1);
+	if((Pointer) aa != DatumGetPointer(value)) {
+	    pfree(aa);
+	}
+    }
 
-    bson_t b; // on stack
-    BSON_STATIC_INIT(&b,aa);
-    
-    bson_iter_t target; 
-    bool rc = false;
-    
-    bool val = false; // doesnt matter
-    rc = _get_bson_iter(&b, dotpath, &target, BSON_TYPE_BOOL);
-    if(rc) {
-	val = bson_iter_bool(&target);
+    int npaths = hash_get_num_entries(paths);
+    int nkeep = Min(npaths, bson_analyze_paths);
+    if(nkeep == 0) {
+	return;   // an empty stavalues would be stored as NULL
     }
 
-    PG_FREE_IF_COPY(aa,0);
+    BsonPathStats** all = (BsonPathStats**) palloc(npaths * sizeof(BsonPathStats*));
+    HASH_SEQ_STATUS seq;
+    BsonPathStats* ps;
+    int n = 0;
+    hash_seq_init(&seq, paths);
+    while((ps = (BsonPathStats*) hash_seq_search(&seq)) != NULL) {
+	all[n++] = ps;
+    }
+    qsort(all, npaths, sizeof(BsonPathStats*), _path_stats_cmp);
 
-    if(rc == true) PG_RETURN_BOOL(val); else PG_RETURN_NULL();    
-}
+    int num_mcv = Min(BSON_STATS_TARGET(stats), BSON_STATS_MCV_MAX);
 
+    MemoryContext old = MemoryContextSwitchTo(stats->anl_context);
+    Datum* values = (Datum*) palloc(nkeep * sizeof(Datum));
+    float4* numbers = (float4*) palloc(2 * sizeof(float4));
+    MemoryContextSwitchTo(old);
 
-PG_FUNCTION_INFO_V1(bson_get_int64);  // long bson_get_int64(bson, dotpath)
-Datum bson_get_int64(PG_FUNCTION_ARGS)
+    for(int i = 0; i < nkeep; i++) {
+	values[i] = _stats_path_doc(all[i], &arena, samplerows, totalrows, num_mcv, stats->anl_context);
+    }
+
+    // For paths we did not keep:  the most any of them could be, and
+    // the least anything seen could be.
+    numbers[0] = (nkeep < npaths) ? (float4) all[nkeep]->count / samplerows : 0;
+    numbers[1] = 1.0 / samplerows;
+
+    stats->stakind[slot] = STATISTIC_KIND_BSON_PATHS;
+    stats->staop[slot] = InvalidOid;
+    stats->stacoll[slot] = InvalidOid;
+    stats->stanumbers[slot] = numbers;
+    stats->numnumbers[slot] = 2;
+    stats->stavalues[slot] = values;
+    stats->numvalues[slot] = nkeep;
+    stats->statypid[slot] = stats->attrtypid;
+    stats->statyplen[slot] = stats->attrtype->typlen;
+    stats->statypbyval[slot] = stats->attrtype->typbyval;
+    stats->statypalign[slot] = stats->attrtype->typalign;
+}
+
+// bool bson_typanalyze(internal), the analyze function of type bson
+PG_FUNCTION_INFO_V1(bson_typanalyze);
+Datum bson_typanalyze(PG_FUNCTION_ARGS)
 {
-    bytea* aa = BSON_GETARG_BSON(0);
-    text* dotpath = PG_GETARG_TEXT_PP(1);
+    VacAttrStats* stats = (VacAttrStats*) PG_GETARG_POINTER(0);
 
-    bson_t b; // on stack
-    BSON_STATIC_INIT(&b,aa);
-    
-    bson_iter_t target; 
-    bool rc = false;
-    
-    int64_t val = 0; // doesnt matter
-    
-    rc = _get_bson_iter(&b, dotpath, &target, BSON_TYPE_INT64);
-    if(rc) {
-	val = bson_iter_int64(&target);
+    if(!std_typanalyze(stats)) {
+	PG_RETURN_BOOL(false);
     }
 
-    PG_FREE_IF_COPY(aa,0);
+    if(bson_analyze_paths > 0) {
+	BsonAnalyzeData* ad = (BsonAnalyzeData*) palloc(sizeof(BsonAnalyzeData));
+	ad->std_compute = stats->compute_stats;
+	ad->std_extra = stats->extra_data;
+	stats->extra_data = ad;
+	stats->compute_stats = _bson_compute_stats;
+    }
 
-    if(rc == true) PG_RETURN_INT64(val); else PG_RETURN_NULL();    
+    PG_RETURN_BOOL(true);
 }
 
 
-PG_FUNCTION_INFO_V1(bson_get_binary);
-Datum bson_get_binary(PG_FUNCTION_ARGS)
+// Reading them back.
+
+static bool _stats_slot(VariableStatData* vardata, AttStatsSlot* sslot)
 {
-    bytea* aa = BSON_GETARG_BSON(0);
-    text* dotpath = PG_GETARG_TEXT_PP(1);
+    return HeapTupleIsValid(vardata->statsTuple)
+	&& get_attstatsslot(sslot, vardata->statsTuple, STATISTIC_KIND_BSON_PATHS, InvalidOid,
+			    ATTSTATSSLOT_VALUES | ATTSTATSSLOT_NUMBERS);
+}
 
-    bson_t b; // on stack
-    BSON_STATIC_INIT(&b,aa);
+static double _stats_double(bson_t* pdoc, const char* key)
+{
+    bson_iter_t it;
+    return (bson_iter_init_find(&it, pdoc, key) && BSON_ITER_HOLDS_DOUBLE(&it)) ? bson_iter_double(&it) : 0;
+}
 
-    bson_iter_t target;
-    if(_get_bson_iter(&b, dotpath, &target, BSON_TYPE_BINARY)) {
-	bson_subtype_t subtype;
-	uint32_t len;
-	const uint8_t* data;
-    
-	bson_iter_binary (&target, &subtype, &len, &data);
+// pdoc is left pointing into sslot.
+static bool _stats_find_path(AttStatsSlot* sslot, const char* path, int len, bson_t* pdoc)
+{
+    for(int i = 0; i < sslot->nvalues; i++) {
+	bytea* aa = DatumGetBson(sslot->values[i]);
+	bson_iter_t it;
+
+	BSON_STATIC_INIT(pdoc, aa);
+	if(bson_iter_init_find(&it, pdoc, "path") && BSON_ITER_HOLDS_UTF8(&it)) {
+	    uint32_t plen;
+	    const char* p = bson_iter_utf8(&it, &plen);
+	    if(plen == (uint32_t) len && memcmp(p, path, len) == 0) {
+		return true;
+	    }
+	}
+    }
+    return false;
+}
 
-	// What to do with subtype?
-	
-	int tot_size = len + VARHDRSZ; // MUST add varlena hdr!
-    
-	bytea* aa2 = (bytea*) palloc(tot_size);
-	SET_VARSIZE(aa2, tot_size);
+// A path we have no stats for.  Array items (a.0, a.b under an array a)
+// are never tracked, so if a prefix is an array go by how often it is;
+// otherwise it was not common enough to keep, or not seen at all.
+static double _stats_missing_sel(AttStatsSlot* sslot, const char* path, int len)
+{
+    bson_t pdoc;
 
-	memcpy((void *) VARDATA(aa2), (void *) data, len); // VARDATA_ANY...?
-	
-	PG_FREE_IF_COPY(aa,0);
-	PG_RETURN_BYTEA_P(aa2);
+    while(--len > 0) {
+	if(path[len] == '.' && _stats_find_path(sslot, path, len, &pdoc)) {
+	    double afrac = _stats_double(&pdoc, "afrac");
+	    if(afrac > 0) {
+		return afrac;
+	    }
+	}
     }
 
-    PG_FREE_IF_COPY(aa,0);
-    PG_RETURN_NULL();
+    if(sslot->nnumbers >= 2) {
+	return (sslot->numbers[0] > 0) ? sslot->numbers[0] / 2 : sslot->numbers[1] / 2;
+    }
+    return DEFAULT_EQ_SEL;
 }
 
+// Fraction of rows whose value at the path is v.  For @>, an array at the
+// path that might hold v counts too (in_arrays).
+static double _stats_eq_sel(bson_t* pdoc, const bson_iter_t* v, bool in_arrays)
+{
+    double sel = -1;
+    double mcfsum = 0;
+    int nmcv = 0;
+    bson_iter_t it;
+    bson_iter_t mv;
+    bson_iter_t mf;
+
+    if(bson_iter_init_find(&it, pdoc, "mcv") && bson_iter_recurse(&it, &mv)
+       && bson_iter_init_find(&it, pdoc, "mcf") && bson_iter_recurse(&it, &mf)) {
+	while(bson_iter_next(&mv) && bson_iter_next(&mf)) {
+	    double f = bson_iter_double(&mf);
+	    nmcv++;
+	    mcfsum += f;
+	    if(sel < 0 && _bson_scalars_equal(&mv, v)) {
+		sel = f;
+	    }
+	}
+    }
 
+    if(sel < 0) {
+	// the rest is spread evenly over the other values
+	double others = _stats_double(pdoc, "ndv") - nmcv;
+	double rest = _stats_double(pdoc, "vfrac") - mcfsum;
+	sel = (others >= 1 && rest > 0) ? rest / others : 0;
+    }
 
+    if(in_arrays) {
+	sel += _stats_double(pdoc, "afrac") * DEFAULT_EQ_SEL;
+    }
+    return sel;
+}
 
-extern void
-_bson_iso8601_date_format (int64_t msec_since_epoch, bson_string_t *str);
-
-PG_FUNCTION_INFO_V1(bson_as_text);  // text bson_get(bson, dotpath)
-Datum bson_as_text(PG_FUNCTION_ARGS)
+// Selectivity of  col @> q  for the members of q at iter, under path[0..plen).
+static double _stats_contains_sel(AttStatsSlot* sslot, bson_iter_t* iter, char* path, int plen)
 {
-    bytea* aa = BSON_GETARG_BSON(0);
-    text* dotpath = PG_GETARG_TEXT_PP(1);
+    double sel = 1.0;
 
-    bson_t b; // on stack
-    bson_init_static(&b, BSON_VARDATA_ANY(aa), VARSIZE_ANY_EXHDR(aa));
+    while(bson_iter_next(iter)) {
+	const char* key = bson_iter_key(iter);
+	int klen = strlen(key);
+	int len = plen + (plen > 0) + klen;
 
-    bson_iter_t iter;
-    bson_iter_t target;
+	if(len >= BSON_STATS_PATH_MAX) {
+	    sel *= DEFAULT_EQ_SEL;
+	    continue;
+	}
+	if(plen > 0) {
+	    path[plen] = '.';
+	}
+	memcpy(path + len - klen, key, klen);
+	path[len] = '\0';
+
+	bson_t pdoc;
+	bool have = _stats_find_path(sslot, path, len, &pdoc);
+	double present = have ? _stats_double(&pdoc, "frac") : _stats_missing_sel(sslot, path, len);
+
+	if(BSON_ITER_HOLDS_DOCUMENT(iter)) {
+	    bson_iter_t child;
+	    double s = bson_iter_recurse(iter, &child) ? _stats_contains_sel(sslot, &child, path, len) : 1.0;
+	    sel *= Min(s, present);
+	} else if(BSON_ITER_HOLDS_ARRAY(iter)) {
+	    // no stats inside arrays:  how often there is one, and a guess
+	    double afrac = have ? _stats_double(&pdoc, "afrac") : present;
+	    sel *= afrac * DEFAULT_EQ_SEL;
+	} else {
+	    sel *= have ? _stats_eq_sel(&pdoc, iter, true) : present;
+	}
+    }
 
-    const char* txt = 0;
-    char valbuf[64]; // good for numbers and dates
-    bool must_free = false;
-		
-    if (!bson_iter_init (&iter, &b)) {
-	ereport(
-	    ERROR,
-	    (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("bat BSON bytes corrupted"))
-	    );
-    } else {
-	char* c_dotpath = text_to_cstring(dotpath);    
-	bool rc = bson_iter_find_descendant(&iter, c_dotpath, &target);
-	pfree(c_dotpath); // dotpath no longer needed
-    
-	if(rc) {
-	    bson_type_t ft = bson_iter_type(&target);
-	    switch(ft) {
-	    case BSON_TYPE_UTF8: {
-		uint32_t len;		
-		txt = bson_iter_utf8(&target, &len); // NO NEED TO free()
-		break;
+    return sel;
+}
+
+// float8 bson_contains_sel(internal, oid, internal, int4), restrict for @>
+PG_FUNCTION_INFO_V1(bson_contains_sel);
+Datum bson_contains_sel(PG_FUNCTION_ARGS)
+{
+    PlannerInfo* root = (PlannerInfo*) PG_GETARG_POINTER(0);
+    List* args = (List*) PG_GETARG_POINTER(2);
+    int varRelid = PG_GETARG_INT32(3);
+    VariableStatData vardata;
+    Node* other;
+    bool varonleft;
+    AttStatsSlot sslot;
+    double sel = -1;
+
+    if(get_restriction_variable(root, args, varRelid, &vardata, &other, &varonleft)) {
+	if(varonleft && IsA(other, Const) && !((Const*) other)->constisnull && _stats_slot(&vardata, &sslot)) {
+	    bytea* q = DatumGetBson(((Const*) other)->constvalue);
+	    bson_t b; // on stack
+	    BSON_STATIC_INIT(&b, q);
+
+	    bson_iter_t iter;
+	    char path[BSON_STATS_PATH_MAX];
+	    if(bson_iter_init(&iter, &b)) {
+		sel = _stats_contains_sel(&sslot, &iter, path, 0);
 	    }
-	    case BSON_TYPE_DOUBLE: {
-		double v = bson_iter_double(&target);
-		sprintf(valbuf, "%lf", v);
-		txt = valbuf;
-		break;		
-	    }
-	    case BSON_TYPE_INT32: {
-		int32_t v = bson_iter_int32(&target);
-		sprintf(valbuf, "%d", v);
-		txt = valbuf;
-		break;		
-	    }
-	    case BSON_TYPE_INT64: {
-		int64_t v = bson_iter_int64(&target);
-		sprintf(valbuf, "%lld", v);
-		txt = valbuf;
-		break;		
-	    }
-	    case BSON_TYPE_DECIMAL128: {
-		bson_decimal128_t val;
-		if(bson_iter_decimal128(&target, &val)) {
-		    bson_decimal128_to_string(&val, valbuf);
-		    txt = valbuf;
-		}
-		break;		
-	    }
-	    case BSON_TYPE_DATE_TIME: {
-		int64_t millis_since_epoch = bson_iter_date_time (&target);
-		bson_string_t* str = bson_string_new (NULL);
-		_bson_iso8601_date_format(millis_since_epoch, str);
-		bson_strncpy (valbuf, str->str, str->len);
-		valbuf[str->len] = '\0';
-		bson_string_free(str, true); // true means "free segment" ?
-		txt = valbuf;
-		break;		
-	    }								
-
-	    case BSON_TYPE_DOCUMENT: 
-	    case BSON_TYPE_ARRAY: {		
-		uint32_t subdoc_len;
-		const uint8_t* subdoc_data;
-
-		if(ft == BSON_TYPE_DOCUMENT) {
-		    bson_iter_document(&target, &subdoc_len, &subdoc_data);
-		} else {
-		    bson_iter_array(&target, &subdoc_len, &subdoc_data);
-		}
+	    free_attstatsslot(&sslot);
+	}
+	ReleaseVariableStats(vardata);
+    }
 
-		bson_t b; // on stack
-		bson_init_static(&b, subdoc_data, subdoc_len);
+    if(sel < 0) {
+	return matchingsel(fcinfo);
+    }
+    CLAMP_PROBABILITY(sel);
+    PG_RETURN_FLOAT8(sel);
+}
 
-		size_t blen;
-		txt = bson_as_relaxed_extended_json(&b, &blen);
-		must_free = true;
-		break;
-	    }
+typedef enum
+{
+    BSON_EXISTS_ONE,
+    BSON_EXISTS_ANY,
+    BSON_EXISTS_ALL
+} BsonExistsKind;
 
-	    case BSON_TYPE_BINARY: {				
-		bson_subtype_t subtype;
-		uint32_t len;
-		const uint8_t* data;
-    
-		// What to do with subtype?  Dunno!
-		bson_iter_binary (&target, &subtype, &len, &data);
-
-		// Output is "\x54252031..."  So 2 bytes for "\x",
-		// then 2 slots to hold hex rep for each byte, plus 1 for NULL:
-		char* tmpp = (char*)bson_malloc (2 + (len*2) + 1);
-
-		tmpp[0] = '\\';
-		tmpp[1] = 'x';
-		int idx = 2;
-		for(int n = 0; n < len; n++) {
-		    // Love that pointer math....
-		    sprintf(tmpp+idx, "%02x", (uint8_t)data[n]);
-		    idx += 2;
-		}
-		tmpp[idx] = '\0';
+static double _stats_exists_path_sel(AttStatsSlot* sslot, text* dotpath)
+{
+    bson_t pdoc;
+    const char* p = VARDATA_ANY(dotpath);
+    int len = VARSIZE_ANY_EXHDR(dotpath);
 
-		txt = tmpp; // because txt is const char*
-		must_free = true;
-		break;
-	    }
+    return _stats_find_path(sslot, p, len, &pdoc) ? _stats_double(&pdoc, "frac") : _stats_missing_sel(sslot, p, len);
+}
 
-	    default: {
-		break; // ?
-	    }		
+// Restrict for ?, ?| and ?&.  Paths are taken to be independent.
+static Datum _bson_exists_sel(FunctionCallInfo fcinfo, BsonExistsKind kind)
+{
+    PlannerInfo* root = (PlannerInfo*) PG_GETARG_POINTER(0);
+    List* args = (List*) PG_GETARG_POINTER(2);
+    int varRelid = PG_GETARG_INT32(3);
+    VariableStatData vardata;
+    Node* other;
+    bool varonleft;
+    AttStatsSlot sslot;
+    double sel = -1;
+
+    if(get_restriction_variable(root, args, varRelid, &vardata, &other, &varonleft)) {
+	if(varonleft && IsA(other, Const) && !((Const*) other)->constisnull && _stats_slot(&vardata, &sslot)) {
+	    Datum c = ((Const*) other)->constvalue;
+
+	    if(kind == BSON_EXISTS_ONE) {
+		sel = _stats_exists_path_sel(&sslot, DatumGetTextPP(c));
+	    } else {
+		Datum* pathdatums;
+		bool* pathnulls;
+		int npaths;
+		deconstruct_array(DatumGetArrayTypeP(c), TEXTOID, -1, false, TYPALIGN_INT,
+				  &pathdatums, &pathnulls, &npaths);
+
+		// any:  1 - P(none of them);  all:  P(each of them)
+		double p = 1.0;
+		for(int i = 0; i < npaths; i++) {
+		    if(!pathnulls[i]) {
+			double s = _stats_exists_path_sel(&sslot, DatumGetTextPP(pathdatums[i]));
+			p *= (kind == BSON_EXISTS_ANY) ? (1.0 - s) : s;
+		    }
+		}
+		sel = (kind == BSON_EXISTS_ANY) ? 1.0 - p : p;
 	    }
+	    free_attstatsslot(&sslot);
 	}
+	ReleaseVariableStats(vardata);
     }
 
-    if(txt != 0) {
-	text* t = mk_text(txt);
-	if(must_free) {
-	    bson_free((void*)txt);
-	}
-	PG_FREE_IF_COPY(aa,0);
-	PG_RETURN_TEXT_P(t);
+    if(sel < 0) {
+	return matchingsel(fcinfo);
     }
-    
-    PG_FREE_IF_COPY(aa,0);
-    PG_RETURN_NULL();
+    CLAMP_PROBABILITY(sel);
+    PG_RETURN_FLOAT8(sel);
 }
 
-/*
-Experimental.  Will pursue one day, but bson_get_jsonb_array is DEF
-good enough for the moment!
+PG_FUNCTION_INFO_V1(bson_exists_sel);
+Datum bson_exists_sel(PG_FUNCTION_ARGS)
+{
+    return _bson_exists_sel(fcinfo, BSON_EXISTS_ONE);
+}
 
-PG_FUNCTION_INFO_V1(bson_get_array_jsonb);
-Datum bson_get_array_jsonb(PG_FUNCTION_ARGS)
+PG_FUNCTION_INFO_V1(bson_exists_any_sel);
+Datum bson_exists_any_sel(PG_FUNCTION_ARGS)
 {
-    bytea* aa = BSON_GETARG_BSON(0);    
-    text* dotpath = PG_GETARG_TEXT_PP(1);
+    return _bson_exists_sel(fcinfo, BSON_EXISTS_ANY);
+}
 
-    (void) fprintf(stderr, "bson_get_array_jsonb()\n");
-    
-    JsonbPair *pair = palloc(sizeof(JsonbPair));
-    pair->key.type = jbvString;
-    pair->key.val.string.len = 3;
-    pair->key.val.string.val = "foo";
-
-    pair->value.type = jbvNumeric;
-    pair->value.val.numeric = DatumGetNumeric(DirectFunctionCall1(int8_numeric, (int64_t)100));
-  
-    JsonbValue *object = palloc(sizeof(JsonbValue));
-    object->type = jbvObject;
-    object->val.object.nPairs = 1;
-    object->val.object.pairs = pair;
-
-
-    JsonbValue *arr = palloc(sizeof(JsonbValue));
-    object->type = jbvArray;
-    object->val.array.nElems = 1;
-    object->val.array.elems = object;    
-    
-    PG_RETURN_POINTER(JsonbValueToJsonb(object));
+PG_FUNCTION_INFO_V1(bson_exists_all_sel);
+Datum bson_exists_all_sel(PG_FUNCTION_ARGS)
+{
+    return _bson_exists_sel(fcinfo, BSON_EXISTS_ALL);
+}
+
+// bson_get_boolean(col, 'const.path') used as a qual:  how often it is
+// true.  False if col has no path stats.
+static bool _stats_boolean_sel(PlannerInfo* root, List* args, int varRelid, Selectivity* sel)
+{
+    if(list_length(args) != 2 || !IsA(lsecond(args), Const) || ((Const*) lsecond(args))->constisnull) {
+	return false;
+    }
+
+    VariableStatData vardata;
+    AttStatsSlot sslot;
+    bool rc = false;
+
+    examine_variable(root, (Node*) linitial(args), varRelid, &vardata);
+    if(_stats_slot(&vardata, &sslot)) {
+	text* dotpath = DatumGetTextPP(((Const*) lsecond(args))->constvalue);
+	bson_t pdoc;
+
+	if(_stats_find_path(&sslot, VARDATA_ANY(dotpath), VARSIZE_ANY_EXHDR(dotpath), &pdoc)) {
+	    bson_t t;
+	    bson_iter_t it;
+	    bson_init(&t);
+	    bson_append_bool(&t, "", 0, true);
+	    bson_iter_init(&it, &t);
+	    bson_iter_next(&it);
+	    *sel = _stats_eq_sel(&pdoc, &it, false);
+	    bson_destroy(&t);
+	} else {
+	    *sel = _stats_missing_sel(&sslot, VARDATA_ANY(dotpath), VARSIZE_ANY_EXHDR(dotpath));
+	}
+	CLAMP_PROBABILITY(*sel);
+	free_attstatsslot(&sslot);
+	rc = true;
+    }
+    ReleaseVariableStats(vardata);
+
+    return rc;
 }
-*/
 
-/*
-PG_FUNCTION_INFO_V1(bson_get_array);
-Datum bson_get_array(PG_FUNCTION_ARGS) {
+// bson[] bson_column_stats(regclass, column):  the path stats documents
+// ANALYZE kept, or NULL.  Visible under the same rules as pg_stats.
+PG_FUNCTION_INFO_V1(bson_column_stats);
+Datum bson_column_stats(PG_FUNCTION_ARGS)
+{
+    Oid relid = PG_GETARG_OID(0);
+    char* attname = text_to_cstring(PG_GETARG_TEXT_PP(1));
+    AttrNumber attnum = get_attnum(relid, attname);
+
+    if(attnum == InvalidAttrNumber) {
+	ereport(
+	    ERROR,
+	    (errcode(ERRCODE_UNDEFINED_COLUMN),
+	     errmsg("column \"%s\" of relation \"%s\" does not exist", attname, get_rel_name(relid)))
+	    );
+    }
+
+    if(pg_attribute_aclcheck(relid, attnum, GetUserId(), ACL_SELECT) != ACLCHECK_OK
+       || check_enable_rls(relid, InvalidOid, true) == RLS_ENABLED) {
+	PG_RETURN_NULL();
+    }
 
-    // _get_bson_iter_array
-    //  bson_iter_array(&target, &subdoc_len, &subdoc_data);
-    for(int i = 0; i < 3; ) {
+    HeapTuple tup = SearchSysCache3(STATRELATTINH, ObjectIdGetDatum(relid), Int16GetDatum(attnum), BoolGetDatum(false));
+    if(!HeapTupleIsValid(tup)) {
+	PG_RETURN_NULL();
     }
 
-  pair->value.type = jbvNumeric;
-  pair->value.val.numeric = DatumGetNumeric(DirectFunctionCall1(int8_numeric, (int64_t)100));
-  
-  JsonbValue *object = palloc(sizeof(JsonbValue));
-  object->type = jbvObject;
-  object->val.object.nPairs = 1;
-  object->val.object.pairs = pair;
+    ArrayType* result = NULL;
+    AttStatsSlot sslot;
+    if(get_attstatsslot(&sslot, tup, STATISTIC_KIND_BSON_PATHS, InvalidOid, ATTSTATSSLOT_VALUES)) {
+	result = construct_array(sslot.values, sslot.nvalues, sslot.valuetype, -1, false, TYPALIGN_INT);
+	free_attstatsslot(&sslot);
+    }
+    ReleaseSysCache(tup);
 
-  PG_RETURN_POINTER(JsonbValueToJsonb(object));
+    if(result == NULL) {
+	PG_RETURN_NULL();
+    }
+    PG_RETURN_ARRAYTYPE_P(result);
 }
-*/
@@ -24,6 +24,9 @@ import json
 import argparse
 import sys
 import os
+import io
+import struct
+import time
 
 
 import collections  # From Python standard library.
@@ -236,6 +239,78 @@ to check that the internals are actually doing something."""
     return msg
         
     
+def slice_detoast_test():
+    """A field near the front of a big out-of-line doc is found from a
+    prefix; one at the back (and one not there) still work."""
+
+    data = {
+        "hdr": {"type":"X", "n":[1,2,3]},
+        "biggie": bson.binary.Binary(os.urandom(100000)),
+        "tail": "T"
+    }
+    insertBson(data)
+
+    msg = None
+    for sql, exp in [
+            ("SELECT bson_get_string(bdata, 'hdr.type') FROM bsontest", "X")
+            ,("SELECT bson_get_int32(bdata, 'hdr.n.2') FROM bsontest", 3)
+            ,("SELECT bson_get_string(bdata, 'tail') FROM bsontest", "T")
+            ,("SELECT bson_get_string(bdata, 'hdr.NOT_IN_FILM') FROM bsontest", None)
+            ,("SELECT bson_as_text(bdata, 'hdr.n') FROM bsontest", "[ 1, 2, 3 ]")
+    ]:
+        for setting in ['on','off']:
+            curs.execute("SET pgbson.slice_detoast = %s" % setting)
+            item = fetchRow1Col(sql)
+            if item != exp:
+                msg = "slice_detoast %s: %s: got %s, expected %s" % (setting, sql, item, exp)
+                return msg
+
+    return msg
+
+
+def bsonx_test():
+    """bsonx getters find top-level keys through the offset index and
+    descend from there; the BSON comes back out unchanged."""
+
+    data = {("k%02d" % n): n for n in range(20)}
+    data["k17"] = {"x": 17, "y": [ "A", "B" ]}
+    data["s"] = "S"
+    rb = insertBson(data)
+
+    msg = None
+    for sql, exp in [
+            ("SELECT bson_get_int32(bdata::bsonx, 'k03') FROM bsontest", 3)
+            ,("SELECT bson_get_int32(bdata::bsonx, 'k17.x') FROM bsontest", 17)
+            ,("SELECT bson_get_string(bdata::bsonx, 'k17.y.1') FROM bsontest", "B")
+            ,("SELECT bdata::bsonx->>'s' FROM bsontest", "S")
+            ,("SELECT bson_get_int32(bdata::bsonx->'k17', 'x') FROM bsontest", 17)
+            ,("SELECT bson_get_string(bson_get_bson(bdata::bsonx, 'k17.y'), '1') FROM bsontest", "B")
+            ,("SELECT bdata::bsonx->'k03' FROM bsontest", None)
+            ,("SELECT bson_get_int32(bdata::bsonx, 'NOT_IN_FILM') FROM bsontest", None)
+            ,("SELECT bson_get_int32((bdata::bsonx)::bson, 'k19') FROM bsontest", 19)
+            ,("SELECT (bdata::bsonx)::bytea = bdata::bytea FROM bsontest", True)
+            ,("SELECT bdata::bsonx = bdata FROM bsontest", True)
+            ,("SELECT bson_get_string(bson_get_bson(bdata, 'k17')::bsonx, 'y.0') FROM bsontest", "A")
+    ]:
+        item = fetchRow1Col(sql)
+        if item != exp:
+            msg = "bsonx: %s: got %s, expected %s" % (sql, item, exp)
+            break
+
+    if msg is None:
+        # Unvalidated bson that starts like a bsonx index is an error, not
+        # an offset to follow.
+        curs.execute("SET pgbson.validate = none")
+        try:
+            fetchRow1Col("SELECT bson_get_int32('\\x8b5b5b8b00000000ffffff7f0500000000'::bytea::bson, 'a')")
+            msg = "bsonx: bson with the index magic was not rejected"
+        except Exception:
+            pass
+        conn.rollback()  # also undoes the SET
+
+    return msg
+
+
 def jsonb_test():  
     """Here is why jsonb type is not the same as BSON."""
 
@@ -315,6 +390,66 @@ def binary_checks():
               "p1 should be < p2"
              )                        
 
+            ,({'a':1},
+             {'a':1.0},
+             0,
+              "int32 1 and double 1.0 should compare equal"
+             )                        
+
+            ,({'a':"Z"},
+             {'a':3},
+             1,
+              "strings should sort after numbers"
+             )                        
+
+            ,({'a':bson.int64.Int64(9007199254740993)},
+             {'a':bson.int64.Int64(9007199254740992)},
+             1,
+              "int64s past 2^53 should compare exactly"
+             )                        
+
+            ,({'a':bson.int64.Int64(9007199254740993)},
+             {'a':9007199254740992.0},
+             1,
+              "int64 against double should not round the int64"
+             )                        
+
+            ,({'a':makeDecimal128("1.000000000000000000000000000000001")},
+             {'a':makeDecimal128("1.000000000000000000000000000000000")},
+             1,
+              "34-digit decimal128s should compare exactly"
+             )
+
+            ,({'a':makeDecimal128("1.50")},
+             {'a':makeDecimal128("15E-1")},
+             0,
+              "decimal128 should compare by value across exponents"
+             )
+
+            ,({'a':makeDecimal128("9223372036854775806.999999999999999")},
+             {'a':bson.int64.Int64(9223372036854775807)},
+             -1,
+              "decimal128 against int64 should not round either"
+             )
+
+            ,({'a':makeDecimal128("0.1")},
+             {'a':0.1},
+             -1,
+              "decimal128 0.1 is below the double nearest 0.1"
+             )
+
+            ,({'a':makeDecimal128("0.1000000000000000055511151231257827")},
+             {'a':0.1},
+             0,
+              "double should compare as its value to 34 digits"
+             )
+
+            ,({'a':makeDecimal128("NaN")},
+             {'a':float('-inf')},
+             -1,
+              "decimal128 NaN should sort below -Infinity"
+             )
+
     ]:
         if False == x(tt[0],tt[1],tt[2]):
             msg = tt[3]
@@ -341,6 +476,321 @@ def bson_test():
     return msg
 
 
+def decimal128_agg_test():
+    """bson_sum/avg_decimal128 are exact across mixed exponents, and the
+    direct decimal128 decode matches the numeric a string would make."""
+
+    vals = ["10.09", "-3.5", "1E+3", "0.000001", "12345678901234567890123456789012.34", "-0.00"]
+    curs.execute("TRUNCATE TABLE bsontest")
+    for v in vals:
+        rb = safe_bson_encode({"amt": makeDecimal128(v)})
+        curs.execute("INSERT INTO bsontest (bdata) VALUES (%s)", (rb,))
+    rb = safe_bson_encode({"amt": "not a decimal"})
+    curs.execute("INSERT INTO bsontest (bdata) VALUES (%s)", (rb,))
+    conn.commit()
+
+    exp_sum = Decimal("12345678901234567890123456790018.930001")  # more digits than the default context
+
+    msg = None
+    for sql, exp in [
+            ("SELECT bson_sum_decimal128(bdata, 'amt') FROM bsontest", exp_sum)
+            ,("SELECT bson_avg_decimal128(bdata, 'amt') = bson_sum_decimal128(bdata, 'amt') / 6 FROM bsontest", True)
+            ,("SELECT bson_sum_decimal128(bdata, 'NOT_IN_FILM') FROM bsontest", None)
+            ,("SELECT count(*) FROM bsontest WHERE bson_get_decimal128(bdata, 'amt')::text <> (bdata::json->'amt'->>'$numberDecimal')::numeric::text", 0)
+    ]:
+        item = fetchRow1Col(sql)
+        if item != exp:
+            msg = "decimal128 agg: %s: got %s, expected %s" % (sql, item, exp)
+            break
+
+    return msg
+
+
+def path_agg_test():
+    """bson_sum, bson_minmax, bson_count_type and bson_agg, serially and
+    with a parallel plan forced so the combine/serialize path runs too."""
+
+    rows = [{"x": 1}, {"x": 2.5}, {"x": bson.int64.Int64(10)},
+            {"x": makeDecimal128("0.25")}, {"x": "s"}, {"y": 1}]
+    curs.execute("TRUNCATE TABLE bsontest")
+    for r in rows:
+        curs.execute("INSERT INTO bsontest (bdata) VALUES (%s)", (safe_bson_encode(r),))
+    conn.commit()
+
+    checks = [
+        ("SELECT bson_sum(bdata, 'x') FROM bsontest", Decimal("13.75"))
+        ,("SELECT bson_get_int32(bson_minmax(bdata, 'x'), 'min') FROM bsontest", 1)
+        ,("SELECT bson_get_string(bson_minmax(bdata, 'x'), 'max') FROM bsontest", "s")
+        ,("SELECT bson_count_type(bdata, 'x')::text FROM bsontest",
+          '{ "missing" : 1, "double" : 1, "string" : 1, "int" : 1, "long" : 1, "decimal" : 1 }')
+        ,("SELECT json_array_length(bson_agg(bdata)::json) FROM bsontest", 6)
+        ,("SELECT bson_get_int32(bson_agg(bdata ORDER BY bdata->>'y'), '0.y') FROM bsontest", 1)
+        ,("SELECT bson_sum(bdata, 'NOT_IN_FILM') FROM bsontest", None)
+    ]
+
+    msg = None
+    for parallel in [False, True]:
+        if parallel:
+            for g in ["parallel_setup_cost = 0", "parallel_tuple_cost = 0",
+                      "min_parallel_table_scan_size = 0", "max_parallel_workers_per_gather = 2"]:
+                curs.execute("SET " + g)
+        for sql, exp in checks:
+            item = fetchRow1Col(sql)
+            if item != exp:
+                msg = "path agg (parallel %s): %s: got %s, expected %s" % (parallel, sql, item, exp)
+                break
+        if msg is not None:
+            break
+
+    for g in ["parallel_setup_cost", "parallel_tuple_cost",
+              "min_parallel_table_scan_size", "max_parallel_workers_per_gather"]:
+        curs.execute("RESET " + g)
+
+    return msg
+
+
+def srf_rows_test():
+    """The support function makes the row estimate exact for constants."""
+
+    plan = fetchRow1Col("""EXPLAIN (FORMAT JSON) SELECT * FROM bson_array_elements('{"a":[1,2,3]}'::bson, 'a')""")
+    rows = plan[0]['Plan']['Plan Rows']
+    if rows != 3:
+        return "bson_array_elements constant: planned %s rows, expected 3" % rows
+    plan = fetchRow1Col("""EXPLAIN (FORMAT JSON) SELECT * FROM bson_each('{"a":{"x":1,"y":2}}'::bson, 'a')""")
+    rows = plan[0]['Plan']['Plan Rows']
+    if rows != 2:
+        return "bson_each constant: planned %s rows, expected 2" % rows
+    return None
+
+
+def path_hash_join_test():
+    """bson_path_equal alone is not hashable; with the bson_path_hash
+    equality next to it the planner can hash join on the embedded key."""
+
+    curs.execute("SET LOCAL enable_nestloop = off")
+    curs.execute("SET LOCAL enable_mergejoin = off")
+    plan = json.dumps(fetchRow1Col("""EXPLAIN (FORMAT JSON) SELECT * FROM bsontest e, bsontest r
+        WHERE bson_path_hash(e.bdata, 'hdr.id') = bson_path_hash(r.bdata, 'id')
+          AND bson_path_equal(e.bdata, 'hdr.id', r.bdata, 'id')"""))
+    conn.rollback()
+
+    if plan.find('"Hash Join"') < 0 or plan.find('bson_path_hash') < 0:
+        return "bson_path_hash equality did not hash join: %s" % plan
+    return None
+
+
+def getter_planner_test():
+    """Cheap getters are filtered first, and a bare boolean getter picks up
+    the stats of its expression index."""
+
+    curs.execute("TRUNCATE TABLE bsontest")
+    for i in range(1000):
+        curs.execute("INSERT INTO bsontest (bdata) VALUES (%s)",
+                     (safe_bson_encode({"n": i, "s": str(i), "active": (i % 10 == 0)}),))
+    curs.execute("CREATE INDEX bsontest_active ON bsontest (bson_get_boolean(bdata, 'active'))")
+    conn.commit()
+    curs.execute("ANALYZE bsontest")
+
+    msg = None
+
+    plan = fetchRow1Col("""EXPLAIN (FORMAT JSON) SELECT * FROM bsontest
+        WHERE bson_as_text(bdata, 's') = '5' AND bson_get_int32(bdata, 'n') = 5""")
+    f = plan[0]['Plan'].get('Filter', '')
+    if f.find('bson_get_int32') < 0 or f.find('bson_get_int32') > f.find('bson_as_text'):
+        msg = "cheap getter not filtered first: %s" % f
+
+    if msg is None:
+        curs.execute("SET enable_indexscan = off")
+        curs.execute("SET enable_bitmapscan = off")
+        plan = fetchRow1Col("""EXPLAIN (FORMAT JSON) SELECT * FROM bsontest
+            WHERE bson_get_boolean(bdata, 'active')""")
+        rows = plan[0]['Plan']['Plan Rows']
+        if rows < 50 or rows > 200:
+            msg = "bson_get_boolean qual: planned %s rows, expected about 100" % rows
+        curs.execute("RESET enable_indexscan")
+        curs.execute("RESET enable_bitmapscan")
+
+    curs.execute("DROP INDEX bsontest_active")
+    conn.commit()
+
+    return msg
+
+
+def path_stats_test():
+    """ANALYZE keeps per-path stats and the @>, ? and bare bson_get_boolean
+    estimates use them."""
+
+    curs.execute("TRUNCATE TABLE bsontest")
+    for i in range(1000):
+        d = {"n": i, "k": i % 4, "sub": {"flag": (i % 10 == 0)}}
+        if i % 5 == 0:
+            d["rare"] = 1
+        curs.execute("INSERT INTO bsontest (bdata) VALUES (%s)", (safe_bson_encode(d),))
+    conn.commit()
+    curs.execute("ANALYZE bsontest")
+
+    def stat(path, field):
+        return fetchRow1Col("""SELECT bson_get_double(s, '%s')
+            FROM unnest(bson_column_stats('bsontest', 'bdata')) s
+            WHERE bson_get_string(s, 'path') = '%s'""" % (field, path))
+
+    def planned(where):
+        plan = fetchRow1Col("EXPLAIN (FORMAT JSON) SELECT * FROM bsontest WHERE " + where)
+        return plan[0]['Plan']['Plan Rows']
+
+    checks = [
+        (stat('k', 'ndv'), 4, 4)
+        ,(stat('rare', 'frac'), 0.2, 0.2)
+        ,(stat('sub.flag', 'frac'), 1.0, 1.0)
+        ,(planned("""bdata @> '{"k":1}'"""), 200, 300)
+        ,(planned("""bdata @> '{"k":1, "rare":1}'"""), 30, 80)
+        ,(planned("bdata ? 'rare'"), 150, 250)
+        ,(planned("bdata ?| array['rare','n']"), 900, 1000)
+        ,(planned("bson_get_boolean(bdata, 'sub.flag')"), 80, 120)
+    ]
+
+    for n, (got, lo, hi) in enumerate(checks):
+        if got is None or got < lo or got > hi:
+            return "path stats check %d: got %s, expected %s..%s" % (n, got, lo, hi)
+    return None
+
+
+def track_stats_test():
+    """With pgbson.track_stats on, pgbson_stats counts getter calls, misses
+    and type mismatches; off, nothing moves."""
+
+    curs.execute("SELECT pgbson_stats_reset()")
+    doc = """'{"a":1, "s":"x"}'::bson"""
+    q = ("SELECT bson_get_int32(%s, 'a'), bson_get_int32(%s, 'nope'),"
+         " bson_get_int32(%s, 's')") % (doc, doc, doc)
+
+    curs.execute(q)  # not tracked yet
+    curs.execute("SET pgbson.track_stats = on")
+    curs.execute(q)
+    curs.execute("""SELECT '{"b":2}'::bson""")  # bson_in, then bson_out
+    curs.execute("RESET pgbson.track_stats")
+
+    curs.execute("SELECT calls, misses, mismatches, miss_rate FROM pgbson_stats WHERE site = 'get'")
+    got = curs.fetchone()
+    if got is None or tuple(got) != (3, 1, 1, 1.0/3):
+        return "get stats: got %s, expected (3, 1, 1, 0.333...)" % (got,)
+
+    n = fetchRow1Col("SELECT calls FROM pgbson_stats WHERE site = 'out'")
+    if n < 1:
+        return "out stats: got %s calls, expected at least 1" % n
+
+    curs.execute("SELECT pgbson_stats_reset()")
+    n = fetchRow1Col("SELECT sum(calls) FROM pgbson_stats")
+    if n != 0:
+        return "after reset: got %s calls, expected 0" % n
+    return None
+
+
+def bson_match_test():
+    """@@ filters give the same rows with and without the GIN index."""
+
+    curs.execute("CREATE TEMP TABLE bsonmatch (bdata bson)")
+    for d in [
+            {"status": "A", "qty": 5, "tags": ["red", "blue"],
+             "items": [{"sku": "x", "n": 1}, {"sku": "y", "n": 3}],
+             "when": makeDatetime(2022,6,6,12,0,0,0), "amt": makeDecimal128("1.5"),
+             "big": bson.int64.Int64(10000000000)}
+            ,{"status": "A", "qty": 15, "tags": ["green"], "items": [{"sku": "y", "n": 2}],
+              "when": makeDatetime(2023,1,1,0,0,0,0)}
+            ,{"status": "B", "qty": 25.5, "tags": [], "dims": {"h": 3}, "big": bson.int64.Int64(5)}
+            ,{"status": "D", "qty": "many"}
+    ]:
+        curs.execute("INSERT INTO bsonmatch (bdata) VALUES (%s)", (safe_bson_encode(d),))
+
+    checks = [
+        ('{}', 4)
+        ,('{"status": "A"}', 2)
+        ,('{"qty": {"$gte": 10, "$lt": 20}}', 1)
+        ,('{"qty": {"$gt": 0}}', 3)
+        ,('{"qty": 25.5}', 1)
+        ,('{"tags": "red"}', 1)
+        ,('{"tags": {"$size": 0}}', 1)
+        ,('{"tags": {"$all": ["red", "blue"]}}', 1)
+        ,('{"items.sku": "y"}', 2)
+        ,('{"items.0.sku": "y"}', 1)
+        ,('{"items": {"$elemMatch": {"sku": "y", "n": {"$gt": 2}}}}', 1)
+        ,('{"$or": [{"status": "B"}, {"dims.h": {"$exists": true}}]}', 1)
+        ,('{"$and": [{"status": "A"}, {"qty": 5}]}', 1)
+        ,('{"$nor": [{"status": "A"}, {"status": "B"}]}', 1)
+        ,('{"dims": {"$exists": false}}', 3)
+        ,('{"dims.h": null}', 3)
+        ,('{"status": {"$ne": "A"}}', 2)
+        ,('{"status": {"$in": ["B", "D"]}}', 2)
+        ,('{"status": {"$nin": ["A", "B"]}}', 1)
+        ,('{"when": {"$gt": {"$date": "2022-12-31T00:00:00Z"}}}', 1)
+        ,('{"amt": {"$gt": {"$numberDecimal": "1"}}}', 1)
+        ,('{"big": {"$gte": {"$numberLong": "10000000000"}}}', 1)
+        ,('{"qty": {"$type": "string"}}', 1)
+        ,('{"qty": {"$not": {"$type": "number"}}}', 1)
+    ]
+
+    msg = None
+    for indexed in [False, True]:
+        if indexed:
+            curs.execute("CREATE INDEX ON bsonmatch USING gin (bdata)")
+            curs.execute("SET enable_seqscan = off")
+        for f, exp in checks:
+            n = fetchRow1Col("SELECT count(*) FROM bsonmatch WHERE bdata @@ '%s'" % f)
+            if n != exp:
+                msg = "%s (indexed=%s): got %s, expected %s" % (f, indexed, n, exp)
+                break
+        if msg is not None:
+            break
+
+    if msg is None:
+        plan = json.dumps(fetchRow1Col("""EXPLAIN (FORMAT JSON) SELECT * FROM bsonmatch WHERE bdata @@ '{"status": "A"}'"""))
+        if "Bitmap Index Scan" not in plan:
+            msg = "@@ with an equality did not use the GIN index"
+
+    curs.execute("RESET enable_seqscan")
+    curs.execute("DROP TABLE bsonmatch")
+    return msg
+
+
+def output_mode_test():
+    msg = None
+
+    src = '{"a":1, "d":{"$numberDecimal":"1.5"}, "x":3.0, "e":[], "s":"q\\"t"}'
+    for mode, exp in [
+            ('relaxed',   '{ "a" : 1, "d" : { "$numberDecimal" : "1.5" }, "x" : 3.0, "e" : [ ], "s" : "q\\"t" }')
+            ,('canonical', '{ "a" : { "$numberInt" : "1" }, "d" : { "$numberDecimal" : "1.5" }, "x" : { "$numberDouble" : "3.0" }, "e" : [ ], "s" : "q\\"t" }')
+            ,('postgres',  '{ "a" : 1, "d" : 1.5, "x" : 3.0, "e" : [ ], "s" : "q\\"t" }')
+    ]:
+        curs.execute("SET pgbson.output_mode = '%s'" % mode)
+        item = fetchRow1Col("SELECT '%s'::bson::text" % src)
+        if item != exp:
+            msg = "output_mode %s: got\n%s\nexpected\n%s" % (mode, item, exp)
+            break
+        # bson_to_ejson ignores the setting:
+        curs.execute("RESET pgbson.output_mode")
+        item = fetchRow1Col("SELECT bson_to_ejson('%s'::bson, '%s')" % (src, mode))
+        if item != exp:
+            msg = "bson_to_ejson %s: got\n%s\nexpected\n%s" % (mode, item, exp)
+            break
+
+    curs.execute("RESET pgbson.output_mode")
+
+    if msg is None:
+        vol = fetchRow1Col("SELECT provolatile FROM pg_proc WHERE proname = 'bson_out'")
+        if vol != 's':
+            msg = "bson_out follows pgbson.output_mode but is not STABLE"
+
+    if msg is None:
+        try:
+            curs.execute("""SELECT bson_to_ejson('{"a":1}'::bson, 'shell')""")
+            msg = "bson_to_ejson accepted an unknown mode"
+        except Exception:
+            pass
+        conn.rollback()
+
+    return msg
+
+
 def cast_insert_good_json():
     msg = None
 
@@ -396,6 +846,146 @@ def cast_corrupt_bson():
 
 
 
+def cast_validate_levels():
+    """Each pgbson.validate level rejects what the one before it lets in."""
+
+    # Structurally fine {'A':'\xff'} but the string is not UTF-8:
+    bad_utf8 = bytes([0x0e, 0x00, 0x00, 0x00, 0x02, 0x41, 0x00, 0x02, 0x00, 0x00,0x00,0xFF,0x00, 0x00])
+    # Right length and trailing NUL, but not a valid element inside:
+    bad_struct = bytes([0x0e, 0x00, 0x00, 0x00, 0xFF, 0xFF, 0xFF, 0x02, 0x00, 0x00,0x00,0x41,0x00, 0x00])
+    # The length prefix says 5 but there are 6 bytes:
+    bad_header = bytes([0x05, 0x00, 0x00, 0x00, 0x00, 0x00])
+
+    def accepted(level, d):
+        try:
+            if level is not None:
+                curs.execute("SET LOCAL pgbson.validate = '%s'" % level)
+            curs.execute("SELECT length(%s::bytea::bson::bytea)", (d,))
+            ok = True
+        except Exception:
+            ok = False
+        conn.rollback()  # also ends the SET LOCAL
+        return ok
+
+    for level, d, exp in [
+            (None, bad_struct, False)   # the default is structure
+            ,(None, bad_header, False)
+            ,('none', bad_header, True)
+            ,('header', bad_header, False)
+            ,('header', bad_struct, True)
+            ,('structure', bad_struct, False)
+            ,('structure', bad_utf8, True)
+            ,('utf8', bad_utf8, False)
+    ]:
+        if accepted(level, d) != exp:
+            return "pgbson.validate = %s: %s was %s" % (level or "default", d.hex(),
+                                                      "rejected" if exp else "accepted")
+    return None
+
+
+def hot_paths_test():
+    """pgbson.hot_paths moves the named fields first in incoming bson,
+    exactly as bson_reorder would; = itself is not affected by it.  It is
+    server wide, so SET is refused and the test goes via ALTER SYSTEM."""
+
+    msg = None
+    doc = '{"a":1,"b":{"x":1,"y":2},"c":3}'
+
+    try:
+        curs.execute("SET LOCAL pgbson.hot_paths = 'c'")
+        msg = "SET pgbson.hot_paths was allowed"
+    except psycopg2.Error:
+        pass
+    conn.rollback()
+    if msg:
+        return msg
+
+    def set_hot_paths(value):
+        # ALTER SYSTEM cannot run in a transaction block; the reload
+        # reaches this backend asynchronously, so wait for it.
+        conn.autocommit = True
+        try:
+            if value:
+                curs.execute("ALTER SYSTEM SET pgbson.hot_paths = %s", (value,))
+            else:
+                curs.execute("ALTER SYSTEM RESET pgbson.hot_paths")
+            curs.execute("SELECT pg_reload_conf()")
+            for _ in range(100):
+                curs.execute("SELECT current_setting('pgbson.hot_paths')")
+                if curs.fetchone()[0] == value:
+                    return True
+                time.sleep(0.05)
+            return False
+        finally:
+            conn.autocommit = False
+
+    try:
+        if not set_hot_paths(' c , b.y'):
+            return "pgbson.hot_paths reload not seen"
+        curs.execute("SELECT %s::bson::bytea", (doc,))
+        hot = bytes(curs.fetchone()[0])
+        conn.rollback()
+    finally:
+        set_hot_paths('')
+
+    curs.execute("""SELECT %s::bson::bytea, bson_reorder(%s::bson, array['c','b.y']) = %s::bson,
+                      %s::bson = %s::bson""", (doc, doc, hot, doc, hot))
+    (cold, reordered_eq, cold_eq) = curs.fetchone()
+    conn.rollback()
+
+    got = bson.decode(hot, codec_options=codec_options)
+    if list(got.keys()) != ['c', 'a', 'b'] or list(got['b'].keys()) != ['y', 'x']:
+        msg = "hot_paths order: %s" % got
+    elif hot == bytes(cold):
+        msg = "hot_paths did not reorder the bytes"
+    elif not reordered_eq:
+        msg = "hot_paths input is not = to bson_reorder of the same document"
+    elif cold_eq:
+        msg = "= became key order insensitive"
+    return msg
+
+def recv_validate_test():
+    """Binary COPY checks the structure of incoming BSON unless
+    pgbson.recv_validate is off; the length is always checked."""
+
+    bad_struct = bytes([0x0e, 0x00, 0x00, 0x00, 0xFF, 0xFF, 0xFF, 0x02, 0x00, 0x00,0x00,0x41,0x00, 0x00])
+    bad_header = bytes([0x05, 0x00, 0x00, 0x00, 0x00, 0x00])
+
+    curs.execute("CREATE TEMP TABLE bsonrecv (bdata bson)")
+    conn.commit()
+
+    def copied(d, validate=True):
+        buf = io.BytesIO()
+        buf.write(b'PGCOPY\n\xff\r\n\x00' + struct.pack('!ii', 0, 0))
+        buf.write(struct.pack('!hi', 1, len(d)) + d)
+        buf.write(struct.pack('!h', -1))
+        buf.seek(0)
+        try:
+            if not validate:
+                curs.execute("SET LOCAL pgbson.recv_validate = off")
+            curs.copy_expert("COPY bsonrecv FROM STDIN (FORMAT binary)", buf)
+            ok = True
+        except Exception:
+            ok = False
+        conn.rollback()
+        return ok
+
+    msg = None
+    for d, validate, exp in [
+            (safe_bson_encode({"a": 1}), True, True)
+            ,(bad_struct, True, False)
+            ,(bad_struct, False, True)
+            ,(bad_header, False, False)
+    ]:
+        if copied(d, validate) != exp:
+            msg = "recv_validate = %s: %s was %s" % (validate, d.hex(), "rejected" if exp else "accepted")
+            break
+
+    curs.execute("DROP TABLE bsonrecv")
+    conn.commit()
+    return msg
+
+
 def ejson_builtin_test1():
     msg = None
     
@@ -606,6 +1196,94 @@ def basic_roundtrip(args):
         
 
 
+def bson_extract_test():
+    insertBson(sdata)
+
+    msg = None
+
+    # Note shared prefixes and a path that does not exist:
+    sql = """
+select x.* from bsontest,
+  bson_extract(bdata, array['data.recordId','data.amt','data.txDate','data.userPrefs.1.u.pi','header.NOT_IN_FILM','header.active'])
+  as x(id text, amt numeric, ts timestamp, pi float8, nope text, active boolean)
+    """
+    items = fetchRowNCol(sql, 6)
+    expected = ['ID0', a_decimal, a_datetime, 3.1415926, None, True]
+    if items != expected:
+        msg = "got %s, expected %s" % (items, expected)
+
+    return msg
+
+
+def arrow_fold_test():
+    """The planner support function should turn an arrow chain with constant
+    keys into one dotpath call."""
+    insertBson(sdata)
+
+    msg = None
+
+    curs.execute("EXPLAIN (VERBOSE) SELECT bdata->'data'->'sub1'->'sub2'->>'corn' FROM bsontest")
+    plan = " ".join([r[0] for r in curs.fetchall()])
+    if "'data.sub1.sub2.corn'" not in plan:
+        msg = "arrow chain not folded into dotpath: %s" % plan
+    else:
+        item = fetchRow1Col("SELECT bdata->'data'->'sub1'->'sub2'->>'corn' FROM bsontest")
+        if item != 'dog':
+            msg = "folded arrow chain got [%s], expected [dog]" % item
+
+    return msg
+
+
+def big_subdoc_test():
+    """Subdocs over a couple of K come back from -> as a view into the
+    parent, not a copy.  Use a non-constant key so the planner cannot fold
+    the chain into a dotpath."""
+    data = {"big": {"x": "hello", "pad": "Z" * 5000}, "small": {"x": "bye"}}
+    raw = safe_bson_encode(data)
+    curs.execute("TRUNCATE TABLE bsontest")
+    curs.execute("INSERT INTO bsontest (marker, bdata) VALUES ('big', %s), ('small', %s)", (raw, raw))
+    conn.commit()
+
+    msg = None
+
+    for key, exp in [('big', 'hello'), ('small', 'bye')]:
+        (item, rb) = fetchRowNCol("SELECT (bdata->marker)->>'x', (bdata->marker)::bytea FROM bsontest WHERE marker = '%s'" % key, 2)
+        if item != exp:
+            msg = "%s: got [%s], expected [%s]" % (key, item, exp)
+            break
+        if bytes(rb) != safe_bson_encode(data[key]):
+            msg = "%s: subdoc bytes do not roundtrip" % key
+            break
+
+    return msg
+
+
+def gin_test():
+    insertBson(sdata)
+
+    msg = None
+
+    curs.execute("CREATE INDEX bsontest_gin ON bsontest USING gin (bdata)")
+    curs.execute("SET enable_seqscan = off")
+
+    for sql, exp in [
+            ("""SELECT count(*) FROM bsontest WHERE bdata @> '{"header":{"type":"X"}}'""", 1)
+            ,("""SELECT count(*) FROM bsontest WHERE bdata @> '{"header":{"type":"Y"}}'""", 0)
+            # int32 in the doc, int64 in the query; still the same number:
+            ,("""SELECT count(*) FROM bsontest WHERE bdata @> '{"data":{"userPrefs":{"u":{"listOfPrimes":{"$numberLong":"7"}}}}}'""", 1)
+            ,("SELECT count(*) FROM bsontest WHERE bdata ? 'data.sub1.sub2.corn'", 1)
+            ,("SELECT count(*) FROM bsontest WHERE bdata ? 'data.sub1.NOT_IN_FILM'", 0)
+            ,("SELECT count(*) FROM bsontest WHERE bdata ?| array['nope','header.evId']", 1)
+            ,("SELECT count(*) FROM bsontest WHERE bdata ?& array['nope','header.evId']", 0)
+    ]:
+        item = fetchRow1Col(sql)
+        if item != exp:
+            msg = "%s: got %s, expected %s" % (sql, item, exp)
+            break
+
+    return msg
+
+
 def create_view():
     msg = None
     try:
@@ -666,11 +1344,19 @@ use case; bson "on its own" in and out of postgres is not very interesting.
         ,{'-':cast_short_bson}
         ,{'-':cast_badnull_bson}
         ,{'-':cast_corrupt_bson}                
+        ,{'-':cast_validate_levels}
+        ,{'-':hot_paths_test}
+        ,{'-':recv_validate_test}
 
         ,{'-':basic_roundtrip, 'desc':"roundtrip smallest BSON", "args":[{'A':'X'}]}
         ,{'-':basic_roundtrip, 'desc':"roundtrip BIG structure", "args":[sdata]}    
         ,{'-':toast_test }
+        ,{'-':slice_detoast_test }
+        ,{'-':bsonx_test }
         ,{'-':bson_test }
+        ,{'-':output_mode_test }
+        ,{'-':decimal128_agg_test }
+        ,{'-':path_agg_test }
         ,{'-':basic_internal_update}
 
         ,{'-':check1, 'desc':"string exists",
@@ -679,10 +1365,28 @@ use case; bson "on its own" in and out of postgres is not very interesting.
           "args": ["SELECT bson_get_string(bdata, 'header.NOT_IN_FILM') FROM bsontest", None] }
         ,{'-':check1, 'desc':"nested string exists",
           "args": ["SELECT bson_get_string(bdata, 'data.sub1.sub2.corn') FROM bsontest", 'dog'] }
+        ,{'-':check1, 'desc':"double text round trips",
+          "args": ["SELECT (bdata->>'data.userPrefs.1.u.pi')::float8 = bson_get_double(bdata, 'data.userPrefs.1.u.pi') FROM bsontest", True] }
+        ,{'-':check1, 'desc':"double text is shortest",
+          "args": ["""SELECT string_agg(x, ',') FROM bson_array_elements_text('{"a":[0.1, 3.0, 1e300, -2147483648, {"$numberLong":"-9223372036854775808"}]}'::bson, 'a') AS x""", '0.1,3,1e+300,-2147483648,-9223372036854775808'] }
+        ,{'-':check1, 'desc':"binary as hex text",
+          "args": ["SELECT bdata->>'data.userPrefs.0.u.thumbnail' FROM bsontest", '\\x50726574656e6420746869732069732061204a504547'] }
+        ,{'-':check1, 'desc':"binary as base64",
+          "args": ["SELECT bson_get_binary_base64(bdata, 'data.userPrefs.0.u.thumbnail') FROM bsontest", 'UHJldGVuZCB0aGlzIGlzIGEgSlBFRw=='] }
+        ,{'-':check1, 'desc':"binary with subtype",
+          "args": ["SELECT (bson_get_bindata(bdata, 'data.userPrefs.0.u.thumbnail')).subtype FROM bsontest", 0] }
+        ,{'-':check1, 'desc':"binary with subtype, data",
+          "args": ["SELECT (bson_get_bindata(bdata, 'data.userPrefs.0.u.thumbnail')).data FROM bsontest", b'Pretend this is a JPEG'] }
         ,{'-':check1, 'desc':"decimal exists",
           "args": ["SELECT bson_get_decimal128(bdata, 'data.amt') FROM bsontest", a_decimal ] }
         ,{'-':check1, 'desc':"datetime exists",
           "args": ["SELECT bson_get_datetime(bdata, 'data.txDate') FROM bsontest", a_datetime ] }
+        ,{'-':check1, 'desc':"datetime pre-1970",
+          "args": ["""SELECT bson_get_datetime('{"a":{"$date":{"$numberLong":"-1500"}}}'::bson, 'a') FROM bsontest""", datetime.datetime(1969,12,31,23,59,58,500000) ] }
+        ,{'-':check1, 'desc':"datetime tz is the same instant",
+          "args": ["SELECT bson_get_datetime_tz(bdata, 'data.txDate') = bson_get_datetime(bdata, 'data.txDate') AT TIME ZONE 'UTC' FROM bsontest", True ] }
+        ,{'-':check1, 'desc':"datetime millis",
+          "args": ["SELECT bson_get_datetime_millis(bdata, 'data.txDate') FROM bsontest", 1654517594500 ] }
 
         ,{'-':binary_checks}  # should be broken up....
 
@@ -700,6 +1404,123 @@ select bson_get_string(bdata,'header.evId') from bsontest
 where (bdata->'data')::jsonb->'userPrefs'->0->>'type' = 'DEP'
     """, "E23234" ] }
 
+        ,{'-':check1, 'desc':"jsonb cast decimal",
+          "args": [ "SELECT (bdata::jsonb)->'data'->'amt'->>'$numberDecimal' FROM bsontest", str(a_decimal) ] }
+        ,{'-':check1, 'desc':"jsonb cast double keeps 17 digits",
+          "args": [ """SELECT ('{"a":0.30000000000000004}'::bson::jsonb)->>'a' FROM bsontest""", "0.30000000000000004" ] }
+        ,{'-':check1, 'desc':"jsonb cast date",
+          "args": [ "SELECT (bdata::jsonb)->'data'->'txDate'->>'$date' FROM bsontest", "2022-06-06T12:13:14.500Z" ] }
+        ,{'-':check1, 'desc':"jsonb cast bool",
+          "args": [ "SELECT ((bdata::jsonb)->'header'->'active')::boolean FROM bsontest", True ] }
+        ,{'-':check1, 'desc':"jsonb array via dotpath",
+          "args": [ "SELECT jsonb_array_length(bson_get_jsonb_array(bdata, 'data.userPrefs.1.u.listOfPrimes')) FROM bsontest", 8 ] }
+
+        ,{'-':check1, 'desc':"jsonb to bson int32",
+          "args": [ """SELECT bson_get_int32('{"a":{"b":17}}'::jsonb::bson, 'a.b') FROM bsontest""", 17 ] }
+        ,{'-':check1, 'desc':"jsonb to bson int64",
+          "args": [ """SELECT bson_get_int64('{"a":[1,88888888888888888]}'::jsonb::bson, 'a.1') FROM bsontest""", 88888888888888888 ] }
+        ,{'-':check1, 'desc':"jsonb to bson EJSON decimal",
+          "args": [ """SELECT bson_get_decimal128('{"a":{"$numberDecimal":"10.09"}}'::jsonb::bson, 'a') FROM bsontest""", Decimal("10.09") ] }
+        ,{'-':check1, 'desc':"jsonb to bson EJSON date",
+          "args": [ """SELECT bson_get_datetime('{"a":{"$date":"2022-06-06T12:13:14.500Z"}}'::jsonb::bson, 'a') FROM bsontest""", a_datetime ] }
+
+        ,{'-':check1, 'desc':"extended hash seed 0 matches hash",
+          "args": ["SELECT (bson_hash_extended(bdata, 0) & 4294967295) = (bson_hash(bdata)::int8 & 4294967295) FROM bsontest", True] }
+
+        ,{'-':check1, 'desc':"path equal same value",
+          "args": ["SELECT bson_path_equal(bdata, 'data.sub1.sub2.corn', '{\"x\":\"dog\"}'::bson, 'x') FROM bsontest", True] }
+        ,{'-':check1, 'desc':"path hash same value",
+          "args": ["SELECT bson_path_hash(bdata, 'data.sub1.sub2.corn') = bson_path_hash('{\"x\":\"dog\"}'::bson, 'x') FROM bsontest", True] }
+        ,{'-':check1, 'desc':"path hash missing path",
+          "args": ["SELECT bson_path_hash(bdata, 'data.NOT_IN_FILM') FROM bsontest", None] }
+
+        ,{'-':check1, 'desc':"bson_in string escapes",
+          "args": ["""SELECT bson_get_string('{"s":"a\\u00e9\\ud83d\\ude00\\t\\"z"}'::bson, 's') FROM bsontest""", 'a\u00e9\U0001F600\t"z'] }
+        ,{'-':check1, 'desc':"bson_in EJSON wrappers",
+          "args": ["""SELECT bson_get_int64('{"a":[{"n":{"$numberLong":"7"}}]}'::bson, 'a.0.n') FROM bsontest""", 7] }
+        ,{'-':check1, 'desc':"bson_in libbson fallback",
+          "args": ["""SELECT bson_get_string('{"r":{"$regularExpression":{"pattern":"a","options":""}},"s":"x"}'::bson, 's') FROM bsontest""", 'x'] }
+
+        ,{'-':check1, 'desc':"bson_reorder",
+          "args": ["""SELECT bson_reorder('{"a":1,"b":{"x":1,"y":2},"c":[{"p":1,"q":2}]}'::bson, array['c.0.q','b.y'])::text FROM bsontest""",
+                   '{ "c" : [ { "q" : 2, "p" : 1 } ], "b" : { "y" : 2, "x" : 1 }, "a" : 1 }'] }
+
+        ,{'-':check1, 'desc':"bson_get_float8_array",
+          "args": ["""SELECT bson_get_float8_array('{"a":[1.5,2,{"$numberLong":"3"},null]}'::bson, 'a') FROM bsontest""", [1.5, 2.0, 3.0, None]] }
+        ,{'-':check1, 'desc':"bson_get_int8_array skip",
+          "args": ["""SELECT bson_get_int8_array('{"a":[1,"x",{"$numberLong":"10000000000"},2.5]}'::bson, 'a', false) FROM bsontest""", [1, 10000000000]] }
+        ,{'-':check1, 'desc':"bson_get_text_array",
+          "args": ["""SELECT bson_get_text_array('{"a":["x","y"]}'::bson, 'a') FROM bsontest""", ['x', 'y']] }
+        ,{'-':check1, 'desc':"bson_get_timestamp_array",
+          "args": ["""SELECT bson_get_timestamp_array('{"a":[{"$date":"2022-06-06T12:13:14.500Z"}]}'::bson, 'a') FROM bsontest""", [a_datetime]] }
+        ,{'-':check1, 'desc':"bson_get_int8_array empty",
+          "args": ["""SELECT cardinality(bson_get_int8_array('{"a":[]}'::bson, 'a')) FROM bsontest""", 0] }
+        ,{'-':check1, 'desc':"every getter and SRF has a COST",
+          "args": ["""SELECT count(*) FROM pg_proc WHERE procost = 1 AND (proname LIKE 'bson_get%' OR proname LIKE 'bson_array_elements%' OR proname LIKE 'bson_each%') AND proname NOT LIKE '%support'""", 0] }
+        ,{'-':check1, 'desc':"bson_get_int8_array more nulls than presized",
+          "args": ["""SELECT cardinality(bson_get_int8_array(('{"a":[' || repeat('null,', 39) || 'null]}')::bson, 'a')) FROM bsontest""", 40] }
+        ,{'-':check1, 'desc':"bson_get_int8_array arrow fold keeps strict",
+          "args": ["""SELECT bson_get_int8_array('{"a":{"b":[1,"x",2]}}'::bson->'a', 'b', false) FROM bsontest""", [1, 2]] }
+        ,{'-':check1, 'desc':"bson_get_int8_array not an array",
+          "args": ["""SELECT bson_get_int8_array('{"a":1}'::bson, 'a') FROM bsontest""", None] }
+        ,{'-':check1, 'desc':"bson_array_elements",
+          "args": ["""SELECT count(*)::text || '/' || count(x)::text FROM bson_array_elements('{"a":[{"p":1},[2],3]}'::bson, 'a') AS x""", '3/2'] }
+        ,{'-':check1, 'desc':"bson_array_elements_text",
+          "args": ["""SELECT string_agg(x, ',') FROM bson_array_elements_text('{"a":[1,"b",null,{"c":1}]}'::bson, 'a') AS x""", '1,b,{ "c" : 1 }'] }
+        ,{'-':check1, 'desc':"bson_array_elements_int8",
+          "args": ["""SELECT sum(x) FROM bson_array_elements_int8('{"a":[1,{"$numberLong":"10000000000"},"x"]}'::bson, 'a') AS x""", 10000000001] }
+        ,{'-':check1, 'desc':"bson_array_elements_numeric",
+          "args": ["""SELECT sum(x) FROM bson_array_elements_numeric('{"a":[1,2.5,{"$numberDecimal":"0.25"}]}'::bson, 'a') AS x""", Decimal("3.75")] }
+        ,{'-':check1, 'desc':"bson_array_elements not an array",
+          "args": ["""SELECT count(*) FROM bson_array_elements('{"a":{"b":1}}'::bson, 'a')""", 0] }
+        ,{'-':check1, 'desc':"bson_each",
+          "args": ["""SELECT string_agg(key || '=' || coalesce(value::text, '-'), ';') FROM bson_each('{"d":{"x":{"y":1},"z":2}}'::bson, 'd')""", 'x={ "y" : 1 };z=-'] }
+        ,{'-':check1, 'desc':"bson_each_text top level",
+          "args": ["""SELECT string_agg(key || '=' || value, ';') FROM bson_each_text('{"a":"s","b":7}'::bson, '')""", 'a=s;b=7'] }
+        ,{'-':srf_rows_test}
+        ,{'-':path_hash_join_test}
+        ,{'-':getter_planner_test}
+        ,{'-':path_stats_test}
+        ,{'-':track_stats_test}
+        ,{'-':bson_match_test}
+        ,{'-':check1, 'desc':"bson_set replace",
+          "args": ["""SELECT bson_set('{"a":1,"b":{"c":2}}'::bson, 'b.c', 'x'::text)::text FROM bsontest""",
+                   '{ "a" : 1, "b" : { "c" : "x" } }'] }
+        ,{'-':check1, 'desc':"bson_set add nested",
+          "args": ["""SELECT bson_set('{"a":1}'::bson, 'b.c.d', 5)::text FROM bsontest""",
+                   '{ "a" : 1, "b" : { "c" : { "d" : 5 } } }'] }
+        ,{'-':check1, 'desc':"bson_set array item to null",
+          "args": ["""SELECT bson_set('{"a":[1,2,3]}'::bson, 'a.1', NULL::int4)::text FROM bsontest""",
+                   '{ "a" : [ 1, null, 3 ] }'] }
+        ,{'-':check1, 'desc':"bson_set numeric is decimal128",
+          "args": ["""SELECT bson_get_decimal128(bson_set('{}'::bson, 'm', 12.50::numeric), 'm') FROM bsontest""", Decimal("12.50")] }
+        ,{'-':check1, 'desc':"bson_set timestamp floors to millis",
+          "args": ["""SELECT bson_get_datetime(bson_set('{}'::bson, 't', '1969-12-31 23:59:59.9995'::timestamp), 't') FROM bsontest""",
+                   datetime.datetime(1969,12,31,23,59,59,999000)] }
+        ,{'-':check1, 'desc':"bson_set then bson_unset is byte exact",
+          "args": ["""SELECT bson_unset(bson_set(x, 'z', 1), 'z')::bytea = x::bytea FROM bsontest,
+                      (SELECT '{"a":{"$numberLong":"1"},"d":{"$numberDecimal":"1.50"},"s":{"t":[1,{"u":null}]}}'::bson AS x) AS q""", True] }
+        ,{'-':check1, 'desc':"bson_array_append",
+          "args": ["""SELECT bson_array_append('{"a":[1]}'::bson, 'a', 2.5::float8)::text FROM bsontest""",
+                   '{ "a" : [ 1, 2.5 ] }'] }
+        ,{'-':check1, 'desc':"bson_array_append makes the array",
+          "args": ["""SELECT bson_array_append('{"q":0}'::bson, 'a.b', 'x'::text)::text FROM bsontest""",
+                   '{ "q" : 0, "a" : { "b" : [ "x" ] } }'] }
+        ,{'-':check1, 'desc':"bson_unset key",
+          "args": ["""SELECT bson_unset('{"a":1,"b":2,"c":[1,2]}'::bson, 'b')::text FROM bsontest""",
+                   '{ "a" : 1, "c" : [ 1, 2 ] }'] }
+        ,{'-':check1, 'desc':"bson_unset array item",
+          "args": ["""SELECT bson_unset('{"a":1,"c":[1,2]}'::bson, 'c.0')::text FROM bsontest""",
+                   '{ "a" : 1, "c" : [ null, 2 ] }'] }
+        ,{'-':check1, 'desc':"bson_merge",
+          "args": ["""SELECT bson_merge('{"a":1,"b":2}'::bson, '{"b":"x","c":3}'::bson)::text FROM bsontest""",
+                   '{ "a" : 1, "b" : "x", "c" : 3 }'] }
+
+        ,{'-':bson_extract_test}
+        ,{'-':arrow_fold_test}
+        ,{'-':big_subdoc_test}
+        ,{'-':gin_test}
+
         ,{'-':create_view}
 
         ,{'-':check1, 'desc':"scalar ts via view",